@@ -0,0 +1,374 @@
+/** \file collector.c Collector endpoints
+ */
+
+#include "collector.h"
+#include "http_client.h"
+
+#include <stddef.h>
+
+#define ARRAY_LEN(x) (sizeof((x))/sizeof((x[0])))
+
+#define BL_CONTAINER_OF(pointer, type, member) \
+        ({ const __typeof__( ((type *)0)->member ) *__memb = (pointer); \
+                (type *)( (char *)__memb - offsetof(type, member) ); })
+
+static
+const char *const _collector_hosts[] = COLLECTOR_HOSTS;
+
+#define COLLECTOR_NR_HOSTS          ARRAY_LEN(_collector_hosts)
+
+/* Collector set by collector_set_host(), which stands in for all of COLLECTOR_HOSTS, or empty */
+static
+char _collector_host[COLLECTOR_HOST_LEN];
+
+static
+struct collector_endpoint _collector_endpoints[COLLECTOR_NR_HOSTS];
+
+static
+unsigned _collector_nr_endpoints = 0;
+
+static
+struct http_client *_collector_client = NULL;
+
+/* The endpoint the client is connected or connecting to, or -1 */
+static
+int _collector_current = -1;
+
+/* Whether the network is up, and the client should be connected */
+static
+bool _collector_running = false;
+
+/* Whether the connection was dropped only to move to a faster endpoint */
+static
+bool _collector_moving = false;
+
+/**
+ * The endpoint with the lowest round trip time, out of those with an address and no failure
+ * against them. Those not measured yet come first, so that each gets its turn.
+ *
+ * \return Its index, or -1 if there is none.
+ */
+static ICACHE_FLASH_ATTR
+int _collector_fastest(void)
+{
+    int best = -1;
+
+    for (unsigned i = 0; i < _collector_nr_endpoints; i++) {
+        struct collector_endpoint *ep = &_collector_endpoints[i];
+
+        if (0 == ep->ip_addr || true == ep->failed) {
+            continue;
+        }
+
+        if (-1 == best || ep->srtt_us < _collector_endpoints[best].srtt_us) {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+static ICACHE_FLASH_ATTR
+void _collector_clear_failed(void)
+{
+    for (unsigned i = 0; i < _collector_nr_endpoints; i++) {
+        _collector_endpoints[i].failed = false;
+    }
+}
+
+/**
+ * Choose the endpoint for the client's next connection attempt. A failure, or leaving a slow
+ * endpoint, moves straight on to the fastest endpoint not yet failed; once they all have, the
+ * client backs off before going round again.
+ */
+static ICACHE_FLASH_ATTR
+int _collector_next_endpoint(struct http_client *client, bool failed,
+        struct http_client_endpoint *endpoint)
+{
+    bool failing_over = false;
+    int next = -1;
+
+    if (-1 != _collector_current) {
+        struct collector_endpoint *cur = &_collector_endpoints[_collector_current];
+
+        if (true == _collector_moving) {
+            /* Nothing went wrong, so nothing is marked failed or forgiven */
+            failing_over = true;
+        } else if (true == failed) {
+            cur->failed = true;
+            cur->nr_failures++;
+            failing_over = true;
+        } else {
+            /* That was a good connection, so everything gets another chance */
+            _collector_clear_failed();
+        }
+    }
+
+    _collector_moving = false;
+
+    if (-1 == (next = _collector_fastest())) {
+        _collector_clear_failed();
+        failing_over = false;
+        next = _collector_fastest();
+    }
+
+    _collector_current = next;
+
+    if (-1 == next) {
+        return -1;
+    }
+
+    endpoint->host = _collector_endpoints[next].host;
+    endpoint->ip_addr = _collector_endpoints[next].ip_addr;
+    endpoint->port = COLLECTOR_PORT;
+
+    return true == failing_over ? 0 : 1;
+}
+
+static ICACHE_FLASH_ATTR
+void _collector_on_rtt(struct http_client *client, uint32_t rtt_us)
+{
+    struct collector_endpoint *ep = NULL;
+
+    if (-1 == _collector_current) {
+        return;
+    }
+
+    ep = &_collector_endpoints[_collector_current];
+
+    /* 0 means not measured */
+    if (0 == rtt_us) {
+        rtt_us = 1;
+    }
+
+    if (0 == ep->srtt_us) {
+        ep->srtt_us = rtt_us;
+    } else {
+        ep->srtt_us += ((int32_t)rtt_us - (int32_t)ep->srtt_us) / (1 << COLLECTOR_RTT_SHIFT);
+    }
+}
+
+static ICACHE_FLASH_ATTR
+void _collector_on_resolved(struct hal_dns *dns, uint32_t ip_addr)
+{
+    struct collector_endpoint *ep = BL_CONTAINER_OF(dns, struct collector_endpoint, dns);
+
+    ep->lookup_pending = false;
+    ep->looked_up_us = hal_time_us();
+
+    /* Looked up for a name the endpoint has had since; it is due another lookup already */
+    if (true == ep->stale) {
+        ep->stale = false;
+        return;
+    }
+
+    if (0 == ip_addr) {
+        os_printf("COLLECTOR: %s did not resolve%s\r\n", ep->host,
+                0 != ep->ip_addr ? ", keeping the last address" : "");
+        return;
+    }
+
+    if (ip_addr != ep->ip_addr) {
+        os_printf("COLLECTOR: %s is at %u.%u.%u.%u\r\n", ep->host, ip_addr & 0xff,
+                (ip_addr >> 8) & 0xff, (ip_addr >> 16) & 0xff, ip_addr >> 24);
+
+        /* A different server, for all we know */
+        ep->ip_addr = ip_addr;
+        ep->srtt_us = 0;
+    }
+
+    /* Connect as soon as there is somewhere to connect to */
+    if (true == _collector_running && false == _collector_client->reconnect) {
+        http_client_start(_collector_client, _collector_next_endpoint);
+    }
+}
+
+static ICACHE_FLASH_ATTR
+void _collector_lookup(struct collector_endpoint *ep)
+{
+    ep->lookup_due = false;
+    ep->lookup_pending = true;
+
+    /* The answer may come before this returns */
+    if (0 != hal_dns_resolve(&ep->dns, ep->host)) {
+        ep->lookup_pending = false;
+        ep->looked_up_us = hal_time_us();
+    }
+}
+
+/**
+ * If the endpoint in use has got slow, and another has been answering faster (or hasn't been
+ * tried), drop the connection, so the next one goes straight there.
+ */
+static ICACHE_FLASH_ATTR
+void _collector_check_slow(void)
+{
+    struct collector_endpoint *cur = NULL;
+    int best = -1;
+
+    if (-1 == _collector_current || HTTP_CLIENT_CONNECTED != _collector_client->state) {
+        return;
+    }
+
+    cur = &_collector_endpoints[_collector_current];
+
+    if (cur->srtt_us <= COLLECTOR_SLOW_RTT_MS * 1000) {
+        return;
+    }
+
+    best = _collector_fastest();
+    if (-1 == best || best == _collector_current ||
+            _collector_endpoints[best].srtt_us >= cur->srtt_us)
+    {
+        return;
+    }
+
+    os_printf("COLLECTOR: %s is slow (%u ms), moving to %s\r\n", cur->host, cur->srtt_us / 1000,
+            _collector_endpoints[best].host);
+
+    _collector_moving = true;
+    http_client_disconnect(_collector_client);
+}
+
+/**
+ * Set the endpoints up afresh, for the collector set at runtime if there is one, and otherwise
+ * for COLLECTOR_HOSTS. A lookup still under way is left to finish, since the resolver has hold of
+ * the endpoint, but its answer is thrown away.
+ */
+static ICACHE_FLASH_ATTR
+void _collector_setup_endpoints(void)
+{
+    _collector_nr_endpoints = '\0' != _collector_host[0] ? 1 : COLLECTOR_NR_HOSTS;
+
+    for (unsigned i = 0; i < COLLECTOR_NR_HOSTS; i++) {
+        struct collector_endpoint *ep = &_collector_endpoints[i];
+
+        ep->host = '\0' != _collector_host[0] ? _collector_host : _collector_hosts[i];
+        ep->ip_addr = 0;
+        ep->srtt_us = 0;
+        ep->nr_failures = 0;
+        ep->looked_up_us = 0;
+        ep->lookup_due = true;
+        ep->failed = false;
+        ep->stale = ep->lookup_pending;
+        ep->dns.on_resolved = _collector_on_resolved;
+    }
+
+    _collector_current = -1;
+    _collector_moving = false;
+}
+
+ICACHE_FLASH_ATTR
+void collector_init(struct http_client *client)
+{
+    os_memset(_collector_endpoints, 0, sizeof(_collector_endpoints));
+    _collector_setup_endpoints();
+
+    _collector_client = client;
+    _collector_current = -1;
+    _collector_running = false;
+
+    client->on_rtt = _collector_on_rtt;
+}
+
+ICACHE_FLASH_ATTR
+void collector_start(void)
+{
+    if (true == _collector_running) {
+        return;
+    }
+
+    _collector_running = true;
+
+    /* The network may not be the one the addresses came from */
+    for (unsigned i = 0; i < _collector_nr_endpoints; i++) {
+        _collector_endpoints[i].lookup_due = true;
+    }
+
+    collector_poll();
+
+    if (false == _collector_client->reconnect && -1 != _collector_fastest()) {
+        http_client_start(_collector_client, _collector_next_endpoint);
+    }
+}
+
+ICACHE_FLASH_ATTR
+void collector_stop(void)
+{
+    if (false == _collector_running) {
+        return;
+    }
+
+    os_printf("COLLECTOR: Network down, disconnecting\r\n");
+
+    _collector_running = false;
+    _collector_current = -1;
+    _collector_moving = false;
+
+    http_client_stop(_collector_client);
+}
+
+ICACHE_FLASH_ATTR
+void collector_set_host(const char *host)
+{
+    bool running = _collector_running;
+
+    if (0 == os_strncmp(host, _collector_host, sizeof(_collector_host))) {
+        return;
+    }
+
+    if (os_strlen(host) >= sizeof(_collector_host)) {
+        os_printf("COLLECTOR: Name %s is too long\r\n", host);
+        return;
+    }
+
+    os_printf("COLLECTOR: Moving to %s\r\n", '\0' != *host ? host : "the built in collectors");
+
+    /* Start over, as if the network had only now come up */
+    if (true == running) {
+        _collector_running = false;
+        http_client_stop(_collector_client);
+    }
+
+    os_strcpy(_collector_host, host);
+    _collector_setup_endpoints();
+
+    if (true == running) {
+        collector_start();
+    }
+}
+
+ICACHE_FLASH_ATTR
+void collector_poll(void)
+{
+    uint32_t now = hal_time_us();
+
+    if (false == _collector_running) {
+        return;
+    }
+
+    for (unsigned i = 0; i < _collector_nr_endpoints; i++) {
+        struct collector_endpoint *ep = &_collector_endpoints[i];
+        uint32_t max_age_s = 0 != ep->ip_addr ? COLLECTOR_DNS_TTL_S : COLLECTOR_DNS_RETRY_S;
+
+        if (false == ep->lookup_pending &&
+                (true == ep->lookup_due || now - ep->looked_up_us >= max_age_s * 1000000))
+        {
+            _collector_lookup(ep);
+        }
+    }
+
+    _collector_check_slow();
+}
+
+ICACHE_FLASH_ATTR
+const struct collector_endpoint *collector_get(unsigned index)
+{
+    return index < _collector_nr_endpoints ? &_collector_endpoints[index] : NULL;
+}
+
+ICACHE_FLASH_ATTR
+int collector_current(void)
+{
+    return _collector_current;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+/** \file collector.h Collector endpoints
+ * Keeps the HTTP client connected to whichever of the collectors in COLLECTOR_HOSTS is answering
+ * fastest. Each name is looked up with the platform's resolver and its address kept for
+ * COLLECTOR_DNS_TTL_S. Every response's round trip goes into a smoothed round trip time for the
+ * endpoint it came from, and each new connection goes to the endpoint with the lowest, passing
+ * over any that have failed since the last good connection. When the endpoint in use fails, the
+ * client fails over to the next straight away; only once every endpoint has failed does it back
+ * off.
+ *
+ * A collector can also be set at runtime, to be used instead of all of those.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hal.h"
+#include "collector_config.h"
+
+struct http_client;
+
+struct collector_endpoint {
+    const char *host;
+
+    /**
+     * Address, in network byte order. 0 until the name has resolved; kept if a later lookup fails.
+     */
+    uint32_t ip_addr;
+
+    /**
+     * Smoothed round trip time, 0 until the first response
+     */
+    uint32_t srtt_us;
+
+    /**
+     * Connection attempts that failed, and connections that broke
+     */
+    uint32_t nr_failures;
+
+    /**
+     * Private
+     */
+    struct hal_dns dns;
+    uint32_t looked_up_us;
+    bool lookup_pending;
+    bool lookup_due;
+    bool stale;
+    bool failed;
+};
+
+/**
+ * Set up the endpoints, for the given client to connect to. Call once, after http_client_init().
+ */
+void collector_init(struct http_client *client);
+
+/**
+ * The network is up: look up the names again, and connect as soon as there is an address. Does
+ * nothing if already started.
+ */
+void collector_start(void);
+
+/**
+ * The network is gone: disconnect, and stop reconnecting. Does nothing if not started.
+ */
+void collector_stop(void);
+
+/**
+ * Use the given collector, by name or as a dotted quad, instead of COLLECTOR_HOSTS; an empty name
+ * goes back to COLLECTOR_HOSTS. The name is copied. If started, the connection moves straight
+ * away.
+ */
+void collector_set_host(const char *host);
+
+/**
+ * Call periodically while started, to look up names as their addresses expire, and to move off an
+ * endpoint that has slowed down.
+ */
+void collector_poll(void);
+
+/**
+ * The index'th endpoint, or NULL past the last one.
+ */
+const struct collector_endpoint *collector_get(unsigned index);
+
+/**
+ * Index of the endpoint the client is connected or connecting to, or -1 if none.
+ */
+int collector_current(void);
@@ -0,0 +1,36 @@
+#pragma once
+
+/**
+ * The collectors samples can go to, by name or as dotted quads. Uploads go to whichever answers
+ * fastest, and move on to the next the moment it fails.
+ */
+#define COLLECTOR_HOSTS             { "yogurt-collector.lan", "172.16.1.1" }
+#define COLLECTOR_PORT              24666
+
+/**
+ * Longest collector name that can be set at runtime with collector_set_host(), NUL included
+ */
+#define COLLECTOR_HOST_LEN          48
+
+/**
+ * How long a looked up address is used before it is looked up again. The SDK's resolver doesn't
+ * pass on the record's own TTL, so this stands in for it.
+ */
+#define COLLECTOR_DNS_TTL_S         300
+
+/**
+ * Wait before looking a name up again when it didn't resolve
+ */
+#define COLLECTOR_DNS_RETRY_S       30
+
+/**
+ * Round trip past which the collector in use counts as overloaded, and the connection is moved
+ * to one that has been answering faster, or hasn't been tried yet
+ */
+#define COLLECTOR_SLOW_RTT_MS       2000
+
+/**
+ * Weight of each new round trip in an endpoint's smoothed round trip time, as a shift: 3 is an
+ * eighth, as TCP uses
+ */
+#define COLLECTOR_RTT_SHIFT         3
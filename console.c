@@ -0,0 +1,132 @@
+/** \file console.c Commands over the UART
+ */
+
+#include "console.h"
+
+#include "hal.h"
+
+static
+struct console_cmd *_console_cmds = NULL;
+
+/* The line so far; once it has overflowed, everything up to the end of it is dropped */
+static
+char _console_line[CONSOLE_LINE_LEN];
+
+static
+size_t _console_len = 0;
+
+static
+bool _console_overflow = false;
+
+static ICACHE_FLASH_ATTR
+void _console_help(int argc, char *argv[])
+{
+    for (struct console_cmd *cmd = _console_cmds; NULL != cmd; cmd = cmd->next) {
+        os_printf("CONSOLE: %-10s %s\r\n", cmd->name, cmd->help);
+    }
+}
+
+static
+struct console_cmd _console_help_cmd = {
+    .name = "help",
+    .help = "List commands",
+    .func = _console_help,
+};
+
+/**
+ * Split a line into words and run the command it names.
+ */
+static ICACHE_FLASH_ATTR
+void _console_run(char *line)
+{
+    char *argv[CONSOLE_MAX_ARGS];
+    int argc = 0;
+    char *p = line;
+
+    while (argc < CONSOLE_MAX_ARGS) {
+        while (' ' == *p) {
+            p++;
+        }
+
+        if ('\0' == *p) {
+            break;
+        }
+
+        argv[argc++] = p;
+
+        while ('\0' != *p && ' ' != *p) {
+            p++;
+        }
+
+        if ('\0' != *p) {
+            *p++ = '\0';
+        }
+    }
+
+    if (0 == argc) {
+        return;
+    }
+
+    for (struct console_cmd *cmd = _console_cmds; NULL != cmd; cmd = cmd->next) {
+        if (0 == os_strcmp(cmd->name, argv[0])) {
+            cmd->func(argc, argv);
+            return;
+        }
+    }
+
+    os_printf("CONSOLE: Unknown command '%s', try help\r\n", argv[0]);
+}
+
+static ICACHE_FLASH_ATTR
+void _console_rx(const char *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        char c = data[i];
+
+        if ('\r' == c || '\n' == c) {
+            if (true == _console_overflow) {
+                os_printf("CONSOLE: Line too long\r\n");
+            } else {
+                _console_line[_console_len] = '\0';
+                _console_run(_console_line);
+            }
+
+            _console_len = 0;
+            _console_overflow = false;
+        } else if ('\b' == c || 0x7f == c) {
+            if (0 != _console_len) {
+                _console_len--;
+            }
+        } else if (_console_len < CONSOLE_LINE_LEN - 1) {
+            _console_line[_console_len++] = c;
+        } else {
+            _console_overflow = true;
+        }
+    }
+}
+
+ICACHE_FLASH_ATTR
+int console_init(void)
+{
+    _console_cmds = NULL;
+    _console_len = 0;
+    _console_overflow = false;
+
+    console_add(&_console_help_cmd);
+
+    return hal_uart_set_rx(_console_rx);
+}
+
+ICACHE_FLASH_ATTR
+void console_add(struct console_cmd *cmd)
+{
+    struct console_cmd **pprev = &_console_cmds;
+
+    /* Keep them in the order they were added, for help */
+    while (NULL != *pprev) {
+        pprev = &(*pprev)->next;
+    }
+
+    cmd->next = NULL;
+    *pprev = cmd;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+/** \file console.h Commands over the UART
+ * Gathers what comes in on the console UART into lines, and runs the command each line names,
+ * with the rest of the line split into arguments at spaces. Commands are added by whichever
+ * module has something to offer; "help" lists them.
+ */
+
+/**
+ * Longest line, and most words in one. Longer lines are thrown away.
+ */
+#define CONSOLE_LINE_LEN            80
+#define CONSOLE_MAX_ARGS            6
+
+/**
+ * Run a command. argv[0] is the command's name.
+ */
+typedef void (*console_func_t)(int argc, char *argv[]);
+
+struct console_cmd {
+    const char *name;
+
+    /**
+     * One line description, for help
+     */
+    const char *help;
+
+    console_func_t func;
+
+    /**
+     * Private
+     */
+    struct console_cmd *next;
+};
+
+/**
+ * Start taking commands from the UART. Call once at start of day, before adding any commands.
+ *
+ * \return 0 on success, -1 if the UART could not be set up.
+ */
+int console_init(void);
+
+/**
+ * Add a command. The command is not copied, so it must stay around.
+ */
+void console_add(struct console_cmd *cmd);
@@ -0,0 +1,19 @@
+#include "crc16.h"
+
+#include "hal.h"
+
+ICACHE_FLASH_ATTR
+uint16_t crc16_ccitt(const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint16_t crc = 0xffff;
+
+    while (len--) {
+        crc ^= (uint16_t)*p++ << 8;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+
+    return crc;
+}
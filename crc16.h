@@ -0,0 +1,12 @@
+#pragma once
+
+/** \file crc16.h CRC-16/CCITT-FALSE, for checking records kept in flash and RTC memory
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * CRC-16/CCITT-FALSE (polynomial 0x1021, initial value 0xffff) of len bytes.
+ */
+uint16_t crc16_ccitt(const void *data, size_t len);
@@ -0,0 +1,357 @@
+/** \file flash_log.c Append-only sample log in SPI flash
+ * Each segment is one sector: a 16 byte header, then fixed-size records. A segment's header
+ * carries its sequence number, so position p lives in segment p / FLASH_LOG_RECS_PER_SEG, which is
+ * stored in sector slot (segment % FLASH_LOG_NR_SECTORS). Once every record in a segment has been
+ * delivered its header's drained word is cleared, which NOR flash lets us do without an erase.
+ */
+
+#include "flash_log.h"
+
+#include "crc16.h"
+#include "hal.h"
+
+#define FLASH_LOG_SEG_MAGIC         0x474f4c59ul    /* "YLOG" */
+#define FLASH_LOG_REC_MAGIC         0x5a17c0deul
+#define FLASH_LOG_NOT_DRAINED       0xfffffffful
+#define FLASH_LOG_DRAINED           0x0ul
+
+struct flash_log_seg_hdr {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t drained;
+    uint32_t reserved;
+};
+
+struct flash_log_record {
+    uint32_t time_ms;
+    int16_t probe_temp;
+    int16_t int_temp;
+    uint8_t probe;
+    uint8_t flags;
+    uint16_t crc;
+    uint32_t magic;
+};
+
+/* The CRC covers everything up to the crc field */
+#define FLASH_LOG_REC_CRC_LEN       offsetof(struct flash_log_record, crc)
+
+#define FLASH_LOG_RECS_PER_SEG \
+    ((HAL_FLASH_SECTOR_SIZE - sizeof(struct flash_log_seg_hdr)) / sizeof(struct flash_log_record))
+
+/* Records per sequential read when draining */
+#define FLASH_LOG_READ_RECS         TELEMETRY_MAX_BATCH
+
+static
+uint32_t _fl_write,
+         _fl_read,
+         _fl_commit;
+
+/* The segment _fl_write points into has been erased and has its header */
+static
+bool _fl_write_seg_ready = false;
+
+static
+struct flash_log_stats _fl_stats;
+
+static
+struct flash_log_record _fl_read_buf[FLASH_LOG_READ_RECS];
+
+static ICACHE_FLASH_ATTR
+uint32_t _flash_log_seg_addr(uint32_t seg)
+{
+    return (FLASH_LOG_START_SECTOR + (seg % FLASH_LOG_NR_SECTORS)) * HAL_FLASH_SECTOR_SIZE;
+}
+
+static ICACHE_FLASH_ATTR
+uint32_t _flash_log_rec_addr(uint32_t pos)
+{
+    return _flash_log_seg_addr(pos / FLASH_LOG_RECS_PER_SEG) + sizeof(struct flash_log_seg_hdr) +
+        (pos % FLASH_LOG_RECS_PER_SEG) * sizeof(struct flash_log_record);
+}
+
+/**
+ * Signed distance from a to b, so comparisons survive the positions wrapping.
+ */
+static inline
+int32_t _flash_log_diff(uint32_t a, uint32_t b)
+{
+    return (int32_t)(b - a);
+}
+
+static ICACHE_FLASH_ATTR
+bool _flash_log_rec_erased(const struct flash_log_record *rec)
+{
+    const uint32_t *words = (const uint32_t *)rec;
+
+    for (size_t i = 0; i < sizeof(*rec) / 4; i++) {
+        if (0xfffffffful != words[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Find where writing left off in the newest segment.
+ */
+static ICACHE_FLASH_ATTR
+int _flash_log_find_write_pos(uint32_t seg)
+{
+    uint32_t pos = seg * FLASH_LOG_RECS_PER_SEG,
+             end = pos + FLASH_LOG_RECS_PER_SEG;
+
+    while (pos < end) {
+        unsigned nr = end - pos < FLASH_LOG_READ_RECS ? end - pos : FLASH_LOG_READ_RECS;
+
+        if (0 != hal_flash_read(_flash_log_rec_addr(pos), _fl_read_buf, nr * sizeof(struct flash_log_record))) {
+            return -1;
+        }
+
+        for (unsigned i = 0; i < nr; i++, pos++) {
+            if (true == _flash_log_rec_erased(&_fl_read_buf[i])) {
+                _fl_write = pos;
+                _fl_write_seg_ready = true;
+                return 0;
+            }
+        }
+    }
+
+    /* Segment is full; the next append starts a new one */
+    _fl_write = end;
+    _fl_write_seg_ready = false;
+
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+int flash_log_init(void)
+{
+    struct flash_log_seg_hdr hdr;
+    uint32_t newest = 0,
+             oldest_undrained = 0;
+    bool have_newest = false,
+         newest_drained = false,
+         have_undrained = false;
+
+    os_memset(&_fl_stats, 0, sizeof(_fl_stats));
+
+    for (unsigned slot = 0; slot < FLASH_LOG_NR_SECTORS; slot++) {
+        if (0 != hal_flash_read((FLASH_LOG_START_SECTOR + slot) * HAL_FLASH_SECTOR_SIZE, &hdr, sizeof(hdr))) {
+            os_printf("FLASHLOG: Failed to read segment %u\r\n", slot);
+            return -1;
+        }
+
+        if (FLASH_LOG_SEG_MAGIC != hdr.magic || slot != hdr.seq % FLASH_LOG_NR_SECTORS) {
+            continue;
+        }
+
+        if (false == have_newest || _flash_log_diff(newest, hdr.seq) > 0) {
+            newest = hdr.seq;
+            newest_drained = FLASH_LOG_NOT_DRAINED != hdr.drained;
+            have_newest = true;
+        }
+
+        if (FLASH_LOG_NOT_DRAINED == hdr.drained &&
+                (false == have_undrained || _flash_log_diff(oldest_undrained, hdr.seq) < 0))
+        {
+            oldest_undrained = hdr.seq;
+            have_undrained = true;
+        }
+    }
+
+    if (false == have_newest) {
+        _fl_write = 0;
+        _fl_write_seg_ready = false;
+    } else if (true == newest_drained) {
+        /* Never append to a drained segment; its records would be skipped after a reset */
+        _fl_write = (newest + 1) * FLASH_LOG_RECS_PER_SEG;
+        _fl_write_seg_ready = false;
+    } else if (0 != _flash_log_find_write_pos(newest)) {
+        return -1;
+    }
+
+    _fl_commit = true == have_undrained ? oldest_undrained * FLASH_LOG_RECS_PER_SEG : _fl_write;
+    _fl_read = _fl_commit;
+
+    if (_fl_write != _fl_commit) {
+        os_printf("FLASHLOG: %u samples waiting from before reset\r\n", _fl_write - _fl_commit);
+    }
+
+    return 0;
+}
+
+/**
+ * Erase the sector for the segment _fl_write has just moved into and write its header. If the
+ * log has wrapped onto undelivered records, they are lost.
+ */
+static ICACHE_FLASH_ATTR
+int _flash_log_start_segment(void)
+{
+    uint32_t seg = _fl_write / FLASH_LOG_RECS_PER_SEG;
+    uint32_t oldest_kept = (seg - FLASH_LOG_NR_SECTORS + 1) * FLASH_LOG_RECS_PER_SEG;
+    struct flash_log_seg_hdr hdr = {
+        .magic = FLASH_LOG_SEG_MAGIC,
+        .seq = seg,
+        .drained = FLASH_LOG_NOT_DRAINED,
+        .reserved = 0xfffffffful,
+    };
+
+    if (seg >= FLASH_LOG_NR_SECTORS && _flash_log_diff(_fl_commit, oldest_kept) > 0) {
+        _fl_stats.overwritten += oldest_kept - _fl_commit;
+        _fl_commit = oldest_kept;
+        if (_flash_log_diff(_fl_read, oldest_kept) > 0) {
+            _fl_read = oldest_kept;
+        }
+    }
+
+    if (0 != hal_flash_erase(FLASH_LOG_START_SECTOR + (seg % FLASH_LOG_NR_SECTORS)) ||
+            0 != hal_flash_write(_flash_log_seg_addr(seg), &hdr, sizeof(hdr)))
+    {
+        os_printf("FLASHLOG: Failed to start segment %u\r\n", seg);
+        return -1;
+    }
+
+    _fl_write_seg_ready = true;
+
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+int flash_log_append(const struct telemetry_sample *sample)
+{
+    struct flash_log_record rec;
+
+    if (false == _fl_write_seg_ready && 0 != _flash_log_start_segment()) {
+        return -1;
+    }
+
+    rec.time_ms = sample->time_ms;
+    rec.probe_temp = sample->probe_temp;
+    rec.int_temp = sample->int_temp;
+    rec.probe = sample->probe;
+    rec.flags = sample->flags;
+    rec.crc = crc16_ccitt(&rec, FLASH_LOG_REC_CRC_LEN);
+    rec.magic = FLASH_LOG_REC_MAGIC;
+
+    if (0 != hal_flash_write(_flash_log_rec_addr(_fl_write), &rec, sizeof(rec))) {
+        os_printf("FLASHLOG: Failed to write record %u\r\n", _fl_write);
+        return -1;
+    }
+
+    _fl_write++;
+
+    if (0 == _fl_write % FLASH_LOG_RECS_PER_SEG) {
+        _fl_write_seg_ready = false;
+    }
+
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+unsigned flash_log_read(struct telemetry_sample *samples, unsigned max_records, uint32_t *end_pos)
+{
+    unsigned nr = _fl_write - _fl_read,
+             seg_left = FLASH_LOG_RECS_PER_SEG - (_fl_read % FLASH_LOG_RECS_PER_SEG),
+             nr_samples = 0;
+
+    if (nr > seg_left) {
+        nr = seg_left;
+    }
+
+    if (nr > max_records) {
+        nr = max_records;
+    }
+
+    if (nr > FLASH_LOG_READ_RECS) {
+        nr = FLASH_LOG_READ_RECS;
+    }
+
+    if (0 != nr && 0 != hal_flash_read(_flash_log_rec_addr(_fl_read), _fl_read_buf, nr * sizeof(struct flash_log_record))) {
+        os_printf("FLASHLOG: Failed to read records at %u\r\n", _fl_read);
+        nr = 0;
+    }
+
+    for (unsigned i = 0; i < nr; i++) {
+        struct flash_log_record *rec = &_fl_read_buf[i];
+        struct telemetry_sample *sample = &samples[nr_samples];
+
+        if (FLASH_LOG_REC_MAGIC != rec->magic || rec->crc != crc16_ccitt(rec, FLASH_LOG_REC_CRC_LEN)) {
+            _fl_stats.corrupt++;
+            continue;
+        }
+
+        sample->time_ms = rec->time_ms;
+        sample->probe_temp = rec->probe_temp;
+        sample->int_temp = rec->int_temp;
+        sample->probe = rec->probe;
+        sample->flags = rec->flags;
+        nr_samples++;
+    }
+
+    _fl_read += nr;
+    *end_pos = _fl_read;
+
+    return nr_samples;
+}
+
+ICACHE_FLASH_ATTR
+void flash_log_commit(uint32_t end_pos)
+{
+    static const uint32_t drained = FLASH_LOG_DRAINED;
+
+    if (_flash_log_diff(_fl_commit, end_pos) <= 0) {
+        /* Already delivered, or overwritten since */
+        return;
+    }
+
+    /*
+     * Caught up with the writer: close off its segment too, so nothing in it is sent again after a
+     * reset. The next append starts a fresh segment.
+     */
+    if (end_pos == _fl_write && 0 != _fl_write % FLASH_LOG_RECS_PER_SEG) {
+        _fl_write += FLASH_LOG_RECS_PER_SEG - _fl_write % FLASH_LOG_RECS_PER_SEG;
+        _fl_write_seg_ready = false;
+        _fl_read = end_pos = _fl_write;
+    }
+
+    /* Mark every segment we have now finished with */
+    for (uint32_t seg = _fl_commit / FLASH_LOG_RECS_PER_SEG; seg < end_pos / FLASH_LOG_RECS_PER_SEG; seg++) {
+        hal_flash_write(_flash_log_seg_addr(seg) + offsetof(struct flash_log_seg_hdr, drained),
+                &drained, sizeof(drained));
+    }
+
+    _fl_commit = end_pos;
+}
+
+ICACHE_FLASH_ATTR
+void flash_log_rewind(void)
+{
+    _fl_read = _fl_commit;
+}
+
+ICACHE_FLASH_ATTR
+uint32_t flash_log_tell(void)
+{
+    return _fl_read;
+}
+
+ICACHE_FLASH_ATTR
+void flash_log_seek(uint32_t pos)
+{
+    /* Never back past what has been delivered, or was overwritten meanwhile */
+    _fl_read = _flash_log_diff(_fl_commit, pos) < 0 ? _fl_commit : pos;
+}
+
+ICACHE_FLASH_ATTR
+uint32_t flash_log_unread(void)
+{
+    return _fl_write - _fl_read;
+}
+
+ICACHE_FLASH_ATTR
+void flash_log_get_stats(struct flash_log_stats *stats)
+{
+    *stats = _fl_stats;
+    stats->pending = _fl_write - _fl_commit;
+}
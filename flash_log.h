@@ -0,0 +1,93 @@
+#pragma once
+
+/** \file flash_log.h Append-only sample log in SPI flash
+ * Holds samples that could not be uploaded before the RAM ring ran out of room. The log is a ring
+ * of sector-sized segments, each written front to back and erased only when the writer comes back
+ * around to it, so wear is spread evenly over the whole region. Every record carries a CRC, so a
+ * record torn by a reset mid-write is skipped rather than uploaded as garbage.
+ *
+ * Records are addressed by free-running positions. The log keeps three: where the next record is
+ * written, where the next read starts, and everything before the commit position has been
+ * delivered and may be erased.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "flash_log_config.h"
+#include "telemetry.h"
+
+struct flash_log_stats {
+    /**
+     * Records written and not yet delivered
+     */
+    uint32_t pending;
+
+    /**
+     * Records erased before they were delivered, because the log wrapped
+     */
+    uint32_t overwritten;
+
+    /**
+     * Records skipped because their CRC did not match
+     */
+    uint32_t corrupt;
+};
+
+/**
+ * Scan the log region and pick up where the previous boot left off. Undelivered records from
+ * before the reset are kept; a partly delivered segment is sent again from its start.
+ *
+ * \return 0 on success, -1 if the flash could not be read.
+ */
+int flash_log_init(void);
+
+/**
+ * Append a sample. If the log is full, the oldest segment is erased to make room.
+ *
+ * \return 0 on success, -1 on a flash error.
+ */
+int flash_log_append(const struct telemetry_sample *sample);
+
+/**
+ * Read up to max_records records from the read position in one sequential read, without crossing
+ * into the next segment, and advance the read position past them. Records that fail their CRC are
+ * skipped.
+ *
+ * \param samples Where to put the valid samples
+ * \param max_records Most records to read
+ * \param end_pos Returns the position just past the records read. Pass this to
+ *        flash_log_commit() once the samples have been delivered.
+ *
+ * \return Number of valid samples read into samples.
+ */
+unsigned flash_log_read(struct telemetry_sample *samples, unsigned max_records, uint32_t *end_pos);
+
+/**
+ * Mark everything before end_pos as delivered. Segments that are entirely delivered are marked as
+ * such in flash, so they are not sent again after a reset.
+ */
+void flash_log_commit(uint32_t end_pos);
+
+/**
+ * Move the read position back to the oldest undelivered record, after reads were lost in flight.
+ */
+void flash_log_rewind(void);
+
+/**
+ * The read position, where the next flash_log_read() starts.
+ */
+uint32_t flash_log_tell(void);
+
+/**
+ * Move the read position back to pos, returned by flash_log_tell(), so records read but never sent
+ * are read again.
+ */
+void flash_log_seek(uint32_t pos);
+
+/**
+ * Records appended but not yet read.
+ */
+uint32_t flash_log_unread(void);
+
+void flash_log_get_stats(struct flash_log_stats *stats);
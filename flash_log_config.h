@@ -0,0 +1,9 @@
+#pragma once
+
+/**
+ * SPI flash region reserved for the offline sample log. On a 4MiB part the firmware and the SDK's
+ * own parameter sectors stay below 1MiB and in the last few sectors, so the log takes the 2MiB
+ * from 1MiB up. That is 512 segments of 255 samples, about 18 hours of one probe at 2Hz.
+ */
+#define FLASH_LOG_START_SECTOR      0x100
+#define FLASH_LOG_NR_SECTORS        512
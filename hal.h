@@ -0,0 +1,429 @@
+#pragma once
+
+/** \file hal.h Hardware abstraction layer
+ * Thin layer over the platform for SPI, GPIO, timers, tasks, UART input, SPI flash, RTC memory and
+ * deep sleep, WiFi, TCP and DNS. The drivers and the
+ * application only talk to the platform through here, so the whole thing can be built either
+ * against the ESP8266 NONOS SDK (hal_sdk.c) or as a native Linux simulator (sim/hal_linux.c).
+ *
+ * The platform header provides ICACHE_FLASH_ATTR, the os_* string and printing helpers, and the
+ * private parts of struct hal_timer, struct hal_tcp and struct hal_dns.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef HAL_LINUX
+#include "sim/hal_linux.h"
+#else
+#include "hal_sdk.h"
+#endif
+
+/**
+ * Build an IPv4 address, in network byte order, from its four octets.
+ */
+#define HAL_IP4(_a, _b, _c, _d) \
+    ((uint32_t)(_a) | ((uint32_t)(_b) << 8) | ((uint32_t)(_c) << 16) | ((uint32_t)(_d) << 24))
+
+/**
+ * Bring up the UART and GPIO subsystems. Call this first thing.
+ */
+void hal_init(void);
+
+/**
+ * Microseconds since boot. Wraps at 32 bits.
+ */
+uint32_t hal_time_us(void);
+
+/**
+ * Free-running CPU cycle counter (CCOUNT on the ESP8266). Only good for measuring short intervals.
+ */
+uint32_t hal_ccount(void);
+
+/**
+ * 32 bits from the hardware random number generator. Good for spreading things out in time, not
+ * for keys.
+ */
+uint32_t hal_random(void);
+
+/**
+ * GPIO
+ */
+
+/**
+ * Route a GPIO to the GPIO function and make it an output.
+ */
+void hal_gpio_enable_output(unsigned gpio);
+
+/**
+ * Drive the GPIOs in the mask high.
+ */
+void hal_gpio_set(uint32_t mask);
+
+/**
+ * Drive the GPIOs in the mask low.
+ */
+void hal_gpio_clear(uint32_t mask);
+
+/**
+ * Tasks
+ */
+
+enum hal_task_prio {
+    HAL_TASK_PRIO_LOW = 0,
+    HAL_TASK_PRIO_MEDIUM,
+    HAL_TASK_PRIO_HIGH,
+    HAL_TASK_PRIO_MAX,
+};
+
+typedef void (*hal_task_func_t)(uint32_t sig, uint32_t par);
+
+/**
+ * Register the handler for a task priority. There is one task per priority.
+ *
+ * \return 0 on success, -1 otherwise.
+ */
+int hal_task_register(enum hal_task_prio prio, hal_task_func_t func);
+
+/**
+ * Post an event to a task. Safe to call from interrupt context.
+ *
+ * \return 0 on success, -1 if the task's queue is full.
+ */
+int hal_task_post(enum hal_task_prio prio, uint32_t sig, uint32_t par);
+
+/**
+ * Software timers
+ */
+
+typedef void (*hal_timer_func_t)(void *arg);
+
+struct hal_timer {
+    struct hal_timer_priv priv;
+};
+
+void hal_timer_setfn(struct hal_timer *timer, hal_timer_func_t func, void *arg);
+void hal_timer_arm(struct hal_timer *timer, uint32_t ms, bool repeat);
+void hal_timer_disarm(struct hal_timer *timer);
+
+/**
+ * Hardware timer. Fires at a fixed period from interrupt context, independently of the software
+ * timers and whatever the WiFi stack is up to. There is only one.
+ *
+ * The callback gets the hal_time_us() the interrupt was taken at. It runs in interrupt context, so
+ * it must be IRAM resident, be quick, and do no more than hal_task_post() or
+ * sched_post_from_isr().
+ */
+typedef void (*hal_hw_timer_func_t)(uint32_t now_us);
+
+/**
+ * Start the hardware timer.
+ *
+ * \return 0 on success, -1 if the period is out of range.
+ */
+int hal_hw_timer_start(uint32_t period_us, hal_hw_timer_func_t func);
+void hal_hw_timer_stop(void);
+
+/**
+ * UART receive
+ */
+
+/**
+ * Called from task context with whatever has come in on the console UART since the last call.
+ */
+typedef void (*hal_uart_rx_func_t)(const char *data, size_t len);
+
+/**
+ * Start receiving on the console UART. Takes the HAL_TASK_PRIO_LOW task. Bytes that arrive while
+ * the receive buffer is full are dropped.
+ *
+ * \return 0 on success, -1 if the task could not be registered.
+ */
+int hal_uart_set_rx(hal_uart_rx_func_t func);
+
+/**
+ * SPI
+ */
+
+/**
+ * Bus ID of the HSPI interface, the only one available to the application.
+ */
+#define HAL_SPI_HSPI                1
+
+struct spi_xfer;
+
+/**
+ * Set up the HSPI pins and clock, in SPI mode 0, MSB first.
+ */
+void hal_spi_init(uint32_t speed_hz);
+
+/**
+ * Change the HSPI clock. Only between transactions; may be called from interrupt context.
+ */
+void hal_spi_set_speed(uint32_t speed_hz);
+
+/**
+ * Assert chip select and A0 and start the given transaction. Once every byte is on the wire the
+ * backend releases chip select and calls spi_queue_complete(), possibly from interrupt context.
+ * Only used by spi_queue.c.
+ */
+void hal_spi_start(struct spi_xfer *xfer);
+
+/**
+ * Run a transaction to completion, spinning until it is done. The SPI queue must be idle.
+ * Only for start of day and benchmarking.
+ */
+void hal_spi_xfer_sync(struct spi_xfer *xfer);
+
+/**
+ * Give the backend a chance to make progress while spi_queue_wait_idle() is spinning. Does
+ * nothing if completion is interrupt driven.
+ */
+void hal_spi_poll(void);
+
+/**
+ * Mask and unmask the SPI completion interrupt, to protect state shared with it.
+ */
+void hal_spi_lock(void);
+void hal_spi_unlock(void);
+
+/**
+ * SPI flash
+ */
+
+#define HAL_FLASH_SECTOR_SIZE       4096
+
+/**
+ * Erase one 4KiB sector of the SPI flash to all ones.
+ *
+ * \return 0 on success, -1 otherwise.
+ */
+int hal_flash_erase(unsigned sector);
+
+/**
+ * Program the flash. Like any NOR flash this can only clear bits, so the area should have been
+ * erased first. addr, data and len must all be multiples of 4.
+ *
+ * \return 0 on success, -1 otherwise.
+ */
+int hal_flash_write(uint32_t addr, const void *data, size_t len);
+
+/**
+ * Read from the flash. addr, data and len must all be multiples of 4.
+ *
+ * \return 0 on success, -1 otherwise.
+ */
+int hal_flash_read(uint32_t addr, void *data, size_t len);
+
+/**
+ * RTC memory and deep sleep
+ */
+
+/**
+ * Bytes of RTC memory available to the application. Unlike RAM, RTC memory keeps its contents
+ * through deep sleep and any reset short of losing power; after power-on it holds garbage.
+ */
+#define HAL_RTC_MEM_LEN             512
+
+/**
+ * Read from RTC memory. offset, data and len must all be multiples of 4.
+ *
+ * \return 0 on success, -1 otherwise.
+ */
+int hal_rtc_mem_read(unsigned offset, void *data, size_t len);
+
+/**
+ * Write to RTC memory. offset, data and len must all be multiples of 4.
+ *
+ * \return 0 on success, -1 otherwise.
+ */
+int hal_rtc_mem_write(unsigned offset, const void *data, size_t len);
+
+/**
+ * Power down everything but the RTC for us microseconds. The chip then resets and starts over
+ * from user_init(), with only RTC memory and the SPI flash intact. Wake up needs GPIO16 wired to
+ * RST. Returns, but the chip goes down shortly after, so do nothing more than return to the SDK.
+ *
+ * \param radio_on_wake Whether the radio is powered up on the next wake. Without it, the WiFi calls
+ *        fail until the next wake that has it.
+ */
+void hal_deep_sleep(uint32_t us, bool radio_on_wake);
+
+/**
+ * WiFi
+ */
+
+enum hal_wifi_status {
+    HAL_WIFI_IDLE = 0,
+    HAL_WIFI_CONNECTING,
+    HAL_WIFI_WRONG_PASSWORD,
+    HAL_WIFI_NO_AP_FOUND,
+    HAL_WIFI_CONNECT_FAIL,
+    HAL_WIFI_GOT_IP,
+};
+
+/**
+ * Where a network was found last time and the address it leased us: enough to join it again
+ * without a scan or DHCP. Addresses are in network byte order, as HAL_IP4() gives them.
+ */
+struct hal_wifi_link {
+    uint8_t bssid[6];
+    uint8_t channel;
+    uint8_t _padding;
+    uint32_t ip;
+    uint32_t netmask;
+    uint32_t gw;
+    uint32_t dns;
+};
+
+/**
+ * Put the radio in station mode.
+ */
+void hal_wifi_init(void);
+
+/**
+ * Configure the station and start connecting to the given network. Any connection or attempt
+ * already under way is dropped first.
+ *
+ * \param link If not NULL, go straight to that access point on that channel, and use its address
+ *        rather than asking DHCP for one. If the access point isn't there the attempt fails as
+ *        usual, and it is up to the caller to try again without.
+ *
+ * \return 0 if the connection attempt was started, -1 otherwise.
+ */
+int hal_wifi_connect(const char *ssid, const char *psk, const struct hal_wifi_link *link);
+
+enum hal_wifi_status hal_wifi_status(void);
+
+/**
+ * Once connected, find out where we are: the access point and address in use, and how long it
+ * took to get them.
+ *
+ * \param link Where to put the access point and address
+ * \param connect_us Where to put the time from hal_wifi_connect() to getting an address
+ *
+ * \return 0 on success, -1 if not connected.
+ */
+int hal_wifi_get_link(struct hal_wifi_link *link, uint32_t *connect_us);
+
+/**
+ * DNS
+ */
+
+struct hal_dns;
+
+/**
+ * A lookup is over. ip_addr is in network byte order, or 0 if the name could not be resolved.
+ */
+typedef void (*hal_dns_func_t)(struct hal_dns *dns, uint32_t ip_addr);
+
+/**
+ * A name lookup. Embed this in the owner's state and fill in the callback before resolving.
+ */
+struct hal_dns {
+    struct hal_dns_priv priv;
+    hal_dns_func_t on_resolved;
+};
+
+/**
+ * Look up a host name with the resolver the network gave us. Dotted quads are answered without
+ * asking anyone. The callback comes from task context once the answer is in or the lookup has
+ * failed; if the platform already has the answer, that may be before this returns. One lookup at
+ * a time per hal_dns, and the name must stay valid until the callback.
+ *
+ * \return 0 if the lookup was started, -1 otherwise.
+ */
+int hal_dns_resolve(struct hal_dns *dns, const char *name);
+
+/**
+ * TCP
+ */
+
+struct hal_tcp;
+
+typedef void (*hal_tcp_event_func_t)(struct hal_tcp *tcp);
+typedef void (*hal_tcp_error_func_t)(struct hal_tcp *tcp, int err);
+typedef void (*hal_tcp_recv_func_t)(struct hal_tcp *tcp, char *data, unsigned short len);
+
+/**
+ * A TCP connection. Embed this in the owner's state and fill in the callbacks before connecting.
+ * All callbacks are invoked from task context.
+ */
+struct hal_tcp {
+    struct hal_tcp_priv priv;
+
+    /**
+     * The connection is established
+     */
+    hal_tcp_event_func_t on_connect;
+
+    /**
+     * The connection was closed, by either end
+     */
+    hal_tcp_event_func_t on_disconnect;
+
+    /**
+     * The connection failed or was reset. err is a platform specific error code.
+     */
+    hal_tcp_error_func_t on_error;
+
+    /**
+     * The last buffer passed to hal_tcp_send() has been sent, and may be reused
+     */
+    hal_tcp_event_func_t on_sent;
+
+    /**
+     * Data arrived. The buffer is only valid for the duration of the callback.
+     */
+    hal_tcp_recv_func_t on_recv;
+};
+
+/**
+ * Start connecting to the given address and port. ip_addr is in network byte order.
+ *
+ * \return 0 if the connection attempt was started, -1 otherwise.
+ */
+int hal_tcp_connect(struct hal_tcp *tcp, uint32_t ip_addr, uint16_t port);
+
+/**
+ * Queue data to be sent. Only one buffer may be outstanding at a time; the buffer must remain
+ * valid until on_sent is called. The data may live in flash (ICACHE_RODATA_ATTR), as long as it
+ * is no longer than HAL_TCP_BOUNCE_LEN.
+ *
+ * \return 0 on success, -1 if the data could not be queued.
+ */
+int hal_tcp_send(struct hal_tcp *tcp, const void *data, size_t len);
+
+/**
+ * Close the connection. on_disconnect is called once it is down.
+ */
+int hal_tcp_disconnect(struct hal_tcp *tcp);
+
+/**
+ * Listening for connections
+ */
+
+struct hal_tcp_listener;
+
+/**
+ * A connection has come in. Return the hal_tcp to carry it, with its callbacks filled in, or NULL
+ * to turn it away. on_connect is called on it straight after.
+ */
+typedef struct hal_tcp *(*hal_tcp_accept_func_t)(struct hal_tcp_listener *listener);
+
+struct hal_tcp_listener {
+    struct hal_tcp_listener_priv priv;
+    hal_tcp_accept_func_t on_accept;
+};
+
+/**
+ * Start accepting connections on the given port.
+ *
+ * \param max_conns Most connections to have open at once; the stack turns away any more
+ * \param timeout_s Connections idle for this long are closed by the stack. Not enforced by the
+ *                  simulator.
+ *
+ * \return 0 on success, -1 otherwise.
+ */
+int hal_tcp_listen(struct hal_tcp_listener *listener, uint16_t port, unsigned max_conns, unsigned timeout_s);
@@ -0,0 +1,1086 @@
+/** \file hal_sdk.c ESP8266 NONOS SDK backend for the HAL
+ * Functions not marked ICACHE_FLASH_ATTR here are called from interrupt context, and must stay in
+ * IRAM.
+ */
+
+#include "hal.h"
+#include "spi_queue.h"
+
+#include <driver/spi_interface.h>
+#include <driver/uart.h>
+#include <driver/uart_register.h>
+#include <gpio.h>
+
+#include <stddef.h>
+
+#define ARRAY_LEN(x) (sizeof((x))/sizeof((x[0])))
+
+#define HAL_SPI_BUS                 SpiNum_HSPI
+
+/* Start of the memory mapped SPI flash, where ICACHE_RODATA_ATTR data lives */
+#define HAL_FLASH_MAP_START         0x40200000ul
+
+/* Size of the HSPI data FIFO (W0-W15) */
+#define HAL_SPI_FIFO_BYTES          64
+
+/* Shared SPI/HSPI/I2S interrupt status register */
+#define HAL_SPI_INT_STATUS          0x3ff00020
+#define HAL_SPI_INT_STATUS_SPI      BIT(4)
+#define HAL_SPI_INT_STATUS_HSPI     BIT(7)
+
+#define HAL_TASK_QUEUE_LEN          4
+
+/* FRC1 control bits, and its clock with the divide by 16 prescaler */
+#define HAL_FRC1_ENABLE             BIT(7)
+#define HAL_FRC1_AUTO_LOAD          BIT(6)
+#define HAL_FRC1_DIV_16             (1 << 2)
+#define HAL_FRC1_TICKS_PER_US       5
+#define HAL_FRC1_MAX_TICKS          0x7fffff
+
+/* The free running microsecond counter system_get_time() reads */
+#define HAL_WDEV_NOW                0x3ff20c00
+
+/* Console UART receive: software buffer (a power of two), and when the FIFO interrupts */
+#define HAL_UART_RX_BUF_LEN         128
+#define HAL_UART_RX_FULL_THRESH     16
+#define HAL_UART_RX_TIMEOUT         2
+#define HAL_UART_TASK_PRIO          HAL_TASK_PRIO_LOW
+
+/**
+ * IO mux register and function for each GPIO that can be used as a plain GPIO. GPIOs 6-11 are
+ * wired to the flash, so are left alone.
+ */
+static const
+struct hal_gpio_mux {
+    uint32_t reg;
+    uint8_t func;
+} _hal_gpio_mux[16] = {
+    [0] =  { PERIPHS_IO_MUX_GPIO0_U, FUNC_GPIO0 },
+    [1] =  { PERIPHS_IO_MUX_U0TXD_U, FUNC_GPIO1 },
+    [2] =  { PERIPHS_IO_MUX_GPIO2_U, FUNC_GPIO2 },
+    [3] =  { PERIPHS_IO_MUX_U0RXD_U, FUNC_GPIO3 },
+    [4] =  { PERIPHS_IO_MUX_GPIO4_U, FUNC_GPIO4 },
+    [5] =  { PERIPHS_IO_MUX_GPIO5_U, FUNC_GPIO5 },
+    [9] =  { PERIPHS_IO_MUX_SD_DATA2_U, FUNC_GPIO9 },
+    [10] = { PERIPHS_IO_MUX_SD_DATA3_U, FUNC_GPIO10 },
+    [12] = { PERIPHS_IO_MUX_MTDI_U, FUNC_GPIO12 },
+    [13] = { PERIPHS_IO_MUX_MTCK_U, FUNC_GPIO13 },
+    [14] = { PERIPHS_IO_MUX_MTMS_U, FUNC_GPIO14 },
+    [15] = { PERIPHS_IO_MUX_MTDO_U, FUNC_GPIO15 },
+};
+
+static
+os_event_t _hal_task_queues[HAL_TASK_PRIO_MAX][HAL_TASK_QUEUE_LEN];
+
+static
+hal_task_func_t _hal_task_funcs[HAL_TASK_PRIO_MAX];
+
+/**
+ * The transaction the HSPI interrupt is currently driving, if any
+ */
+static
+struct spi_xfer *volatile _hal_spi_cur = NULL;
+
+ICACHE_FLASH_ATTR
+void hal_init(void)
+{
+    /* Initialize the UART */
+    uart_init(BIT_RATE_115200, BIT_RATE_115200);
+    os_delay_us(100);
+
+    /*
+     * Initialize the GPIO subsystem
+     */
+    gpio_init();
+}
+
+uint32_t hal_time_us(void)
+{
+    return system_get_time();
+}
+
+uint32_t hal_ccount(void)
+{
+    uint32_t ccount;
+    __asm__ __volatile__("rsr %0, ccount" : "=a" (ccount));
+    return ccount;
+}
+
+ICACHE_FLASH_ATTR
+uint32_t hal_random(void)
+{
+    return os_random();
+}
+
+ICACHE_FLASH_ATTR
+void hal_gpio_enable_output(unsigned gpio)
+{
+    if (gpio >= ARRAY_LEN(_hal_gpio_mux) || 0 == _hal_gpio_mux[gpio].reg) {
+        os_printf("HAL: GPIO %u can't be used as an output\r\n", gpio);
+        return;
+    }
+
+    PIN_FUNC_SELECT(_hal_gpio_mux[gpio].reg, _hal_gpio_mux[gpio].func);
+    gpio_output_set(0, 0, (1 << gpio), 0);
+}
+
+void hal_gpio_set(uint32_t mask)
+{
+    gpio_output_set(mask, 0, 0, 0);
+}
+
+void hal_gpio_clear(uint32_t mask)
+{
+    gpio_output_set(0, mask, 0, 0);
+}
+
+/*
+ * Tasks. The SDK only passes the event to the task function, so each priority needs its own
+ * trampoline to find the handler.
+ */
+#define HAL_TASK_TRAMPOLINE(_prio) \
+    static ICACHE_FLASH_ATTR \
+    void _hal_task_ ## _prio(os_event_t *evt) \
+    { \
+        _hal_task_funcs[(_prio)](evt->sig, evt->par); \
+    }
+
+HAL_TASK_TRAMPOLINE(HAL_TASK_PRIO_LOW)
+HAL_TASK_TRAMPOLINE(HAL_TASK_PRIO_MEDIUM)
+HAL_TASK_TRAMPOLINE(HAL_TASK_PRIO_HIGH)
+
+static
+os_task_t _hal_task_trampolines[HAL_TASK_PRIO_MAX] = {
+    [HAL_TASK_PRIO_LOW] = _hal_task_HAL_TASK_PRIO_LOW,
+    [HAL_TASK_PRIO_MEDIUM] = _hal_task_HAL_TASK_PRIO_MEDIUM,
+    [HAL_TASK_PRIO_HIGH] = _hal_task_HAL_TASK_PRIO_HIGH,
+};
+
+ICACHE_FLASH_ATTR
+int hal_task_register(enum hal_task_prio prio, hal_task_func_t func)
+{
+    if (prio >= HAL_TASK_PRIO_MAX || NULL != _hal_task_funcs[prio]) {
+        return -1;
+    }
+
+    _hal_task_funcs[prio] = func;
+
+    if (false == system_os_task(_hal_task_trampolines[prio], USER_TASK_PRIO_0 + prio,
+                _hal_task_queues[prio], HAL_TASK_QUEUE_LEN))
+    {
+        _hal_task_funcs[prio] = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int hal_task_post(enum hal_task_prio prio, uint32_t sig, uint32_t par)
+{
+    return true == system_os_post(USER_TASK_PRIO_0 + prio, sig, par) ? 0 : -1;
+}
+
+/*
+ * Hardware timer, on FRC1. This is the same timer the SDK's PWM and hw_timer drivers use, so
+ * neither can be used alongside it.
+ */
+static
+hal_hw_timer_func_t _hal_hw_timer_func = NULL;
+
+static
+void _hal_hw_timer_isr(void *arg)
+{
+    RTC_CLR_REG_MASK(FRC1_INT_ADDRESS, FRC1_INT_CLR_MASK);
+
+    /* system_get_time() lives in flash; the register it reads doesn't */
+    _hal_hw_timer_func(READ_PERI_REG(HAL_WDEV_NOW));
+}
+
+ICACHE_FLASH_ATTR
+int hal_hw_timer_start(uint32_t period_us, hal_hw_timer_func_t func)
+{
+    if (0 == period_us || period_us > HAL_FRC1_MAX_TICKS / HAL_FRC1_TICKS_PER_US) {
+        return -1;
+    }
+
+    _hal_hw_timer_func = func;
+
+    RTC_REG_WRITE(FRC1_CTRL_ADDRESS, HAL_FRC1_AUTO_LOAD | HAL_FRC1_DIV_16 | HAL_FRC1_ENABLE);
+    RTC_REG_WRITE(FRC1_LOAD_ADDRESS, period_us * HAL_FRC1_TICKS_PER_US);
+
+    ETS_FRC_TIMER1_INTR_ATTACH(_hal_hw_timer_isr, NULL);
+    TM1_EDGE_INT_ENABLE();
+    ETS_FRC1_INTR_ENABLE();
+
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+void hal_hw_timer_stop(void)
+{
+    ETS_FRC1_INTR_DISABLE();
+    TM1_EDGE_INT_DISABLE();
+    RTC_REG_WRITE(FRC1_CTRL_ADDRESS, 0);
+}
+
+/*
+ * Console UART receive. The interrupt drains the FIFO into a ring and posts the UART task, which
+ * hands whatever has gathered to the application. This replaces the receive handler uart_init()
+ * installs.
+ */
+static
+hal_uart_rx_func_t _hal_uart_rx_func = NULL;
+
+static
+char _hal_uart_rx_buf[HAL_UART_RX_BUF_LEN];
+
+/* Written by the interrupt only, and by the task only, respectively */
+static
+volatile uint32_t _hal_uart_rx_head = 0,
+                  _hal_uart_rx_tail = 0;
+
+static
+volatile bool _hal_uart_posted = false;
+
+static
+void _hal_uart_isr(void *arg)
+{
+    uint32_t status = READ_PERI_REG(UART_INT_ST(UART0));
+
+    while (0 != (READ_PERI_REG(UART_STATUS(UART0)) & (UART_RXFIFO_CNT << UART_RXFIFO_CNT_S))) {
+        char c = READ_PERI_REG(UART_FIFO(UART0)) & 0xff;
+
+        if (_hal_uart_rx_head - _hal_uart_rx_tail < HAL_UART_RX_BUF_LEN) {
+            _hal_uart_rx_buf[_hal_uart_rx_head % HAL_UART_RX_BUF_LEN] = c;
+            _hal_uart_rx_head++;
+        }
+    }
+
+    WRITE_PERI_REG(UART_INT_CLR(UART0), status);
+
+    if (false == _hal_uart_posted) {
+        _hal_uart_posted = true;
+        hal_task_post(HAL_UART_TASK_PRIO, 0, 0);
+    }
+}
+
+static ICACHE_FLASH_ATTR
+void _hal_uart_task(uint32_t sig, uint32_t par)
+{
+    char data[HAL_UART_RX_BUF_LEN];
+    size_t len = 0;
+
+    /* Anything that comes in from here on gets another post */
+    _hal_uart_posted = false;
+
+    while (_hal_uart_rx_tail != _hal_uart_rx_head) {
+        data[len++] = _hal_uart_rx_buf[_hal_uart_rx_tail % HAL_UART_RX_BUF_LEN];
+        _hal_uart_rx_tail++;
+    }
+
+    if (0 != len) {
+        _hal_uart_rx_func(data, len);
+    }
+}
+
+ICACHE_FLASH_ATTR
+int hal_uart_set_rx(hal_uart_rx_func_t func)
+{
+    uint32_t conf1 = 0;
+
+    if (0 != hal_task_register(HAL_UART_TASK_PRIO, _hal_uart_task)) {
+        return -1;
+    }
+
+    _hal_uart_rx_func = func;
+
+    ETS_UART_INTR_DISABLE();
+    ETS_UART_INTR_ATTACH(_hal_uart_isr, NULL);
+
+    /* Interrupt once the FIFO fills part way, or when the line goes quiet with anything in it */
+    conf1 = READ_PERI_REG(UART_CONF1(UART0));
+    conf1 &= ~((UART_RXFIFO_FULL_THRHD << UART_RXFIFO_FULL_THRHD_S) |
+            (UART_RX_TOUT_THRHD << UART_RX_TOUT_THRHD_S));
+    conf1 |= (HAL_UART_RX_FULL_THRESH << UART_RXFIFO_FULL_THRHD_S) |
+        (HAL_UART_RX_TIMEOUT << UART_RX_TOUT_THRHD_S) | UART_RX_TOUT_EN;
+    WRITE_PERI_REG(UART_CONF1(UART0), conf1);
+
+    WRITE_PERI_REG(UART_INT_CLR(UART0), 0xffff);
+    WRITE_PERI_REG(UART_INT_ENA(UART0), UART_RXFIFO_FULL_INT_ENA | UART_RXFIFO_TOUT_INT_ENA);
+    ETS_UART_INTR_ENABLE();
+
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+void hal_timer_setfn(struct hal_timer *timer, hal_timer_func_t func, void *arg)
+{
+    os_timer_disarm(&timer->priv.timer);
+    os_timer_setfn(&timer->priv.timer, (os_timer_func_t *)func, arg);
+}
+
+ICACHE_FLASH_ATTR
+void hal_timer_arm(struct hal_timer *timer, uint32_t ms, bool repeat)
+{
+    os_timer_arm(&timer->priv.timer, ms, repeat);
+}
+
+ICACHE_FLASH_ATTR
+void hal_timer_disarm(struct hal_timer *timer)
+{
+    os_timer_disarm(&timer->priv.timer);
+}
+
+/*
+ * SPI
+ */
+
+/**
+ * Load the next chunk of the transaction into the FIFO and start it. The read phase, if any, is
+ * tacked onto the end of the last chunk.
+ */
+static
+void _hal_spi_load_chunk(struct spi_xfer *xfer)
+{
+    size_t remaining = xfer->tx_len - xfer->tx_offs,
+           chunk = remaining > HAL_SPI_FIFO_BYTES ? HAL_SPI_FIFO_BYTES : remaining;
+    uint32_t user = READ_PERI_REG(SPI_USER(HAL_SPI_BUS)) &
+        ~(SPI_USR_COMMAND | SPI_USR_ADDR | SPI_USR_DUMMY | SPI_USR_MOSI | SPI_USR_MISO);
+
+    if (0 != chunk) {
+        const uint32_t *data = (const uint32_t *)((const uint8_t *)xfer->tx + xfer->tx_offs);
+
+        for (size_t i = 0; i < (chunk + 3)/4; i++) {
+            WRITE_PERI_REG(SPI_W0(HAL_SPI_BUS) + (i * 4), data[i]);
+        }
+
+        WRITE_PERI_REG(SPI_USER1(HAL_SPI_BUS),
+                (READ_PERI_REG(SPI_USER1(HAL_SPI_BUS)) & ~(SPI_USR_MOSI_BITLEN << SPI_USR_MOSI_BITLEN_S)) |
+                (((chunk * 8) - 1) << SPI_USR_MOSI_BITLEN_S));
+        user |= SPI_USR_MOSI;
+    }
+
+    if (chunk == remaining && 0 != xfer->rx_len) {
+        WRITE_PERI_REG(SPI_USER1(HAL_SPI_BUS),
+                (READ_PERI_REG(SPI_USER1(HAL_SPI_BUS)) & ~(SPI_USR_MISO_BITLEN << SPI_USR_MISO_BITLEN_S)) |
+                (((xfer->rx_len * 8) - 1) << SPI_USR_MISO_BITLEN_S));
+        user |= SPI_USR_MISO;
+    }
+
+    WRITE_PERI_REG(SPI_USER(HAL_SPI_BUS), user);
+
+    xfer->tx_offs += chunk;
+
+    SET_PERI_REG_MASK(SPI_CMD(HAL_SPI_BUS), SPI_USR);
+}
+
+#if SPI_CS_EXPANDER_TYPE == SPI_CS_EXPANDER_SHIFT_REG
+/**
+ * Shift a new set of chip select levels into the 74HC595s and latch them. Lines are numbered from
+ * QA of the register nearest the ESP8266, so the far register's byte goes out first. Runs with the
+ * bus idle, and keeps the completion interrupt out of it.
+ */
+static
+void _hal_spi_cs_shift(uint32_t levels)
+{
+    uint32_t word = 0;
+
+    for (int i = 0; i < SPI_CS_SHIFT_REG_NR_BYTES; i++) {
+        word |= ((levels >> ((SPI_CS_SHIFT_REG_NR_BYTES - 1 - i) * 8)) & 0xff) << (i * 8);
+    }
+
+    CLEAR_PERI_REG_MASK(SPI_SLAVE(HAL_SPI_BUS), SPI_TRANS_DONE_EN);
+
+    WRITE_PERI_REG(SPI_W0(HAL_SPI_BUS), word);
+    WRITE_PERI_REG(SPI_USER1(HAL_SPI_BUS),
+            (READ_PERI_REG(SPI_USER1(HAL_SPI_BUS)) & ~(SPI_USR_MOSI_BITLEN << SPI_USR_MOSI_BITLEN_S)) |
+            (((SPI_CS_SHIFT_REG_NR_BYTES * 8) - 1) << SPI_USR_MOSI_BITLEN_S));
+    WRITE_PERI_REG(SPI_USER(HAL_SPI_BUS), (READ_PERI_REG(SPI_USER(HAL_SPI_BUS)) &
+            ~(SPI_USR_COMMAND | SPI_USR_ADDR | SPI_USR_DUMMY | SPI_USR_MISO)) | SPI_USR_MOSI);
+
+    SET_PERI_REG_MASK(SPI_CMD(HAL_SPI_BUS), SPI_USR);
+    while (READ_PERI_REG(SPI_CMD(HAL_SPI_BUS)) & SPI_USR);
+
+    CLEAR_PERI_REG_MASK(SPI_SLAVE(HAL_SPI_BUS), SPI_TRANS_DONE);
+    SET_PERI_REG_MASK(SPI_SLAVE(HAL_SPI_BUS), SPI_TRANS_DONE_EN);
+
+    /* Outputs follow the shift register on the rising edge */
+    gpio_output_set(1 << SPI_CS_SHIFT_REG_LATCH_GPIO, 0, 0, 0);
+    gpio_output_set(0, 1 << SPI_CS_SHIFT_REG_LATCH_GPIO, 0, 0);
+}
+#endif
+
+static
+void _hal_spi_cs_assert(uint8_t cs)
+{
+    if (false == SPI_CS_IS_EXPANDER(cs)) {
+        gpio_output_set(0, 1 << cs, 0, 0);
+        return;
+    }
+
+#if SPI_CS_EXPANDER_TYPE == SPI_CS_EXPANDER_DECODER
+    {
+        unsigned line = SPI_CS_EXPANDER_LINE(cs);
+        uint32_t addr_mask = (1 << SPI_CS_DECODER_A0_GPIO) | (1 << SPI_CS_DECODER_A1_GPIO) |
+                    (1 << SPI_CS_DECODER_A2_GPIO),
+                 addr = ((line & 1) ? (1 << SPI_CS_DECODER_A0_GPIO) : 0) |
+                    ((line & 2) ? (1 << SPI_CS_DECODER_A1_GPIO) : 0) |
+                    ((line & 4) ? (1 << SPI_CS_DECODER_A2_GPIO) : 0);
+
+        /* Settle the address before enabling, so no other output glitches low */
+        gpio_output_set(addr, addr_mask & ~addr, 0, 0);
+        gpio_output_set(0, 1 << SPI_CS_DECODER_EN_GPIO, 0, 0);
+    }
+#elif SPI_CS_EXPANDER_TYPE == SPI_CS_EXPANDER_SHIFT_REG
+    _hal_spi_cs_shift(~(1ul << SPI_CS_EXPANDER_LINE(cs)));
+#endif
+}
+
+static
+void _hal_spi_cs_release(uint8_t cs)
+{
+    if (false == SPI_CS_IS_EXPANDER(cs)) {
+        gpio_output_set(1 << cs, 0, 0, 0);
+        return;
+    }
+
+#if SPI_CS_EXPANDER_TYPE == SPI_CS_EXPANDER_DECODER
+    gpio_output_set(1 << SPI_CS_DECODER_EN_GPIO, 0, 0, 0);
+#elif SPI_CS_EXPANDER_TYPE == SPI_CS_EXPANDER_SHIFT_REG
+    _hal_spi_cs_shift(~0ul);
+#endif
+}
+
+static
+void _hal_spi_select(struct spi_xfer *xfer)
+{
+    if (SPI_XFER_NO_A0 != xfer->a0_gpio) {
+        if (true == xfer->a0_level) {
+            gpio_output_set(1 << xfer->a0_gpio, 0, 0, 0);
+        } else {
+            gpio_output_set(0, 1 << xfer->a0_gpio, 0, 0);
+        }
+    }
+
+    _hal_spi_cs_assert(xfer->cs);
+}
+
+/**
+ * Wrap up a transaction whose last chunk has gone out: pick up anything read, and release the
+ * chip select.
+ */
+static
+void _hal_spi_finish(struct spi_xfer *xfer)
+{
+    if (0 != xfer->rx_len) {
+        uint32_t *data = xfer->rx;
+
+        for (size_t i = 0; i < (xfer->rx_len + 3)/4; i++) {
+            data[i] = READ_PERI_REG(SPI_W0(HAL_SPI_BUS) + (i * 4));
+        }
+    }
+
+    _hal_spi_cs_release(xfer->cs);
+}
+
+static
+void _hal_spi_isr(void *arg)
+{
+    uint32_t status = READ_PERI_REG(HAL_SPI_INT_STATUS);
+    struct spi_xfer *xfer = _hal_spi_cur;
+
+    if (status & HAL_SPI_INT_STATUS_SPI) {
+        /* Flash SPI shares this vector, just acknowledge it */
+        CLEAR_PERI_REG_MASK(SPI_SLAVE(SpiNum_SPI), 0x3ff);
+    }
+
+    if (0 == (status & HAL_SPI_INT_STATUS_HSPI)) {
+        return;
+    }
+
+    CLEAR_PERI_REG_MASK(SPI_SLAVE(HAL_SPI_BUS), SPI_TRANS_DONE);
+
+    if (NULL == xfer) {
+        /* Spurious, or a synchronous transfer */
+        return;
+    }
+
+    if (xfer->tx_offs < xfer->tx_len) {
+        _hal_spi_load_chunk(xfer);
+        return;
+    }
+
+    _hal_spi_finish(xfer);
+    _hal_spi_cur = NULL;
+
+    spi_queue_complete();
+}
+
+ICACHE_FLASH_ATTR
+void hal_spi_init(uint32_t speed_hz)
+{
+    SpiAttr spi_attr;
+
+    /* Set up the GPIOs for the hardware SPI */
+    WRITE_PERI_REG(PERIPHS_IO_MUX, 0x105);
+    /* HSPI MISO */
+    PIN_FUNC_SELECT(PERIPHS_IO_MUX_MTDI_U, 2);
+    /* HSPI MOSI */
+    PIN_FUNC_SELECT(PERIPHS_IO_MUX_MTCK_U, 2);
+    /* HSPI CLK */
+    PIN_FUNC_SELECT(PERIPHS_IO_MUX_MTMS_U, 2);
+
+    /* Set up the SPI interface. The SDK speed is a divider from the 80MHz APB clock. */
+    spi_attr.bitOrder = SpiBitOrder_MSBFirst;
+    spi_attr.speed = 80000000 / speed_hz;
+    spi_attr.mode = SpiMode_Master;
+    spi_attr.subMode = SpiSubMode_0;
+    SPIInit(HAL_SPI_BUS, &spi_attr);
+
+    /* Hook the transaction done interrupt */
+    ETS_SPI_INTR_ATTACH(_hal_spi_isr, NULL);
+    CLEAR_PERI_REG_MASK(SPI_SLAVE(HAL_SPI_BUS), SPI_TRANS_DONE);
+    SET_PERI_REG_MASK(SPI_SLAVE(HAL_SPI_BUS), SPI_TRANS_DONE_EN);
+    ETS_SPI_INTR_ENABLE();
+
+    /* Every expander line starts out deselected */
+#if SPI_CS_EXPANDER_TYPE == SPI_CS_EXPANDER_DECODER
+    hal_gpio_enable_output(SPI_CS_DECODER_A0_GPIO);
+    hal_gpio_enable_output(SPI_CS_DECODER_A1_GPIO);
+    hal_gpio_enable_output(SPI_CS_DECODER_A2_GPIO);
+    hal_gpio_enable_output(SPI_CS_DECODER_EN_GPIO);
+    gpio_output_set(1 << SPI_CS_DECODER_EN_GPIO, 0, 0, 0);
+#elif SPI_CS_EXPANDER_TYPE == SPI_CS_EXPANDER_SHIFT_REG
+    hal_gpio_enable_output(SPI_CS_SHIFT_REG_LATCH_GPIO);
+    gpio_output_set(0, 1 << SPI_CS_SHIFT_REG_LATCH_GPIO, 0, 0);
+    _hal_spi_cs_shift(~0ul);
+#endif
+}
+
+/**
+ * The clock is the 80MHz APB clock through a prescaler and a counter, split the same way SPIInit()
+ * splits it.
+ */
+void hal_spi_set_speed(uint32_t speed_hz)
+{
+    uint32_t div = 0 != speed_hz ? 80000000 / speed_hz : 1,
+             pre = 0,
+             n = 0;
+
+    if (div <= 1) {
+        WRITE_PERI_REG(SPI_CLOCK(HAL_SPI_BUS), SPI_CLK_EQU_SYSCLK);
+        return;
+    }
+
+    pre = 0 != div / 40 ? div / 40 : 1;
+    n = div / pre;
+
+    WRITE_PERI_REG(SPI_CLOCK(HAL_SPI_BUS),
+            (((pre - 1) & SPI_CLKDIV_PRE) << SPI_CLKDIV_PRE_S) |
+            (((n - 1) & SPI_CLKCNT_N) << SPI_CLKCNT_N_S) |
+            ((((n + 1) / 2 - 1) & SPI_CLKCNT_H) << SPI_CLKCNT_H_S) |
+            (((n - 1) & SPI_CLKCNT_L) << SPI_CLKCNT_L_S));
+}
+
+void hal_spi_start(struct spi_xfer *xfer)
+{
+    /* Selecting may itself use the bus, so the transaction only becomes current afterwards */
+    _hal_spi_select(xfer);
+    _hal_spi_cur = xfer;
+    _hal_spi_load_chunk(xfer);
+}
+
+ICACHE_FLASH_ATTR
+void hal_spi_xfer_sync(struct spi_xfer *xfer)
+{
+    xfer->tx_offs = 0;
+
+    _hal_spi_select(xfer);
+
+    do {
+        _hal_spi_load_chunk(xfer);
+        while (READ_PERI_REG(SPI_CMD(HAL_SPI_BUS)) & SPI_USR);
+    } while (xfer->tx_offs < xfer->tx_len);
+
+    _hal_spi_finish(xfer);
+}
+
+ICACHE_FLASH_ATTR
+void hal_spi_poll(void)
+{
+    /* Completion is driven by the HSPI interrupt */
+}
+
+void hal_spi_lock(void)
+{
+    ETS_SPI_INTR_DISABLE();
+}
+
+void hal_spi_unlock(void)
+{
+    ETS_SPI_INTR_ENABLE();
+}
+
+/*
+ * SPI flash
+ */
+
+ICACHE_FLASH_ATTR
+int hal_flash_erase(unsigned sector)
+{
+    return SPI_FLASH_RESULT_OK == spi_flash_erase_sector(sector) ? 0 : -1;
+}
+
+ICACHE_FLASH_ATTR
+int hal_flash_write(uint32_t addr, const void *data, size_t len)
+{
+    return SPI_FLASH_RESULT_OK == spi_flash_write(addr, (uint32 *)data, len) ? 0 : -1;
+}
+
+ICACHE_FLASH_ATTR
+int hal_flash_read(uint32_t addr, void *data, size_t len)
+{
+    return SPI_FLASH_RESULT_OK == spi_flash_read(addr, (uint32 *)data, len) ? 0 : -1;
+}
+
+/*
+ * RTC memory and deep sleep
+ */
+
+/* The first 64 blocks of RTC memory belong to the SDK; ours are 4 byte blocks 64 to 191 */
+#define HAL_RTC_USER_BLOCK          64
+
+ICACHE_FLASH_ATTR
+int hal_rtc_mem_read(unsigned offset, void *data, size_t len)
+{
+    if (0 != (offset & 3) || 0 != (len & 3) || offset + len > HAL_RTC_MEM_LEN) {
+        return -1;
+    }
+
+    return true == system_rtc_mem_read(HAL_RTC_USER_BLOCK + offset / 4, data, len) ? 0 : -1;
+}
+
+ICACHE_FLASH_ATTR
+int hal_rtc_mem_write(unsigned offset, const void *data, size_t len)
+{
+    if (0 != (offset & 3) || 0 != (len & 3) || offset + len > HAL_RTC_MEM_LEN) {
+        return -1;
+    }
+
+    return true == system_rtc_mem_write(HAL_RTC_USER_BLOCK + offset / 4, data, len) ? 0 : -1;
+}
+
+ICACHE_FLASH_ATTR
+void hal_deep_sleep(uint32_t us, bool radio_on_wake)
+{
+    /* 1: radio on, calibrated as the init data says. 4: radio stays off, as in modem sleep */
+    system_deep_sleep_set_option(true == radio_on_wake ? 1 : 4);
+    system_deep_sleep(us);
+}
+
+/*
+ * WiFi
+ */
+
+/* The link as the SDK reports it, and when the attempt that got it started */
+static
+struct hal_wifi_link _hal_wifi_link;
+
+static
+bool _hal_wifi_link_valid = false;
+
+static
+uint32_t _hal_wifi_connect_start_us = 0,
+         _hal_wifi_connect_us = 0;
+
+static ICACHE_FLASH_ATTR
+void _hal_wifi_event_cb(System_Event_t *evt)
+{
+    switch (evt->event) {
+    case EVENT_STAMODE_CONNECTED:
+        os_memcpy(_hal_wifi_link.bssid, evt->event_info.connected.bssid, sizeof(_hal_wifi_link.bssid));
+        _hal_wifi_link.channel = evt->event_info.connected.channel;
+        break;
+    case EVENT_STAMODE_GOT_IP:
+        _hal_wifi_link.ip = evt->event_info.got_ip.ip.addr;
+        _hal_wifi_link.netmask = evt->event_info.got_ip.mask.addr;
+        _hal_wifi_link.gw = evt->event_info.got_ip.gw.addr;
+        _hal_wifi_link.dns = espconn_dns_getserver(0).addr;
+        _hal_wifi_connect_us = system_get_time() - _hal_wifi_connect_start_us;
+        _hal_wifi_link_valid = true;
+        break;
+    case EVENT_STAMODE_DISCONNECTED:
+        /* The SDK tries to get back on by itself after a dropout; time that from here */
+        if (true == _hal_wifi_link_valid) {
+            _hal_wifi_connect_start_us = system_get_time();
+        }
+        _hal_wifi_link_valid = false;
+        break;
+    default:
+        break;
+    }
+}
+
+ICACHE_FLASH_ATTR
+void hal_wifi_init(void)
+{
+    ETS_UART_INTR_DISABLE();
+    wifi_set_opmode(STATION_MODE);
+    ETS_UART_INTR_ENABLE();
+
+    /* We decide when to connect, and to where */
+    wifi_station_set_auto_connect(false);
+    wifi_set_event_handler_cb(_hal_wifi_event_cb);
+}
+
+ICACHE_FLASH_ATTR
+int hal_wifi_connect(const char *ssid, const char *psk, const struct hal_wifi_link *link)
+{
+    struct station_config wifi_sta_cfg;
+
+    os_memset(&wifi_sta_cfg, 0, sizeof(wifi_sta_cfg));
+    os_strncpy((char *)wifi_sta_cfg.ssid, ssid, sizeof(wifi_sta_cfg.ssid));
+    os_strncpy((char *)wifi_sta_cfg.password, psk, sizeof(wifi_sta_cfg.password));
+
+    wifi_station_disconnect();
+    _hal_wifi_link_valid = false;
+
+    if (NULL != link) {
+        struct ip_info ip;
+        ip_addr_t dns;
+
+        /* Straight to the access point, on its channel, with the address it gave us last time */
+        wifi_sta_cfg.bssid_set = 1;
+        os_memcpy(wifi_sta_cfg.bssid, link->bssid, sizeof(wifi_sta_cfg.bssid));
+
+        wifi_station_dhcpc_stop();
+        ip.ip.addr = link->ip;
+        ip.netmask.addr = link->netmask;
+        ip.gw.addr = link->gw;
+        wifi_set_ip_info(STATION_IF, &ip);
+
+        dns.addr = link->dns;
+        espconn_dns_setserver(0, &dns);
+
+        wifi_set_channel(link->channel);
+    } else {
+        wifi_sta_cfg.bssid_set = 0;
+        wifi_station_dhcpc_start();
+    }
+
+    /* Not saved to the SDK's own flash sectors; we connect explicitly every boot */
+    wifi_station_set_config_current(&wifi_sta_cfg);
+
+    os_printf("WIFI: SSID=%s\r\n", ssid);
+
+    _hal_wifi_connect_start_us = system_get_time();
+
+    return true == wifi_station_connect() ? 0 : -1;
+}
+
+ICACHE_FLASH_ATTR
+enum hal_wifi_status hal_wifi_status(void)
+{
+    switch (wifi_station_get_connect_status()) {
+    case STATION_IDLE:
+        return HAL_WIFI_IDLE;
+    case STATION_CONNECTING:
+        return HAL_WIFI_CONNECTING;
+    case STATION_WRONG_PASSWORD:
+        return HAL_WIFI_WRONG_PASSWORD;
+    case STATION_NO_AP_FOUND:
+        return HAL_WIFI_NO_AP_FOUND;
+    case STATION_GOT_IP:
+        return HAL_WIFI_GOT_IP;
+    case STATION_CONNECT_FAIL:
+    default:
+        return HAL_WIFI_CONNECT_FAIL;
+    }
+}
+
+ICACHE_FLASH_ATTR
+int hal_wifi_get_link(struct hal_wifi_link *link, uint32_t *connect_us)
+{
+    if (false == _hal_wifi_link_valid || STATION_GOT_IP != wifi_station_get_connect_status()) {
+        return -1;
+    }
+
+    *link = _hal_wifi_link;
+    *connect_us = _hal_wifi_connect_us;
+
+    return 0;
+}
+
+/*
+ * DNS, through espconn's resolver
+ */
+
+static ICACHE_FLASH_ATTR
+void _hal_dns_found_cb(const char *name, ip_addr_t *ipaddr, void *arg)
+{
+    struct hal_dns *dns = ((struct espconn *)arg)->reverse;
+
+    dns->on_resolved(dns, NULL != ipaddr ? ipaddr->addr : 0);
+}
+
+ICACHE_FLASH_ATTR
+int hal_dns_resolve(struct hal_dns *dns, const char *name)
+{
+    int ret = 0;
+
+    os_memset(&dns->priv, 0, sizeof(dns->priv));
+    dns->priv.conn.reverse = dns;
+
+    ret = espconn_gethostbyname(&dns->priv.conn, name, &dns->priv.addr, _hal_dns_found_cb);
+
+    if (ESPCONN_OK == ret) {
+        /* Cached, or a dotted quad: no callback coming */
+        dns->on_resolved(dns, dns->priv.addr.addr);
+        return 0;
+    }
+
+    return ESPCONN_INPROGRESS == ret ? 0 : -1;
+}
+
+/*
+ * TCP, on top of espconn
+ */
+
+/*
+ * Connections accepted by a listener. Some SDK versions hand the callbacks for these the
+ * listener's espconn, with the remote end filled in, rather than the connection's own. So an
+ * accepted espconn never gets reverse set, since that could be the listener's, and these are
+ * found by their remote end instead.
+ */
+static
+struct hal_tcp *_hal_tcp_accepted = NULL;
+
+/* The single listener */
+static
+struct hal_tcp_listener *_hal_tcp_listener = NULL;
+
+/**
+ * Find the connection an espconn callback is for: an outgoing one by reverse, an accepted one by
+ * its remote end.
+ */
+static ICACHE_FLASH_ATTR
+struct hal_tcp *_hal_tcp_from_conn(struct espconn *conn)
+{
+    if (NULL != conn->reverse) {
+        return conn->reverse;
+    }
+
+    for (struct hal_tcp *tcp = _hal_tcp_accepted; NULL != tcp; tcp = tcp->priv.next) {
+        if (tcp->priv.remote_port == conn->proto.tcp->remote_port &&
+                0 == os_memcmp(tcp->priv.remote_ip, conn->proto.tcp->remote_ip, 4))
+        {
+            return tcp;
+        }
+    }
+
+    return NULL;
+}
+
+static ICACHE_FLASH_ATTR
+void _hal_tcp_forget(struct hal_tcp *tcp)
+{
+    struct hal_tcp **pprev = &_hal_tcp_accepted;
+
+    while (NULL != *pprev && tcp != *pprev) {
+        pprev = &(*pprev)->priv.next;
+    }
+
+    if (NULL != *pprev) {
+        *pprev = tcp->priv.next;
+    }
+}
+
+static ICACHE_FLASH_ATTR
+void _hal_tcp_on_sent_cb(void *arg)
+{
+    struct hal_tcp *tcp = _hal_tcp_from_conn(arg);
+
+    if (NULL != tcp && NULL != tcp->on_sent) {
+        tcp->on_sent(tcp);
+    }
+}
+
+static ICACHE_FLASH_ATTR
+void _hal_tcp_on_recv_cb(void *arg, char *pdata, unsigned short len)
+{
+    struct hal_tcp *tcp = _hal_tcp_from_conn(arg);
+
+    if (NULL != tcp && NULL != tcp->on_recv) {
+        tcp->on_recv(tcp, pdata, len);
+    }
+}
+
+static ICACHE_FLASH_ATTR
+void _hal_tcp_on_disconnect_cb(void *arg)
+{
+    struct hal_tcp *tcp = _hal_tcp_from_conn(arg);
+
+    if (NULL == tcp) {
+        return;
+    }
+
+    _hal_tcp_forget(tcp);
+
+    if (NULL != tcp->on_disconnect) {
+        tcp->on_disconnect(tcp);
+    }
+}
+
+/**
+ * Hook up the callbacks of a connection that has just come up, and pass it on.
+ */
+static ICACHE_FLASH_ATTR
+void _hal_tcp_connected(struct hal_tcp *tcp, struct espconn *conn)
+{
+    tcp->priv.espconn = conn;
+
+    /*
+     * espconn only lets us register these once the connection exists. With ESPCONN_COPY the
+     * write finish callback fires as soon as the data is copied into lwIP's send buffer, rather
+     * than when it is acknowledged, so back-to-back sends coalesce instead of costing a round trip
+     * each.
+     */
+    espconn_set_opt(conn, ESPCONN_COPY);
+    espconn_regist_write_finish(conn, _hal_tcp_on_sent_cb);
+    espconn_regist_recvcb(conn, _hal_tcp_on_recv_cb);
+    espconn_regist_disconcb(conn, _hal_tcp_on_disconnect_cb);
+
+    if (NULL != tcp->on_connect) {
+        tcp->on_connect(tcp);
+    }
+}
+
+static ICACHE_FLASH_ATTR
+void _hal_tcp_on_connect_cb(void *arg)
+{
+    struct espconn *conn = arg;
+
+    _hal_tcp_connected(conn->reverse, conn);
+}
+
+static ICACHE_FLASH_ATTR
+void _hal_tcp_on_accept_cb(void *arg)
+{
+    struct espconn *conn = arg;
+    struct hal_tcp *tcp = NULL;
+
+    if (NULL == _hal_tcp_listener || NULL == (tcp = _hal_tcp_listener->on_accept(_hal_tcp_listener))) {
+        espconn_disconnect(conn);
+        return;
+    }
+
+    os_memset(&tcp->priv, 0, sizeof(tcp->priv));
+    os_memcpy(tcp->priv.remote_ip, conn->proto.tcp->remote_ip, sizeof(tcp->priv.remote_ip));
+    tcp->priv.remote_port = conn->proto.tcp->remote_port;
+    tcp->priv.next = _hal_tcp_accepted;
+    _hal_tcp_accepted = tcp;
+
+    _hal_tcp_connected(tcp, conn);
+}
+
+static ICACHE_FLASH_ATTR
+void _hal_tcp_on_error_cb(void *arg, sint8 err)
+{
+    struct hal_tcp *tcp = _hal_tcp_from_conn(arg);
+
+    if (NULL == tcp) {
+        return;
+    }
+
+    _hal_tcp_forget(tcp);
+
+    if (NULL != tcp->on_error) {
+        tcp->on_error(tcp, err);
+    }
+}
+
+ICACHE_FLASH_ATTR
+int hal_tcp_connect(struct hal_tcp *tcp, uint32_t ip_addr, uint16_t port)
+{
+    struct espconn *conn = &tcp->priv.conn;
+    esp_tcp *tcp_state = &tcp->priv.tcp_state;
+
+    os_memset(&tcp->priv, 0, sizeof(tcp->priv));
+
+    conn->type = ESPCONN_TCP;
+    conn->state = ESPCONN_NONE;
+    conn->proto.tcp = tcp_state;
+    conn->reverse = tcp;
+    tcp_state->local_port = espconn_port();
+    tcp_state->remote_port = port;
+    os_memcpy(&tcp_state->remote_ip, &ip_addr, 4);
+    tcp->priv.espconn = conn;
+
+    espconn_regist_connectcb(conn, _hal_tcp_on_connect_cb);
+    espconn_regist_reconcb(conn, _hal_tcp_on_error_cb);
+
+    return 0 == espconn_connect(conn) ? 0 : -1;
+}
+
+ICACHE_FLASH_ATTR
+int hal_tcp_listen(struct hal_tcp_listener *listener, uint16_t port, unsigned max_conns, unsigned timeout_s)
+{
+    struct espconn *conn = &listener->priv.conn;
+    esp_tcp *tcp_state = &listener->priv.tcp_state;
+
+    if (NULL != _hal_tcp_listener) {
+        return -1;
+    }
+
+    os_memset(&listener->priv, 0, sizeof(listener->priv));
+
+    conn->type = ESPCONN_TCP;
+    conn->state = ESPCONN_NONE;
+    conn->proto.tcp = tcp_state;
+    tcp_state->local_port = port;
+
+    /* Accepted connections share these until they get their own */
+    espconn_regist_connectcb(conn, _hal_tcp_on_accept_cb);
+    espconn_regist_reconcb(conn, _hal_tcp_on_error_cb);
+
+    if (0 != espconn_accept(conn)) {
+        return -1;
+    }
+
+    espconn_tcp_set_max_con_allow(conn, max_conns);
+    espconn_regist_time(conn, timeout_s, 0);
+    _hal_tcp_listener = listener;
+
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+int hal_tcp_send(struct hal_tcp *tcp, const void *data, size_t len)
+{
+    /*
+     * lwIP copies with byte loads, which fault on the flash mapping. Stage anything in flash
+     * through the bounce buffer a word at a time; it can be reused as soon as espconn returns.
+     */
+    if ((uintptr_t)data >= HAL_FLASH_MAP_START) {
+        const uint32_t *src = (const uint32_t *)((uintptr_t)data & ~3ul);
+        size_t skew = (uintptr_t)data & 3;
+
+        if (len + skew > sizeof(tcp->priv.bounce)) {
+            return -1;
+        }
+
+        for (size_t i = 0; i < (len + skew + 3) / 4; i++) {
+            tcp->priv.bounce[i] = src[i];
+        }
+
+        data = (const uint8_t *)tcp->priv.bounce + skew;
+    }
+
+    return 0 == espconn_sent(tcp->priv.espconn, (uint8 *)data, len) ? 0 : -1;
+}
+
+ICACHE_FLASH_ATTR
+int hal_tcp_disconnect(struct hal_tcp *tcp)
+{
+    return 0 == espconn_disconnect(tcp->priv.espconn) ? 0 : -1;
+}
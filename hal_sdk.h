@@ -0,0 +1,46 @@
+#pragma once
+
+/** \file hal_sdk.h ESP8266 NONOS SDK platform definitions for the HAL
+ */
+
+#include <ets_sys.h>
+#include <osapi.h>
+#include <os_type.h>
+#include <user_interface.h>
+#include <espconn.h>
+
+#include "c99_fixups.h"
+
+struct hal_timer_priv {
+    os_timer_t timer;
+};
+
+/* Largest piece of flash-resident data hal_tcp_send() can take in one go */
+#define HAL_TCP_BOUNCE_LEN      128
+
+struct hal_tcp_priv {
+    struct espconn conn;
+    esp_tcp tcp_state;
+    uint32_t bounce[HAL_TCP_BOUNCE_LEN / 4];
+
+    /* The espconn in use: conn for outgoing connections, the SDK's own for accepted ones */
+    struct espconn *espconn;
+
+    /*
+     * Accepted connections, listed to find them from the listener's espconn by the remote end,
+     * kept from when they were accepted
+     */
+    struct hal_tcp *next;
+    uint8_t remote_ip[4];
+    int remote_port;
+};
+
+struct hal_tcp_listener_priv {
+    struct espconn conn;
+    esp_tcp tcp_state;
+};
+
+struct hal_dns_priv {
+    struct espconn conn;
+    ip_addr_t addr;
+};
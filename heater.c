@@ -0,0 +1,283 @@
+/** \file heater.c Heater control
+ * A PID controller in integer arithmetic. The proportional and derivative terms are computed
+ * fresh each step; the derivative is taken on the measurement, so setpoint changes don't kick
+ * the output. The integral is held in output units and is only allowed to grow while the output
+ * isn't saturated in the same direction, and never beyond the output range, so it doesn't wind up
+ * during the initial heat-up or while the heater is faulted off.
+ */
+
+#include "heater.h"
+
+#include "hal.h"
+
+static
+const struct heater_profile_step *_heater_profile = NULL;
+
+static
+unsigned _heater_nr_steps = 0;
+
+/* Control steps spent in the current profile step, and where its ramp started from */
+static
+uint32_t _heater_step_ticks = 0;
+
+static
+int32_t _heater_ramp_from = 0;
+
+static
+bool _heater_have_setpoint = false;
+
+static
+struct heater_gains _heater_gains = {
+    .kp = HEATER_GAIN(HEATER_KP),
+    .ki = HEATER_GAIN(HEATER_KI),
+    .kd = HEATER_GAIN(HEATER_KD),
+};
+
+static
+int32_t _heater_integral = 0;
+
+static
+int32_t _heater_last_temp = 0;
+
+static
+bool _heater_primed = false;
+
+static
+uint32_t _heater_last_us = 0;
+
+static
+bool _heater_has_run = false;
+
+static
+struct heater_stats _heater_stats;
+
+/* Turns the heater off part way through the period */
+static
+struct hal_timer _heater_off_timer;
+
+static ICACHE_FLASH_ATTR
+void _heater_output(bool on)
+{
+    bool level = HEATER_ACTIVE_LOW ? !on : on;
+
+    if (true == level) {
+        hal_gpio_set(1 << HEATER_GPIO);
+    } else {
+        hal_gpio_clear(1 << HEATER_GPIO);
+    }
+}
+
+static ICACHE_FLASH_ATTR
+void _heater_off_timer_fn(void *arg)
+{
+    _heater_output(false);
+}
+
+/**
+ * Work out where the profile has got to, and the setpoint it calls for.
+ *
+ * \param temp Current temperature, where a ramp starts from if there's no setpoint yet
+ *
+ * \return false if the heater should be off.
+ */
+static ICACHE_FLASH_ATTR
+bool _heater_setpoint(int32_t temp, int32_t *setpoint)
+{
+    const struct heater_profile_step *step = NULL;
+    uint32_t elapsed_ms = 0;
+
+    /* Move on past any steps that are over */
+    while (_heater_stats.profile_step < _heater_nr_steps) {
+        step = &_heater_profile[_heater_stats.profile_step];
+
+        if (HEATER_STEP_OFF == step->type && 0 == step->duration_s) {
+            break;
+        }
+
+        if (_heater_step_ticks * HEATER_CONTROL_MS < step->duration_s * 1000) {
+            break;
+        }
+
+        if (HEATER_STEP_OFF != step->type) {
+            _heater_ramp_from = step->target;
+            _heater_have_setpoint = true;
+        }
+
+        _heater_stats.profile_step++;
+        _heater_step_ticks = 0;
+    }
+
+    if (_heater_stats.profile_step == _heater_nr_steps) {
+        return false;
+    }
+
+    step = &_heater_profile[_heater_stats.profile_step];
+
+    if (0 == _heater_step_ticks && false == _heater_have_setpoint) {
+        _heater_ramp_from = temp;
+        _heater_have_setpoint = true;
+    }
+
+    elapsed_ms = _heater_step_ticks * HEATER_CONTROL_MS;
+    _heater_step_ticks++;
+
+    switch (step->type) {
+    case HEATER_STEP_RAMP:
+        *setpoint = _heater_ramp_from +
+            (int32_t)((int64_t)(step->target - _heater_ramp_from) * elapsed_ms / (step->duration_s * 1000));
+        return true;
+    case HEATER_STEP_HOLD:
+        *setpoint = step->target;
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * One step of the PID.
+ *
+ * \return The output, from 0 to HEATER_DUTY_MAX
+ */
+static ICACHE_FLASH_ATTR
+int32_t _heater_pid(int32_t setpoint, int32_t temp)
+{
+    int32_t error = setpoint - temp;
+    int64_t p = (int64_t)_heater_gains.kp * error,
+            d = 0,
+            i = _heater_integral + (int64_t)_heater_gains.ki * error * HEATER_CONTROL_MS / 1000,
+            out;
+
+    if (true == _heater_primed) {
+        d = -(int64_t)_heater_gains.kd * (temp - _heater_last_temp) * 1000 / HEATER_CONTROL_MS;
+    }
+
+    _heater_last_temp = temp;
+    _heater_primed = true;
+
+    /* Hold the integral while the output is pinned in the direction it would push */
+    out = p + i + d;
+    if (false == ((out > HEATER_DUTY_MAX && error > 0) || (out < 0 && error < 0))) {
+        _heater_integral = i < 0 ? 0 : i > HEATER_DUTY_MAX ? HEATER_DUTY_MAX : (int32_t)i;
+    }
+
+    out = p + _heater_integral + d;
+
+    return out < 0 ? 0 : out > HEATER_DUTY_MAX ? HEATER_DUTY_MAX : (int32_t)out;
+}
+
+ICACHE_FLASH_ATTR
+void heater_init(const struct heater_profile_step *profile, unsigned nr_steps)
+{
+    hal_gpio_enable_output(HEATER_GPIO);
+    _heater_output(false);
+
+    hal_timer_disarm(&_heater_off_timer);
+    hal_timer_setfn(&_heater_off_timer, _heater_off_timer_fn, NULL);
+
+    _heater_profile = profile;
+    _heater_nr_steps = nr_steps;
+    _heater_step_ticks = 0;
+    _heater_have_setpoint = false;
+    _heater_integral = 0;
+    _heater_primed = false;
+    _heater_has_run = false;
+
+    os_memset(&_heater_stats, 0, sizeof(_heater_stats));
+}
+
+ICACHE_FLASH_ATTR
+void heater_step(int32_t temp, bool valid)
+{
+    uint32_t now = hal_time_us(),
+             on_ms = 0;
+    int32_t setpoint = 0,
+            duty = 0;
+
+    if (true == _heater_has_run) {
+        int32_t jitter = (int32_t)(now - _heater_last_us) - HEATER_CONTROL_MS * 1000;
+
+        if (0 == _heater_stats.nr_steps || jitter < _heater_stats.min_jitter_us) {
+            _heater_stats.min_jitter_us = jitter;
+        }
+        if (0 == _heater_stats.nr_steps || jitter > _heater_stats.max_jitter_us) {
+            _heater_stats.max_jitter_us = jitter;
+        }
+        _heater_stats.total_jitter_us += jitter < 0 ? -jitter : jitter;
+        _heater_stats.nr_steps++;
+    }
+
+    _heater_last_us = now;
+    _heater_has_run = true;
+
+    hal_timer_disarm(&_heater_off_timer);
+
+    if (false == valid && false == _heater_have_setpoint) {
+        /* The profile can't start until there's a reading to ramp from */
+        _heater_stats.nr_faults++;
+    } else if (false == _heater_setpoint(temp, &setpoint)) {
+        /* Profile says off; start afresh if it ever says otherwise */
+        _heater_integral = 0;
+        _heater_primed = false;
+    } else if (false == valid || temp > HEATER_TEMP(HEATER_MAX_TEMP_C)) {
+        _heater_stats.nr_faults++;
+        _heater_primed = false;
+    } else {
+        duty = _heater_pid(setpoint, temp);
+        on_ms = ((int64_t)duty * HEATER_CONTROL_MS) >> HEATER_DUTY_FRAC_BITS;
+    }
+
+    _heater_stats.setpoint = setpoint;
+    _heater_stats.temp = temp;
+    _heater_stats.duty = duty;
+
+    /* Slow PWM: on for the start of the period, within what the relay can do */
+    if (on_ms < HEATER_MIN_SWITCH_MS) {
+        _heater_output(false);
+    } else if (on_ms > HEATER_CONTROL_MS - HEATER_MIN_SWITCH_MS) {
+        _heater_output(true);
+    } else {
+        _heater_output(true);
+        hal_timer_arm(&_heater_off_timer, on_ms, false);
+    }
+}
+
+ICACHE_FLASH_ATTR
+void heater_set_gains(const struct heater_gains *gains)
+{
+    _heater_gains = *gains;
+}
+
+ICACHE_FLASH_ATTR
+void heater_get_stats(struct heater_stats *stats)
+{
+    *stats = _heater_stats;
+}
+
+/**
+ * A temperature in hundredths of a degree, for printing
+ */
+static ICACHE_FLASH_ATTR
+int32_t _heater_centi(int32_t temp)
+{
+    return (temp * 100) >> HEATER_TEMP_FRAC_BITS;
+}
+
+ICACHE_FLASH_ATTR
+void heater_report(void)
+{
+    struct heater_stats *st = &_heater_stats;
+    int32_t sp = _heater_centi(st->setpoint),
+            pv = _heater_centi(st->temp);
+    /* Tenths of a percent */
+    uint32_t duty = ((int64_t)st->duty * 1000) >> HEATER_DUTY_FRAC_BITS;
+
+    os_printf("HEATER: Profile step %u, setpoint %d.%02d C, probe %d.%02d C, duty %u.%u%%\r\n",
+            st->profile_step, sp / 100, sp % 100, pv / 100, pv % 100, duty / 10, duty % 10);
+    os_printf("HEATER: %u steps, jitter %d to %d us, mean %u us, %u faults\r\n", st->nr_steps,
+            st->min_jitter_us, st->max_jitter_us,
+            0 != st->nr_steps ? st->total_jitter_us / st->nr_steps : 0, st->nr_faults);
+
+    st->nr_steps = st->nr_faults = st->total_jitter_us = 0;
+    st->min_jitter_us = st->max_jitter_us = 0;
+}
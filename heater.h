@@ -0,0 +1,122 @@
+#pragma once
+
+/** \file heater.h Heater control
+ * Holds the probe at a setpoint by driving the heater GPIO, with an integer PID controller and
+ * time-proportional output. The setpoint follows a profile of ramps and holds.
+ *
+ * heater_step() must be called every HEATER_CONTROL_MS. The controller always assumes exactly
+ * that much time has passed, so its behaviour doesn't depend on when the caller gets to run; how
+ * far the calls stray from the period is measured and reported as jitter instead. The heater is
+ * switched off again by a timer of its own, so the duty it is given is not at the mercy of
+ * anything else that is running either.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "heater_config.h"
+#include "max31855.h"
+
+/**
+ * Temperatures are in the filtered units of the MAX31855 driver: quarter degrees C with
+ * MAX31855_FILTER_FRAC_BITS more fraction bits.
+ */
+#define HEATER_TEMP_FRAC_BITS       (2 + MAX31855_FILTER_FRAC_BITS)
+#define HEATER_TEMP(c)              ((int32_t)((c) * (1 << HEATER_TEMP_FRAC_BITS)))
+
+/**
+ * Controller output, as a fraction of the control period with this many fraction bits
+ */
+#define HEATER_DUTY_FRAC_BITS       24
+#define HEATER_DUTY_MAX             (1l << HEATER_DUTY_FRAC_BITS)
+
+/**
+ * Convert a gain in duty per degree C (or per degree C second, or second per degree C) to the
+ * controller's units
+ */
+#define HEATER_GAIN(g)              ((int32_t)((g) * (HEATER_DUTY_MAX >> HEATER_TEMP_FRAC_BITS)))
+
+enum heater_step_type {
+    /**
+     * Move the setpoint in a straight line from wherever the last step left it to target, over
+     * duration_s
+     */
+    HEATER_STEP_RAMP,
+
+    /**
+     * Hold the setpoint at target for duration_s
+     */
+    HEATER_STEP_HOLD,
+
+    /**
+     * Heater off, for duration_s or for good if 0. The profile ends this way regardless.
+     */
+    HEATER_STEP_OFF,
+};
+
+struct heater_profile_step {
+    enum heater_step_type type;
+    int32_t target;
+    uint32_t duration_s;
+};
+
+struct heater_gains {
+    int32_t kp;
+    int32_t ki;
+    int32_t kd;
+};
+
+struct heater_stats {
+    /**
+     * Control steps run
+     */
+    uint32_t nr_steps;
+
+    /**
+     * Steps that found no valid reading, or an over-temperature, and turned the heater off
+     */
+    uint32_t nr_faults;
+
+    /**
+     * Time between steps less the control period: extremes, and the mean of its magnitude
+     */
+    int32_t min_jitter_us;
+    int32_t max_jitter_us;
+    uint32_t total_jitter_us;
+
+    /**
+     * Latest setpoint, process value and output
+     */
+    int32_t setpoint;
+    int32_t temp;
+    int32_t duty;
+
+    /**
+     * Index of the profile step being run
+     */
+    unsigned profile_step;
+};
+
+/**
+ * Set up the heater GPIO, with the heater off, and start on the profile.
+ *
+ * \param profile Profile to follow. Not copied, so it must stay around.
+ * \param nr_steps Number of steps in the profile
+ */
+void heater_init(const struct heater_profile_step *profile, unsigned nr_steps);
+
+/**
+ * Run one control step.
+ *
+ * \param temp Filtered probe temperature
+ * \param valid false if there is no trustworthy reading, in which case the heater is turned off
+ */
+void heater_step(int32_t temp, bool valid);
+
+void heater_set_gains(const struct heater_gains *gains);
+void heater_get_stats(struct heater_stats *stats);
+
+/**
+ * Print the controller state and timing to the UART, and start a new jitter interval.
+ */
+void heater_report(void);
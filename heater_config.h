@@ -0,0 +1,46 @@
+#pragma once
+
+/**
+ * GPIO driving the heater relay or SSR. GPIO0 is pulled up through boot, so with the heater
+ * wired active low it stays off until we take control of it.
+ */
+#define HEATER_GPIO                 0
+#define HEATER_ACTIVE_LOW           1
+
+/**
+ * Probe (index into MAX31855_PROBE_CS) the heater is controlled from
+ */
+#define HEATER_PROBE                0
+
+/**
+ * Control period. Each period the PID runs once and the heater is switched on for the fraction
+ * of the period it asks for, so this is also the PWM window.
+ */
+#define HEATER_CONTROL_MS           5000
+
+/**
+ * Shortest time the heater is switched on or off for, to spare the relay. Smaller outputs are
+ * rounded to fully off or fully on.
+ */
+#define HEATER_MIN_SWITCH_MS        250
+
+/**
+ * Cut out above this temperature, whatever the setpoint, in degrees C
+ */
+#define HEATER_MAX_TEMP_C           50
+
+/**
+ * PID gains, as heater duty (0 to 1) per degree C of error; per degree C second for the integral
+ * and per degree C per second for the derivative. Tuned against the simulator's plant, a litre of
+ * milk in an insulated pot over a 100W element.
+ */
+#define HEATER_KP                   0.15
+#define HEATER_KI                   0.0002
+#define HEATER_KD                   0.0
+
+/**
+ * The default profile: ramp to 43C over an hour, hold for 8 hours, then leave it to cool.
+ */
+#define HEATER_PROFILE_TEMP_C       43
+#define HEATER_PROFILE_RAMP_S       3600
+#define HEATER_PROFILE_HOLD_S       (8 * 3600)
@@ -1,8 +1,5 @@
 #include "http_client.h"
-
-#include <osapi.h>
-#include <os_type.h>
-#include <espconn.h>
+#include "prof.h"
 
 #include <stddef.h>
 
@@ -12,60 +9,492 @@
         ({ const __typeof__( ((type *)0)->member ) *__memb = (pointer); \
                 (type *)( (char *)__memb - offsetof(type, member) ); })
 
+#define HTTP_REQ_SLOT(_client, _ctr) (&(_client)->requests[(_ctr) % HTTP_CLIENT_MAX_PIPELINE])
+
+#define FLASH_STR       ICACHE_RODATA_ATTR __attribute__((aligned(4)))
+
+/*
+ * Constant request text, kept in flash and sent in place. The method strings carry the space that
+ * follows them, and the content type strings carry everything between Host and the
+ * Content-Length value. Connections are persistent by default in HTTP/1.1, so there is no need to
+ * spend bytes on every request asking for keep-alive.
+ */
+static const char _http_method_get[] FLASH_STR = "GET ";
+static const char _http_method_post[] FLASH_STR = "POST ";
+static const char _http_method_put[] FLASH_STR = "PUT ";
+static const char _http_method_delete[] FLASH_STR = "DELETE ";
+static const char _http_version_host[] FLASH_STR = " HTTP/1.1\r\nHost: ";
+static const char _http_type_json[] FLASH_STR =
+        "\r\nContent-Type: application/json\r\nContent-Length: ";
+static const char _http_type_octet_stream[] FLASH_STR =
+        "\r\nContent-Type: application/octet-stream\r\nContent-Length: ";
+
+struct http_frag {
+    const char *data;
+    uint16_t len;
+};
+
+#define HTTP_FRAG(_str) { .data = (_str), .len = sizeof(_str) - 1 }
+
+static
+const struct http_frag _http_methods[] = {
+    [HTTP_METHOD_GET] = HTTP_FRAG(_http_method_get),
+    [HTTP_METHOD_POST] = HTTP_FRAG(_http_method_post),
+    [HTTP_METHOD_PUT] = HTTP_FRAG(_http_method_put),
+    [HTTP_METHOD_DELETE] = HTTP_FRAG(_http_method_delete),
+};
+
+static
+const struct http_frag _http_content_types[] = {
+    [HTTP_CONTENT_TYPE_JSON] = HTTP_FRAG(_http_type_json),
+    [HTTP_CONTENT_TYPE_OCTET_STREAM] = HTTP_FRAG(_http_type_octet_stream),
+};
+
+/**
+ * The fragments of a request, in the order they go on the wire
+ */
+enum http_frag_id {
+    HTTP_FRAG_METHOD = 0,
+    HTTP_FRAG_RESOURCE,
+    HTTP_FRAG_VERSION_HOST,
+    HTTP_FRAG_HOST,
+    HTTP_FRAG_CONTENT_TYPE,
+    HTTP_FRAG_CONTENT_LENGTH,
+    HTTP_FRAG_BODY,
+    HTTP_FRAG_DONE,
+};
+
+/**
+ * Look up one fragment of a request by its position on the wire. host is what goes in the Host
+ * header if the request has none of its own.
+ */
+static ICACHE_FLASH_ATTR
+void _http_request_frag(const struct http_request *req, const char *host, unsigned id,
+        struct http_frag *frag)
+{
+    switch (id) {
+    case HTTP_FRAG_METHOD:
+        *frag = _http_methods[req->method];
+        break;
+    case HTTP_FRAG_RESOURCE:
+        frag->data = req->resource;
+        frag->len = os_strlen(req->resource);
+        break;
+    case HTTP_FRAG_VERSION_HOST:
+        *frag = (struct http_frag)HTTP_FRAG(_http_version_host);
+        break;
+    case HTTP_FRAG_HOST:
+        frag->data = NULL != req->host ? req->host : host;
+        frag->len = os_strlen(frag->data);
+        break;
+    case HTTP_FRAG_CONTENT_TYPE:
+        *frag = _http_content_types[req->content_type];
+        break;
+    case HTTP_FRAG_CONTENT_LENGTH:
+        frag->data = req->scratch;
+        frag->len = req->scratch_len;
+        break;
+    case HTTP_FRAG_BODY:
+        frag->data = req->body;
+        frag->len = req->body_len;
+        break;
+    default:
+        frag->data = NULL;
+        frag->len = 0;
+    }
+}
+
+/**
+ * Fill in a request's scratch area with its Content-Length value and the blank line that ends the
+ * headers.
+ */
+static ICACHE_FLASH_ATTR
+void _http_request_fill_scratch(struct http_request *req)
+{
+    char digits[5];
+    unsigned len = req->body_len,
+             nr = 0;
+
+    do {
+        digits[nr++] = '0' + (len % 10);
+        len /= 10;
+    } while (0 != len);
+
+    req->scratch_len = 0;
+    while (nr > 0) {
+        req->scratch[req->scratch_len++] = digits[--nr];
+    }
+
+    os_memcpy(req->scratch + req->scratch_len, "\r\n\r\n", 4);
+    req->scratch_len += 4;
+}
+
+/**
+ * Hand the next fragment of the next unsent request to the TCP stack, if the link is free.
+ */
+static ICACHE_FLASH_ATTR
+void _http_client_kick(struct http_client *client)
+{
+    struct http_request *req = NULL;
+    const char *host = NULL != client->endpoint.host ? client->endpoint.host : "";
+    struct http_frag frag;
+
+    if (HTTP_CLIENT_CONNECTED != client->state || true == client->sending ||
+            client->req_sent == client->req_tail)
+    {
+        return;
+    }
+
+    req = HTTP_REQ_SLOT(client, client->req_sent);
+
+    /* Skip anything empty, such as the body of a GET */
+    for (;;) {
+        _http_request_frag(req, host, req->frag, &frag);
+        if (0 != frag.len || HTTP_FRAG_BODY == req->frag) {
+            break;
+        }
+        req->frag++;
+    }
+
+    if (0 == frag.len) {
+        /* Nothing left to send for this request; move on to the next one */
+        req->frag = HTTP_FRAG_DONE;
+        client->req_sent++;
+        _http_client_kick(client);
+        return;
+    }
+
+    if (0 != hal_tcp_send(&client->tcp, frag.data, frag.len)) {
+        /* The stack is busy; we'll try again from the next sent or receive callback */
+        return;
+    }
+
+    if (HTTP_FRAG_METHOD == req->frag) {
+        req->sent_us = hal_time_us();
+    }
+
+    client->sending = true;
+}
+
+/**
+ * Keep as much of the response body as fits, for the response callback.
+ */
 static ICACHE_FLASH_ATTR
-void _http_client_on_sent_cb(void *arg)
+void _http_client_on_body(void *arg, const char *data, size_t len)
 {
-    struct espconn *conn = arg;
-    struct http_client *client = BL_CONTAINER_OF(conn, struct http_client, conn);
+    struct http_client *client = arg;
+    size_t room = sizeof(client->body) - client->body_len;
+
+    if (len > room) {
+        len = room;
+    }
+
+    os_memcpy(client->body + client->body_len, data, len);
+    client->body_len += len;
+}
+
+/**
+ * A response is complete. Dispatch it to the oldest outstanding request, and free that request's slot.
+ */
+static ICACHE_FLASH_ATTR
+void _http_client_on_response(void *arg, unsigned response_code, bool keep_alive)
+{
+    struct http_client *client = arg;
+    struct http_request *req = HTTP_REQ_SLOT(client, client->req_head);
+    on_response_func_t on_response = req->on_response;
+
+    client->req_head++;
 
-    DEBUG("Bomb away!");
+    client->stats.last_rtt_us = hal_time_us() - req->sent_us;
+    if (NULL != client->on_rtt) {
+        client->on_rtt(client, client->stats.last_rtt_us);
+    }
+
+    if (NULL != on_response) {
+        on_response(client, response_code, client->body, client->body_len);
+    }
+
+    client->body_len = 0;
+
+    if (false == keep_alive && HTTP_CLIENT_CONNECTED == client->state) {
+        DEBUG("Server asked to close the connection.");
+        hal_tcp_disconnect(&client->tcp);
+    }
 }
 
+/**
+ * Fail every request that was sent but not answered. Requests not yet sent stay queued for the
+ * next connection, unless the owner asked for those to be failed too.
+ */
 static ICACHE_FLASH_ATTR
-void _http_client_on_disconnect_cb(void *arg)
+void _http_client_fail_inflight(struct http_client *client)
 {
-    struct espconn *conn = arg;
-    struct http_client *client = BL_CONTAINER_OF(conn, struct http_client, conn);
+    if (true == client->fail_unsent_on_disconnect) {
+        client->req_sent = client->req_tail;
+    }
+
+    while (client->req_head != client->req_sent) {
+        struct http_request *req = HTTP_REQ_SLOT(client, client->req_head);
+
+        client->req_head++;
+
+        if (NULL != req->on_response) {
+            req->on_response(client, 0, NULL, 0);
+        }
+    }
+
+    /* A request cut off part way through goes out again from the start */
+    for (uint8_t i = client->req_sent; i != client->req_tail; i++) {
+        HTTP_REQ_SLOT(client, i)->frag = HTTP_FRAG_METHOD;
+    }
+
+    client->sending = false;
+    client->body_len = 0;
+    http_response_parser_reset(&client->resp);
+}
+
+/**
+ * Feed received bytes through the response parser, a response at a time.
+ *
+ * \return 0 on success, -1 if the server sent something we can't make sense of.
+ */
+static ICACHE_FLASH_ATTR
+int _http_client_parse(struct http_client *client, const char *data, size_t len)
+{
+    while (len > 0) {
+        int nr = 0;
+
+        if (client->req_head == client->req_sent) {
+            DEBUG("Response from server with no request outstanding.");
+            return -1;
+        }
+
+        if (0 > (nr = http_response_parse(&client->resp, data, len))) {
+            DEBUG("Malformed response from server.");
+            return -1;
+        }
+
+        data += nr;
+        len -= nr;
+    }
+
+    return 0;
+}
+
+static ICACHE_FLASH_ATTR
+void _http_client_on_sent_cb(struct hal_tcp *tcp)
+{
+    struct http_client *client = BL_CONTAINER_OF(tcp, struct http_client, tcp);
+
+    PROF_START(http_on_sent);
+
+    if (true == client->sending) {
+        struct http_request *req = HTTP_REQ_SLOT(client, client->req_sent);
+
+        client->sending = false;
+
+        if (HTTP_FRAG_DONE == ++req->frag) {
+            client->req_sent++;
+        }
+    }
+
+    _http_client_kick(client);
+
+    PROF_END(http_on_sent);
+}
+
+/**
+ * Arm the retry timer for after a backoff. The cap on the wait doubles with each backoff in a row;
+ * the wait itself is half the cap plus a random share of the other half.
+ */
+static ICACHE_FLASH_ATTR
+void _http_client_backoff(struct http_client *client)
+{
+    uint32_t cap = HTTP_CLIENT_BACKOFF_MIN_MS;
+
+    for (unsigned i = 0; i < client->backoffs && cap < HTTP_CLIENT_BACKOFF_MAX_MS; i++) {
+        cap <<= 1;
+    }
+
+    if (cap > HTTP_CLIENT_BACKOFF_MAX_MS) {
+        cap = HTTP_CLIENT_BACKOFF_MAX_MS;
+    }
+
+    if (client->backoffs < UINT8_MAX) {
+        client->backoffs++;
+    }
+
+    client->stats.backoff_ms = cap / 2 + hal_random() % (cap / 2 + 1);
+
+    DEBUG("Reconnecting in %u ms (%u backoffs in a row)", client->stats.backoff_ms,
+            (unsigned)client->backoffs);
+
+    client->retry_pending = true;
+    hal_timer_disarm(&client->retry_timer);
+    hal_timer_arm(&client->retry_timer, client->stats.backoff_ms, false);
+}
+
+/**
+ * The connection attempt failed, or the connection went away: count it, and schedule the retry,
+ * if the client is meant to stay connected.
+ */
+static ICACHE_FLASH_ATTR
+void _http_client_lost(struct http_client *client, enum http_client_state was, bool failed)
+{
+    int next = 0;
+
+    if (HTTP_CLIENT_CONNECTED == was) {
+        if (false == client->closing) {
+            client->stats.nr_drops++;
+        }
+        client->stats.connected_ms += (hal_time_us() - client->connected_since_us) / 1000;
+    } else {
+        client->stats.nr_failures++;
+    }
+
+    client->closing = false;
+
+    if (false == client->reconnect) {
+        return;
+    }
+
+    next = client->next_endpoint(client, failed, &client->endpoint);
+    client->have_endpoint = next >= 0;
+
+    if (0 != next) {
+        _http_client_backoff(client);
+        return;
+    }
+
+    DEBUG("Failing over to %s", client->endpoint.host);
+
+    /* No backoff, but not from inside the TCP callback either: the stack isn't done with it yet */
+    client->retry_pending = true;
+    client->stats.backoff_ms = 0;
+    hal_timer_disarm(&client->retry_timer);
+    hal_timer_arm(&client->retry_timer, 0, false);
+}
+
+static ICACHE_FLASH_ATTR
+void _http_client_on_disconnect_cb(struct hal_tcp *tcp)
+{
+    struct http_client *client = BL_CONTAINER_OF(tcp, struct http_client, tcp);
+    enum http_client_state was = client->state;
 
     client->state = HTTP_CLIENT_IDLE;
 
+    /* A body delimited by the connection closing is now complete */
+    if (client->req_head != client->req_sent) {
+        http_response_parser_eof(&client->resp);
+    }
+
+    _http_client_fail_inflight(client);
+
     DEBUG("HTTP client disconnected...");
+
+    _http_client_lost(client, was, HTTP_CLIENT_CONNECTED != was);
 }
 
 static ICACHE_FLASH_ATTR
-void _http_client_on_connect_cb(void *arg)
+void _http_client_on_connect_cb(struct hal_tcp *tcp)
 {
-    struct espconn *conn = arg;
-    struct http_client *client = BL_CONTAINER_OF(conn, struct http_client, conn);
-
-    espconn_regist_sentcb(conn, _http_client_on_sent_cb);
-    espconn_regist_disconcb(conn, _http_client_on_disconnect_cb);
+    struct http_client *client = BL_CONTAINER_OF(tcp, struct http_client, tcp);
 
     client->state = HTTP_CLIENT_CONNECTED;
 
+    client->connected_since_us = hal_time_us();
+    client->stats.last_connect_us = client->connected_since_us - client->connect_start_us;
+    if (client->stats.last_connect_us > client->stats.max_connect_us) {
+        client->stats.max_connect_us = client->stats.last_connect_us;
+    }
+    client->backoffs = 0;
+
     DEBUG("HTTP client is connected...");
 
-    espconn_sent(conn, "Hello!\r\n", 8);
+    _http_client_kick(client);
 }
 
 static ICACHE_FLASH_ATTR
-void _http_client_on_error_cb(void *arg, sint8 err)
+void _http_client_on_error_cb(struct hal_tcp *tcp, int err)
 {
-    struct espconn *conn = arg;
-    struct http_client *client = BL_CONTAINER_OF(conn, struct http_client, conn);
+    struct http_client *client = BL_CONTAINER_OF(tcp, struct http_client, tcp);
+    enum http_client_state was = client->state;
 
+    _http_client_fail_inflight(client);
     client->state = HTTP_CLIENT_ERROR;
 
     DEBUG("An error occurred while trying to connect to the server. Code: %d", (int)err);
+
+    _http_client_lost(client, was, true);
 }
 
 static ICACHE_FLASH_ATTR
-void _http_client_on_recv_cb(void *arg, char *pdata, unsigned short len)
+void _http_client_on_recv_cb(struct hal_tcp *tcp, char *pdata, unsigned short len)
 {
-    struct espconn *conn = arg;
-    struct http_client *client = BL_CONTAINER_OF(conn, struct http_client, conn);
+    struct http_client *client = BL_CONTAINER_OF(tcp, struct http_client, tcp);
 
-    DEBUG("Received %u bytes from remote host.\r\n", (unsigned)len);
+    PROF_START(http_on_recv);
+
+    /* Not through http_client_disconnect(): a server we can't make sense of counts as a drop */
+    if (0 != _http_client_parse(client, pdata, len)) {
+        hal_tcp_disconnect(&client->tcp);
+    } else {
+        _http_client_kick(client);
+    }
+
+    PROF_END(http_on_recv);
+}
+
+/**
+ * Make the next connection attempt, to the endpoint chosen when the last one was lost, or to
+ * wherever there is to go now if nowhere was chosen then.
+ */
+static ICACHE_FLASH_ATTR
+void _http_client_attempt(struct http_client *client)
+{
+    if (false == client->have_endpoint &&
+            0 > client->next_endpoint(client, false, &client->endpoint))
+    {
+        _http_client_backoff(client);
+        return;
+    }
+
+    client->have_endpoint = false;
+
+    if (0 != http_client_connect(client, client->endpoint.ip_addr, client->endpoint.port)) {
+        _http_client_lost(client, HTTP_CLIENT_CONNECTING, true);
+    }
+}
+
+static ICACHE_FLASH_ATTR
+void _http_client_on_retry_timer(void *arg)
+{
+    struct http_client *client = arg;
+
+    client->retry_pending = false;
+    client->stats.backoff_ms = 0;
+
+    if (true == client->reconnect) {
+        _http_client_attempt(client);
+    }
+}
+
+ICACHE_FLASH_ATTR
+void http_client_init(struct http_client *client)
+{
+    memset(client, 0, sizeof(*client));
+
+    client->state = HTTP_CLIENT_IDLE;
+
+    client->tcp.on_connect = _http_client_on_connect_cb;
+    client->tcp.on_disconnect = _http_client_on_disconnect_cb;
+    client->tcp.on_error = _http_client_on_error_cb;
+    client->tcp.on_sent = _http_client_on_sent_cb;
+    client->tcp.on_recv = _http_client_on_recv_cb;
+
+    http_response_parser_init(&client->resp, _http_client_on_body, _http_client_on_response, client);
+
+    hal_timer_setfn(&client->retry_timer, _http_client_on_retry_timer, client);
 }
 
 ICACHE_FLASH_ATTR
@@ -81,7 +510,8 @@ int http_client_disconnect(struct http_client *client)
     if (HTTP_CLIENT_CONNECTED == client->state ||
             HTTP_CLIENT_CONNECTING == client->state)
     {
-        espconn_disconnect(&client->conn);
+        client->closing = true;
+        hal_tcp_disconnect(&client->tcp);
     }
 
 done:
@@ -93,67 +523,284 @@ ICACHE_FLASH_ATTR
 int http_client_connect(struct http_client *client, uint32_t ip_addr, uint16_t port)
 {
     int status = 0;
-    struct espconn *conn = &client->conn;
-    esp_tcp *tcp_state = &client->tcp_state;
 
     if (NULL == client) {
         status = -1;
         goto done;
     }
 
-    memset(client, 0, sizeof(*client));
-
-    conn->type = ESPCONN_TCP;
-    conn->state = ESPCONN_NONE;
-    conn->proto.tcp = tcp_state;
-    tcp_state->local_port = espconn_port();
-    tcp_state->remote_port = port;
-    memcpy(&tcp_state->remote_ip, &ip_addr, 4);
+    if (HTTP_CLIENT_CONNECTED == client->state || HTTP_CLIENT_CONNECTING == client->state) {
+        /* Already have (or are getting) a connection to reuse */
+        goto done;
+    }
 
-    espconn_regist_connectcb(conn, _http_client_on_connect_cb);
-    espconn_regist_reconcb(conn, _http_client_on_error_cb);
+    client->sending = false;
+    client->body_len = 0;
+    http_response_parser_reset(&client->resp);
 
     client->state = HTTP_CLIENT_CONNECTING;
+    client->connect_start_us = hal_time_us();
+    client->stats.nr_connects++;
 
     DEBUG("Connecting to %x:%u", ip_addr, (unsigned)port);
 
     /* And we're off... */
-    espconn_connect(conn);
+    if (0 != hal_tcp_connect(&client->tcp, ip_addr, port)) {
+        client->state = HTTP_CLIENT_ERROR;
+        status = -1;
+    }
 
 done:
     return status;
 }
 
-static
-char *_http_methods[] = {
-    [HTTP_METHOD_GET] = "GET",
-    [HTTP_METHOD_POST] = "POST",
-    [HTTP_METHOD_PUT] = "PUT",
-    [HTTP_METHOD_DELETE] = "DELETE",
-};
+ICACHE_FLASH_ATTR
+int http_client_start(struct http_client *client, http_client_endpoint_func_t next_endpoint)
+{
+    int status = 0;
 
-static
-char _http_buf[512];
+    if (NULL == client || NULL == next_endpoint) {
+        status = -1;
+        goto done;
+    }
+
+    client->next_endpoint = next_endpoint;
+    client->reconnect = true;
+
+    if (true == client->retry_pending || HTTP_CLIENT_CONNECTED == client->state ||
+            HTTP_CLIENT_CONNECTING == client->state)
+    {
+        /* Already on the way */
+        goto done;
+    }
+
+    client->have_endpoint = false;
+    _http_client_attempt(client);
+
+    if (HTTP_CLIENT_CONNECTING != client->state) {
+        status = -1;
+    }
+
+done:
+    return status;
+}
 
 ICACHE_FLASH_ATTR
-int http_client_send_json_message(struct http_client *client, enum http_method method, const char *host, const char *resource,
-        const char *message, size_t msg_len, on_response_func_t response)
+void http_client_stop(struct http_client *client)
+{
+    client->reconnect = false;
+    client->retry_pending = false;
+    client->stats.backoff_ms = 0;
+    hal_timer_disarm(&client->retry_timer);
+
+    http_client_disconnect(client);
+}
+
+ICACHE_FLASH_ATTR
+void http_client_get_stats(struct http_client *client, struct http_client_stats *stats)
+{
+    *stats = client->stats;
+
+    if (HTTP_CLIENT_CONNECTED == client->state) {
+        stats->connected_ms += (hal_time_us() - client->connected_since_us) / 1000;
+    }
+}
+
+ICACHE_FLASH_ATTR
+unsigned http_client_free_slots(struct http_client *client)
+{
+    return HTTP_CLIENT_MAX_PIPELINE - (uint8_t)(client->req_tail - client->req_head);
+}
+
+ICACHE_FLASH_ATTR
+int http_client_send_message(struct http_client *client, enum http_method method, const char *host, const char *resource,
+        enum http_content_type content_type, const void *message, size_t msg_len, on_response_func_t response)
 {
     int status = 0;
+    struct http_request *req = NULL;
+
+    if (NULL == client || NULL == resource || method > HTTP_METHOD_DELETE ||
+            content_type > HTTP_CONTENT_TYPE_OCTET_STREAM || msg_len > UINT16_MAX)
+    {
+        status = -1;
+        goto done;
+    }
 
-    int offs = os_sprintf(_http_buf, "%s %s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\nContent-Type: application/json\r\n");
+    if (0 == http_client_free_slots(client)) {
+        DEBUG("HTTP request pipeline is full.");
+        status = -1;
+        goto done;
+    }
 
-    if (NULL != message && 0 != msg_len) {
-        memcpy(_http_buf + offs - 1, message, msg_len);
-        offs += msg_len - 1;
+    if (NULL == message) {
+        msg_len = 0;
     }
 
-    memcpy(_http_buf + offs - 1, "\r\n", 2);
+    req = HTTP_REQ_SLOT(client, client->req_tail);
+
+    req->on_response = response;
+    req->method = method;
+    req->content_type = content_type;
+    req->resource = resource;
+    req->host = host;
+    req->body = message;
+    req->body_len = msg_len;
+    req->frag = HTTP_FRAG_METHOD;
+    _http_request_fill_scratch(req);
 
-    espconn_sent(&client->conn, _http_buf, offs + 2);
+    client->req_tail++;
 
-    client->on_response = response;
+    _http_client_kick(client);
 
+done:
     return status;
 }
 
+ICACHE_FLASH_ATTR
+int http_client_send_json_message(struct http_client *client, enum http_method method, const char *host, const char *resource,
+        const char *message, size_t msg_len, on_response_func_t response)
+{
+    return http_client_send_message(client, method, host, resource, HTTP_CONTENT_TYPE_JSON, message, msg_len,
+            response);
+}
+
+#ifdef HTTP_CLIENT_BENCHMARK
+#define HTTP_BENCH_ITERS        1000
+#define HTTP_BENCH_STACK_PAINT  1024
+#define HTTP_BENCH_PAINT_BYTE   0xa5
+
+/* Bytes the request builders have copied, totalled over a run */
+static
+uint32_t _http_bench_copied;
+
+/* Stand in for the TCP stack, so the builders can't be optimized away */
+static
+uint32_t _http_bench_sink;
+
+/**
+ * The original request builder: format the headers into one static buffer and copy the body in
+ * after them.
+ */
+static ICACHE_FLASH_ATTR __attribute__((noinline))
+void _http_bench_build_legacy(enum http_method method, const char *host, const char *resource,
+        const char *message, size_t msg_len)
+{
+    static const char *methods[] = { "GET", "POST", "PUT", "DELETE" };
+    static char buf[512];
+    int offs = os_sprintf(buf, "%s %s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n"
+            "Content-Type: application/json\r\nContent-Length: %u\r\n\r\n",
+            methods[method], resource, host, (unsigned)msg_len);
+
+    os_memcpy(buf + offs, message, msg_len);
+    offs += msg_len;
+
+    _http_bench_copied += offs;
+    _http_bench_sink += buf[offs - 1] + offs;
+}
+
+/**
+ * The scatter-gather builder: fill in a request slot and walk its fragments, as the sent callback
+ * would.
+ */
+static ICACHE_FLASH_ATTR __attribute__((noinline))
+void _http_bench_build_frags(enum http_method method, const char *host, const char *resource,
+        const char *message, size_t msg_len)
+{
+    struct http_request req;
+    struct http_frag frag;
+
+    req.method = method;
+    req.content_type = HTTP_CONTENT_TYPE_JSON;
+    req.resource = resource;
+    req.host = host;
+    req.body = message;
+    req.body_len = msg_len;
+    _http_request_fill_scratch(&req);
+
+    _http_bench_copied += req.scratch_len;
+
+    for (req.frag = HTTP_FRAG_METHOD; req.frag < HTTP_FRAG_DONE; req.frag++) {
+        _http_request_frag(&req, host, req.frag, &frag);
+        _http_bench_sink += frag.len + (0 != frag.len ? frag.data[frag.len - 1] : 0);
+    }
+}
+
+typedef void (*http_bench_build_func_t)(enum http_method method, const char *host, const char *resource,
+        const char *message, size_t msg_len);
+
+/**
+ * Paint the stack below the caller, so a later call can be measured by how much paint it scrubs.
+ */
+static ICACHE_FLASH_ATTR __attribute__((noinline))
+uintptr_t _http_bench_paint_stack(void)
+{
+    volatile uint8_t paint[HTTP_BENCH_STACK_PAINT];
+
+    for (size_t i = 0; i < sizeof(paint); i++) {
+        paint[i] = HTTP_BENCH_PAINT_BYTE;
+    }
+
+    return (uintptr_t)paint;
+}
+
+/**
+ * Run a builder once on a freshly painted stack, and return the number of bytes of stack it used.
+ */
+static ICACHE_FLASH_ATTR __attribute__((noinline))
+unsigned _http_bench_stack_use(http_bench_build_func_t build, const char *message, size_t msg_len)
+{
+    const volatile uint8_t *paint = (const volatile uint8_t *)_http_bench_paint_stack();
+    unsigned i;
+
+    build(HTTP_METHOD_POST, "collector.local", "/samples", message, msg_len);
+
+    /* The stack grows down, so the deepest untouched paint is at the start of the array */
+    for (i = 0; i < HTTP_BENCH_STACK_PAINT && HTTP_BENCH_PAINT_BYTE == paint[i]; i++);
+
+    return HTTP_BENCH_STACK_PAINT - i;
+}
+
+static ICACHE_FLASH_ATTR
+void _http_bench_run(const char *name, http_bench_build_func_t build, const char *message, size_t msg_len)
+{
+    uint32_t start_cyc, cycles;
+    unsigned stack;
+
+    /* Warm up first, so one-time setup inside the C library isn't counted */
+    build(HTTP_METHOD_POST, "collector.local", "/samples", message, msg_len);
+    stack = _http_bench_stack_use(build, message, msg_len);
+
+    _http_bench_copied = 0;
+    start_cyc = hal_ccount();
+    for (int i = 0; i < HTTP_BENCH_ITERS; i++) {
+        build(HTTP_METHOD_POST, "collector.local", "/samples", message, msg_len);
+    }
+    cycles = hal_ccount() - start_cyc;
+
+    os_printf("HTTP: %-7s %u byte body: %u cycles, %u bytes copied, ~%u bytes stack per request\r\n",
+            name, (unsigned)msg_len, cycles / HTTP_BENCH_ITERS, _http_bench_copied / HTTP_BENCH_ITERS, stack);
+}
+
+/**
+ * Compare the old format-and-copy request builder against the scatter-gather one.
+ */
+ICACHE_FLASH_ATTR
+void http_client_benchmark(void)
+{
+    static char body[320];
+    static const size_t body_lens[] = { 48, 160, 320 };
+
+    os_memset(body, '7', sizeof(body));
+
+    os_printf("HTTP: request buffers: legacy 512 bytes static, scatter-gather %u bytes per slot, %u slots\r\n",
+            (unsigned)sizeof(struct http_request), HTTP_CLIENT_MAX_PIPELINE);
+    os_printf("HTTP: neither builder allocates from the heap\r\n");
+
+    for (int i = 0; i < sizeof(body_lens)/sizeof(body_lens[0]); i++) {
+        _http_bench_run("legacy", _http_bench_build_legacy, body, body_lens[i]);
+        _http_bench_run("frags", _http_bench_build_frags, body, body_lens[i]);
+    }
+
+    os_printf("HTTP: (sink %u)\r\n", _http_bench_sink & 0xff);
+}
+#endif /* HTTP_CLIENT_BENCHMARK */
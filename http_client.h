@@ -1,19 +1,69 @@
 #pragma once
 
-#include <osapi.h>
-#include <os_type.h>
-#include <ets_sys.h>
-#include <user_interface.h>
-#include <espconn.h>
-
 #include <stdbool.h>
 
-#include "c99_fixups.h"
+#include "hal.h"
+#include "http_parse.h"
+
+/**
+ * Number of requests that can be queued or awaiting a response at once
+ */
+#define HTTP_CLIENT_MAX_PIPELINE        4
+
+/**
+ * Per-request scratch space, for the only part of a request that is formatted rather than sent
+ * from where it already lives: the Content-Length value and the end of the header block.
+ */
+#define HTTP_CLIENT_SCRATCH_LEN         16
+
+/**
+ * Longest response body handed to the response callback. Longer bodies are truncated.
+ */
+#define HTTP_CLIENT_MAX_BODY            128
+
+/**
+ * Reconnection backoff, for clients started with http_client_start(). The longest wait before a
+ * retry doubles with each backoff in a row, from HTTP_CLIENT_BACKOFF_MIN_MS up to
+ * HTTP_CLIENT_BACKOFF_MAX_MS, and each wait is picked at random from the upper half of that, so a
+ * fleet of devices that lost the server at the same moment doesn't come back at the same moment.
+ */
+#define HTTP_CLIENT_BACKOFF_MIN_MS      500
+#define HTTP_CLIENT_BACKOFF_MAX_MS      60000
 
 struct http_client;
 
+/**
+ * Called once per request, in the order the requests were queued. A response_code of 0 means the
+ * connection went away before the response arrived.
+ */
 typedef void (*on_response_func_t)(struct http_client *client, unsigned response_code, const char *body, size_t length);
 
+/**
+ * A server to connect to. host goes in the Host header of requests queued without one of their
+ * own, and must stay valid while the client is connected there.
+ */
+struct http_client_endpoint {
+    const char *host;
+    uint32_t ip_addr;
+    uint16_t port;
+};
+
+/**
+ * Choose where the next connection attempt goes, for clients started with http_client_start().
+ * Called on starting, and each time the connection attempt fails or the connection goes away:
+ * failed is set if it failed or broke, rather than being closed.
+ *
+ * \return 0 to try the endpoint filled in straight away, failing over to it; 1 to try it after
+ *         the backoff; -1 if there is nowhere to try yet, to be asked again after the backoff.
+ */
+typedef int (*http_client_endpoint_func_t)(struct http_client *client, bool failed,
+        struct http_client_endpoint *endpoint);
+
+/**
+ * A response came in, rtt_us after its request started going out.
+ */
+typedef void (*http_client_rtt_func_t)(struct http_client *client, uint32_t rtt_us);
+
 enum http_client_state {
     HTTP_CLIENT_IDLE = 0,
     HTTP_CLIENT_CONNECTING,
@@ -21,34 +71,179 @@ enum http_client_state {
     HTTP_CLIENT_ERROR,
 };
 
-struct http_client {
-    enum http_client_state state;
-    struct espconn conn;
-    esp_tcp tcp_state;
+enum http_content_type {
+    HTTP_CONTENT_TYPE_JSON,
+    HTTP_CONTENT_TYPE_OCTET_STREAM,
+};
+
+/**
+ * A queued request. Nothing is serialized up front: the request is sent as a list of fragments,
+ * constant header text straight from flash and the caller's resource, host and body in place,
+ * one fragment per sent callback. The request stays in its slot until its response arrives.
+ */
+struct http_request {
     on_response_func_t on_response;
+    const char *resource;
+    const char *host;
+    const char *body;
+    uint16_t body_len;
+    uint8_t method;
+    uint8_t content_type;
+
+    /* When the request started going out, for its round trip time */
+    uint32_t sent_us;
+
+    /* Fragment in flight, or next to be sent */
+    uint8_t frag;
+    uint8_t scratch_len;
+    char scratch[HTTP_CLIENT_SCRATCH_LEN];
 };
 
-enum http_method {
-    HTTP_METHOD_GET,
-    HTTP_METHOD_POST,
-    HTTP_METHOD_PUT,
-    HTTP_METHOD_DELETE,
+/**
+ * Connection health, since the client was set up
+ */
+struct http_client_stats {
+    /* Connection attempts, and those that never came up */
+    uint32_t nr_connects;
+    uint32_t nr_failures;
+
+    /* Connections that came up and later went away, other than by http_client_disconnect() */
+    uint32_t nr_drops;
+
+    /* Time from attempt to connected, for the last connection and at worst */
+    uint32_t last_connect_us;
+    uint32_t max_connect_us;
+
+    /* Time from request to response, for the last response */
+    uint32_t last_rtt_us;
+
+    /* Total time spent connected, including the connection up now */
+    uint32_t connected_ms;
+
+    /* Wait before the retry now pending, 0 if there is none */
+    uint32_t backoff_ms;
+};
+
+struct http_client {
+    enum http_client_state state;
+    struct hal_tcp tcp;
+
+    /**
+     * Request FIFO. Requests between req_head and req_sent are on the wire awaiting a response,
+     * those between req_sent and req_tail have yet to be sent. Free-running counters, taken
+     * modulo HTTP_CLIENT_MAX_PIPELINE.
+     */
+    struct http_request requests[HTTP_CLIENT_MAX_PIPELINE];
+    uint8_t req_head;
+    uint8_t req_sent;
+    uint8_t req_tail;
+
+    /* A request fragment has been handed to the TCP stack, and not yet acknowledged as sent */
+    bool sending;
+
+    /**
+     * If set, requests not yet sent are failed along with those awaiting a response when the
+     * connection drops, rather than held for the next connection. For owners that would rather
+     * rebuild their requests from scratch.
+     */
+    bool fail_unsent_on_disconnect;
+
+    struct http_response_parser resp;
+
+    /* The start of the body of the response coming in, for the response callback */
+    uint16_t body_len;
+    char body[HTTP_CLIENT_MAX_BODY];
+
+    /**
+     * Called with the round trip time of every response, if set
+     */
+    http_client_rtt_func_t on_rtt;
+
+    /**
+     * Reconnection, for clients started with http_client_start(): who chooses where to, where
+     * the last or next attempt goes, the backoffs in a row so far, and the timer for the next
+     * attempt
+     */
+    bool reconnect;
+    bool retry_pending;
+    bool have_endpoint;
+    uint8_t backoffs;
+    http_client_endpoint_func_t next_endpoint;
+    struct http_client_endpoint endpoint;
+    struct hal_timer retry_timer;
+
+    /* Whether the connection is going away because http_client_disconnect() asked it to */
+    bool closing;
+
+    /* When the attempt under way started, and when the connection up now came up */
+    uint32_t connect_start_us;
+    uint32_t connected_since_us;
+
+    struct http_client_stats stats;
 };
 
+/**
+ * Set up an HTTP client. Call once, before connecting.
+ */
+void http_client_init(struct http_client *client);
+
 /**
  * Using the HTTP client, connect to the specified host IP address, on the given port. This does not
- * send any headers.
+ * send any headers. Requests still queued from a previous connection are sent once connected.
  */
 int http_client_connect(struct http_client *client, uint32_t ip_addr, uint16_t port);
 
 /**
- * Force the HTTP client to disconnect.
+ * Force the HTTP client to disconnect. The connection going away isn't counted as a drop.
  */
 int http_client_disconnect(struct http_client *client);
 
 /**
- * Send a JSON message. Register a response callback that will be called when the message has been sent. If the response has
- * a body, this function will receive the response as well as the status code.
+ * Connect to wherever next_endpoint chooses, and keep the connection up from then on: whenever the
+ * attempt fails or the connection drops, try again, straight from the TCP callbacks. The retry
+ * goes out at once if next_endpoint fails over to another server, after a backoff otherwise.
+ *
+ * \return 0 if the first attempt is under way, -1 if it could not be started (a retry is
+ *         scheduled all the same).
+ */
+int http_client_start(struct http_client *client, http_client_endpoint_func_t next_endpoint);
+
+/**
+ * Stop reconnecting, cancel any pending retry and disconnect.
+ */
+void http_client_stop(struct http_client *client);
+
+/**
+ * Take a copy of the connection health counters.
+ */
+void http_client_get_stats(struct http_client *client, struct http_client_stats *stats);
+
+/**
+ * Number of requests that can be queued right now.
+ */
+unsigned http_client_free_slots(struct http_client *client);
+
+/**
+ * Queue a JSON message. The request is sent on the persistent connection as soon as the link is
+ * free, without waiting for responses to earlier requests. The response callback is called once
+ * the matching response has been received, with the status code and body (if any). If host is
+ * NULL, the request carries the host of whichever endpoint it goes out to.
+ *
+ * Nothing is copied: host, resource and message must stay valid until the response callback has
+ * been called.
+ *
+ * \return 0 on success, -1 if the pipeline is full.
  */
 int http_client_send_json_message(struct http_client *client, enum http_method method, const char *host, const char *resource,
         const char *message, size_t msg_len, on_response_func_t response);
+
+/**
+ * Queue a message with the given content type, such as a binary telemetry batch sent as
+ * application/octet-stream. Otherwise the same as http_client_send_json_message().
+ */
+int http_client_send_message(struct http_client *client, enum http_method method, const char *host, const char *resource,
+        enum http_content_type content_type, const void *message, size_t msg_len, on_response_func_t response);
+
+#ifdef HTTP_CLIENT_BENCHMARK
+void http_client_benchmark(void);
+#endif
@@ -0,0 +1,727 @@
+/** \file http_parse.c HTTP/1.1 parsing shared by the client and the server
+ */
+
+#include "http_parse.h"
+
+#include "hal.h"
+
+#define ARRAY_LEN(x) (sizeof((x))/sizeof((x[0])))
+
+/* Method names as they appear in a request line. Kept in RAM, since they are compared bytewise. */
+static
+const char *const _http_method_names[] = {
+    [HTTP_METHOD_GET] = "GET",
+    [HTTP_METHOD_POST] = "POST",
+    [HTTP_METHOD_PUT] = "PUT",
+    [HTTP_METHOD_DELETE] = "DELETE",
+};
+
+ICACHE_FLASH_ATTR
+bool http_line_add(char *line, uint16_t *line_len, size_t size, char c)
+{
+    if ('\n' == c) {
+        if (*line_len > 0 && '\r' == line[*line_len - 1]) {
+            (*line_len)--;
+        }
+        line[*line_len] = '\0';
+        return true;
+    }
+
+    if (*line_len < size - 1) {
+        line[(*line_len)++] = c;
+    }
+
+    return false;
+}
+
+ICACHE_FLASH_ATTR
+const char *http_header_value(const char *line, const char *name)
+{
+    while ('\0' != *name) {
+        char c = *line++;
+
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+
+        if (c != *name++) {
+            return NULL;
+        }
+    }
+
+    if (':' != *line++) {
+        return NULL;
+    }
+
+    while (' ' == *line || '\t' == *line) {
+        line++;
+    }
+
+    return line;
+}
+
+ICACHE_FLASH_ATTR
+int http_parse_decimal(const char *value, uint32_t *number)
+{
+    uint32_t n = 0;
+
+    if (*value < '0' || *value > '9') {
+        return -1;
+    }
+
+    for (; *value >= '0' && *value <= '9'; value++) {
+        if (n > (UINT32_MAX - 9) / 10) {
+            return -1;
+        }
+        n = n * 10 + (*value - '0');
+    }
+
+    *number = n;
+
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+int http_parse_request_line(char *line, enum http_method *method, char **resource)
+{
+    char *p = line;
+    unsigned i;
+
+    while ('\0' != *p && ' ' != *p) {
+        p++;
+    }
+
+    if (' ' != *p) {
+        return -1;
+    }
+
+    *p++ = '\0';
+
+    for (i = 0; i < ARRAY_LEN(_http_method_names); i++) {
+        if (0 == os_strcmp(line, _http_method_names[i])) {
+            break;
+        }
+    }
+
+    if (ARRAY_LEN(_http_method_names) == i) {
+        return -1;
+    }
+
+    *method = i;
+    *resource = p;
+
+    while ('\0' != *p && ' ' != *p) {
+        p++;
+    }
+
+    if (' ' != *p || p == *resource) {
+        return -1;
+    }
+
+    *p++ = '\0';
+
+    return 0 == os_strncmp(p, "HTTP/1.", 7) ? 0 : -1;
+}
+
+/**
+ * Where the response parser is. Everything but the bodies is read a byte at a time.
+ */
+enum http_resp_state {
+    HTTP_RESP_VERSION = 0,
+    HTTP_RESP_MINOR_VERSION,
+    HTTP_RESP_STATUS_SPACE,
+    HTTP_RESP_STATUS,
+    HTTP_RESP_REASON,
+    HTTP_RESP_HEADER_START,
+    HTTP_RESP_HEADER_NAME,
+    HTTP_RESP_HEADER_VALUE,
+    HTTP_RESP_HEADER_SKIP,
+    HTTP_RESP_BODY,
+    HTTP_RESP_BODY_UNTIL_CLOSE,
+    HTTP_RESP_CHUNK_SIZE,
+    HTTP_RESP_CHUNK_EXT,
+    HTTP_RESP_CHUNK_DATA,
+    HTTP_RESP_CHUNK_DATA_END,
+    HTTP_RESP_TRAILER_START,
+    HTTP_RESP_TRAILER_SKIP,
+};
+
+#define HTTP_RESP_FLAG_CHUNKED          0x01
+#define HTTP_RESP_FLAG_HAS_LENGTH       0x02
+#define HTTP_RESP_FLAG_CLOSE            0x04
+#define HTTP_RESP_FLAG_KEEP_ALIVE       0x08
+#define HTTP_RESP_FLAG_HTTP_1_0         0x10
+
+/* Position within the Content-Length value once whitespace follows the digits */
+#define HTTP_RESP_LENGTH_DONE           0xff
+
+static
+const char _http_resp_version[] = "HTTP/1.";
+
+/*
+ * The headers we act on, and the tokens we look for in their values, lower case. Names are matched
+ * as they arrive: match holds a bit for each candidate that still agrees with what has been seen,
+ * and pos how far in we are.
+ */
+enum http_resp_header {
+    HTTP_RESP_HEADER_CONTENT_LENGTH,
+    HTTP_RESP_HEADER_TRANSFER_ENCODING,
+    HTTP_RESP_HEADER_CONNECTION,
+    HTTP_RESP_HEADER_OTHER,
+};
+
+static
+const char *const _http_resp_headers[] = {
+    [HTTP_RESP_HEADER_CONTENT_LENGTH] = "content-length",
+    [HTTP_RESP_HEADER_TRANSFER_ENCODING] = "transfer-encoding",
+    [HTTP_RESP_HEADER_CONNECTION] = "connection",
+};
+
+static
+const char *const _http_resp_tokens[] = { "chunked", "close", "keep-alive" };
+
+/* The flag each token sets, and the tokens that mean anything in each header's value */
+static
+const uint8_t _http_resp_token_flags[] = {
+    HTTP_RESP_FLAG_CHUNKED, HTTP_RESP_FLAG_CLOSE, HTTP_RESP_FLAG_KEEP_ALIVE
+};
+
+static
+const uint8_t _http_resp_header_tokens[] = {
+    [HTTP_RESP_HEADER_CONTENT_LENGTH] = 0,
+    [HTTP_RESP_HEADER_TRANSFER_ENCODING] = 0x1,
+    [HTTP_RESP_HEADER_CONNECTION] = 0x6,
+    [HTTP_RESP_HEADER_OTHER] = 0,
+};
+
+/**
+ * Narrow down the candidates still matching, given the next character.
+ */
+static ICACHE_FLASH_ATTR
+void _http_resp_match(struct http_response_parser *parser, const char *const *names,
+        size_t nr_names, char c)
+{
+    if (c >= 'A' && c <= 'Z') {
+        c += 'a' - 'A';
+    }
+
+    for (size_t i = 0; i < nr_names; i++) {
+        /* A candidate already out may be shorter than pos */
+        if (0 == (parser->match & (1 << i))) {
+            continue;
+        }
+
+        if ('\0' == names[i][parser->pos] || c != names[i][parser->pos]) {
+            parser->match &= ~(1 << i);
+        }
+    }
+
+    /* Once nothing matches, pos stops mattering, so it can't run off the end */
+    if (0 != parser->match) {
+        parser->pos++;
+    }
+}
+
+/**
+ * The candidate that has been matched in full, or nr_names if none.
+ */
+static ICACHE_FLASH_ATTR
+unsigned _http_resp_matched(const struct http_response_parser *parser, const char *const *names,
+        size_t nr_names)
+{
+    unsigned i;
+
+    for (i = 0; i < nr_names; i++) {
+        if (0 != (parser->match & (1 << i)) && '\0' == names[i][parser->pos]) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+static ICACHE_FLASH_ATTR
+void _http_resp_start(struct http_response_parser *parser)
+{
+    parser->state = HTTP_RESP_VERSION;
+    parser->remaining = 0;
+    parser->status = 0;
+    parser->flags = 0;
+    parser->header = HTTP_RESP_HEADER_OTHER;
+    parser->match = 0;
+    parser->pos = 0;
+}
+
+/**
+ * The response is over. Get ready for the next before calling back, since the callback might
+ * well reset the parser itself.
+ */
+static ICACHE_FLASH_ATTR
+void _http_resp_complete(struct http_response_parser *parser)
+{
+    unsigned status = parser->status;
+    bool keep_alive = true;
+
+    if (0 != (parser->flags & HTTP_RESP_FLAG_CLOSE)) {
+        keep_alive = false;
+    } else if (0 != (parser->flags & HTTP_RESP_FLAG_HTTP_1_0)) {
+        keep_alive = 0 != (parser->flags & HTTP_RESP_FLAG_KEEP_ALIVE);
+    }
+
+    _http_resp_start(parser);
+
+    parser->on_response(parser->arg, status, keep_alive);
+}
+
+/**
+ * The end of a header's value.
+ *
+ * \return 0 on success, -1 if the value is malformed.
+ */
+static ICACHE_FLASH_ATTR
+int _http_resp_value_end(struct http_response_parser *parser)
+{
+    unsigned token = 0;
+
+    switch (parser->header) {
+    case HTTP_RESP_HEADER_CONTENT_LENGTH:
+        if (0 == parser->pos) {
+            return -1;
+        }
+        parser->flags |= HTTP_RESP_FLAG_HAS_LENGTH;
+        break;
+    case HTTP_RESP_HEADER_TRANSFER_ENCODING:
+    case HTTP_RESP_HEADER_CONNECTION:
+        token = _http_resp_matched(parser, _http_resp_tokens, ARRAY_LEN(_http_resp_tokens));
+        if (token < ARRAY_LEN(_http_resp_tokens)) {
+            parser->flags |= _http_resp_token_flags[token];
+        }
+
+        parser->match = _http_resp_header_tokens[parser->header];
+        parser->pos = 0;
+        break;
+    }
+
+    return 0;
+}
+
+/**
+ * The next character of a header's value.
+ *
+ * \return 0 on success, -1 if the value is malformed.
+ */
+static ICACHE_FLASH_ATTR
+int _http_resp_value(struct http_response_parser *parser, char c)
+{
+    if (HTTP_RESP_HEADER_CONTENT_LENGTH == parser->header) {
+        if (c >= '0' && c <= '9') {
+            if (HTTP_RESP_LENGTH_DONE == parser->pos || parser->remaining > (UINT32_MAX - 9) / 10) {
+                return -1;
+            }
+            parser->remaining = parser->remaining * 10 + (c - '0');
+            parser->pos = 1;
+        } else if (' ' == c || '\t' == c) {
+            if (0 != parser->pos) {
+                parser->pos = HTTP_RESP_LENGTH_DONE;
+            }
+        } else {
+            return -1;
+        }
+
+        return 0;
+    }
+
+    /* A list of tokens */
+    if (',' == c || ' ' == c || '\t' == c) {
+        return _http_resp_value_end(parser);
+    }
+
+    _http_resp_match(parser, _http_resp_tokens, ARRAY_LEN(_http_resp_tokens), c);
+
+    return 0;
+}
+
+/**
+ * The blank line ending the headers. Work out how the body is framed.
+ *
+ * \return 1 if that was the end of the response, 0 otherwise.
+ */
+static ICACHE_FLASH_ATTR
+int _http_resp_headers_done(struct http_response_parser *parser)
+{
+    if (parser->status >= 100 && parser->status < 200) {
+        /* Interim response; the real one follows */
+        _http_resp_start(parser);
+    } else if (204 == parser->status || 304 == parser->status) {
+        _http_resp_complete(parser);
+        return 1;
+    } else if (0 != (parser->flags & HTTP_RESP_FLAG_CHUNKED)) {
+        parser->state = HTTP_RESP_CHUNK_SIZE;
+        parser->remaining = 0;
+        parser->pos = 0;
+    } else if (0 != (parser->flags & HTTP_RESP_FLAG_HAS_LENGTH)) {
+        if (0 == parser->remaining) {
+            _http_resp_complete(parser);
+            return 1;
+        }
+        parser->state = HTTP_RESP_BODY;
+    } else {
+        /* No framing, so the body runs until the server closes the connection */
+        parser->flags |= HTTP_RESP_FLAG_CLOSE;
+        parser->state = HTTP_RESP_BODY_UNTIL_CLOSE;
+    }
+
+    return 0;
+}
+
+/**
+ * The end of a chunk size line.
+ */
+static ICACHE_FLASH_ATTR
+int _http_resp_chunk_size_done(struct http_response_parser *parser)
+{
+    if (0 == parser->pos) {
+        return -1;
+    }
+
+    parser->state = 0 == parser->remaining ? HTTP_RESP_TRAILER_START : HTTP_RESP_CHUNK_DATA;
+
+    return 0;
+}
+
+/**
+ * Run one byte outside of a body through the parser.
+ *
+ * \return 0 to carry on, 1 if that was the end of the response, -1 if the stream is malformed.
+ */
+static ICACHE_FLASH_ATTR
+int _http_resp_byte(struct http_response_parser *parser, char c)
+{
+    int status = 0;
+
+    switch (parser->state) {
+    case HTTP_RESP_VERSION:
+        /* Tolerate stray line ends between responses */
+        if (0 == parser->pos && ('\r' == c || '\n' == c)) {
+            break;
+        }
+
+        if (c != _http_resp_version[parser->pos]) {
+            status = -1;
+        } else if ('\0' == _http_resp_version[++parser->pos]) {
+            parser->state = HTTP_RESP_MINOR_VERSION;
+        }
+        break;
+    case HTTP_RESP_MINOR_VERSION:
+        if (c < '0' || c > '9') {
+            status = -1;
+        } else {
+            if ('0' == c) {
+                parser->flags |= HTTP_RESP_FLAG_HTTP_1_0;
+            }
+            parser->state = HTTP_RESP_STATUS_SPACE;
+        }
+        break;
+    case HTTP_RESP_STATUS_SPACE:
+        if (' ' != c) {
+            status = -1;
+        } else {
+            parser->state = HTTP_RESP_STATUS;
+            parser->pos = 0;
+        }
+        break;
+    case HTTP_RESP_STATUS:
+        if (' ' == c && 0 == parser->pos) {
+            break;
+        }
+
+        if (c < '0' || c > '9') {
+            status = -1;
+        } else {
+            parser->status = parser->status * 10 + (c - '0');
+            if (3 == ++parser->pos) {
+                parser->state = HTTP_RESP_REASON;
+            }
+        }
+        break;
+    case HTTP_RESP_REASON:
+    case HTTP_RESP_HEADER_SKIP:
+        if ('\n' == c) {
+            parser->state = HTTP_RESP_HEADER_START;
+        }
+        break;
+    case HTTP_RESP_HEADER_START:
+        if ('\n' == c) {
+            status = _http_resp_headers_done(parser);
+            break;
+        } else if ('\r' == c) {
+            break;
+        } else if (' ' == c || '\t' == c) {
+            /* A folded continuation of the last header, which we don't act on */
+            parser->state = HTTP_RESP_HEADER_SKIP;
+            break;
+        }
+
+        parser->state = HTTP_RESP_HEADER_NAME;
+        parser->match = (1 << ARRAY_LEN(_http_resp_headers)) - 1;
+        parser->pos = 0;
+        /* Fall through */
+    case HTTP_RESP_HEADER_NAME:
+        if (':' == c) {
+            parser->header = _http_resp_matched(parser, _http_resp_headers, ARRAY_LEN(_http_resp_headers));
+            parser->match = _http_resp_header_tokens[parser->header];
+            parser->pos = 0;
+
+            if (HTTP_RESP_HEADER_OTHER == parser->header) {
+                parser->state = HTTP_RESP_HEADER_SKIP;
+            } else if (HTTP_RESP_HEADER_CONTENT_LENGTH == parser->header) {
+                parser->remaining = 0;
+                parser->state = HTTP_RESP_HEADER_VALUE;
+            } else {
+                parser->state = HTTP_RESP_HEADER_VALUE;
+            }
+        } else if ('\n' == c) {
+            status = -1;
+        } else {
+            _http_resp_match(parser, _http_resp_headers, ARRAY_LEN(_http_resp_headers), c);
+        }
+        break;
+    case HTTP_RESP_HEADER_VALUE:
+        if ('\n' == c) {
+            status = _http_resp_value_end(parser);
+            parser->state = HTTP_RESP_HEADER_START;
+        } else if ('\r' != c) {
+            status = _http_resp_value(parser, c);
+        }
+        break;
+    case HTTP_RESP_CHUNK_SIZE:
+        if (c >= '0' && c <= '9') {
+            c -= '0';
+        } else if (c >= 'a' && c <= 'f') {
+            c -= 'a' - 10;
+        } else if (c >= 'A' && c <= 'F') {
+            c -= 'A' - 10;
+        } else if ('\n' == c) {
+            status = _http_resp_chunk_size_done(parser);
+            break;
+        } else if ('\r' == c) {
+            break;
+        } else if (';' == c || ' ' == c || '\t' == c) {
+            /* A chunk extension, which we ignore */
+            parser->state = 0 != parser->pos ? HTTP_RESP_CHUNK_EXT : HTTP_RESP_CHUNK_SIZE;
+            status = 0 != parser->pos ? 0 : -1;
+            break;
+        } else {
+            status = -1;
+            break;
+        }
+
+        if (parser->remaining > (UINT32_MAX >> 4)) {
+            status = -1;
+        } else {
+            parser->remaining = (parser->remaining << 4) | c;
+            parser->pos = 1;
+        }
+        break;
+    case HTTP_RESP_CHUNK_EXT:
+        if ('\n' == c) {
+            status = _http_resp_chunk_size_done(parser);
+        }
+        break;
+    case HTTP_RESP_CHUNK_DATA_END:
+        if ('\n' == c) {
+            parser->state = HTTP_RESP_CHUNK_SIZE;
+            parser->remaining = 0;
+            parser->pos = 0;
+        } else if ('\r' != c) {
+            status = -1;
+        }
+        break;
+    case HTTP_RESP_TRAILER_START:
+        if ('\n' == c) {
+            _http_resp_complete(parser);
+            status = 1;
+        } else if ('\r' != c) {
+            parser->state = HTTP_RESP_TRAILER_SKIP;
+        }
+        break;
+    case HTTP_RESP_TRAILER_SKIP:
+        if ('\n' == c) {
+            parser->state = HTTP_RESP_TRAILER_START;
+        }
+        break;
+    default:
+        status = -1;
+    }
+
+    return status;
+}
+
+ICACHE_FLASH_ATTR
+void http_response_parser_init(struct http_response_parser *parser, http_body_func_t on_body,
+        http_response_func_t on_response, void *arg)
+{
+    parser->on_body = on_body;
+    parser->on_response = on_response;
+    parser->arg = arg;
+
+    _http_resp_start(parser);
+}
+
+ICACHE_FLASH_ATTR
+void http_response_parser_reset(struct http_response_parser *parser)
+{
+    _http_resp_start(parser);
+}
+
+ICACHE_FLASH_ATTR
+int http_response_parse(struct http_response_parser *parser, const char *data, size_t len)
+{
+    size_t used = 0;
+
+    while (used < len) {
+        size_t nr = len - used;
+        int status = 0;
+
+        switch (parser->state) {
+        case HTTP_RESP_BODY:
+        case HTTP_RESP_CHUNK_DATA:
+            if (nr > parser->remaining) {
+                nr = parser->remaining;
+            }
+
+            parser->remaining -= nr;
+            if (NULL != parser->on_body) {
+                parser->on_body(parser->arg, data + used, nr);
+            }
+            used += nr;
+
+            if (0 != parser->remaining) {
+                break;
+            }
+
+            if (HTTP_RESP_BODY == parser->state) {
+                _http_resp_complete(parser);
+                return used;
+            }
+
+            parser->state = HTTP_RESP_CHUNK_DATA_END;
+            break;
+        case HTTP_RESP_BODY_UNTIL_CLOSE:
+            if (NULL != parser->on_body) {
+                parser->on_body(parser->arg, data + used, nr);
+            }
+            used += nr;
+            break;
+        default:
+            if (0 > (status = _http_resp_byte(parser, data[used++]))) {
+                return -1;
+            } else if (0 != status) {
+                return used;
+            }
+        }
+    }
+
+    return used;
+}
+
+ICACHE_FLASH_ATTR
+bool http_response_parser_eof(struct http_response_parser *parser)
+{
+    if (HTTP_RESP_BODY_UNTIL_CLOSE != parser->state) {
+        _http_resp_start(parser);
+        return false;
+    }
+
+    _http_resp_complete(parser);
+
+    return true;
+}
+
+static ICACHE_FLASH_ATTR
+int _http_hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+
+    return -1;
+}
+
+/**
+ * Decode a form field in place: + is a space, and %XX the byte XX.
+ */
+static ICACHE_FLASH_ATTR
+int _http_form_decode(char *field)
+{
+    char *out = field;
+
+    for (char *in = field; '\0' != *in; in++) {
+        if ('+' == *in) {
+            *out++ = ' ';
+        } else if ('%' == *in) {
+            int hi = _http_hex_digit(in[1]),
+                lo = -1 != hi ? _http_hex_digit(in[2]) : -1;
+
+            if (-1 == lo || (0 == hi && 0 == lo)) {
+                return -1;
+            }
+
+            *out++ = (hi << 4) | lo;
+            in += 2;
+        } else {
+            *out++ = *in;
+        }
+    }
+
+    *out = '\0';
+
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+int http_form_next(char **body, char **name, char **value)
+{
+    char *p = *body;
+
+    /* Empty pairs, as in a&&b, are nothing */
+    while ('&' == *p) {
+        p++;
+    }
+
+    if ('\0' == *p) {
+        *body = p;
+        return 1;
+    }
+
+    *name = p;
+    *value = NULL;
+
+    for (; '\0' != *p && '&' != *p; p++) {
+        if ('=' == *p && NULL == *value) {
+            *p = '\0';
+            *value = p + 1;
+        }
+    }
+
+    /* No =, so the value is the empty string at the end of the name */
+    if (NULL == *value) {
+        *value = p;
+    }
+
+    if ('&' == *p) {
+        *p++ = '\0';
+    }
+
+    *body = p;
+
+    return 0 == _http_form_decode(*name) && 0 == _http_form_decode(*value) ? 0 : -1;
+}
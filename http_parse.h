@@ -0,0 +1,122 @@
+#pragma once
+
+/** \file http_parse.h HTTP/1.1 parsing shared by the client and the server
+ * Both ends read the protocol as it arrives, so nothing needs reassembling however the stream is
+ * split. Requests are read a line at a time into a small line buffer. Responses go through a push
+ * parser that keeps no buffer at all, just a few bytes of state, and hands the body on in slices
+ * as it arrives.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum http_method {
+    HTTP_METHOD_GET,
+    HTTP_METHOD_POST,
+    HTTP_METHOD_PUT,
+    HTTP_METHOD_DELETE,
+};
+
+/**
+ * Add a received byte to the line being gathered in line, which holds size bytes. Lines too long
+ * for it are truncated, which is harmless for the headers we care about.
+ *
+ * \return true once the line is complete: its CR LF stripped, and NUL terminated. Start the next
+ *         line by setting line_len back to 0.
+ */
+bool http_line_add(char *line, uint16_t *line_len, size_t size, char c);
+
+/**
+ * Case-insensitive check that a header line is for the given (lower case) header name.
+ *
+ * \return The header value, with leading whitespace stripped, or NULL if the name does not match.
+ */
+const char *http_header_value(const char *line, const char *name);
+
+/**
+ * Parse the decimal number at the start of value, such as a Content-Length.
+ *
+ * \return 0 on success, -1 if there is no number there or it doesn't fit.
+ */
+int http_parse_decimal(const char *value, uint32_t *number);
+
+/**
+ * Split a request line in place into its method and resource, and check the version.
+ *
+ * \return 0 on success, -1 if the line is malformed or the method is not one we know.
+ */
+int http_parse_request_line(char *line, enum http_method *method, char **resource);
+
+/**
+ * Take the next name=value pair off an application/x-www-form-urlencoded body, in place: the pair
+ * is split off at the &, and the name and value NUL terminated and decoded. A pair with no = gets
+ * an empty value. body is advanced past the pair.
+ *
+ * \return 0 on success, 1 once there are no more pairs, -1 if a %-escape is malformed.
+ */
+int http_form_next(char **body, char **name, char **value);
+
+/**
+ * Called with each slice of a response body, as it arrives. Chunked bodies arrive without their
+ * framing.
+ */
+typedef void (*http_body_func_t)(void *arg, const char *data, size_t len);
+
+/**
+ * Called once a response is complete, after the last of its body. keep_alive is false if the
+ * connection can't carry another response, and should be closed.
+ */
+typedef void (*http_response_func_t)(void *arg, unsigned status, bool keep_alive);
+
+/**
+ * Push parser for a stream of HTTP/1.1 responses. Handles the status line, Content-Length and
+ * chunked bodies, bodies delimited by the connection closing, interim 1xx responses and the
+ * keep-alive rules for 1.0 and 1.1. Only the headers that frame the body are looked at; the rest
+ * are skipped. Responses to HEAD requests aren't told apart, so don't send any.
+ */
+struct http_response_parser {
+    http_body_func_t on_body;
+    http_response_func_t on_response;
+    void *arg;
+
+    /**
+     * Private
+     */
+    uint32_t remaining;
+    uint16_t status;
+    uint8_t state;
+    uint8_t flags;
+    uint8_t header;
+    uint8_t match;
+    uint8_t pos;
+};
+
+/**
+ * Set up a response parser. on_body may be NULL if the body is of no interest.
+ */
+void http_response_parser_init(struct http_response_parser *parser, http_body_func_t on_body,
+        http_response_func_t on_response, void *arg);
+
+/**
+ * Start over, expecting a new response. For a new connection, or after an error.
+ */
+void http_response_parser_reset(struct http_response_parser *parser);
+
+/**
+ * Feed the next bytes of the stream through the parser, calling back with the body and the end of
+ * the response as they are found. Parsing stops at the end of each response, so the caller can
+ * check there is a request for the next one; feed the rest in again to carry on.
+ *
+ * \return Number of bytes consumed, which is short of len only if a response ended part way
+ *         through, or -1 if the stream is malformed. The parser must be reset after an error.
+ */
+int http_response_parse(struct http_response_parser *parser, const char *data, size_t len);
+
+/**
+ * The connection has closed. Completes a response whose body runs until the connection closes.
+ *
+ * \return true if that completed a response, false if there was none in progress, or the one in
+ *         progress was cut off.
+ */
+bool http_response_parser_eof(struct http_response_parser *parser);
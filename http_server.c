@@ -0,0 +1,341 @@
+/** \file http_server.c Small HTTP server
+ */
+
+#include "http_server.h"
+#include "prof.h"
+
+#include <stddef.h>
+
+#define BL_CONTAINER_OF(pointer, type, member) \
+        ({ const __typeof__( ((type *)0)->member ) *__memb = (pointer); \
+                (type *)( (char *)__memb - offsetof(type, member) ); })
+
+static ICACHE_FLASH_ATTR
+const char *_http_server_reason(unsigned status)
+{
+    switch (status) {
+    case 200:
+        return "OK";
+    case 400:
+        return "Bad Request";
+    case 403:
+        return "Forbidden";
+    case 404:
+        return "Not Found";
+    case 405:
+        return "Method Not Allowed";
+    case 411:
+        return "Length Required";
+    case 413:
+        return "Payload Too Large";
+    case 500:
+        return "Internal Server Error";
+    default:
+        return "Error";
+    }
+}
+
+/**
+ * Fill the send buffer with whatever comes next: the headers, then as much of the body as fits.
+ *
+ * \return Number of bytes in the buffer; 0 once the response is over.
+ */
+static ICACHE_FLASH_ATTR
+size_t _http_server_fill(struct http_server_conn *conn)
+{
+    char *buf = (char *)conn->tx;
+    size_t len = 0;
+
+    if (false == conn->headers_sent) {
+        len = os_sprintf(buf, "HTTP/1.1 %u %s\r\nContent-Type: %s\r\nConnection: close\r\n\r\n",
+                conn->status, _http_server_reason(conn->status),
+                NULL != conn->resource ? conn->resource->content_type : "text/plain");
+        conn->headers_sent = true;
+
+        if (NULL == conn->resource) {
+            len += os_sprintf(buf + len, "%u %s\n", conn->status, _http_server_reason(conn->status));
+            return len;
+        }
+    }
+
+    if (NULL == conn->resource) {
+        return len;
+    }
+
+    /* The render function stops when the next piece won't fit, or when it has no more */
+    for (;;) {
+        size_t nr = conn->resource->render(&conn->cursor, buf + len, sizeof(conn->tx) - len);
+
+        if (0 == nr) {
+            break;
+        }
+
+        len += nr;
+    }
+
+    return len;
+}
+
+/**
+ * Send the next buffer of the response, or close the connection if it is all out.
+ */
+static ICACHE_FLASH_ATTR
+void _http_server_kick(struct http_server_conn *conn)
+{
+    size_t len = 0;
+
+    if (HTTP_SERVER_CONN_RESPONSE != conn->state || true == conn->sending) {
+        return;
+    }
+
+    PROF_START(http_server_render);
+    len = _http_server_fill(conn);
+    PROF_END(http_server_render);
+
+    if (0 == len) {
+        conn->state = HTTP_SERVER_CONN_CLOSING;
+        hal_tcp_disconnect(&conn->tcp);
+        return;
+    }
+
+    if (0 != hal_tcp_send(&conn->tcp, conn->tx, len)) {
+        conn->state = HTTP_SERVER_CONN_CLOSING;
+        hal_tcp_disconnect(&conn->tcp);
+        return;
+    }
+
+    conn->sending = true;
+}
+
+/**
+ * The request is in; work out the response and start sending it.
+ */
+static ICACHE_FLASH_ATTR
+void _http_server_respond(struct http_server_conn *conn, unsigned status,
+        const struct http_server_resource *resource)
+{
+    conn->state = HTTP_SERVER_CONN_RESPONSE;
+    conn->status = status;
+    conn->resource = resource;
+    conn->cursor = 0;
+    conn->headers_sent = false;
+
+    if (200 == status) {
+        conn->server->nr_served++;
+    } else {
+        conn->server->nr_errors++;
+    }
+
+    _http_server_kick(conn);
+}
+
+/**
+ * A complete request line: find what it asks for. The response waits for the end of the headers.
+ *
+ * \return 0 on success, or the status to answer with.
+ */
+static ICACHE_FLASH_ATTR
+unsigned _http_server_route(struct http_server_conn *conn)
+{
+    char *path = NULL,
+         *query = NULL;
+
+    if (0 != http_parse_request_line(conn->line, &conn->method, &path)) {
+        return 400;
+    }
+
+    /* Queries mean nothing to any of our resources */
+    query = path;
+    while ('\0' != *query && '?' != *query) {
+        query++;
+    }
+    *query = '\0';
+
+    for (conn->resource = conn->server->resources; NULL != conn->resource;
+            conn->resource = conn->resource->next)
+    {
+        if (0 == os_strcmp(conn->resource->path, path)) {
+            break;
+        }
+    }
+
+    if (NULL == conn->resource) {
+        return 404;
+    }
+
+    if (HTTP_METHOD_GET != conn->method &&
+            (HTTP_METHOD_POST != conn->method || NULL == conn->resource->post))
+    {
+        conn->resource = NULL;
+        return 405;
+    }
+
+    return 0;
+}
+
+/**
+ * The whole of a POST body is in the send buffer. Hand it over, and answer as the resource says.
+ */
+static ICACHE_FLASH_ATTR
+void _http_server_post(struct http_server_conn *conn)
+{
+    char *body = (char *)conn->tx;
+    unsigned status = 0;
+
+    body[conn->body_len] = '\0';
+
+    PROF_START(http_server_post);
+    status = conn->resource->post(body, conn->body_len);
+    PROF_END(http_server_post);
+
+    _http_server_respond(conn, status, 200 == status ? conn->resource : NULL);
+}
+
+/**
+ * End of the headers. A GET is answered straight away; a POST first needs its body.
+ */
+static ICACHE_FLASH_ATTR
+void _http_server_headers_done(struct http_server_conn *conn)
+{
+    if (HTTP_METHOD_POST != conn->method) {
+        _http_server_respond(conn, 200, conn->resource);
+        return;
+    }
+
+    if (false == conn->have_length) {
+        _http_server_respond(conn, 411, NULL);
+        return;
+    }
+
+    /* Room is kept for a NUL */
+    if (conn->content_length >= sizeof(conn->tx)) {
+        _http_server_respond(conn, 413, NULL);
+        return;
+    }
+
+    conn->state = HTTP_SERVER_CONN_BODY;
+    conn->body_len = 0;
+
+    if (0 == conn->content_length) {
+        _http_server_post(conn);
+    }
+}
+
+static ICACHE_FLASH_ATTR
+void _http_server_on_recv_cb(struct hal_tcp *tcp, char *data, unsigned short len)
+{
+    struct http_server_conn *conn = BL_CONTAINER_OF(tcp, struct http_server_conn, tcp);
+
+    for (unsigned short i = 0; i < len; i++) {
+        const char *value = NULL;
+        unsigned status = 0;
+
+        if (HTTP_SERVER_CONN_BODY == conn->state) {
+            /* Anything past the body is ignored, as is anything after the request */
+            ((char *)conn->tx)[conn->body_len++] = data[i];
+            if (conn->body_len == conn->content_length) {
+                _http_server_post(conn);
+            }
+            continue;
+        }
+
+        if (HTTP_SERVER_CONN_REQUEST != conn->state) {
+            break;
+        }
+
+        if (false == http_line_add(conn->line, &conn->line_len, sizeof(conn->line), data[i])) {
+            continue;
+        }
+
+        if (false == conn->have_request_line) {
+            conn->have_request_line = true;
+            if (0 != (status = _http_server_route(conn))) {
+                _http_server_respond(conn, status, NULL);
+            }
+        } else if (0 == conn->line_len) {
+            /* End of the headers; only the length of a POST body changes anything we do */
+            _http_server_headers_done(conn);
+        } else if (NULL != (value = http_header_value(conn->line, "content-length"))) {
+            if (0 != http_parse_decimal(value, &conn->content_length)) {
+                _http_server_respond(conn, 400, NULL);
+            }
+            conn->have_length = true;
+        }
+
+        conn->line_len = 0;
+    }
+}
+
+static ICACHE_FLASH_ATTR
+void _http_server_on_sent_cb(struct hal_tcp *tcp)
+{
+    struct http_server_conn *conn = BL_CONTAINER_OF(tcp, struct http_server_conn, tcp);
+
+    conn->sending = false;
+    _http_server_kick(conn);
+}
+
+static ICACHE_FLASH_ATTR
+void _http_server_on_disconnect_cb(struct hal_tcp *tcp)
+{
+    struct http_server_conn *conn = BL_CONTAINER_OF(tcp, struct http_server_conn, tcp);
+
+    conn->state = HTTP_SERVER_CONN_FREE;
+}
+
+static ICACHE_FLASH_ATTR
+void _http_server_on_error_cb(struct hal_tcp *tcp, int err)
+{
+    struct http_server_conn *conn = BL_CONTAINER_OF(tcp, struct http_server_conn, tcp);
+
+    conn->state = HTTP_SERVER_CONN_FREE;
+}
+
+static ICACHE_FLASH_ATTR
+struct hal_tcp *_http_server_on_accept(struct hal_tcp_listener *listener)
+{
+    struct http_server *server = BL_CONTAINER_OF(listener, struct http_server, listener);
+    struct http_server_conn *conn = NULL;
+
+    for (unsigned i = 0; i < HTTP_SERVER_MAX_CONNS; i++) {
+        if (HTTP_SERVER_CONN_FREE == server->conns[i].state) {
+            conn = &server->conns[i];
+            break;
+        }
+    }
+
+    if (NULL == conn) {
+        server->nr_refused++;
+        return NULL;
+    }
+
+    os_memset(conn, 0, sizeof(*conn));
+    conn->server = server;
+    conn->state = HTTP_SERVER_CONN_REQUEST;
+
+    conn->tcp.on_disconnect = _http_server_on_disconnect_cb;
+    conn->tcp.on_error = _http_server_on_error_cb;
+    conn->tcp.on_sent = _http_server_on_sent_cb;
+    conn->tcp.on_recv = _http_server_on_recv_cb;
+
+    return &conn->tcp;
+}
+
+ICACHE_FLASH_ATTR
+int http_server_start(struct http_server *server, uint16_t port)
+{
+    for (unsigned i = 0; i < HTTP_SERVER_MAX_CONNS; i++) {
+        server->conns[i].state = HTTP_SERVER_CONN_FREE;
+    }
+
+    server->listener.on_accept = _http_server_on_accept;
+
+    return hal_tcp_listen(&server->listener, port, HTTP_SERVER_MAX_CONNS, HTTP_SERVER_TIMEOUT_S);
+}
+
+ICACHE_FLASH_ATTR
+void http_server_add_resource(struct http_server *server, struct http_server_resource *resource)
+{
+    resource->next = server->resources;
+    server->resources = resource;
+}
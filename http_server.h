@@ -0,0 +1,140 @@
+#pragma once
+
+/** \file http_server.h Small HTTP server
+ * Serves GET requests for a fixed set of resources, one request per connection, and POST requests
+ * to those that take them. Each resource has a render function that writes its body straight into the connection's send buffer, a
+ * buffer at a time, so a response can be much longer than the buffer and is never built up
+ * anywhere else first. Responses carry no Content-Length; the connection is closed at the end of
+ * the body instead.
+ *
+ * A POST body is gathered into the send buffer, so it has to fit there, and handed to the
+ * resource's post function whole. The response is then rendered as for a GET.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hal.h"
+#include "http_parse.h"
+
+/**
+ * Connections served at once. More are turned away.
+ */
+#define HTTP_SERVER_MAX_CONNS           2
+
+/**
+ * Longest request or header line kept. The request line has to fit for the resource to be found.
+ */
+#define HTTP_SERVER_LINE_LEN            64
+
+/**
+ * Send buffer per connection, which bounds the longest single piece a render function can write
+ */
+#define HTTP_SERVER_TX_LEN              512
+
+/**
+ * Connections left idle this long are closed
+ */
+#define HTTP_SERVER_TIMEOUT_S           10
+
+/**
+ * Write the next part of a response body into buf, which has room for len bytes. cursor is 0 at
+ * the start of each response, and is the render function's to keep its place with between calls.
+ * A piece that doesn't fit should be left for the next call, which will have an empty buffer.
+ *
+ * \return Number of bytes written. 0 into an empty buffer ends the body.
+ */
+typedef size_t (*http_server_render_func_t)(uint32_t *cursor, char *buf, size_t len);
+
+/**
+ * Take a POST body, len bytes, NUL terminated. The body is the function's to modify in place.
+ *
+ * \return The status to answer with. A 200 is followed by the resource's body, anything else just
+ *         by the status.
+ */
+typedef unsigned (*http_server_post_func_t)(char *body, size_t len);
+
+struct http_server_resource {
+    const char *path;
+    const char *content_type;
+    http_server_render_func_t render;
+
+    /**
+     * NULL if the resource can only be fetched
+     */
+    http_server_post_func_t post;
+
+    /**
+     * Private
+     */
+    struct http_server_resource *next;
+};
+
+enum http_server_conn_state {
+    HTTP_SERVER_CONN_FREE = 0,
+    HTTP_SERVER_CONN_REQUEST,
+    HTTP_SERVER_CONN_BODY,
+    HTTP_SERVER_CONN_RESPONSE,
+    HTTP_SERVER_CONN_CLOSING,
+};
+
+struct http_server;
+
+struct http_server_conn {
+    struct hal_tcp tcp;
+    struct http_server *server;
+    enum http_server_conn_state state;
+
+    /**
+     * Request parser: the line being gathered, and whether the request line has been seen
+     */
+    bool have_request_line;
+    uint16_t line_len;
+    char line[HTTP_SERVER_LINE_LEN];
+
+    /**
+     * The request's method, and for a POST, how long its body is and how much of it is in
+     */
+    enum http_method method;
+    bool have_length;
+    uint32_t content_length;
+    uint32_t body_len;
+
+    /**
+     * The response: its status, the resource rendering its body (NULL for an error), and where
+     * the render function is up to
+     */
+    unsigned status;
+    const struct http_server_resource *resource;
+    uint32_t cursor;
+    bool headers_sent;
+    bool sending;
+
+    uint32_t tx[HTTP_SERVER_TX_LEN / 4];
+};
+
+struct http_server {
+    struct hal_tcp_listener listener;
+    struct http_server_conn conns[HTTP_SERVER_MAX_CONNS];
+    struct http_server_resource *resources;
+
+    /**
+     * Requests answered, by outcome, and connections turned away for want of a free slot
+     */
+    uint32_t nr_served;
+    uint32_t nr_errors;
+    uint32_t nr_refused;
+};
+
+/**
+ * Start listening on the given port.
+ *
+ * \return 0 on success, -1 if the port could not be listened on.
+ */
+int http_server_start(struct http_server *server, uint16_t port);
+
+/**
+ * Serve a resource. The resource is not copied, so it must stay around.
+ */
+void http_server_add_resource(struct http_server *server, struct http_server_resource *resource);
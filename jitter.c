@@ -0,0 +1,85 @@
+/** \file jitter.c Timing jitter histograms
+ */
+
+#include "jitter.h"
+
+#include "hal.h"
+
+ICACHE_FLASH_ATTR
+void jitter_init(struct jitter_hist *hist, const char *name)
+{
+    hist->name = name;
+    jitter_reset(hist);
+}
+
+ICACHE_FLASH_ATTR
+void jitter_record(struct jitter_hist *hist, uint32_t intended_us, uint32_t actual_us)
+{
+    int32_t late = (int32_t)(actual_us - intended_us);
+    uint32_t mag = late < 0 ? -late : late;
+    unsigned bin = 0;
+
+    while (bin < JITTER_NR_BINS - 1 && mag >= (JITTER_BIN0_US << bin)) {
+        bin++;
+    }
+
+    if (0 == hist->count || late < hist->min_us) {
+        hist->min_us = late;
+    }
+
+    if (0 == hist->count || late > hist->max_us) {
+        hist->max_us = late;
+    }
+
+    if (late < 0) {
+        hist->early++;
+    }
+
+    hist->bins[bin]++;
+    hist->count++;
+}
+
+ICACHE_FLASH_ATTR
+void jitter_report(const struct jitter_hist *hist)
+{
+    os_printf("JITTER: %s: %u events, %d to %d us, %u early, %u missed\r\n", hist->name, hist->count,
+            hist->min_us, hist->max_us, hist->early, hist->missed);
+
+    for (unsigned i = 0; i < JITTER_NR_BINS; i++) {
+        if (0 == hist->bins[i]) {
+            continue;
+        }
+
+        if (JITTER_NR_BINS - 1 == i) {
+            os_printf("JITTER: %s:   >= %u us: %u\r\n", hist->name, JITTER_BIN0_US << (i - 1), hist->bins[i]);
+        } else {
+            os_printf("JITTER: %s:   < %u us: %u\r\n", hist->name, JITTER_BIN0_US << i, hist->bins[i]);
+        }
+    }
+}
+
+ICACHE_FLASH_ATTR
+int jitter_format_json(const struct jitter_hist *hist, char *buf)
+{
+    char *p = buf;
+
+    p += os_sprintf(p, "{\"count\":%u,\"early\":%u,\"missed\":%u,\"min_us\":%d,\"max_us\":%d,"
+            "\"bin0_us\":%u,\"bins\":[", hist->count, hist->early, hist->missed, hist->min_us,
+            hist->max_us, JITTER_BIN0_US);
+
+    for (unsigned i = 0; i < JITTER_NR_BINS; i++) {
+        p += os_sprintf(p, "%s%u", 0 == i ? "" : ",", hist->bins[i]);
+    }
+
+    p += os_sprintf(p, "]}");
+
+    return p - buf;
+}
+
+ICACHE_FLASH_ATTR
+void jitter_reset(struct jitter_hist *hist)
+{
+    hist->count = hist->early = hist->missed = 0;
+    hist->min_us = hist->max_us = 0;
+    os_memset(hist->bins, 0, sizeof(hist->bins));
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+/** \file jitter.h Timing jitter histograms
+ * Records how late something happened against when it was meant to, in power of two bins:
+ * bin 0 counts anything within JITTER_BIN0_US, and each bin after it twice the width of the one
+ * before, with the last bin catching everything beyond. Events that came early are binned by how
+ * early they were, and counted separately as well.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define JITTER_NR_BINS              16
+#define JITTER_BIN0_US              16
+
+/**
+ * Longest output of jitter_format_json()
+ */
+#define JITTER_JSON_MAX             (128 + JITTER_NR_BINS * 11)
+
+struct jitter_hist {
+    /**
+     * Name, for reports
+     */
+    const char *name;
+
+    uint32_t count;
+
+    /**
+     * Events that came before they were due
+     */
+    uint32_t early;
+
+    /**
+     * Events that didn't happen at all, because an earlier one ran a whole period late
+     */
+    uint32_t missed;
+
+    int32_t min_us;
+    int32_t max_us;
+
+    uint32_t bins[JITTER_NR_BINS];
+};
+
+void jitter_init(struct jitter_hist *hist, const char *name);
+
+/**
+ * Record an event that was due at intended_us and happened at actual_us, both hal_time_us() values.
+ */
+void jitter_record(struct jitter_hist *hist, uint32_t intended_us, uint32_t actual_us);
+
+/**
+ * Print the histogram to the UART.
+ */
+void jitter_report(const struct jitter_hist *hist);
+
+/**
+ * Render the histogram as a JSON object into buf, which must have room for JITTER_JSON_MAX bytes.
+ *
+ * \return Length of the JSON, excluding the terminator.
+ */
+int jitter_format_json(const struct jitter_hist *hist, char *buf);
+
+/**
+ * Start the next interval.
+ */
+void jitter_reset(struct jitter_hist *hist);
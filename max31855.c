@@ -1,10 +1,8 @@
 #include "max31855.h"
 
-#include <driver/spi_interface.h>
-
-#include <c99_fixups.h>
-#include <gpio.h>
-#include <osapi.h>
+#include "hal.h"
+#include "prof.h"
+#include "spi_queue.h"
 
 #define MAX31855_OC_BIT             (1ul << 0)
 #define MAX31855_SCG_BIT            (1ul << 1)
@@ -14,70 +12,55 @@
 #define MAX31855_FAULT_BIT          (1ul << 16)
 #define MAX31855_THERMO_TEMP(x)     (((x) >> 18) & 0x3fff)
 
+/* Fraction bits of the exponential average's state */
+#define MAX31855_EMA_FRAC_BITS      16
+#define MAX31855_EMA_MAX_SHIFT      12
 
-static ICACHE_FLASH_ATTR
-uint32_t _max31855_spi_read(struct max31855_dev *dev)
-{
-    SpiData data_rx;
-    uint32_t v = 0;
-
-    data_rx.cmd = MASTER_READ_DATA_FROM_SLAVE_CMD;
-    data_rx.cmdLen = 0;
-    data_rx.addr = NULL;
-    data_rx.addrLen = 0;
-    data_rx.data = (void *)&v;
-    data_rx.dataLen = 4;
-
-    /* Assert the chip select for the MAX31855 */
-    gpio_output_set(0, (1 << dev->cs_gpio), 0, 0);
-
-    /* Receive 32 bits from the interface */
-    if (0 > SPIMasterRecvData(dev->spi_bus, &data_rx)) {
-        os_printf("MAX31855: Failed to receive %u bytes.\r\n", data_rx.dataLen);
-    }
-
-    /* De-sert the GPIO */
-    gpio_output_set((1 << dev->cs_gpio), 0, 0, 0);
-
-    v = __builtin_bswap32(v);
-
-    return v;
-}
 
 ICACHE_FLASH_ATTR
-int max31855_init(struct max31855_dev *dev, unsigned spi_bus, unsigned csn_gpio)
+int max31855_init(struct max31855_dev *dev, unsigned spi_bus, unsigned cs)
 {
     int status = MAX31855_OK;
 
     memset(dev, 0, sizeof(*dev));
 
-    if (spi_bus > SpiNum_HSPI) {
-        os_printf("MAX31855: Error: SPI bus must be SpiNum_HSPI or SpiNum_SPI.\r\n");
+    if (spi_bus != HAL_SPI_HSPI) {
+        os_printf("MAX31855: Error: SPI bus must be HAL_SPI_HSPI.\r\n");
         status = MAX31855_BAD_ARGS;
         goto done;
     }
 
-    if (csn_gpio > 15) {
+    if (true == SPI_CS_IS_EXPANDER(cs)) {
+        if (SPI_CS_EXPANDER_LINE(cs) >= SPI_CS_EXPANDER_NR_LINES) {
+            os_printf("MAX31855: Error: CS expander line %u does not exist\r\n", SPI_CS_EXPANDER_LINE(cs));
+            status = MAX31855_BAD_ARGS;
+            goto done;
+        }
+    } else if (cs > 15) {
         os_printf("MAX31855: Error: CSN GPIO must be less than or equal to 15\r\n");
         status = MAX31855_BAD_ARGS;
         goto done;
     }
 
     dev->spi_bus = spi_bus;
-    dev->cs_gpio = csn_gpio;
+    dev->cs = cs;
     dev->flags = MAX31855_FLAG_NO_PROBE;
 
+    dev->filter.type = MAX31855_DEFAULT_FILTER;
+    dev->filter.len = MAX31855_DEFAULT_FILTER_LEN;
+    dev->filter.shift = MAX31855_DEFAULT_EMA_SHIFT;
+
 done:
     return status;
 }
 
-ICACHE_FLASH_ATTR
-int max31855_read(struct max31855_dev *dev)
+/**
+ * Decode the raw 32-bit word from the MAX31855 into the device state.
+ */
+static ICACHE_FLASH_ATTR
+int _max31855_decode(struct max31855_dev *dev, uint32_t v)
 {
     int status = MAX31855_OK;
-    uint32_t v = 0;
-
-    v = _max31855_spi_read(dev);
 
     dev->flags = 0;
 
@@ -102,3 +85,171 @@ int max31855_read(struct max31855_dev *dev)
     return status;
 }
 
+/**
+ * Run a good reading through the filter. Returns the filter output, with
+ * MAX31855_FILTER_FRAC_BITS fraction bits.
+ */
+static ICACHE_FLASH_ATTR
+int32_t _max31855_filter(struct max31855_dev *dev, int16_t temp)
+{
+    int32_t out = (int32_t)temp << MAX31855_FILTER_FRAC_BITS;
+
+    switch (dev->filter.type) {
+    case MAX31855_FILTER_MOVING_AVERAGE:
+        if (dev->ma_count == dev->filter.len) {
+            dev->ma_sum -= dev->ma_window[dev->ma_next];
+        } else {
+            dev->ma_count++;
+        }
+
+        dev->ma_window[dev->ma_next] = temp;
+        dev->ma_sum += temp;
+        dev->ma_next = (dev->ma_next + 1) % dev->filter.len;
+
+        /* Round to nearest, away from zero on ties */
+        out = dev->ma_sum << MAX31855_FILTER_FRAC_BITS;
+        out = (out + (out < 0 ? -(dev->ma_count / 2) : dev->ma_count / 2)) / dev->ma_count;
+        break;
+    case MAX31855_FILTER_EXPONENTIAL:
+        if (false == dev->filter_primed) {
+            dev->ema = (int32_t)temp << MAX31855_EMA_FRAC_BITS;
+            dev->filter_primed = true;
+        } else {
+            dev->ema += (((int32_t)temp << MAX31855_EMA_FRAC_BITS) - dev->ema) >> dev->filter.shift;
+        }
+
+        out = (dev->ema + (1 << (MAX31855_EMA_FRAC_BITS - MAX31855_FILTER_FRAC_BITS - 1))) >>
+            (MAX31855_EMA_FRAC_BITS - MAX31855_FILTER_FRAC_BITS);
+        break;
+    default:
+        break;
+    }
+
+    return out;
+}
+
+/**
+ * Account a reading in the interval in progress.
+ */
+static ICACHE_FLASH_ATTR
+void _max31855_accumulate(struct max31855_dev *dev, int status)
+{
+    int16_t temp;
+    int32_t delta;
+
+    if (MAX31855_OK != status) {
+        dev->acc_faults++;
+        return;
+    }
+
+    temp = (int16_t)(dev->probe_temp << 2) >> 2;
+
+    dev->filter_out = _max31855_filter(dev, temp);
+
+    if (0 == dev->acc_samples) {
+        dev->acc_ref = dev->acc_min = dev->acc_max = temp;
+        dev->acc_sum = 0;
+        dev->acc_sum_sq = 0;
+    } else if (temp < dev->acc_min) {
+        dev->acc_min = temp;
+    } else if (temp > dev->acc_max) {
+        dev->acc_max = temp;
+    }
+
+    delta = temp - dev->acc_ref;
+    dev->acc_sum += delta;
+    dev->acc_sum_sq += (uint64_t)(delta * delta);
+    dev->acc_samples++;
+}
+
+ICACHE_FLASH_ATTR
+void max31855_end_interval(struct max31855_dev *dev)
+{
+    struct max31855_interval *iv = &dev->interval;
+    uint32_t n = dev->acc_samples;
+
+    iv->nr_samples = n;
+    iv->nr_faults = dev->acc_faults;
+    iv->min = dev->acc_min;
+    iv->max = dev->acc_max;
+    iv->filtered = dev->filter_out;
+    iv->variance = 0;
+
+    if (n > 1) {
+        /* n^2 var = n sum(d^2) - sum(d)^2, all in integers */
+        uint64_t num = n * dev->acc_sum_sq - (uint64_t)((int64_t)dev->acc_sum * dev->acc_sum);
+        iv->variance = (uint32_t)((num << MAX31855_FILTER_FRAC_BITS) / ((uint64_t)n * n));
+    }
+
+    dev->acc_samples = 0;
+    dev->acc_faults = 0;
+}
+
+ICACHE_FLASH_ATTR
+int max31855_set_filter(struct max31855_dev *dev, const struct max31855_filter_config *cfg)
+{
+    if ((MAX31855_FILTER_MOVING_AVERAGE == cfg->type &&
+                (0 == cfg->len || cfg->len > MAX31855_FILTER_MAX_LEN)) ||
+            (MAX31855_FILTER_EXPONENTIAL == cfg->type && cfg->shift > MAX31855_EMA_MAX_SHIFT) ||
+            cfg->type > MAX31855_FILTER_EXPONENTIAL)
+    {
+        os_printf("MAX31855: Error: bad filter settings\r\n");
+        return MAX31855_BAD_ARGS;
+    }
+
+    dev->filter = *cfg;
+    dev->ma_next = dev->ma_count = 0;
+    dev->ma_sum = 0;
+    dev->filter_primed = false;
+
+    return MAX31855_OK;
+}
+
+static ICACHE_FLASH_ATTR
+void _max31855_read_done(struct spi_xfer *xfer, void *arg)
+{
+    struct max31855_dev *dev = arg;
+    int status = _max31855_decode(dev, __builtin_bswap32(dev->raw));
+
+    _max31855_accumulate(dev, status);
+
+    if (NULL != dev->on_read) {
+        dev->on_read(dev, status, dev->on_read_arg);
+    }
+}
+
+ICACHE_FLASH_ATTR
+int max31855_read(struct max31855_dev *dev, max31855_read_func_t on_read, void *arg)
+{
+    struct spi_xfer *xfer = &dev->xfer;
+    int status = MAX31855_OK;
+
+    PROF_START(max31855_read);
+
+    if (spi_xfer_pending(xfer)) {
+        status = MAX31855_BUSY;
+        goto done;
+    }
+
+    dev->on_read = on_read;
+    dev->on_read_arg = arg;
+
+    /* Receive 32 bits from the interface */
+    xfer->tx = NULL;
+    xfer->tx_len = 0;
+    xfer->rx = &dev->raw;
+    xfer->rx_len = 4;
+    xfer->cs = dev->cs;
+    xfer->a0_gpio = SPI_XFER_NO_A0;
+    xfer->done = _max31855_read_done;
+    xfer->arg = dev;
+
+    if (0 != spi_queue_submit(xfer)) {
+        os_printf("MAX31855: Failed to queue read.\r\n");
+        status = MAX31855_BUSY;
+    }
+
+done:
+    PROF_END(max31855_read);
+    return status;
+}
@@ -4,15 +4,90 @@
 #include <stdint.h>
 
 #include "max31855_config.h"
+#include "spi_queue.h"
 
 #define MAX31855_OK                 0x0
 #define MAX31855_PROBE_FAULT        0x1
 #define MAX31855_BAD_ARGS           0x2
+#define MAX31855_BUSY               0x3
 
 #define MAX31855_FLAG_NO_PROBE      0x1
 #define MAX31855_FLAG_SHORT_GND     0x2
 #define MAX31855_FLAG_SHORT_VCC     0x4
 
+/**
+ * Fraction bits the filtered temperature carries beyond the device's quarter degree LSB
+ */
+#define MAX31855_FILTER_FRAC_BITS   4
+
+struct max31855_dev;
+
+enum max31855_filter {
+    /**
+     * Pass readings through unfiltered
+     */
+    MAX31855_FILTER_NONE = 0,
+
+    /**
+     * Mean of the last len readings
+     */
+    MAX31855_FILTER_MOVING_AVERAGE,
+
+    /**
+     * Exponential moving average, with a weight of 1/2^shift on each new reading
+     */
+    MAX31855_FILTER_EXPONENTIAL,
+};
+
+struct max31855_filter_config {
+    enum max31855_filter type;
+
+    /**
+     * Moving average window, at most MAX31855_FILTER_MAX_LEN readings
+     */
+    uint8_t len;
+
+    /**
+     * Exponential moving average weight, as a shift. At most 12.
+     */
+    uint8_t shift;
+};
+
+/**
+ * Summary of the readings over one reporting interval. Temperatures are in the device's quarter
+ * degree units, sign extended, unless noted otherwise.
+ */
+struct max31855_interval {
+    /**
+     * Good readings in the interval, and readings that reported a fault
+     */
+    uint16_t nr_samples;
+    uint16_t nr_faults;
+
+    /**
+     * Extremes of the raw readings
+     */
+    int16_t min;
+    int16_t max;
+
+    /**
+     * Filter output at the end of the interval, with MAX31855_FILTER_FRAC_BITS more fraction bits
+     */
+    int32_t filtered;
+
+    /**
+     * Variance of the raw readings, in quarter degrees squared with MAX31855_FILTER_FRAC_BITS
+     * more fraction bits
+     */
+    uint32_t variance;
+};
+
+/**
+ * Called once a read started by max31855_read() has completed and the device state has been
+ * updated. status is MAX31855_OK or MAX31855_PROBE_FAULT.
+ */
+typedef void (*max31855_read_func_t)(struct max31855_dev *dev, int status, void *arg);
+
 struct max31855_dev {
     /**
      * The SPI Bus ID to use
@@ -20,9 +95,9 @@ struct max31855_dev {
     uint8_t spi_bus;
 
     /**
-     * The GPIO to be used as a chip select
+     * Chip select: a GPIO, or SPI_CS_EXPANDER(line)
      */
-    uint8_t cs_gpio;
+    uint8_t cs;
 
     /**
      * Status flags for the MAX31855
@@ -43,30 +118,107 @@ struct max31855_dev {
      * Internal calibration temperature.
      */
     uint32_t int_temp;
+
+    /**
+     * Raw word received from the device
+     */
+    uint32_t raw;
+
+    /**
+     * Filter settings and state. The moving average keeps its window in a ring, with a running
+     * sum; the exponential average is kept with 16 fraction bits, so small weights don't stall.
+     */
+    struct max31855_filter_config filter;
+    int16_t ma_window[MAX31855_FILTER_MAX_LEN];
+    uint8_t ma_next;
+    uint8_t ma_count;
+    int32_t ma_sum;
+    int32_t ema;
+    int32_t filter_out;
+    bool filter_primed;
+
+    /**
+     * Accumulators for the interval in progress. Sums are taken relative to the interval's first
+     * reading, which keeps the sum of squares small.
+     */
+    uint16_t acc_samples;
+    uint16_t acc_faults;
+    int16_t acc_min;
+    int16_t acc_max;
+    int16_t acc_ref;
+    int32_t acc_sum;
+    uint64_t acc_sum_sq;
+
+    /**
+     * The last completed reporting interval, published by max31855_end_interval()
+     */
+    struct max31855_interval interval;
+
+    /**
+     * The SPI transaction used to read the device
+     */
+    struct spi_xfer xfer;
+
+    /**
+     * Completion callback for the current read, and its argument
+     */
+    max31855_read_func_t on_read;
+    void *on_read_arg;
 };
 
 #define MAX31855_GET_PROBE_TEMP(_dev)       ((_dev)->probe_temp)
 #define MAX31855_GET_INTERNAL_TEMP(_dev)    ((_dev)->internal_temp)
 
+/**
+ * The probe temperature to report, in quarter degrees, sign extended: the filtered value from the
+ * last interval, rounded, or the last reading if that interval had no good readings.
+ */
+static inline
+int16_t max31855_report_temp(const struct max31855_dev *dev)
+{
+    if (0 == dev->interval.nr_samples) {
+        return (int16_t)(dev->probe_temp << 2) >> 2;
+    }
+
+    return (dev->interval.filtered + (1 << (MAX31855_FILTER_FRAC_BITS - 1))) >> MAX31855_FILTER_FRAC_BITS;
+}
+
 /**
  * Initialize a MAX31855 Status structure.
  *
  * \param dev The status structure to be initialized
  * \param spi_bus The SPI bus ID to use
- * \param csn_gpio The GPIO ID for the chip select.
+ * \param cs The chip select: a GPIO ID, or SPI_CS_EXPANDER(line) for a line of the chip select
+ *           expander.
  *
  * \return MAX31855_OK if the values are correct, MAX31855_BAD_ARGS if not.
  */
-int max31855_init(struct max31855_dev *dev, unsigned spi_bus, unsigned csn_gpio);
+int max31855_init(struct max31855_dev *dev, unsigned spi_bus, unsigned cs);
 
 /**
- * Read the temperature from the attached MAX31855. Any parameters you're not interested
- * in can be set to NULL.
+ * Start reading the temperature from the attached MAX31855. The read is queued on the SPI bus
+ * and the device state is updated when it completes.
  *
  * \param dev The MAX31855 device to act on.
+ * \param on_read Function to call once the read has completed, can be NULL.
+ * \param arg Argument to pass to on_read.
+ *
+ * \return MAX31855_OK if the read was queued, MAX31855_BUSY if the previous read has not
+ *         completed yet.
+ */
+int max31855_read(struct max31855_dev *dev, max31855_read_func_t on_read, void *arg);
+
+/**
+ * Change the filter run over the readings. Restarts the filter.
  *
- * \return MAX31855_OK if the values read are correct, MAX31855_PROBE_FAULT if there is an
- *         error with the probe configuration.
+ * \return MAX31855_OK, or MAX31855_BAD_ARGS if the settings are out of range.
+ */
+int max31855_set_filter(struct max31855_dev *dev, const struct max31855_filter_config *cfg);
+
+/**
+ * Close the reporting interval in progress: publish its summary in dev->interval and start the
+ * next. Every good reading from max31855_read() feeds the filter and the interval in progress, so
+ * for oversampling, read at MAX31855_CONVERSION_MS and close an interval at the reporting rate.
  */
-int max31855_read(struct max31855_dev *dev);
+void max31855_end_interval(struct max31855_dev *dev);
 
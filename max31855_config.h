@@ -1,4 +1,31 @@
 #pragma once
 
 #define MAX31855_SPI_CSN            2
-#define MAX31855_SPI_IFACE          SpiNum_HSPI
+#define MAX31855_SPI_IFACE          HAL_SPI_HSPI
+
+/**
+ * Chip select of every probe fitted, in display and telemetry order: a GPIO, or
+ * SPI_CS_EXPANDER(line) for a probe behind the chip select expander (see spi_cs_config.h). At most
+ * TELEMETRY_CODEC_MAX_PROBES. For example, eight probes on a 74HC595:
+ *
+ *     SPI_CS_EXPANDER(0), SPI_CS_EXPANDER(1), ..., SPI_CS_EXPANDER(7)
+ */
+#define MAX31855_PROBE_CS           MAX31855_SPI_CSN
+
+/**
+ * Time the MAX31855 takes for a conversion. Reading the device (driving CS low) aborts a
+ * conversion in progress, so this is as often as it is worth reading.
+ */
+#define MAX31855_CONVERSION_MS      100
+
+/**
+ * Longest moving average window supported
+ */
+#define MAX31855_FILTER_MAX_LEN     16
+
+/**
+ * Filter each probe starts out with; see struct max31855_filter_config.
+ */
+#define MAX31855_DEFAULT_FILTER     MAX31855_FILTER_EXPONENTIAL
+#define MAX31855_DEFAULT_FILTER_LEN 8
+#define MAX31855_DEFAULT_EMA_SHIFT  2
@@ -0,0 +1,60 @@
+/** \file prof.c Hot path profiling
+ */
+
+#include "prof.h"
+
+#ifdef PROF_ENABLE
+
+static
+struct prof_point *_prof_points = NULL;
+
+ICACHE_FLASH_ATTR
+void prof_record(struct prof_point *point, uint32_t cycles)
+{
+    if (false == point->linked) {
+        point->next = _prof_points;
+        _prof_points = point;
+        point->linked = true;
+    }
+
+    if (0 == point->count || cycles < point->min) {
+        point->min = cycles;
+    }
+
+    if (0 == point->count || cycles > point->max) {
+        point->max = cycles;
+    }
+
+    point->total += cycles;
+    point->count++;
+}
+
+ICACHE_FLASH_ATTR
+void prof_report(void)
+{
+    os_printf("PROF: %-28s %8s %10s %8s %8s %8s\r\n", "point", "calls", "avg cyc", "min", "max", "avg us");
+
+    for (struct prof_point *point = _prof_points; NULL != point; point = point->next) {
+        uint32_t avg = 0 != point->count ? (uint32_t)(point->total / point->count) : 0;
+
+        os_printf("PROF: %-28s %8u %10u %8u %8u %8u\r\n", point->name, point->count, avg,
+                point->min, point->max, avg / PROF_CPU_MHZ);
+
+        point->count = point->min = point->max = 0;
+        point->total = 0;
+    }
+}
+
+ICACHE_FLASH_ATTR
+const struct prof_point *prof_get(unsigned index)
+{
+    struct prof_point *point = _prof_points;
+
+    while (NULL != point && 0 != index--) {
+        point = point->next;
+    }
+
+    return point;
+}
+
+#endif /* PROF_ENABLE */
@@ -0,0 +1,75 @@
+#pragma once
+
+/** \file prof.h Hot path profiling
+ * Counts the CPU cycles spent between PROF_START() and PROF_END() at each named probe point:
+ * calls, total, shortest and longest. Each point keeps its counts in a static record of its own,
+ * which joins the table the first time the point is passed, so adding a point is just a matter
+ * of putting the macros in.
+ *
+ *     PROF_START(redraw_display);
+ *     ...
+ *     PROF_END(redraw_display);
+ *
+ * Cycles come from hal_ccount(): CCOUNT on the device, the monotonic clock in the simulator. Not
+ * for use in interrupt context, or across anything that yields to the SDK.
+ *
+ * Unless the build defines PROF_ENABLE (`make PROFILE=1`), the macros and prof_report() compile to
+ * nothing and the points cost neither time nor memory.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "prof_config.h"
+
+#ifdef PROF_ENABLE
+
+#include "hal.h"
+
+struct prof_point {
+    const char *name;
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+
+    /**
+     * Private
+     */
+    bool linked;
+    struct prof_point *next;
+};
+
+/**
+ * Start timing a probe point. Declares the point's record, so each name can only be started once
+ * in a function.
+ */
+#define PROF_START(_name) \
+    static struct prof_point _prof_point_##_name = { .name = #_name }; \
+    uint32_t _prof_start_##_name = hal_ccount()
+
+/**
+ * Stop timing a probe point, and add this pass to its record.
+ */
+#define PROF_END(_name) \
+    prof_record(&_prof_point_##_name, hal_ccount() - _prof_start_##_name)
+
+void prof_record(struct prof_point *point, uint32_t cycles);
+
+/**
+ * Print every probe point to the UART, and start them all over.
+ */
+void prof_report(void);
+
+/**
+ * The index'th probe point to have been passed, or NULL past the last one.
+ */
+const struct prof_point *prof_get(unsigned index);
+
+#else
+
+#define PROF_START(_name)           do { } while (0)
+#define PROF_END(_name)             do { } while (0)
+#define prof_report()               do { } while (0)
+
+#endif /* PROF_ENABLE */
@@ -0,0 +1,12 @@
+#pragma once
+
+/**
+ * How often the profile is printed and started over, as well as whenever the prof command asks.
+ * 0 to print it on command only.
+ */
+#define PROF_REPORT_MS              60000
+
+/**
+ * CPU clock, to turn cycles into microseconds for the report
+ */
+#define PROF_CPU_MHZ                80
@@ -0,0 +1,103 @@
+/** \file rtc_log.c Sample buffer in RTC memory
+ * A RAM copy of the whole image is kept, and written back in full on every change. The image is at
+ * most HAL_RTC_MEM_LEN bytes, which is cheap to write, and writing all of it means the CRC never
+ * has to be patched up piecemeal.
+ */
+
+#include "rtc_log.h"
+
+#include "crc16.h"
+
+#define RTC_LOG_MAGIC               0x43545279ul    /* "yRTC" */
+
+static
+struct rtc_log_image {
+    struct rtc_log_hdr hdr;
+    struct telemetry_sample samples[RTC_LOG_NR_SAMPLES];
+} _rtc_log;
+
+/**
+ * The CRC covers everything after it, up to the last sample in use. The caller makes sure
+ * nr_samples is sane.
+ */
+static ICACHE_FLASH_ATTR
+uint16_t _rtc_log_crc(void)
+{
+    const uint8_t *start = &_rtc_log.hdr.nr_samples;
+    const uint8_t *end = (const uint8_t *)&_rtc_log.samples[_rtc_log.hdr.nr_samples];
+
+    return crc16_ccitt(start, end - start);
+}
+
+static ICACHE_FLASH_ATTR
+int _rtc_log_write(void)
+{
+    _rtc_log.hdr.magic = RTC_LOG_MAGIC;
+    _rtc_log.hdr.crc = _rtc_log_crc();
+
+    if (0 != hal_rtc_mem_write(0, &_rtc_log, sizeof(_rtc_log))) {
+        os_printf("RTCLOG: Failed to write RTC memory\r\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+int rtc_log_init(struct rtc_log_state *state)
+{
+    int status = 0;
+
+    if (0 != hal_rtc_mem_read(0, &_rtc_log, sizeof(_rtc_log)) ||
+            RTC_LOG_MAGIC != _rtc_log.hdr.magic ||
+            _rtc_log.hdr.nr_samples > RTC_LOG_NR_SAMPLES ||
+            _rtc_log.hdr.crc != _rtc_log_crc())
+    {
+        os_memset(&_rtc_log, 0, sizeof(_rtc_log));
+        _rtc_log_write();
+        status = -1;
+    }
+
+    *state = _rtc_log.hdr.state;
+
+    return status;
+}
+
+ICACHE_FLASH_ATTR
+int rtc_log_append(const struct telemetry_sample *sample)
+{
+    if (RTC_LOG_NR_SAMPLES == _rtc_log.hdr.nr_samples) {
+        return -1;
+    }
+
+    _rtc_log.samples[_rtc_log.hdr.nr_samples++] = *sample;
+
+    return _rtc_log_write();
+}
+
+ICACHE_FLASH_ATTR
+unsigned rtc_log_count(void)
+{
+    return _rtc_log.hdr.nr_samples;
+}
+
+ICACHE_FLASH_ATTR
+const struct telemetry_sample *rtc_log_sample(unsigned i)
+{
+    return &_rtc_log.samples[i];
+}
+
+ICACHE_FLASH_ATTR
+void rtc_log_clear(void)
+{
+    _rtc_log.hdr.nr_samples = 0;
+    _rtc_log_write();
+}
+
+ICACHE_FLASH_ATTR
+int rtc_log_save(const struct rtc_log_state *state)
+{
+    _rtc_log.hdr.state = *state;
+
+    return _rtc_log_write();
+}
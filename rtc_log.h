@@ -0,0 +1,91 @@
+#pragma once
+
+/** \file rtc_log.h Sample buffer in RTC memory
+ * Holds the samples taken on wakes from deep sleep while the radio stays off, until a wake with
+ * the radio up hands them to telemetry. RTC memory survives deep sleep and crashes, but not a loss
+ * of power, so the whole image carries a CRC; anything that fails the check at boot is discarded
+ * and the log starts over empty.
+ *
+ * Every change is written straight through to RTC memory, so a sample is safe as soon as
+ * rtc_log_append() returns.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hal.h"
+#include "telemetry.h"
+
+/**
+ * The radio is up on the next wake
+ */
+#define RTC_LOG_FLAG_RADIO          (1ul << 0)
+
+/**
+ * Bookkeeping that has to survive deep sleep along with the samples
+ */
+struct rtc_log_state {
+    /**
+     * Wakes from deep sleep since the log was last reset
+     */
+    uint32_t wakes;
+
+    /**
+     * What the telemetry clock should read when the next wake starts
+     */
+    uint32_t clock_ms;
+
+    /**
+     * RTC_LOG_FLAG_*
+     */
+    uint32_t flags;
+};
+
+struct rtc_log_hdr {
+    uint32_t magic;
+    uint16_t crc;
+    uint8_t nr_samples;
+    uint8_t reserved;
+    struct rtc_log_state state;
+};
+
+#define RTC_LOG_NR_SAMPLES \
+    ((HAL_RTC_MEM_LEN - sizeof(struct rtc_log_hdr)) / sizeof(struct telemetry_sample))
+
+/**
+ * Load the log from RTC memory.
+ *
+ * \param state Returns the state saved before the last deep sleep. Zeroed if the log was reset.
+ *
+ * \return 0 if the log was intact, -1 if it was not (after power-on, say) and has been reset.
+ */
+int rtc_log_init(struct rtc_log_state *state);
+
+/**
+ * Append a sample.
+ *
+ * \return 0 on success, -1 if the log is full or RTC memory could not be written.
+ */
+int rtc_log_append(const struct telemetry_sample *sample);
+
+/**
+ * Number of samples held.
+ */
+unsigned rtc_log_count(void);
+
+/**
+ * The i'th oldest sample held.
+ */
+const struct telemetry_sample *rtc_log_sample(unsigned i);
+
+/**
+ * Discard every sample, once they are delivered or safe elsewhere.
+ */
+void rtc_log_clear(void);
+
+/**
+ * Save the state for the next wake.
+ *
+ * \return 0 on success, -1 if RTC memory could not be written.
+ */
+int rtc_log_save(const struct rtc_log_state *state);
@@ -0,0 +1,308 @@
+/** \file sched.c Cooperative task scheduler
+ * One SDK task does the dispatching: each time it runs it picks the highest priority ready task,
+ * runs it, and posts itself again if anything else is ready. A single one-shot timer is kept armed
+ * for the earliest moment a task becomes ready through the passage of time, either its next tick or
+ * the end of its minimum interval.
+ *
+ * Times are hal_time_us() values, compared by signed difference so they survive it wrapping.
+ */
+
+#include "sched.h"
+
+#include "hal.h"
+
+static
+struct sched_task *_sched_tasks = NULL;
+
+static
+struct hal_timer _sched_timer;
+
+static
+bool _sched_posted = false;
+
+/* IDs tell sched_post_from_isr() events apart from the dispatcher kicking itself, which is 0 */
+static
+uint8_t _sched_next_id = 1;
+
+/* Start of the current accounting interval */
+static
+uint32_t _sched_report_us = 0;
+
+/**
+ * Signed distance from a to b
+ */
+static inline
+int32_t _sched_diff(uint32_t a, uint32_t b)
+{
+    return (int32_t)(b - a);
+}
+
+/**
+ * The task has events to run, and is not being held back by its minimum interval.
+ *
+ * \param wait_us If the task has events but has to wait, returns how long for.
+ */
+static ICACHE_FLASH_ATTR
+bool _sched_ready(struct sched_task *task, uint32_t now, int32_t *wait_us)
+{
+    int32_t wait = 0;
+
+    if (0 == task->pending) {
+        return false;
+    }
+
+    if (0 != task->min_interval_ms && true == task->has_run) {
+        wait = (int32_t)(task->min_interval_ms * 1000) - _sched_diff(task->last_run_us, now);
+    }
+
+    if (wait > 0) {
+        if (NULL != wait_us) {
+            *wait_us = wait;
+        }
+        return false;
+    }
+
+    return true;
+}
+
+static ICACHE_FLASH_ATTR
+void _sched_kick(void)
+{
+    if (false == _sched_posted && 0 == hal_task_post(SCHED_HAL_TASK_PRIO, 0, 0)) {
+        _sched_posted = true;
+    }
+}
+
+/**
+ * Arm the timer for the earliest moment a task becomes ready without anything being posted.
+ */
+static ICACHE_FLASH_ATTR
+void _sched_arm(void)
+{
+    uint32_t now = hal_time_us();
+    int32_t next_us = 0;
+    bool found = false;
+
+    for (struct sched_task *task = _sched_tasks; NULL != task; task = task->next) {
+        int32_t wait_us = 0;
+
+        if (0 != task->period_ms && 0 == (task->pending & SCHED_EVENT_TICK)) {
+            wait_us = _sched_diff(now, task->tick_due_us);
+            if (false == found || wait_us < next_us) {
+                next_us = wait_us;
+                found = true;
+            }
+        }
+
+        if (false == _sched_ready(task, now, &wait_us) && 0 != wait_us) {
+            if (false == found || wait_us < next_us) {
+                next_us = wait_us;
+                found = true;
+            }
+        }
+    }
+
+    hal_timer_disarm(&_sched_timer);
+
+    if (false == found) {
+        return;
+    }
+
+    /* The timer only has millisecond resolution; never wake early */
+    hal_timer_arm(&_sched_timer, next_us > 0 ? (next_us + 999) / 1000 : 0, false);
+}
+
+/**
+ * Hand out the ticks that are due, and get the dispatcher going.
+ */
+static ICACHE_FLASH_ATTR
+void _sched_timer_fn(void *arg)
+{
+    uint32_t now = hal_time_us();
+
+    for (struct sched_task *task = _sched_tasks; NULL != task; task = task->next) {
+        if (0 == task->period_ms || 0 != (task->pending & SCHED_EVENT_TICK) ||
+                _sched_diff(task->tick_due_us, now) < 0)
+        {
+            continue;
+        }
+
+        task->pending |= SCHED_EVENT_TICK;
+    }
+
+    _sched_kick();
+    _sched_arm();
+}
+
+/**
+ * Run the highest priority ready task, after delivering the event from interrupt context this
+ * run was posted for, if any.
+ */
+static ICACHE_FLASH_ATTR
+void _sched_dispatch(uint32_t sig, uint32_t par)
+{
+    uint32_t now = hal_time_us(),
+             end,
+             events,
+             run_us;
+    struct sched_task *task = _sched_tasks;
+
+    if (0 == sig) {
+        _sched_posted = false;
+    } else {
+        while (NULL != task && sig != task->id) {
+            task = task->next;
+        }
+
+        if (NULL != task) {
+            task->pending |= SCHED_EVENT_ISR;
+            task->isr_data = par;
+        }
+
+        task = _sched_tasks;
+    }
+
+    /* The list is kept in priority order */
+    while (NULL != task && false == _sched_ready(task, now, NULL)) {
+        task = task->next;
+    }
+
+    if (NULL == task) {
+        return;
+    }
+
+    events = task->pending;
+    task->pending = 0;
+
+    /* A tick posted by hand ahead of time doesn't move the schedule */
+    if (0 != (events & SCHED_EVENT_TICK) && 0 != task->period_ms && _sched_diff(task->tick_due_us, now) >= 0) {
+        uint32_t late_us = now - task->tick_due_us;
+
+        if (late_us > task->max_late_us) {
+            task->max_late_us = late_us;
+        }
+
+        /* Keep to the period, unless we fell more than a whole period behind */
+        task->tick_due_us += task->period_ms * 1000;
+        if (_sched_diff(task->tick_due_us, now) > 0) {
+            task->tick_due_us = now + task->period_ms * 1000;
+        }
+    }
+
+    task->func(task, events);
+
+    end = hal_time_us();
+    run_us = end - now;
+
+    task->has_run = true;
+    task->last_run_us = now;
+    task->nr_runs++;
+    task->total_us += run_us;
+
+    if (run_us > task->max_us) {
+        task->max_us = run_us;
+    }
+
+    if (run_us > (0 != task->budget_us ? task->budget_us : SCHED_DEFAULT_BUDGET_US)) {
+        task->over_budget++;
+    }
+
+    /* Anything else ready goes after the SDK has had a look in */
+    for (task = _sched_tasks; NULL != task; task = task->next) {
+        if (true == _sched_ready(task, end, NULL)) {
+            _sched_kick();
+            break;
+        }
+    }
+
+    _sched_arm();
+}
+
+ICACHE_FLASH_ATTR
+int sched_init(void)
+{
+    _sched_tasks = NULL;
+    _sched_posted = false;
+    _sched_next_id = 1;
+    _sched_report_us = hal_time_us();
+
+    hal_timer_disarm(&_sched_timer);
+    hal_timer_setfn(&_sched_timer, _sched_timer_fn, NULL);
+
+    if (0 != hal_task_register(SCHED_HAL_TASK_PRIO, _sched_dispatch)) {
+        os_printf("SCHED: Failed to register task\r\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+void sched_add(struct sched_task *task)
+{
+    struct sched_task **pprev = &_sched_tasks;
+
+    task->id = _sched_next_id++;
+    task->pending = 0;
+    task->has_run = false;
+    task->tick_due_us = hal_time_us() + task->period_ms * 1000;
+    task->nr_runs = task->total_us = task->max_us = task->over_budget = task->max_late_us = 0;
+
+    /* Equal priorities run in the order they were added */
+    while (NULL != *pprev && (*pprev)->prio >= task->prio) {
+        pprev = &(*pprev)->next;
+    }
+
+    task->next = *pprev;
+    *pprev = task;
+
+    _sched_arm();
+}
+
+ICACHE_FLASH_ATTR
+void sched_post(struct sched_task *task, uint32_t events)
+{
+    task->pending |= events;
+
+    if (true == _sched_ready(task, hal_time_us(), NULL)) {
+        _sched_kick();
+    } else {
+        _sched_arm();
+    }
+}
+
+int sched_post_from_isr(struct sched_task *task, uint32_t data)
+{
+    return hal_task_post(SCHED_HAL_TASK_PRIO, task->id, data);
+}
+
+ICACHE_FLASH_ATTR
+void sched_set_period(struct sched_task *task, uint32_t period_ms)
+{
+    task->period_ms = period_ms;
+    task->tick_due_us = hal_time_us() + period_ms * 1000;
+    _sched_arm();
+}
+
+ICACHE_FLASH_ATTR
+void sched_report(void)
+{
+    uint32_t now = hal_time_us(),
+             interval_us = now - _sched_report_us;
+
+    os_printf("SCHED: Last %u ms:\r\n", interval_us / 1000);
+
+    for (struct sched_task *task = _sched_tasks; NULL != task; task = task->next) {
+        uint32_t avg_us = 0 != task->nr_runs ? task->total_us / task->nr_runs : 0;
+        /* Hundredths of a percent of the interval spent in this task */
+        uint32_t busy = 0 != interval_us ? (uint32_t)((uint64_t)task->total_us * 10000 / interval_us) : 0;
+
+        os_printf("SCHED: %s: %u runs, avg %u us, max %u us, %u.%02u%% busy, %u over budget, "
+                "ticks up to %u us late\r\n", task->name, task->nr_runs, avg_us, task->max_us,
+                busy / 100, busy % 100, task->over_budget, task->max_late_us);
+
+        task->nr_runs = task->total_us = task->max_us = task->over_budget = task->max_late_us = 0;
+    }
+
+    _sched_report_us = now;
+}
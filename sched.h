@@ -0,0 +1,130 @@
+#pragma once
+
+/** \file sched.h Cooperative task scheduler
+ * Multiplexes any number of application tasks onto one SDK task. A task runs when it has events
+ * pending: either posted to it with sched_post(), or the SCHED_EVENT_TICK its period delivers.
+ * When several tasks are ready the highest priority one runs first, and control goes back to the
+ * SDK between tasks so WiFi and TCP get their turn. Tasks must not block; a task that has more
+ * work than fits in one run should post itself an event and return.
+ *
+ * The time every task takes is accounted, along with how late its ticks start, so a stage that
+ * hogs the CPU shows up in sched_report().
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sched_config.h"
+
+/**
+ * Event delivered when a periodic task's period comes around. The other bits are for the tasks
+ * to define.
+ */
+#define SCHED_EVENT_TICK            (1ul << 31)
+
+/**
+ * Event delivered by sched_post_from_isr()
+ */
+#define SCHED_EVENT_ISR             (1ul << 30)
+
+struct sched_task;
+
+/**
+ * Run a task.
+ *
+ * \param task The task being run
+ * \param events Every event posted since the task last ran
+ */
+typedef void (*sched_func_t)(struct sched_task *task, uint32_t events);
+
+struct sched_task {
+    /**
+     * Name, for reports
+     */
+    const char *name;
+
+    sched_func_t func;
+    void *arg;
+
+    /**
+     * Interval between SCHED_EVENT_TICKs, or 0 if the task only runs on posted events
+     */
+    uint32_t period_ms;
+
+    /**
+     * Shortest interval between runs; events posted in the meantime are held and delivered
+     * together. 0 for none.
+     */
+    uint32_t min_interval_ms;
+
+    /**
+     * Longest a single run should take. Runs that take longer are counted against the task.
+     * 0 for SCHED_DEFAULT_BUDGET_US.
+     */
+    uint32_t budget_us;
+
+    /**
+     * Higher priority tasks run first
+     */
+    uint8_t prio;
+
+    /**
+     * Value passed with the latest sched_post_from_isr()
+     */
+    uint32_t isr_data;
+
+    /**
+     * Private
+     */
+    uint8_t id;
+    uint32_t pending;
+    uint32_t tick_due_us;
+    uint32_t last_run_us;
+    bool has_run;
+    struct sched_task *next;
+
+    /**
+     * Accounting, cleared by sched_report()
+     */
+    uint32_t nr_runs;
+    uint32_t total_us;
+    uint32_t max_us;
+    uint32_t over_budget;
+    uint32_t max_late_us;
+};
+
+/**
+ * Set up the scheduler. Call once at start of day, before adding any tasks.
+ *
+ * \return 0 on success, -1 if the SDK task could not be registered.
+ */
+int sched_init(void);
+
+/**
+ * Add a task. Periodic tasks get their first tick one period from now.
+ */
+void sched_add(struct sched_task *task);
+
+/**
+ * Post events to a task. Task context only.
+ */
+void sched_post(struct sched_task *task, uint32_t events);
+
+/**
+ * Post SCHED_EVENT_ISR to a task from interrupt context. The event goes through the SDK's task
+ * queue, and is picked up along with data the next time the scheduler runs. Events posted again
+ * before the task gets to run are merged, keeping the latest data.
+ *
+ * \return 0 on success, -1 if the SDK's queue is full and the event was lost.
+ */
+int sched_post_from_isr(struct sched_task *task, uint32_t data);
+
+/**
+ * Change a task's period, starting from now.
+ */
+void sched_set_period(struct sched_task *task, uint32_t period_ms);
+
+/**
+ * Print every task's accounting to the UART and start the next interval.
+ */
+void sched_report(void);
@@ -0,0 +1,12 @@
+#pragma once
+
+/**
+ * SDK task priority the scheduler runs at. SPI completions run above it.
+ */
+#define SCHED_HAL_TASK_PRIO         HAL_TASK_PRIO_MEDIUM
+
+/**
+ * Default run time budget per task. The SDK wants control back within a few milliseconds to keep
+ * WiFi happy.
+ */
+#define SCHED_DEFAULT_BUDGET_US     2000
@@ -0,0 +1,393 @@
+/** \file settings.c Settings kept in flash
+ */
+
+#include "settings.h"
+
+#include "crc16.h"
+#include "hal.h"
+
+#include <stddef.h>
+
+#define ARRAY_LEN(x) (sizeof((x))/sizeof((x[0])))
+
+#define SETTINGS_REC_MAGIC          0x47464379ul    /* "yCFG" */
+#define SETTINGS_REC_LEN            256
+#define SETTINGS_REC_DATA_LEN       (SETTINGS_REC_LEN - 12)
+
+struct settings_record {
+    /**
+     * struct settings as the firmware that saved it had it. Settings are only ever added at the
+     * end, so whatever firmware loads it takes as much as it knows of, newer or older.
+     */
+    uint32_t data[SETTINGS_REC_DATA_LEN / 4];
+
+    /**
+     * SETTINGS_VERSION and sizeof(struct settings) of the firmware that saved it
+     */
+    uint16_t version;
+    uint16_t len;
+
+    /**
+     * CRC of everything before it. The magic goes last, so a record is only taken as written once
+     * all of it is.
+     */
+    uint16_t crc;
+    uint16_t reserved;
+    uint32_t magic;
+};
+
+/* Breaks the build if the settings outgrow the record */
+typedef char _settings_fit_record[sizeof(struct settings) <= SETTINGS_REC_DATA_LEN ? 1 : -1];
+
+#define SETTINGS_REC_CRC_LEN        offsetof(struct settings_record, crc)
+#define SETTINGS_NR_RECS            (HAL_FLASH_SECTOR_SIZE / sizeof(struct settings_record))
+
+enum settings_type {
+    SETTINGS_TYPE_STRING,
+    SETTINGS_TYPE_NUMBER,
+};
+
+/**
+ * A setting: where it lives in struct settings, what changes with it, and its limits. For a
+ * string the limits are on its length.
+ */
+struct settings_field {
+    const char *name;
+    uint16_t offset;
+    uint16_t size;
+    enum settings_type type;
+    bool secret;
+    uint32_t changes;
+    uint32_t min;
+    uint32_t max;
+};
+
+#define SETTINGS_FIELD(_name, _type, _secret, _changes, _min, _max) \
+    { #_name, offsetof(struct settings, _name), sizeof(((struct settings *)0)->_name), \
+        _type, _secret, _changes, _min, _max }
+
+static
+const struct settings_field _settings_fields[] = {
+    SETTINGS_FIELD(ssid, SETTINGS_TYPE_STRING, false, SETTINGS_WIFI, 1, 31),
+    SETTINGS_FIELD(psk, SETTINGS_TYPE_STRING, true, SETTINGS_WIFI, 0, 63),
+    SETTINGS_FIELD(collector, SETTINGS_TYPE_STRING, false, SETTINGS_COLLECTOR,
+            0, COLLECTOR_HOST_LEN - 1),
+    SETTINGS_FIELD(spi_hz, SETTINGS_TYPE_NUMBER, false, SETTINGS_SPI,
+            SETTINGS_MIN_SPI_HZ, SETTINGS_MAX_SPI_HZ),
+    SETTINGS_FIELD(sample_ms, SETTINGS_TYPE_NUMBER, false, SETTINGS_SAMPLE,
+            SETTINGS_MIN_SAMPLE_MS, SETTINGS_MAX_SAMPLE_MS),
+    SETTINGS_FIELD(display_ms, SETTINGS_TYPE_NUMBER, false, SETTINGS_DISPLAY,
+            SETTINGS_MIN_DISPLAY_MS, SETTINGS_MAX_DISPLAY_MS),
+    SETTINGS_FIELD(batch_size, SETTINGS_TYPE_NUMBER, false, SETTINGS_BATCH,
+            SETTINGS_MIN_BATCH_SIZE, SETTINGS_MAX_BATCH_SIZE),
+    SETTINGS_FIELD(display_budget, SETTINGS_TYPE_NUMBER, false, SETTINGS_DISPLAY,
+            SETTINGS_MIN_DISPLAY_BUDGET, SETTINGS_MAX_DISPLAY_BUDGET),
+    SETTINGS_FIELD(token, SETTINGS_TYPE_STRING, true, 0, 0, 31),
+};
+
+static
+const struct settings _settings_defaults = {
+    .ssid = SETTINGS_DEFAULT_SSID,
+    .psk = SETTINGS_DEFAULT_PSK,
+    .collector = SETTINGS_DEFAULT_COLLECTOR,
+    .spi_hz = SETTINGS_DEFAULT_SPI_HZ,
+    .sample_ms = SETTINGS_DEFAULT_SAMPLE_MS,
+    .display_ms = SETTINGS_DEFAULT_DISPLAY_MS,
+    .batch_size = SETTINGS_DEFAULT_BATCH_SIZE,
+    .display_budget = SETTINGS_DEFAULT_DISPLAY_BUDGET,
+    .token = SETTINGS_DEFAULT_TOKEN,
+};
+
+/* The settings in effect, and the newest saved */
+static
+struct settings _settings,
+                _settings_saved;
+
+static
+bool _settings_have_saved = false;
+
+/* The slot the next record goes in */
+static
+unsigned _settings_next = 0;
+
+/* Settings changed but not yet applied */
+static
+uint32_t _settings_changed = 0;
+
+static
+settings_change_func_t _settings_on_change = NULL;
+
+static ICACHE_FLASH_ATTR
+uint32_t _settings_rec_addr(unsigned slot)
+{
+    return SETTINGS_SECTOR * HAL_FLASH_SECTOR_SIZE + slot * sizeof(struct settings_record);
+}
+
+static ICACHE_FLASH_ATTR
+bool _settings_rec_erased(const struct settings_record *rec)
+{
+    const uint32_t *words = (const uint32_t *)rec;
+
+    for (size_t i = 0; i < sizeof(*rec) / 4; i++) {
+        if (0xfffffffful != words[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static ICACHE_FLASH_ATTR
+const struct settings_field *_settings_find(const char *name)
+{
+    for (unsigned i = 0; i < ARRAY_LEN(_settings_fields); i++) {
+        if (0 == os_strcmp(_settings_fields[i].name, name)) {
+            return &_settings_fields[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Check a setting's value is within its limits, and for a string that it is terminated.
+ */
+static ICACHE_FLASH_ATTR
+bool _settings_valid(const struct settings *settings, const struct settings_field *field)
+{
+    const char *p = (const char *)settings + field->offset;
+    uint32_t value = 0;
+
+    if (SETTINGS_TYPE_STRING == field->type) {
+        while (value < field->size && '\0' != p[value]) {
+            value++;
+        }
+
+        if (value == field->size) {
+            return false;
+        }
+    } else {
+        os_memcpy(&value, p, sizeof(value));
+    }
+
+    return value >= field->min && value <= field->max;
+}
+
+static ICACHE_FLASH_ATTR
+int _settings_parse_number(const char *value, uint32_t *number)
+{
+    uint32_t n = 0;
+
+    if ('\0' == *value) {
+        return -1;
+    }
+
+    for (; '\0' != *value; value++) {
+        if (*value < '0' || *value > '9' || n > (UINT32_MAX - 9) / 10) {
+            return -1;
+        }
+        n = n * 10 + (*value - '0');
+    }
+
+    *number = n;
+
+    return 0;
+}
+
+/**
+ * Find the newest intact record, and where writing left off, and load the settings from the record.
+ */
+static ICACHE_FLASH_ATTR
+int _settings_load(void)
+{
+    struct settings_record rec;
+    unsigned slot;
+
+    for (slot = 0; slot < SETTINGS_NR_RECS; slot++) {
+        if (0 != hal_flash_read(_settings_rec_addr(slot), &rec, sizeof(rec))) {
+            os_printf("SETTINGS: Failed to read record %u\r\n", slot);
+            return -1;
+        }
+
+        if (true == _settings_rec_erased(&rec)) {
+            break;
+        }
+
+        /* A torn record still takes up its slot */
+        if (SETTINGS_REC_MAGIC != rec.magic || rec.crc != crc16_ccitt(&rec, SETTINGS_REC_CRC_LEN) ||
+                rec.len > SETTINGS_REC_DATA_LEN)
+        {
+            continue;
+        }
+
+        /* Whatever the record lacks keeps its default */
+        _settings_saved = _settings_defaults;
+        os_memcpy(&_settings_saved, rec.data,
+                rec.len < sizeof(_settings_saved) ? rec.len : sizeof(_settings_saved));
+        _settings_have_saved = true;
+    }
+
+    _settings_next = slot;
+
+    if (false == _settings_have_saved) {
+        return -1;
+    }
+
+    _settings = _settings_saved;
+
+    /* Limits may have changed since the record was saved */
+    for (unsigned i = 0; i < ARRAY_LEN(_settings_fields); i++) {
+        const struct settings_field *field = &_settings_fields[i];
+
+        if (false == _settings_valid(&_settings, field)) {
+            os_printf("SETTINGS: Saved %s is out of range, using the default\r\n", field->name);
+            os_memcpy((char *)&_settings + field->offset,
+                    (const char *)&_settings_defaults + field->offset, field->size);
+        }
+    }
+
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+int settings_init(settings_change_func_t on_change)
+{
+    _settings = _settings_defaults;
+    _settings_have_saved = false;
+    _settings_next = 0;
+    _settings_changed = 0;
+    _settings_on_change = on_change;
+
+    if (0 != _settings_load()) {
+        os_printf("SETTINGS: None saved, using the defaults\r\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+const struct settings *settings_get(void)
+{
+    return &_settings;
+}
+
+ICACHE_FLASH_ATTR
+int settings_set(const char *name, const char *value)
+{
+    const struct settings_field *field = _settings_find(name);
+    struct settings updated = _settings;
+    char *p = NULL;
+
+    if (NULL == field) {
+        os_printf("SETTINGS: No setting called %s\r\n", name);
+        return -1;
+    }
+
+    p = (char *)&updated + field->offset;
+
+    if (SETTINGS_TYPE_STRING == field->type) {
+        size_t len = os_strlen(value);
+
+        if (len < field->min || len > field->max) {
+            os_printf("SETTINGS: %s must be %u to %u characters\r\n", field->name, field->min,
+                    field->max);
+            return -1;
+        }
+
+        os_memset(p, 0, field->size);
+        os_memcpy(p, value, len);
+    } else {
+        uint32_t number = 0;
+
+        if (0 != _settings_parse_number(value, &number) || number < field->min ||
+                number > field->max)
+        {
+            os_printf("SETTINGS: %s must be a number from %u to %u\r\n", field->name, field->min,
+                    field->max);
+            return -1;
+        }
+
+        os_memcpy(p, &number, sizeof(number));
+    }
+
+    if (0 != os_memcmp(p, (const char *)&_settings + field->offset, field->size)) {
+        os_memcpy((char *)&_settings + field->offset, p, field->size);
+        _settings_changed |= field->changes;
+    }
+
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+void settings_apply(void)
+{
+    uint32_t changed = _settings_changed;
+
+    _settings_changed = 0;
+
+    if (0 != changed && NULL != _settings_on_change) {
+        _settings_on_change(changed);
+    }
+}
+
+ICACHE_FLASH_ATTR
+int settings_save(void)
+{
+    struct settings_record rec;
+
+    if (true == _settings_have_saved && 0 == os_memcmp(&_settings, &_settings_saved, sizeof(_settings))) {
+        return 0;
+    }
+
+    os_memset(&rec, 0, sizeof(rec));
+    os_memcpy(rec.data, &_settings, sizeof(_settings));
+    rec.version = SETTINGS_VERSION;
+    rec.len = sizeof(_settings);
+    rec.crc = crc16_ccitt(&rec, SETTINGS_REC_CRC_LEN);
+    rec.magic = SETTINGS_REC_MAGIC;
+
+    if (SETTINGS_NR_RECS == _settings_next) {
+        if (0 != hal_flash_erase(SETTINGS_SECTOR)) {
+            os_printf("SETTINGS: Failed to erase the settings\r\n");
+            return -1;
+        }
+        _settings_next = 0;
+    }
+
+    if (0 != hal_flash_write(_settings_rec_addr(_settings_next), &rec, sizeof(rec))) {
+        os_printf("SETTINGS: Failed to write record %u\r\n", _settings_next);
+        _settings_next++;
+        return -1;
+    }
+
+    _settings_next++;
+    _settings_saved = _settings;
+    _settings_have_saved = true;
+
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+int settings_format(unsigned index, char *buf, size_t len)
+{
+    const struct settings_field *field = NULL;
+    const char *p = NULL;
+    uint32_t number = 0;
+
+    if (index >= ARRAY_LEN(_settings_fields)) {
+        return -1;
+    }
+
+    field = &_settings_fields[index];
+    p = (const char *)&_settings + field->offset;
+
+    if (SETTINGS_TYPE_STRING == field->type) {
+        return os_snprintf(buf, len, "%s=%s", field->name,
+                true == field->secret && '\0' != *p ? "*" : p);
+    }
+
+    os_memcpy(&number, p, sizeof(number));
+
+    return os_snprintf(buf, len, "%s=%u", field->name, number);
+}
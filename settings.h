@@ -0,0 +1,117 @@
+#pragma once
+
+/** \file settings.h Settings kept in flash
+ * The settings that used to need a rebuild to change: the network to join, where to send samples,
+ * and the rates and sizes worth tuning on a running device. They are read from flash once at start
+ * of day into RAM, where the application reads them from then on, and can be changed by name while
+ * running, from the console or over HTTP. Changes take effect when applied, and survive a reset
+ * once saved.
+ *
+ * Saved settings are a versioned record, CRC protected, appended to a sector of flash; the newest
+ * intact record wins, and the sector is only erased once it fills up. New settings go on the end
+ * of the record, so a record saved by older firmware still loads, with defaults for whatever it
+ * lacks.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "settings_config.h"
+
+/**
+ * Bumped whenever settings are added to the end of struct settings
+ */
+#define SETTINGS_VERSION            3
+
+struct settings {
+    char ssid[32];
+    char psk[64];
+
+    /**
+     * Collector to use in place of COLLECTOR_HOSTS, or empty to use those
+     */
+    char collector[COLLECTOR_HOST_LEN];
+
+    uint32_t spi_hz;
+
+    /**
+     * Time between samples reported, in whole probe conversions
+     */
+    uint32_t sample_ms;
+
+    /**
+     * Time between display frames
+     */
+    uint32_t display_ms;
+
+    /**
+     * Samples per upload
+     */
+    uint32_t batch_size;
+
+    /**
+     * Most bytes each display frame puts on the bus. Since version 2.
+     */
+    uint32_t display_budget;
+
+    /**
+     * Shared secret a POST to /config has to carry, or empty to refuse them all. Since version 3.
+     */
+    char token[32];
+};
+
+/**
+ * Which settings changed, for settings_change_func_t
+ */
+#define SETTINGS_WIFI               (1ul << 0)
+#define SETTINGS_COLLECTOR          (1ul << 1)
+#define SETTINGS_SPI                (1ul << 2)
+#define SETTINGS_SAMPLE             (1ul << 3)
+#define SETTINGS_DISPLAY            (1ul << 4)
+#define SETTINGS_BATCH              (1ul << 5)
+
+/**
+ * Put changed settings into effect. changed is a mask of SETTINGS_*.
+ */
+typedef void (*settings_change_func_t)(uint32_t changed);
+
+/**
+ * Load the settings from flash, or start from the defaults if none are saved. on_change, which
+ * may be NULL, is called from settings_apply().
+ *
+ * \return 0 if the settings were loaded, -1 if they are the defaults.
+ */
+int settings_init(settings_change_func_t on_change);
+
+/**
+ * The settings in effect.
+ */
+const struct settings *settings_get(void);
+
+/**
+ * Change a setting, by name. Nothing takes effect until settings_apply(). A value that is out of
+ * range or doesn't fit is refused, with the reason printed.
+ *
+ * \return 0 on success, -1 if there is no such setting or the value is refused.
+ */
+int settings_set(const char *name, const char *value);
+
+/**
+ * Put every setting changed since the last call into effect.
+ */
+void settings_apply(void);
+
+/**
+ * Save the settings to flash. Nothing is written if they are the ones saved already.
+ *
+ * \return 0 on success, -1 on a flash error.
+ */
+int settings_save(void);
+
+/**
+ * Write the index'th setting as name=value, snprintf() style. Secrets are written as *.
+ *
+ * \return The length of the whole setting, even if it didn't fit, or -1 past the last one.
+ */
+int settings_format(unsigned index, char *buf, size_t len);
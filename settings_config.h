@@ -0,0 +1,39 @@
+#pragma once
+
+#include "collector_config.h"
+#include "max31855_config.h"
+#include "telemetry_config.h"
+
+/**
+ * SPI flash sector holding the settings, just past the WiFi fast connect cache
+ */
+#define SETTINGS_SECTOR             0x301
+
+/**
+ * Settings used until some are saved, and for any a saved record from older firmware lacks
+ */
+#define SETTINGS_DEFAULT_SSID       "SiprExtend"
+#define SETTINGS_DEFAULT_PSK        "lolnsaownsyou"
+#define SETTINGS_DEFAULT_COLLECTOR  ""
+#define SETTINGS_DEFAULT_SPI_HZ     10000000
+#define SETTINGS_DEFAULT_SAMPLE_MS  500
+#define SETTINGS_DEFAULT_DISPLAY_MS 500
+#define SETTINGS_DEFAULT_DISPLAY_BUDGET 512
+#define SETTINGS_DEFAULT_BATCH_SIZE TELEMETRY_DEFAULT_BATCH_SIZE
+#define SETTINGS_DEFAULT_TOKEN      ""
+
+/**
+ * Limits on the numeric settings. Every device on the bus has to keep up with the SPI clock, and
+ * samples can't come faster than the probes convert. A whole display is a little over 1KiB on the
+ * bus, so the smallest display budget takes about 16 frames to redraw it all.
+ */
+#define SETTINGS_MIN_SPI_HZ         100000
+#define SETTINGS_MAX_SPI_HZ         20000000
+#define SETTINGS_MIN_SAMPLE_MS      MAX31855_CONVERSION_MS
+#define SETTINGS_MAX_SAMPLE_MS      60000
+#define SETTINGS_MIN_DISPLAY_MS     20
+#define SETTINGS_MAX_DISPLAY_MS     10000
+#define SETTINGS_MIN_DISPLAY_BUDGET 64
+#define SETTINGS_MAX_DISPLAY_BUDGET 4096
+#define SETTINGS_MIN_BATCH_SIZE     1
+#define SETTINGS_MAX_BATCH_SIZE     TELEMETRY_MAX_BATCH
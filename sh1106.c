@@ -6,64 +6,116 @@
 #include <sh1106.h>
 #include <sh1106_cmds.h>
 
+#include "font_cache.h"
+
+#ifdef SH1106_BENCHMARK
+/* The raw font, to compare against the old drawing paths */
 #include "font_5x7.h"
+#endif
 
-#include <driver/spi_interface.h>
-#include <gpio.h>
-#include <osapi.h>
-#include <c99_fixups.h>
+#include "hal.h"
+#include "prof.h"
+#include "spi_queue.h"
 
 #define OLED_WIDTH  128
 #define OLED_HEIGHT 64
+#define OLED_PAGES  (OLED_HEIGHT/8)
 
-#define OLED_SPI_NUM        SpiNum_HSPI
+/* The SH1106 has 132 columns of RAM, the panel is centered within them */
+#define OLED_COL_OFFSET     2
 
-static ICACHE_FLASH_ATTR
-void _spi_write(uint32_t *data, size_t nr_bytes)
-{
-    SpiData data_tx;
+/**
+ * Local copy of the display RAM. Drawing operations only touch this; the panel is updated
+ * by sh1106_display_flush().
+ */
+static
+uint8_t _sh1106_fb[OLED_PAGES][OLED_WIDTH] __attribute__((aligned(4)));
 
-    data_tx.cmd = MASTER_WRITE_DATA_TO_SLAVE_CMD;
-    data_tx.cmdLen = 0;
-    data_tx.addr = NULL;
-    data_tx.addrLen = 0;
-    data_tx.data = data;
-    data_tx.dataLen = nr_bytes;
+/**
+ * Range of columns [start, end) in each page that differ from what the panel is showing.
+ * A page is clean if start >= end.
+ */
+static
+struct sh1106_dirty_span {
+    uint8_t start;
+    uint8_t end;
+} _sh1106_dirty[OLED_PAGES];
+
+/**
+ * Page a budgeted flush starts from: the one the last flush ran out of budget on, so that every
+ * page gets its turn however little fits in each flush.
+ */
+static
+unsigned _sh1106_flush_page = 0;
 
-    if (0 > SPIMasterSendData(OLED_SPI_NUM, &data_tx)) {
-        os_printf("SH1106: Could not send data via SPI\r\n");
-    }
+/**
+ * Bytes of page address command ahead of each burst
+ */
+#define SH1106_PAGE_ADDR_LEN    3
 
-    /* WORKAROUND: The upstream SPI driver doesn't actually wait until the transaction has
-     * finished, even though it will purport that it has.
-     */
-    while (READ_PERI_REG(SPI_CMD(OLED_SPI_NUM)) & SPI_USR);
-}
+/**
+ * Address command and data burst for each page, used by sh1106_display_flush().
+ */
+static
+struct sh1106_page_xfer {
+    struct spi_xfer addr;
+    struct spi_xfer data;
+    uint32_t addr_cmd;
+} _sh1106_page_xfers[OLED_PAGES];
+
+/**
+ * Small ring of slots for one-off commands, so the caller doesn't have to keep the command
+ * around until it is on the wire.
+ */
+#define SH1106_CMD_SLOTS    4
 
-static ICACHE_FLASH_ATTR
-void _spi_write_display(uint32_t *buffer, size_t nr_bytes)
-{
-    /* Set the CS GPIO */
-    gpio_output_set((1 << SH1106_SPI_A0), (1 << SH1106_SPI_CSN), 0, 0);
+static
+struct sh1106_cmd_slot {
+    struct spi_xfer xfer;
+    uint32_t cmd;
+} _sh1106_cmd_slots[SH1106_CMD_SLOTS];
 
-    /* Write out the data */
-    _spi_write(buffer, nr_bytes);
+static
+unsigned _sh1106_next_cmd_slot = 0;
 
-    /* De-assert the chip select */
-    gpio_output_set((1 << SH1106_SPI_CSN), 0, 0, 0);
+static ICACHE_FLASH_ATTR
+void _sh1106_fill_xfer(struct spi_xfer *xfer, const void *data, size_t nr_bytes, bool is_data)
+{
+    xfer->tx = data;
+    xfer->tx_len = nr_bytes;
+    xfer->rx = NULL;
+    xfer->rx_len = 0;
+    xfer->cs = SH1106_SPI_CSN;
+    xfer->a0_gpio = SH1106_SPI_A0;
+    xfer->a0_level = is_data;
+    xfer->done = NULL;
+    xfer->arg = NULL;
 }
 
 static ICACHE_FLASH_ATTR
-void _spi_write_command(uint32_t *cmd, size_t nr_bytes)
+void _spi_write_command(const uint32_t *cmd, size_t nr_bytes)
 {
-    /* Set the CS GPIO. Make sure A0 is de-asserted as well, so this gets treated as a command. */
-    gpio_output_set(0, (1 << SH1106_SPI_CSN) | ( 1 << SH1106_SPI_A0), 0, 0);
+    struct sh1106_cmd_slot *slot = &_sh1106_cmd_slots[_sh1106_next_cmd_slot];
+
+    PROF_START(spi_write_command);
+
+    if (spi_xfer_pending(&slot->xfer)) {
+        os_printf("SH1106: Command queue full, dropping command\r\n");
+        goto done;
+    }
+
+    _sh1106_next_cmd_slot = (_sh1106_next_cmd_slot + 1) % SH1106_CMD_SLOTS;
 
-    /* Write the command out via SPI */
-    _spi_write(cmd, nr_bytes);
+    /* A0 is de-asserted, so this gets treated as a command */
+    slot->cmd = *cmd;
+    _sh1106_fill_xfer(&slot->xfer, &slot->cmd, nr_bytes, false);
 
-    /* Clear the CS GPIO */
-    gpio_output_set((1 << SH1106_SPI_CSN), 0 , 0, 0);
+    if (0 != spi_queue_submit(&slot->xfer)) {
+        os_printf("SH1106: Could not queue command\r\n");
+    }
+
+done:
+    PROF_END(spi_write_command);
 }
 
 static inline ICACHE_FLASH_ATTR
@@ -81,35 +133,46 @@ void _sh1106_set_start_column(uint8_t col)
 }
 
 
-static ICACHE_FLASH_ATTR
-void _sh1106_checkerboard_test(void)
+static inline ICACHE_FLASH_ATTR
+void _sh1106_mark_dirty(unsigned page, unsigned start, unsigned end)
 {
-    uint32_t display_line[(OLED_WIDTH+31)/32],
-             line_val = 0;
-    int page = 0;
+    struct sh1106_dirty_span *span = &_sh1106_dirty[page];
 
-    for (size_t i = 0; i < sizeof(display_line)/sizeof(display_line[0]); i++) {
-        if (0 == i % 2) {
-            line_val = ~line_val;
+    if (span->start >= span->end) {
+        span->start = start;
+        span->end = end;
+    } else {
+        if (start < span->start) {
+            span->start = start;
+        }
+        if (end > span->end) {
+            span->end = end;
         }
-        display_line[i] = line_val;
     }
+}
 
+/**
+ * Write a column of 8 pixels to the framebuffer, marking it dirty only if it changed.
+ */
+static inline ICACHE_FLASH_ATTR
+void _sh1106_fb_put(unsigned page, unsigned col, uint8_t val)
+{
+    if (col >= OLED_WIDTH || _sh1106_fb[page][col] == val) {
+        return;
+    }
 
-    for (size_t i = 0; i < OLED_HEIGHT; i++) {
-        if (0 == i % 8) {
-            uint32_t page_cmd = SH1106_CMD_SET_PAGE_ADDR(page);
-
-            for (size_t j = 0; j < sizeof(display_line)/sizeof(display_line[0]); j++) {
-                display_line[j] = ~display_line[j];
-            }
+    _sh1106_fb[page][col] = val;
+    _sh1106_mark_dirty(page, col, col + 1);
+}
 
-            /* Open the next page */
-            _spi_write_command(&page_cmd, 1);
-            _sh1106_set_start_column(2);
-            page++;
+static ICACHE_FLASH_ATTR
+void _sh1106_checkerboard_test(void)
+{
+    for (int page = 0; page < OLED_PAGES; page++) {
+        for (int col = 0; col < OLED_WIDTH; col++) {
+            /* 8x8 pixel squares, alternating every page */
+            _sh1106_fb_put(page, col, ((col / 8) + page) % 2 ? 0xff : 0x00);
         }
-        _spi_write_display(display_line, sizeof(display_line));
     }
 }
 
@@ -123,73 +186,91 @@ void sh1106_display_set_invert(bool invert)
 ICACHE_FLASH_ATTR
 void sh1106_clear_page(int page, bool invert, int start_col)
 {
-    uint32_t data[(OLED_WIDTH + 31)/32],
-             page_cmd = SH1106_CMD_SET_PAGE_ADDR(page);
+    uint8_t fill = invert ? 0xff : 0x0;
 
-    memset(data, invert ? 0xff : 0x0, sizeof(data));
-
-    _spi_write_command(&page_cmd, 1);
-    _sh1106_set_start_column(start_col + 2);
-
-    for (int i = 0; i < OLED_HEIGHT/8; i++) {
-        _spi_write_display(data, (OLED_WIDTH - start_col)/8);
+    for (int col = start_col; col < OLED_WIDTH; col++) {
+        _sh1106_fb_put(page & (OLED_PAGES - 1), col, fill);
     }
 }
 
 ICACHE_FLASH_ATTR
 void sh1106_display_clear(void)
 {
-    for (int i = 0; i < 8; i++) {
-        sh1106_clear_page(i, false, 0);
+    /* We don't know what the panel RAM holds, so force every page out on the next flush */
+    memset(_sh1106_fb, 0, sizeof(_sh1106_fb));
+
+    for (int i = 0; i < OLED_PAGES; i++) {
+        _sh1106_mark_dirty(i, 0, OLED_WIDTH);
     }
 }
 
-static ICACHE_FLASH_ATTR
-void _sh1106_display_putc(int c, bool invert)
+/**
+ * Copy a run of columns into the framebuffer, marking them dirty only if they changed.
+ */
+static inline ICACHE_FLASH_ATTR
+void _sh1106_fb_put_run(unsigned page, unsigned col, const void *src, unsigned nr_cols)
 {
-    uint32_t character;
-    character = (uint32_t)font_data[(c * 5) + 0] |
-        ((uint32_t)font_data[(c * 5) + 1] << 8)     |
-        ((uint32_t)font_data[(c * 5) + 2] << 16)    |
-        ((uint32_t)font_data[(c * 5) + 3] << 24);
+    uint8_t *dst = &_sh1106_fb[page][col];
 
-    if (true == invert) {
-        character = ~character;
+    if (col >= OLED_WIDTH) {
+        return;
     }
 
-    _spi_write_display(&character, 4);
-
-    character =
-        ((uint32_t)font_data[(c * 5) + 4] << 0);
+    if (col + nr_cols > OLED_WIDTH) {
+        nr_cols = OLED_WIDTH - col;
+    }
 
-    if (true == invert) {
-        character = ~character;
+    if (0 == memcmp(dst, src, nr_cols)) {
+        return;
     }
-    _spi_write_display(&character, 2);
+
+    memcpy(dst, src, nr_cols);
+    _sh1106_mark_dirty(page, col, col + nr_cols);
 }
 
-ICACHE_FLASH_ATTR
-void sh1106_display_puts(unsigned line, unsigned x_offs, const char *str, bool invert, enum sh1106_text_align align)
+static inline ICACHE_FLASH_ATTR
+void _sh1106_display_putc(unsigned page, unsigned col, uint8_t c, bool invert)
 {
-    uint32_t page_cmd = SH1106_CMD_SET_PAGE_ADDR(line),
-             x_start = x_offs;
-    const char *pstr = str;
-    int len = 0;
+    /* The record includes the inter-character spacing column */
+    _sh1106_fb_put_run(page, col, font_small_glyphs[c][invert], FONT_SMALL_WIDTH);
+}
 
-    len = os_strlen(str);
-    if (0 == len) {
-        goto done;
+static inline ICACHE_FLASH_ATTR
+void _sh1106_display_putc_large(unsigned page, unsigned col, uint8_t c, bool invert)
+{
+    uint8_t idx = font_large_index[c];
+
+    for (int i = 0; i < FONT_LARGE_PAGES; i++) {
+        unsigned glyph_page = (page + i) & (OLED_PAGES - 1);
+
+        if (FONT_LARGE_NONE == idx) {
+            /* Not in the font, draw a blank cell */
+            for (int j = 0; j < FONT_LARGE_WIDTH; j++) {
+                _sh1106_fb_put(glyph_page, col + j, invert ? 0xff : 0x00);
+            }
+        } else {
+            _sh1106_fb_put_run(glyph_page, col, font_large_glyphs[idx][invert][i], FONT_LARGE_WIDTH);
+        }
     }
+}
 
-    if (len * 6 >= 124) {
+/**
+ * Work out the starting column for a string of len characters, each char_width wide.
+ */
+static ICACHE_FLASH_ATTR
+unsigned _sh1106_text_start(int len, unsigned char_width, unsigned x_offs, enum sh1106_text_align align)
+{
+    unsigned x_start = x_offs;
+
+    if (len * char_width >= 124) {
         x_start = 2;
     } else {
         switch (align) {
         case SH1106_TEXT_ALIGN_RIGHT:
-            x_start = 128 - (len * 6) - 2;
+            x_start = 128 - (len * char_width) - 2;
             break;
         case SH1106_TEXT_ALIGN_CENTER:
-            x_start = 64 - ((len * 6)/2);
+            x_start = 64 - ((len * char_width)/2);
             break;
         case SH1106_TEXT_ALIGN_LEFT:
             x_start = 2;
@@ -200,17 +281,339 @@ void sh1106_display_puts(unsigned line, unsigned x_offs, const char *str, bool i
         }
     }
 
-    _spi_write_command(&page_cmd, 1);
-    _sh1106_set_start_column(x_start + 2);
+    return x_start;
+}
+
+ICACHE_FLASH_ATTR
+void sh1106_display_puts(unsigned line, unsigned x_offs, const char *str, bool invert, enum sh1106_text_align align)
+{
+    unsigned x_start,
+             page = line & (OLED_PAGES - 1);
+    const char *pstr = str;
+    int len = 0;
+
+    len = os_strlen(str);
+    if (0 == len) {
+        goto done;
+    }
+
+    x_start = _sh1106_text_start(len, FONT_SMALL_WIDTH, x_offs, align);
 
-    while ('\0' != *pstr) {
-        _sh1106_display_putc(*pstr++, invert);
+    while ('\0' != *pstr && x_start < OLED_WIDTH) {
+        _sh1106_display_putc(page, x_start, (uint8_t)*pstr++, invert);
+        x_start += FONT_SMALL_WIDTH;
     }
 
 done:
     return;
 }
 
+ICACHE_FLASH_ATTR
+void sh1106_display_puts_large(unsigned line, unsigned x_offs, const char *str, bool invert, enum sh1106_text_align align)
+{
+    unsigned x_start;
+    const char *pstr = str;
+    int len = 0;
+
+    len = os_strlen(str);
+    if (0 == len) {
+        goto done;
+    }
+
+    x_start = _sh1106_text_start(len, FONT_LARGE_WIDTH, x_offs, align);
+
+    while ('\0' != *pstr && x_start < OLED_WIDTH) {
+        _sh1106_display_putc_large(line, x_start, (uint8_t)*pstr++, invert);
+        x_start += FONT_LARGE_WIDTH;
+    }
+
+done:
+    return;
+}
+
+ICACHE_FLASH_ATTR
+void sh1106_text_init(struct sh1106_text *text, unsigned line, unsigned x_offs, bool invert, bool large,
+        enum sh1106_text_align align)
+{
+    memset(text, 0, sizeof(*text));
+
+    text->line = line & (OLED_PAGES - 1);
+    text->x_offs = x_offs;
+    text->x_start = x_offs;
+    text->invert = invert;
+    text->large = large;
+    text->align = align;
+}
+
+/**
+ * Fill columns [start, end) of every page the text field covers with its background.
+ */
+static ICACHE_FLASH_ATTR
+void _sh1106_text_blank(struct sh1106_text *text, unsigned start, unsigned end)
+{
+    int nr_pages = text->large ? FONT_LARGE_PAGES : 1;
+
+    for (int i = 0; i < nr_pages; i++) {
+        for (unsigned col = start; col < end; col++) {
+            _sh1106_fb_put((text->line + i) & (OLED_PAGES - 1), col, text->invert ? 0xff : 0x00);
+        }
+    }
+}
+
+ICACHE_FLASH_ATTR
+void sh1106_text_set(struct sh1106_text *text, const char *str)
+{
+    unsigned width = text->large ? FONT_LARGE_WIDTH : FONT_SMALL_WIDTH,
+             x_start = text->x_start,
+             old_end = text->x_start + (text->len * width),
+             new_end;
+    size_t len = os_strlen(str);
+
+    if (len > SH1106_TEXT_MAX_LEN) {
+        len = SH1106_TEXT_MAX_LEN;
+    }
+
+    if (len == text->len && 0 == memcmp(text->shadow, str, len)) {
+        /* Nothing changed */
+        return;
+    }
+
+    if (0 != len) {
+        x_start = _sh1106_text_start(len, width, text->x_offs, text->align);
+    }
+    new_end = x_start + (len * width);
+
+    for (size_t i = 0; i < len; i++) {
+        /* If the string hasn't moved, only redraw the cells that differ */
+        if (x_start == text->x_start && i < text->len && text->shadow[i] == str[i]) {
+            continue;
+        }
+
+        if (true == text->large) {
+            _sh1106_display_putc_large(text->line, x_start + (i * width), (uint8_t)str[i], text->invert);
+        } else {
+            _sh1106_display_putc(text->line, x_start + (i * width), (uint8_t)str[i], text->invert);
+        }
+    }
+
+    /* Blank whatever the old string covered that the new one doesn't */
+    if (text->x_start < x_start) {
+        _sh1106_text_blank(text, text->x_start, old_end < x_start ? old_end : x_start);
+    }
+
+    if (old_end > new_end) {
+        _sh1106_text_blank(text, text->x_start > new_end ? text->x_start : new_end, old_end);
+    }
+
+    memcpy(text->shadow, str, len);
+    text->len = len;
+    text->x_start = x_start;
+}
+
+ICACHE_FLASH_ATTR
+void sh1106_text_clear(struct sh1106_text *text)
+{
+    sh1106_text_set(text, "");
+}
+
+ICACHE_FLASH_ATTR
+size_t sh1106_display_flush_budget(size_t budget)
+{
+    size_t used = 0;
+    unsigned first = _sh1106_flush_page;
+
+    PROF_START(sh1106_display_flush);
+
+    for (unsigned i = 0; i < OLED_PAGES; i++) {
+        unsigned page = (first + i) % OLED_PAGES;
+        struct sh1106_dirty_span *span = &_sh1106_dirty[page];
+        struct sh1106_page_xfer *xfers = &_sh1106_page_xfers[page];
+        unsigned start, end, col;
+
+        if (span->start >= span->end) {
+            continue;
+        }
+
+        if (spi_xfer_pending(&xfers->addr) || spi_xfer_pending(&xfers->data)) {
+            /* Previous flush of this page is still going out, catch it next time */
+            continue;
+        }
+
+        /* The SPI queue works in words, so widen the span to word boundaries */
+        start = span->start & ~3u;
+        end = (span->end + 3) & ~3u;
+        col = start + OLED_COL_OFFSET;
+
+        /* Send as much of the span as the budget leaves room for, and the rest next time */
+        if (used + SH1106_PAGE_ADDR_LEN + (end - start) > budget) {
+            size_t room = budget - used;
+
+            _sh1106_flush_page = page;
+
+            if (room < SH1106_PAGE_ADDR_LEN + 4) {
+                break;
+            }
+
+            end = start + ((room - SH1106_PAGE_ADDR_LEN) & ~3u);
+        }
+
+        xfers->addr_cmd = SH1106_CMD_SET_PAGE_ADDR(page) |
+            (SH1106_CMD_SET_LOW_COL_ADDR(col) << 8) |
+            (SH1106_CMD_SET_HIGH_COL_ADDR(col) << 16);
+        _sh1106_fill_xfer(&xfers->addr, &xfers->addr_cmd, SH1106_PAGE_ADDR_LEN, false);
+        _sh1106_fill_xfer(&xfers->data, &_sh1106_fb[page][start], end - start, true);
+
+        /* Send the whole span as one burst. Anything drawn into the span while it is in flight
+         * marks it dirty again, so will go out with the next flush.
+         */
+        if (0 != spi_queue_submit(&xfers->addr) || 0 != spi_queue_submit(&xfers->data)) {
+            os_printf("SH1106: Could not queue page %u\r\n", page);
+            continue;
+        }
+
+        used += SH1106_PAGE_ADDR_LEN + (end - start);
+
+        if (end < span->end) {
+            span->start = end;
+            break;
+        }
+
+        span->start = span->end = 0;
+    }
+
+    PROF_END(sh1106_display_flush);
+
+    return used;
+}
+
+ICACHE_FLASH_ATTR
+void sh1106_display_flush(void)
+{
+    sh1106_display_flush_budget(SIZE_MAX);
+}
+
+ICACHE_FLASH_ATTR
+bool sh1106_display_dirty(void)
+{
+    for (unsigned page = 0; page < OLED_PAGES; page++) {
+        if (_sh1106_dirty[page].start < _sh1106_dirty[page].end) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+#ifdef SH1106_BENCHMARK
+/**
+ * The original synchronous path: one transaction with its own chip select toggle and busy-wait.
+ */
+static ICACHE_FLASH_ATTR
+void _sh1106_bench_write_legacy(uint32_t data, size_t nr_bytes, bool is_data)
+{
+    struct spi_xfer xfer;
+
+    _sh1106_fill_xfer(&xfer, &data, nr_bytes, is_data);
+    hal_spi_xfer_sync(&xfer);
+}
+
+/**
+ * The original per-glyph path: two transactions (4 bytes, then 2) per character.
+ */
+static ICACHE_FLASH_ATTR
+void _sh1106_bench_putc_legacy(int c)
+{
+    _sh1106_bench_write_legacy(
+            (uint32_t)font_data[(c * 5) + 0] |
+            ((uint32_t)font_data[(c * 5) + 1] << 8) |
+            ((uint32_t)font_data[(c * 5) + 2] << 16) |
+            ((uint32_t)font_data[(c * 5) + 3] << 24), 4, true);
+    _sh1106_bench_write_legacy((uint32_t)font_data[(c * 5) + 4], 2, true);
+}
+
+/**
+ * The original framebuffer glyph path: five byte loads from the raw font, inverted and written
+ * a column at a time.
+ */
+static ICACHE_FLASH_ATTR
+void _sh1106_bench_putc_columns(unsigned page, unsigned col, uint8_t c)
+{
+    for (int i = 0; i < FONT_CHAR_WIDTH; i++) {
+        _sh1106_fb_put(page, col + i, font_data[(c * FONT_CHAR_WIDTH) + i]);
+    }
+
+    _sh1106_fb_put(page, col + FONT_CHAR_WIDTH, 0);
+}
+
+/**
+ * Compare the cost of drawing a full 21 character line with the old per-glyph SPI writes against
+ * rendering into the framebuffer and flushing it as a single burst.
+ */
+ICACHE_FLASH_ATTR
+void sh1106_benchmark(void)
+{
+    static const char line_a[] = "ABCDEFGHIJKLMNOPQRSTU",
+                      line_b[] = "abcdefghijklmnopqrstu";
+    uint32_t start_cyc, start_us, legacy_cyc, legacy_us, batched_cyc, batched_us;
+
+    /* Don't collide with anything still going out from start of day */
+    spi_queue_wait_idle();
+
+    start_us = hal_time_us();
+    start_cyc = hal_ccount();
+    _sh1106_bench_write_legacy(SH1106_CMD_SET_PAGE_ADDR(7), 1, false);
+    _sh1106_bench_write_legacy((SH1106_CMD_SET_HIGH_COL_ADDR(2 + OLED_COL_OFFSET) << 8) |
+            SH1106_CMD_SET_LOW_COL_ADDR(2 + OLED_COL_OFFSET), 2, false);
+    for (const char *p = line_a; '\0' != *p; p++) {
+        _sh1106_bench_putc_legacy(*p);
+    }
+    legacy_cyc = hal_ccount() - start_cyc;
+    legacy_us = hal_time_us() - start_us;
+
+    /* Make sure the line differs from what is in the framebuffer, so every column gets sent */
+    sh1106_display_puts(7, 0, line_a, false, SH1106_TEXT_ALIGN_LEFT);
+    sh1106_display_flush();
+    spi_queue_wait_idle();
+
+    start_us = hal_time_us();
+    start_cyc = hal_ccount();
+    sh1106_display_puts(7, 0, line_b, false, SH1106_TEXT_ALIGN_LEFT);
+    sh1106_display_flush();
+    spi_queue_wait_idle();
+    batched_cyc = hal_ccount() - start_cyc;
+    batched_us = hal_time_us() - start_us;
+
+    os_printf("SH1106: 21 char line: per-glyph %u cycles (%u us), batched %u cycles (%u us)\r\n",
+            legacy_cyc, legacy_us, batched_cyc, batched_us);
+
+    /* Per-character cost of drawing into the framebuffer, without any SPI traffic */
+    start_cyc = hal_ccount();
+    for (const char *p = line_a; '\0' != *p; p++) {
+        _sh1106_bench_putc_columns(7, 2 + (p - line_a) * FONT_SMALL_WIDTH, *p);
+    }
+    legacy_cyc = hal_ccount() - start_cyc;
+
+    start_cyc = hal_ccount();
+    sh1106_display_puts(7, 0, line_b, false, SH1106_TEXT_ALIGN_LEFT);
+    batched_cyc = hal_ccount() - start_cyc;
+
+    os_printf("SH1106: per char: column at a time %u cycles, cached record %u cycles\r\n",
+            legacy_cyc / 21, batched_cyc / 21);
+
+    start_cyc = hal_ccount();
+    sh1106_display_puts_large(4, 0, "-12.75\xb0" "C", false, SH1106_TEXT_ALIGN_RIGHT);
+    batched_cyc = hal_ccount() - start_cyc;
+
+    os_printf("SH1106: per char: large digits %u cycles\r\n", batched_cyc / 8);
+
+    sh1106_clear_page(4, false, 0);
+    sh1106_clear_page(5, false, 0);
+
+    sh1106_clear_page(7, false, 0);
+    sh1106_display_flush();
+}
+#endif /* SH1106_BENCHMARK */
+
 ICACHE_FLASH_ATTR
 int sh1106_display_init(uint8_t contrast)
 {
@@ -221,7 +624,7 @@ int sh1106_display_init(uint8_t contrast)
              cmd_remap_disp = SH1106_CMD_SET_SEG_REMAP(true);
 
     /* Release the display from reset */
-    gpio_output_set(1 << SH1106_SPI_RSTN, 0, 0, 0);
+    hal_gpio_set(1 << SH1106_SPI_RSTN);
 
     /* TODO: after releasing reset, do we need to wait? */
 
@@ -232,6 +635,7 @@ int sh1106_display_init(uint8_t contrast)
     //_spi_write_command(&cmd_remap_disp, 1);
 
     sh1106_display_clear();
+    sh1106_display_flush();
 
     /* Turn the display on */
     _spi_write_command(&cmd_display_on, 1);
@@ -2,6 +2,7 @@
 
 #include "sh1106_config.h"
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -12,11 +13,89 @@ enum sh1106_text_align {
     SH1106_TEXT_ALIGN_USER,
 };
 
+/**
+ * Longest string a text field will hold, a full line of the small font.
+ */
+#define SH1106_TEXT_MAX_LEN     21
+
+/**
+ * A region of the display showing a string. The last rendered string is shadowed, so updating
+ * the field only redraws the character cells that changed.
+ */
+struct sh1106_text {
+    char shadow[SH1106_TEXT_MAX_LEN];
+    uint8_t len;
+    uint8_t x_start;
+    uint8_t line;
+    uint8_t x_offs;
+    uint8_t align;
+    bool invert;
+    bool large;
+};
+
 int sh1106_display_init(uint8_t contrast);
 int sh1106_display_shutdown(void);
 void sh1106_display_reset(void);
 
 void sh1106_display_set_invert(bool invert);
 void sh1106_display_puts(unsigned line, unsigned x_offs, const char *str, bool invert, enum sh1106_text_align align);
+
+/**
+ * Draw a string in the 8x16 font, covering pages line and line + 1. Characters missing from the
+ * font are drawn as blanks.
+ */
+void sh1106_display_puts_large(unsigned line, unsigned x_offs, const char *str, bool invert, enum sh1106_text_align align);
+
 void sh1106_clear_page(int page, bool invert, int start_col);
+
+/**
+ * Set up a text field. Nothing is drawn until the first call to sh1106_text_set().
+ *
+ * \param text The field to initialize
+ * \param line The page the field is drawn on (the first of two if large is true)
+ * \param x_offs Starting column, used if align is SH1106_TEXT_ALIGN_USER
+ * \param invert Draw the text inverted
+ * \param large Draw the text with the 8x16 font
+ * \param align How to align the text on the line
+ */
+void sh1106_text_init(struct sh1106_text *text, unsigned line, unsigned x_offs, bool invert, bool large,
+        enum sh1106_text_align align);
+
+/**
+ * Update the string shown in a text field. Only the cells that differ from what was last drawn
+ * are touched, and anything left over from a longer string is blanked. Setting the same string
+ * again does nothing.
+ */
+void sh1106_text_set(struct sh1106_text *text, const char *str);
+
+/**
+ * Blank out whatever a text field is currently showing.
+ */
+void sh1106_text_clear(struct sh1106_text *text);
 void sh1106_display_clear(void);
+
+/**
+ * Push all regions of the framebuffer that changed since the last flush out to the panel.
+ */
+void sh1106_display_flush(void);
+
+/**
+ * Push out as much of what changed as fits in budget bytes on the bus, commands included. What
+ * doesn't fit stays dirty for the next flush, which starts where this one left off, so a small
+ * budget still gets every page out in turn. A budget under a few bytes sends nothing.
+ *
+ * \return Bytes queued.
+ */
+size_t sh1106_display_flush_budget(size_t budget);
+
+/**
+ * Check whether anything drawn has yet to go out to the panel.
+ */
+bool sh1106_display_dirty(void);
+
+#ifdef SH1106_BENCHMARK
+/**
+ * Measure the cost of drawing a full line of text, and dump the results to the UART.
+ */
+void sh1106_benchmark(void);
+#endif
@@ -0,0 +1,1379 @@
+/** \file hal_linux.c Linux simulator backend for the HAL
+ * Runs the application as a native process. A single-threaded event loop stands in for the SDK:
+ * it fires timers, runs posted tasks, delivers SPI completions to the emulated devices and
+ * services TCP connections over real sockets.
+ *
+ * Usage: yogurt-sim [--pbm FILE] [--probe-script FILE] [--flash FILE] [--duration SECONDS]
+ *                   [--fast] [--tcp-redirect HOST:PORT] [--listen-port PORT] [--wifi-fail]
+ *                   [--wifi-channel N] [--plant] [--ambient C] [--dns NAME=ADDR]
+ *
+ * Each probe in MAX31855_PROBE_CS gets an emulated MAX31855. --probe-script may be given once per
+ * probe, in the same order; probes past the last script play that one back too.
+ *
+ * With --plant, the heater probe reads a thermal model of the pot, warmed by the heater GPIO, in
+ * a room at --ambient degrees (22C by default). Run it with --fast over a whole profile to tune
+ * the heater controller.
+ *
+ * With --fast, time is virtual and skips straight to the next timer whenever there is nothing
+ * else to do, so long runs complete quickly.
+ *
+ * Listening sockets are real too, on the port asked for or on --listen-port.
+ *
+ * There is one access point to join, on channel 6 unless --wifi-channel moves it, which is enough
+ * to make a fast connect to where it used to be fail. Fast connects to where it is now are quicker
+ * than a full scan and DHCP. With --wifi-fail it can't be found at all.
+ *
+ * The resolver knows the names given with --dns, and answers a little later, as a real one would.
+ * Any other name fails to resolve. Pointing names at different loopback addresses (127.0.0.2,
+ * 127.0.0.3, ...) makes it easy to stand in for several servers on one machine.
+ *
+ * stdin is the console UART: lines typed there go to the application's UART receive handler.
+ *
+ * The SPI flash is backed by a file (yogurt-sim.flash by default), so anything the application
+ * stores there survives from one run to the next.
+ *
+ * Deep sleep is a reboot in place: once the sleep is over, every timer, task and connection is
+ * dropped and user_init() runs again, with RTC memory kept as it was. The application's own
+ * statics are not wiped the way RAM would be, so anything that matters must be set up again in
+ * user_init(), as it would have to be on the device.
+ */
+
+#include "hal.h"
+#include "spi_queue.h"
+#include "sim/sim.h"
+
+#include "sh1106_config.h"
+#include "max31855_config.h"
+#include "heater_config.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SIM_TASK_QUEUE_LEN      32
+#define SIM_MAX_TCP             16
+#define SIM_TCP_RECV_LEN        1460
+#define SIM_UART_RX_LEN         128
+
+/* Time from hal_wifi_connect() to the station getting an address, with and without a scan */
+#define SIM_WIFI_CONNECT_US     1000000ull
+#define SIM_WIFI_FAST_CONNECT_US 150000ull
+
+/* Time the resolver takes to answer */
+#define SIM_DNS_DELAY_US        20000ull
+
+void user_init(void);
+
+struct sim_options sim_opts = {
+    .pbm_path = "yogurt-sim.pbm",
+    .flash_path = "yogurt-sim.flash",
+    .duration_s = 0,
+    .ambient_c = 22.0,
+    .wifi_channel = 6,
+};
+
+struct sim_task {
+    hal_task_func_t func;
+    struct {
+        uint32_t sig;
+        uint32_t par;
+    } events[SIM_TASK_QUEUE_LEN];
+    unsigned head;
+    unsigned count;
+};
+
+static
+struct sim_task _sim_tasks[HAL_TASK_PRIO_MAX];
+
+static
+struct hal_timer *_sim_timers = NULL;
+
+static
+struct hal_tcp *_sim_tcp_conns = NULL;
+
+static
+struct hal_dns *_sim_dns_pending = NULL;
+
+static
+struct hal_tcp_listener *_sim_tcp_listener = NULL;
+
+static
+struct sim_spi_device *_sim_spi_devices = NULL;
+
+/**
+ * Transaction whose "interrupt" is waiting to be delivered
+ */
+static
+struct spi_xfer *_sim_spi_cur = NULL;
+
+/* The bus clock, and how many times it has been changed since start of day */
+static
+uint32_t _sim_spi_hz = 0,
+         _sim_spi_nr_speed_changes = 0;
+
+static
+uint64_t _sim_start_ns = 0,
+         _sim_virtual_us = 0;
+
+static
+uint32_t _sim_random_state = 1;
+
+static
+uint32_t _sim_gpio_out = 0;
+
+static
+enum hal_wifi_status _sim_wifi_status = HAL_WIFI_IDLE;
+
+static
+uint64_t _sim_wifi_connect_at = 0,
+         _sim_wifi_connect_start = 0;
+
+/* Whether the attempt under way finds the access point */
+static
+bool _sim_wifi_found = false;
+
+/* The access point, and the lease it hands out */
+static
+const uint8_t _sim_wifi_bssid[6] = { 0x02, 0x00, 0x5e, 0x10, 0x00, 0x01 };
+
+/* RTC memory, which survives deep sleep. Starts out as garbage, as after power-on */
+static
+uint32_t _sim_rtc_mem[HAL_RTC_MEM_LEN / 4];
+
+static
+bool _sim_sleeping = false,
+     _sim_powered = true,
+     _sim_radio_on = true,
+     _sim_radio_on_wake = true;
+
+/* Time of the last boot, and of the end of the current deep sleep */
+static
+uint64_t _sim_boot_us = 0,
+         _sim_wake_us = 0;
+
+/* For the report at exit: wakes from deep sleep and time spent awake */
+static
+uint64_t _sim_nr_wakes = 0,
+         _sim_nr_radio_wakes = 0,
+         _sim_awake_us = 0,
+         _sim_radio_awake_us = 0;
+
+static
+uint64_t _sim_monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t sim_time_us(void)
+{
+    if (true == sim_opts.fast) {
+        return _sim_virtual_us;
+    }
+
+    return (_sim_monotonic_ns() - _sim_start_ns) / 1000;
+}
+
+void hal_init(void)
+{
+    setvbuf(stdout, NULL, _IOLBF, 0);
+}
+
+uint32_t hal_time_us(void)
+{
+    /* Like the device, counts from the last boot */
+    return (uint32_t)(sim_time_us() - _sim_boot_us);
+}
+
+uint32_t hal_ccount(void)
+{
+    /* Pretend to be an 80MHz part */
+    return (uint32_t)((_sim_monotonic_ns() - _sim_start_ns) * 80 / 1000);
+}
+
+uint32_t hal_random(void)
+{
+    /* xorshift32, seeded differently every run as separate devices would be */
+    _sim_random_state ^= _sim_random_state << 13;
+    _sim_random_state ^= _sim_random_state >> 17;
+    _sim_random_state ^= _sim_random_state << 5;
+
+    return _sim_random_state;
+}
+
+/*
+ * GPIO
+ */
+
+void hal_gpio_enable_output(unsigned gpio)
+{
+}
+
+void hal_gpio_set(uint32_t mask)
+{
+    sim_plant_advance();
+    _sim_gpio_out |= mask;
+}
+
+void hal_gpio_clear(uint32_t mask)
+{
+    sim_plant_advance();
+    _sim_gpio_out &= ~mask;
+}
+
+uint32_t sim_gpio_out(void)
+{
+    return _sim_gpio_out;
+}
+
+/*
+ * Tasks
+ */
+
+int hal_task_register(enum hal_task_prio prio, hal_task_func_t func)
+{
+    if (prio >= HAL_TASK_PRIO_MAX || NULL != _sim_tasks[prio].func) {
+        return -1;
+    }
+
+    _sim_tasks[prio].func = func;
+
+    return 0;
+}
+
+int hal_task_post(enum hal_task_prio prio, uint32_t sig, uint32_t par)
+{
+    struct sim_task *task = &_sim_tasks[prio];
+    unsigned slot;
+
+    if (prio >= HAL_TASK_PRIO_MAX || SIM_TASK_QUEUE_LEN == task->count) {
+        return -1;
+    }
+
+    slot = (task->head + task->count) % SIM_TASK_QUEUE_LEN;
+    task->events[slot].sig = sig;
+    task->events[slot].par = par;
+    task->count++;
+
+    return 0;
+}
+
+/**
+ * Run one event from the highest priority task with anything queued.
+ *
+ * \return true if an event was run.
+ */
+static
+bool _sim_run_task(void)
+{
+    for (int prio = HAL_TASK_PRIO_MAX - 1; prio >= 0; prio--) {
+        struct sim_task *task = &_sim_tasks[prio];
+        uint32_t sig, par;
+
+        if (0 == task->count) {
+            continue;
+        }
+
+        sig = task->events[task->head].sig;
+        par = task->events[task->head].par;
+        task->head = (task->head + 1) % SIM_TASK_QUEUE_LEN;
+        task->count--;
+
+        if (NULL != task->func) {
+            task->func(sig, par);
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Timers
+ */
+
+void hal_timer_setfn(struct hal_timer *timer, hal_timer_func_t func, void *arg)
+{
+    hal_timer_disarm(timer);
+    timer->priv.func = func;
+    timer->priv.arg = arg;
+}
+
+void hal_timer_arm(struct hal_timer *timer, uint32_t ms, bool repeat)
+{
+    hal_timer_disarm(timer);
+
+    timer->priv.period_ms = ms;
+    timer->priv.repeat = repeat;
+    timer->priv.deadline_us = sim_time_us() + (uint64_t)ms * 1000;
+    timer->priv.armed = true;
+    timer->priv.next = _sim_timers;
+    _sim_timers = timer;
+}
+
+void hal_timer_disarm(struct hal_timer *timer)
+{
+    struct hal_timer **pprev = &_sim_timers;
+
+    if (false == timer->priv.armed) {
+        return;
+    }
+
+    while (NULL != *pprev && timer != *pprev) {
+        pprev = &(*pprev)->priv.next;
+    }
+
+    if (NULL != *pprev) {
+        *pprev = timer->priv.next;
+    }
+
+    timer->priv.armed = false;
+    timer->priv.next = NULL;
+}
+
+/*
+ * Console UART receive, from stdin. What is read is handed over from the UART task, as on the
+ * device.
+ */
+static
+hal_uart_rx_func_t _sim_uart_rx_func = NULL;
+
+static
+char _sim_uart_rx_buf[SIM_UART_RX_LEN];
+
+static
+size_t _sim_uart_rx_len = 0;
+
+static
+bool _sim_uart_eof = false;
+
+static
+void _sim_uart_task(uint32_t sig, uint32_t par)
+{
+    size_t len = _sim_uart_rx_len;
+
+    _sim_uart_rx_len = 0;
+
+    if (0 != len && NULL != _sim_uart_rx_func) {
+        _sim_uart_rx_func(_sim_uart_rx_buf, len);
+    }
+}
+
+int hal_uart_set_rx(hal_uart_rx_func_t func)
+{
+    if (0 != hal_task_register(HAL_TASK_PRIO_LOW, _sim_uart_task)) {
+        return -1;
+    }
+
+    _sim_uart_rx_func = func;
+
+    return 0;
+}
+
+/**
+ * Pick up whatever is waiting on stdin, without blocking.
+ *
+ * \return true if anything was.
+ */
+static
+bool _sim_poll_uart(void)
+{
+    struct pollfd fd = { .fd = STDIN_FILENO, .events = POLLIN };
+    ssize_t nr;
+
+    /* Wait for the last lot to be handed over first */
+    if (NULL == _sim_uart_rx_func || true == _sim_uart_eof || 0 != _sim_uart_rx_len) {
+        return false;
+    }
+
+    if (1 != poll(&fd, 1, 0)) {
+        return false;
+    }
+
+    if (0 >= (nr = read(STDIN_FILENO, _sim_uart_rx_buf, sizeof(_sim_uart_rx_buf)))) {
+        _sim_uart_eof = true;
+        return false;
+    }
+
+    _sim_uart_rx_len = nr;
+    hal_task_post(HAL_TASK_PRIO_LOW, 0, 0);
+
+    return true;
+}
+
+/*
+ * The hardware timer is one more software timer here, to the millisecond. It fires from the main
+ * loop, so the time it passes on shows the latency of the software timers rather than of an
+ * interrupt.
+ */
+static
+struct hal_timer _sim_hw_timer;
+
+static
+hal_hw_timer_func_t _sim_hw_timer_func = NULL;
+
+static
+void _sim_hw_timer_fire(void *arg)
+{
+    _sim_hw_timer_func(hal_time_us());
+}
+
+int hal_hw_timer_start(uint32_t period_us, hal_hw_timer_func_t func)
+{
+    if (period_us < 1000) {
+        return -1;
+    }
+
+    _sim_hw_timer_func = func;
+    hal_timer_setfn(&_sim_hw_timer, _sim_hw_timer_fire, NULL);
+    hal_timer_arm(&_sim_hw_timer, period_us / 1000, true);
+
+    return 0;
+}
+
+void hal_hw_timer_stop(void)
+{
+    hal_timer_disarm(&_sim_hw_timer);
+}
+
+/**
+ * Fire the earliest expired timer, if any.
+ *
+ * \return true if a timer fired.
+ */
+static
+bool _sim_run_timer(uint64_t now)
+{
+    struct hal_timer *expired = NULL;
+
+    for (struct hal_timer *timer = _sim_timers; NULL != timer; timer = timer->priv.next) {
+        if (timer->priv.deadline_us <= now &&
+                (NULL == expired || timer->priv.deadline_us < expired->priv.deadline_us))
+        {
+            expired = timer;
+        }
+    }
+
+    if (NULL == expired) {
+        return false;
+    }
+
+    if (true == expired->priv.repeat) {
+        /* Keep the period fixed relative to the deadline, like the SDK does */
+        expired->priv.deadline_us += (uint64_t)expired->priv.period_ms * 1000;
+    } else {
+        hal_timer_disarm(expired);
+    }
+
+    expired->priv.func(expired->priv.arg);
+
+    return true;
+}
+
+static
+bool _sim_next_deadline(uint64_t *deadline)
+{
+    bool found = false;
+
+    for (struct hal_timer *timer = _sim_timers; NULL != timer; timer = timer->priv.next) {
+        if (false == found || timer->priv.deadline_us < *deadline) {
+            *deadline = timer->priv.deadline_us;
+            found = true;
+        }
+    }
+
+    for (struct hal_dns *dns = _sim_dns_pending; NULL != dns; dns = dns->priv.next) {
+        if (false == found || dns->priv.due_us < *deadline) {
+            *deadline = dns->priv.due_us;
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+/*
+ * SPI
+ */
+
+void sim_spi_register(struct sim_spi_device *dev)
+{
+    dev->next = _sim_spi_devices;
+    _sim_spi_devices = dev;
+}
+
+void hal_spi_init(uint32_t speed_hz)
+{
+    static const uint8_t probe_cs[] = { MAX31855_PROBE_CS };
+    static bool devices_ready = false;
+
+    _sim_spi_hz = speed_hz;
+
+    /* The emulated devices stay powered through deep sleep */
+    if (true == devices_ready) {
+        return;
+    }
+
+    devices_ready = true;
+
+    if (true == sim_opts.plant) {
+        sim_plant_init();
+    }
+
+    sim_sh1106_init(SH1106_SPI_CSN, sim_opts.pbm_path);
+
+    /* Probes past the last script given play back the last one */
+    for (size_t i = 0; i < sizeof(probe_cs); i++) {
+        const char *script = NULL;
+
+        if (0 != sim_opts.nr_probe_scripts) {
+            script = sim_opts.probe_scripts[i < sim_opts.nr_probe_scripts ? i : sim_opts.nr_probe_scripts - 1];
+        }
+
+        if (0 != sim_max31855_init(probe_cs[i], script, true == sim_opts.plant && HEATER_PROBE == i)) {
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void hal_spi_set_speed(uint32_t speed_hz)
+{
+    if (speed_hz != _sim_spi_hz) {
+        _sim_spi_hz = speed_hz;
+        _sim_spi_nr_speed_changes++;
+    }
+}
+
+/**
+ * Run the transaction against whichever emulated device its chip select picks. The whole thing
+ * happens at once; only the completion is deferred.
+ */
+static
+void _sim_spi_xfer(struct spi_xfer *xfer)
+{
+    uint32_t rx_words[(SPI_XFER_MAX_RX + 3)/4];
+    struct sim_spi_device *dev = _sim_spi_devices;
+
+    while (NULL != dev && dev->cs != xfer->cs) {
+        dev = dev->next;
+    }
+
+    memset(rx_words, 0xff, sizeof(rx_words));
+
+    if (NULL != dev) {
+        dev->xfer(dev, xfer->a0_level, xfer->tx, xfer->tx_len, (uint8_t *)rx_words, xfer->rx_len);
+        dev->nr_xfers++;
+        dev->nr_bytes += xfer->tx_len + xfer->rx_len;
+    }
+
+    if (0 != xfer->rx_len) {
+        memcpy(xfer->rx, rx_words, xfer->rx_len);
+    }
+
+    xfer->tx_offs = xfer->tx_len;
+}
+
+void hal_spi_start(struct spi_xfer *xfer)
+{
+    _sim_spi_xfer(xfer);
+    _sim_spi_cur = xfer;
+}
+
+void hal_spi_xfer_sync(struct spi_xfer *xfer)
+{
+    _sim_spi_xfer(xfer);
+}
+
+/**
+ * Deliver the pending SPI "interrupt", if any.
+ *
+ * \return true if a transaction completed.
+ */
+static
+bool _sim_spi_complete(void)
+{
+    if (NULL == _sim_spi_cur) {
+        return false;
+    }
+
+    _sim_spi_cur = NULL;
+    spi_queue_complete();
+
+    return true;
+}
+
+void hal_spi_poll(void)
+{
+    _sim_spi_complete();
+}
+
+void hal_spi_lock(void)
+{
+}
+
+void hal_spi_unlock(void)
+{
+}
+
+/*
+ * WiFi
+ */
+
+void hal_wifi_init(void)
+{
+}
+
+int hal_wifi_connect(const char *ssid, const char *psk, const struct hal_wifi_link *link)
+{
+    if (false == _sim_radio_on) {
+        fprintf(stderr, "sim: hal_wifi_connect() with the radio powered down\n");
+        return -1;
+    }
+
+    _sim_wifi_status = HAL_WIFI_CONNECTING;
+    _sim_wifi_connect_start = sim_time_us();
+    _sim_wifi_found = false == sim_opts.wifi_fail;
+
+    if (NULL == link) {
+        _sim_wifi_connect_at = _sim_wifi_connect_start + SIM_WIFI_CONNECT_US;
+    } else if (0 == memcmp(link->bssid, _sim_wifi_bssid, sizeof(_sim_wifi_bssid)) &&
+            link->channel == sim_opts.wifi_channel)
+    {
+        _sim_wifi_connect_at = _sim_wifi_connect_start + SIM_WIFI_FAST_CONNECT_US;
+    } else {
+        /* Not where it was; the SDK gives up after much the same time as a scan takes */
+        _sim_wifi_connect_at = _sim_wifi_connect_start + SIM_WIFI_CONNECT_US;
+        _sim_wifi_found = false;
+    }
+
+    return 0;
+}
+
+enum hal_wifi_status hal_wifi_status(void)
+{
+    if (HAL_WIFI_CONNECTING == _sim_wifi_status && sim_time_us() >= _sim_wifi_connect_at) {
+        _sim_wifi_status = true == _sim_wifi_found ? HAL_WIFI_GOT_IP : HAL_WIFI_NO_AP_FOUND;
+    }
+
+    return _sim_wifi_status;
+}
+
+int hal_wifi_get_link(struct hal_wifi_link *link, uint32_t *connect_us)
+{
+    if (HAL_WIFI_GOT_IP != hal_wifi_status()) {
+        return -1;
+    }
+
+    memset(link, 0, sizeof(*link));
+    memcpy(link->bssid, _sim_wifi_bssid, sizeof(link->bssid));
+    link->channel = sim_opts.wifi_channel;
+    link->ip = HAL_IP4(192, 168, 4, 50);
+    link->netmask = HAL_IP4(255, 255, 255, 0);
+    link->gw = HAL_IP4(192, 168, 4, 1);
+    link->dns = HAL_IP4(192, 168, 4, 1);
+    *connect_us = _sim_wifi_connect_at - _sim_wifi_connect_start;
+
+    return 0;
+}
+
+/*
+ * DNS, from the names given on the command line
+ */
+
+int hal_dns_resolve(struct hal_dns *dns, const char *name)
+{
+    struct in_addr addr;
+
+    if (true == dns->priv.pending) {
+        return -1;
+    }
+
+    /* Like lwIP, a dotted quad is answered straight away */
+    if (1 == inet_pton(AF_INET, name, &addr)) {
+        dns->on_resolved(dns, addr.s_addr);
+        return 0;
+    }
+
+    dns->priv.ip_addr = 0;
+    for (unsigned i = 0; i < sim_opts.nr_dns_names; i++) {
+        if (0 == strcmp(sim_opts.dns_names[i], name)) {
+            dns->priv.ip_addr = sim_opts.dns_addrs[i];
+            break;
+        }
+    }
+
+    dns->priv.due_us = sim_time_us() + SIM_DNS_DELAY_US;
+    dns->priv.pending = true;
+    dns->priv.next = _sim_dns_pending;
+    _sim_dns_pending = dns;
+
+    return 0;
+}
+
+/**
+ * Answer the first lookup that is due, if any.
+ *
+ * \return true if a lookup was answered.
+ */
+static
+bool _sim_run_dns(uint64_t now)
+{
+    for (struct hal_dns **pprev = &_sim_dns_pending; NULL != *pprev; pprev = &(*pprev)->priv.next) {
+        struct hal_dns *dns = *pprev;
+
+        if (dns->priv.due_us <= now) {
+            *pprev = dns->priv.next;
+            dns->priv.pending = false;
+            dns->on_resolved(dns, dns->priv.ip_addr);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * TCP, over real sockets
+ */
+
+static
+void _sim_tcp_unlink(struct hal_tcp *tcp)
+{
+    struct hal_tcp **pprev = &_sim_tcp_conns;
+
+    while (NULL != *pprev && tcp != *pprev) {
+        pprev = &(*pprev)->priv.next;
+    }
+
+    if (NULL != *pprev) {
+        *pprev = tcp->priv.next;
+    }
+
+    if (tcp->priv.fd >= 0) {
+        close(tcp->priv.fd);
+    }
+
+    tcp->priv.fd = -1;
+    tcp->priv.active = false;
+    tcp->priv.next = NULL;
+}
+
+int hal_tcp_connect(struct hal_tcp *tcp, uint32_t ip_addr, uint16_t port)
+{
+    struct sockaddr_in sa;
+
+    memset(&tcp->priv, 0, sizeof(tcp->priv));
+    tcp->priv.fd = -1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = ip_addr;
+    sa.sin_port = htons(port);
+
+    if (NULL != sim_opts.tcp_redirect_host) {
+        inet_pton(AF_INET, sim_opts.tcp_redirect_host, &sa.sin_addr);
+        sa.sin_port = htons(sim_opts.tcp_redirect_port);
+    }
+
+    if (0 > (tcp->priv.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0))) {
+        perror("sim: socket");
+        return -1;
+    }
+
+    if (0 != connect(tcp->priv.fd, (struct sockaddr *)&sa, sizeof(sa)) && EINPROGRESS != errno) {
+        perror("sim: connect");
+        close(tcp->priv.fd);
+        tcp->priv.fd = -1;
+        return -1;
+    }
+
+    tcp->priv.active = true;
+    tcp->priv.next = _sim_tcp_conns;
+    _sim_tcp_conns = tcp;
+
+    return 0;
+}
+
+int hal_tcp_listen(struct hal_tcp_listener *listener, uint16_t port, unsigned max_conns, unsigned timeout_s)
+{
+    struct sockaddr_in sa;
+    int one = 1;
+
+    if (NULL != _sim_tcp_listener) {
+        return -1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = htons(0 != sim_opts.listen_port ? sim_opts.listen_port : port);
+
+    if (0 > (listener->priv.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0))) {
+        perror("sim: socket");
+        return -1;
+    }
+
+    setsockopt(listener->priv.fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (0 != bind(listener->priv.fd, (struct sockaddr *)&sa, sizeof(sa)) ||
+            0 != listen(listener->priv.fd, max_conns))
+    {
+        perror("sim: listen");
+        close(listener->priv.fd);
+        return -1;
+    }
+
+    _sim_tcp_listener = listener;
+
+    return 0;
+}
+
+/**
+ * Take a connection waiting on the listener, if the application wants it.
+ */
+static
+void _sim_tcp_accept(void)
+{
+    struct hal_tcp *tcp = NULL;
+    int fd = accept(_sim_tcp_listener->priv.fd, NULL, NULL);
+
+    if (fd < 0) {
+        return;
+    }
+
+    if (0 > fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)) {
+        close(fd);
+        return;
+    }
+
+    if (NULL == (tcp = _sim_tcp_listener->on_accept(_sim_tcp_listener))) {
+        close(fd);
+        return;
+    }
+
+    memset(&tcp->priv, 0, sizeof(tcp->priv));
+    tcp->priv.fd = fd;
+    tcp->priv.active = true;
+    tcp->priv.connected = true;
+    tcp->priv.next = _sim_tcp_conns;
+    _sim_tcp_conns = tcp;
+
+    if (NULL != tcp->on_connect) {
+        tcp->on_connect(tcp);
+    }
+}
+
+int hal_tcp_send(struct hal_tcp *tcp, const void *data, size_t len)
+{
+    if (false == tcp->priv.active || false == tcp->priv.connected || NULL != tcp->priv.tx) {
+        return -1;
+    }
+
+    tcp->priv.tx = data;
+    tcp->priv.tx_len = len;
+    tcp->priv.tx_offs = 0;
+
+    return 0;
+}
+
+int hal_tcp_disconnect(struct hal_tcp *tcp)
+{
+    if (false == tcp->priv.active) {
+        return -1;
+    }
+
+    /* Like espconn, the disconnect callback comes later */
+    shutdown(tcp->priv.fd, SHUT_RDWR);
+    tcp->priv.closing = true;
+
+    return 0;
+}
+
+/**
+ * Service one event on one connection.
+ */
+static
+void _sim_tcp_service(struct hal_tcp *tcp, short revents)
+{
+    if (true == tcp->priv.closing) {
+        _sim_tcp_unlink(tcp);
+        if (NULL != tcp->on_disconnect) {
+            tcp->on_disconnect(tcp);
+        }
+        return;
+    }
+
+    if (false == tcp->priv.connected) {
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+
+        if (0 == (revents & (POLLOUT | POLLERR | POLLHUP))) {
+            return;
+        }
+
+        getsockopt(tcp->priv.fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+        if (0 != err) {
+            _sim_tcp_unlink(tcp);
+            if (NULL != tcp->on_error) {
+                tcp->on_error(tcp, -err);
+            }
+            return;
+        }
+
+        tcp->priv.connected = true;
+        if (NULL != tcp->on_connect) {
+            tcp->on_connect(tcp);
+        }
+        return;
+    }
+
+    if ((revents & POLLOUT) && NULL != tcp->priv.tx) {
+        ssize_t ret = send(tcp->priv.fd, tcp->priv.tx + tcp->priv.tx_offs,
+                tcp->priv.tx_len - tcp->priv.tx_offs, MSG_NOSIGNAL);
+
+        if (ret > 0) {
+            tcp->priv.tx_offs += ret;
+        }
+
+        if (tcp->priv.tx_offs == tcp->priv.tx_len) {
+            tcp->priv.tx = NULL;
+            if (NULL != tcp->on_sent) {
+                tcp->on_sent(tcp);
+            }
+            return;
+        }
+    }
+
+    if (revents & (POLLIN | POLLERR | POLLHUP)) {
+        char buf[SIM_TCP_RECV_LEN];
+        ssize_t ret = recv(tcp->priv.fd, buf, sizeof(buf), 0);
+
+        if (ret > 0) {
+            if (NULL != tcp->on_recv) {
+                tcp->on_recv(tcp, buf, ret);
+            }
+        } else if (0 == ret) {
+            _sim_tcp_unlink(tcp);
+            if (NULL != tcp->on_disconnect) {
+                tcp->on_disconnect(tcp);
+            }
+        } else if (EAGAIN != errno && EWOULDBLOCK != errno) {
+            int err = errno;
+            _sim_tcp_unlink(tcp);
+            if (NULL != tcp->on_error) {
+                tcp->on_error(tcp, -err);
+            }
+        }
+    }
+}
+
+/**
+ * Wait up to timeout_ms for socket activity, and service whatever is ready.
+ *
+ * \return true if any connection was serviced.
+ */
+static
+bool _sim_poll_tcp(int timeout_ms)
+{
+    struct pollfd fds[SIM_MAX_TCP + 1];
+    struct hal_tcp *conns[SIM_MAX_TCP + 1];
+    int nr = 0;
+    bool serviced = false;
+
+    for (struct hal_tcp *tcp = _sim_tcp_conns; NULL != tcp && nr < SIM_MAX_TCP; tcp = tcp->priv.next) {
+        if (true == tcp->priv.closing) {
+            /* Nothing to wait for */
+            timeout_ms = 0;
+        }
+
+        fds[nr].fd = tcp->priv.fd;
+        fds[nr].events = POLLIN;
+        if (false == tcp->priv.connected || NULL != tcp->priv.tx) {
+            fds[nr].events |= POLLOUT;
+        }
+        fds[nr].revents = 0;
+        conns[nr] = tcp;
+        nr++;
+    }
+
+    /* The listener goes last, with no connection */
+    if (NULL != _sim_tcp_listener) {
+        fds[nr].fd = _sim_tcp_listener->priv.fd;
+        fds[nr].events = POLLIN;
+        fds[nr].revents = 0;
+        conns[nr] = NULL;
+        nr++;
+    }
+
+    if (0 == nr) {
+        if (timeout_ms > 0) {
+            usleep(timeout_ms * 1000);
+        }
+        return false;
+    }
+
+    if (0 > poll(fds, nr, timeout_ms)) {
+        return false;
+    }
+
+    for (int i = 0; i < nr; i++) {
+        if (NULL == conns[i]) {
+            if (0 != fds[i].revents) {
+                _sim_tcp_accept();
+                serviced = true;
+            }
+            continue;
+        }
+
+        /* An earlier callback may have torn this one down */
+        if (false == conns[i]->priv.active) {
+            continue;
+        }
+
+        if (0 != fds[i].revents || true == conns[i]->priv.closing) {
+            _sim_tcp_service(conns[i], fds[i].revents);
+            serviced = true;
+        }
+    }
+
+    return serviced;
+}
+
+/*
+ * RTC memory and deep sleep
+ */
+
+int hal_rtc_mem_read(unsigned offset, void *data, size_t len)
+{
+    if (0 != (offset & 3) || 0 != (len & 3) || offset + len > HAL_RTC_MEM_LEN) {
+        return -1;
+    }
+
+    memcpy(data, (uint8_t *)_sim_rtc_mem + offset, len);
+
+    return 0;
+}
+
+int hal_rtc_mem_write(unsigned offset, const void *data, size_t len)
+{
+    if (0 != (offset & 3) || 0 != (len & 3) || offset + len > HAL_RTC_MEM_LEN) {
+        return -1;
+    }
+
+    memcpy((uint8_t *)_sim_rtc_mem + offset, data, len);
+
+    return 0;
+}
+
+void hal_deep_sleep(uint32_t us, bool radio_on_wake)
+{
+    /* The main loop powers everything down once the current callback returns */
+    _sim_sleeping = true;
+    _sim_wake_us = sim_time_us() + us;
+    _sim_radio_on_wake = radio_on_wake;
+}
+
+/**
+ * Account for the time spent awake since the last boot.
+ */
+static
+void _sim_account_awake(void)
+{
+    uint64_t awake_us = sim_time_us() - _sim_boot_us;
+
+    _sim_awake_us += awake_us;
+    if (true == _sim_radio_on) {
+        _sim_radio_awake_us += awake_us;
+    }
+}
+
+/**
+ * Power down: forget every timer, task, SPI transaction and connection.
+ */
+static
+void _sim_power_down(void)
+{
+    while (NULL != _sim_tcp_conns) {
+        _sim_tcp_unlink(_sim_tcp_conns);
+    }
+
+    if (NULL != _sim_tcp_listener) {
+        close(_sim_tcp_listener->priv.fd);
+        _sim_tcp_listener = NULL;
+    }
+
+    while (NULL != _sim_timers) {
+        hal_timer_disarm(_sim_timers);
+    }
+
+    _sim_dns_pending = NULL;
+
+    memset(_sim_tasks, 0, sizeof(_sim_tasks));
+    _sim_uart_rx_func = NULL;
+    _sim_uart_rx_len = 0;
+    _sim_spi_cur = NULL;
+    _sim_wifi_status = HAL_WIFI_IDLE;
+
+    _sim_account_awake();
+    _sim_powered = false;
+}
+
+/**
+ * The deep sleep is over; boot again.
+ */
+static
+void _sim_wake(void)
+{
+    _sim_sleeping = false;
+    _sim_powered = true;
+    _sim_radio_on = _sim_radio_on_wake;
+    _sim_boot_us = sim_time_us();
+
+    _sim_nr_wakes++;
+    if (true == _sim_radio_on) {
+        _sim_nr_radio_wakes++;
+    }
+
+    user_init();
+}
+
+/*
+ * Main loop
+ */
+
+static
+void _sim_report(void)
+{
+    sim_sh1106_sync();
+
+    fprintf(stderr, "sim: ran for %.3f s\n", sim_time_us() / 1e6);
+
+    if (0 != _sim_nr_wakes) {
+        if (true == _sim_powered) {
+            _sim_account_awake();
+        }
+
+        fprintf(stderr, "sim: %llu wakes from deep sleep, %llu with the radio on\n",
+                (unsigned long long)_sim_nr_wakes, (unsigned long long)_sim_nr_radio_wakes);
+        fprintf(stderr, "sim: awake %.3f s, %.3f s of it with the radio on\n",
+                _sim_awake_us / 1e6, _sim_radio_awake_us / 1e6);
+    }
+
+    sim_plant_report();
+
+    fprintf(stderr, "sim: spi clock %u Hz, changed %u times\n", _sim_spi_hz, _sim_spi_nr_speed_changes);
+
+    for (struct sim_spi_device *dev = _sim_spi_devices; NULL != dev; dev = dev->next) {
+        fprintf(stderr, "sim: spi %s: %llu transactions, %llu bytes\n", dev->name,
+                (unsigned long long)dev->nr_xfers, (unsigned long long)dev->nr_bytes);
+    }
+}
+
+static
+void _sim_usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [--pbm FILE] [--probe-script FILE] [--flash FILE] [--duration SECONDS]\n"
+            "          [--fast] [--tcp-redirect HOST:PORT] [--listen-port PORT] [--wifi-fail]\n"
+            "          [--wifi-channel N] [--plant] [--ambient C] [--dns NAME=ADDR]\n", argv0);
+}
+
+static
+int _sim_parse_args(int argc, char *argv[])
+{
+    static const struct option long_opts[] = {
+        { "pbm", required_argument, NULL, 'p' },
+        { "probe-script", required_argument, NULL, 's' },
+        { "flash", required_argument, NULL, 'F' },
+        { "duration", required_argument, NULL, 'd' },
+        { "fast", no_argument, NULL, 'f' },
+        { "tcp-redirect", required_argument, NULL, 'r' },
+        { "listen-port", required_argument, NULL, 'l' },
+        { "wifi-fail", no_argument, NULL, 'w' },
+        { "wifi-channel", required_argument, NULL, 'c' },
+        { "plant", no_argument, NULL, 'P' },
+        { "ambient", required_argument, NULL, 'a' },
+        { "dns", required_argument, NULL, 'D' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    int opt;
+
+    while (-1 != (opt = getopt_long(argc, argv, "p:s:F:d:fr:l:wc:Pa:D:h", long_opts, NULL))) {
+        switch (opt) {
+        case 'p':
+            sim_opts.pbm_path = optarg;
+            break;
+        case 's':
+            if (SIM_MAX31855_MAX_PROBES == sim_opts.nr_probe_scripts) {
+                fprintf(stderr, "sim: too many probe scripts\n");
+                return -1;
+            }
+            sim_opts.probe_scripts[sim_opts.nr_probe_scripts++] = optarg;
+            break;
+        case 'F':
+            sim_opts.flash_path = optarg;
+            break;
+        case 'd':
+            sim_opts.duration_s = atof(optarg);
+            break;
+        case 'f':
+            sim_opts.fast = true;
+            break;
+        case 'r': {
+            char *colon = strrchr(optarg, ':');
+
+            if (NULL == colon) {
+                _sim_usage(argv[0]);
+                return -1;
+            }
+
+            *colon = '\0';
+            sim_opts.tcp_redirect_host = optarg;
+            sim_opts.tcp_redirect_port = atoi(colon + 1);
+            break;
+        }
+        case 'l':
+            sim_opts.listen_port = atoi(optarg);
+            break;
+        case 'w':
+            sim_opts.wifi_fail = true;
+            break;
+        case 'c':
+            sim_opts.wifi_channel = atoi(optarg);
+            break;
+        case 'P':
+            sim_opts.plant = true;
+            break;
+        case 'a':
+            sim_opts.ambient_c = atof(optarg);
+            break;
+        case 'D': {
+            char *eq = strchr(optarg, '=');
+            struct in_addr addr;
+
+            if (NULL == eq || 1 != inet_pton(AF_INET, eq + 1, &addr)) {
+                _sim_usage(argv[0]);
+                return -1;
+            }
+
+            if (SIM_MAX_DNS_NAMES == sim_opts.nr_dns_names) {
+                fprintf(stderr, "sim: too many DNS names\n");
+                return -1;
+            }
+
+            *eq = '\0';
+            sim_opts.dns_names[sim_opts.nr_dns_names] = optarg;
+            sim_opts.dns_addrs[sim_opts.nr_dns_names++] = addr.s_addr;
+            break;
+        }
+        default:
+            _sim_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t end_us;
+
+    if (0 != _sim_parse_args(argc, argv)) {
+        return EXIT_FAILURE;
+    }
+
+    _sim_start_ns = _sim_monotonic_ns();
+    end_us = (uint64_t)(sim_opts.duration_s * 1e6);
+    _sim_random_state = ((uint32_t)_sim_start_ns ^ (uint32_t)getpid()) | 1;
+
+    for (size_t i = 0; i < HAL_RTC_MEM_LEN / 4; i++) {
+        _sim_rtc_mem[i] = (uint32_t)rand();
+    }
+
+    user_init();
+
+    for (;;) {
+        uint64_t now = sim_time_us(),
+                 deadline;
+        bool busy = false;
+        int timeout_ms = 0;
+
+        if (0 != end_us && now >= end_us) {
+            break;
+        }
+
+        if (true == _sim_sleeping) {
+            uint64_t wake_us = 0 != end_us && end_us < _sim_wake_us ? end_us : _sim_wake_us;
+
+            if (true == _sim_powered) {
+                _sim_power_down();
+            }
+
+            if (now >= _sim_wake_us) {
+                _sim_wake();
+            } else if (true == sim_opts.fast) {
+                _sim_virtual_us = wake_us;
+            } else {
+                poll(NULL, 0, (int)((wake_us - now + 999) / 1000));
+            }
+            continue;
+        }
+
+        /* Interrupts first, then tasks, then timers: roughly what the SDK does */
+        busy |= _sim_spi_complete();
+        busy |= _sim_poll_uart();
+        busy |= _sim_run_task();
+        busy |= _sim_run_timer(now);
+        busy |= _sim_run_dns(now);
+
+        if (true == busy) {
+            /* Keep draining before we sleep */
+            _sim_poll_tcp(0);
+            continue;
+        }
+
+        sim_sh1106_sync();
+
+        if (true == _sim_next_deadline(&deadline)) {
+            if (0 != end_us && deadline > end_us) {
+                deadline = end_us;
+            }
+
+            if (true == sim_opts.fast) {
+                /* Give the network a look in, then jump ahead */
+                if (false == _sim_poll_tcp(0)) {
+                    _sim_virtual_us = deadline;
+                }
+                continue;
+            }
+
+            timeout_ms = deadline > now ? (int)((deadline - now + 999) / 1000) : 0;
+        } else if (0 != end_us) {
+            timeout_ms = (int)((end_us - now + 999) / 1000);
+            if (true == sim_opts.fast) {
+                _sim_virtual_us = end_us;
+                continue;
+            }
+        } else {
+            timeout_ms = 100;
+        }
+
+        _sim_poll_tcp(timeout_ms);
+    }
+
+    _sim_report();
+
+    return EXIT_SUCCESS;
+}
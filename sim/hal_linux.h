@@ -0,0 +1,62 @@
+#pragma once
+
+/** \file hal_linux.h Linux simulator platform definitions for the HAL
+ * Maps the SDK-isms used throughout the application onto libc.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RODATA_ATTR
+
+#define os_printf           printf
+#define os_sprintf          sprintf
+#define os_snprintf         snprintf
+#define os_strlen           strlen
+#define os_strcpy           strcpy
+#define os_strncpy          strncpy
+#define os_strcmp           strcmp
+#define os_strncmp          strncmp
+#define os_memcpy           memcpy
+#define os_memset           memset
+#define os_memcmp           memcmp
+#define os_delay_us(_us)    do { } while (0)
+
+struct hal_timer;
+struct hal_tcp;
+struct hal_dns;
+
+struct hal_timer_priv {
+    void (*func)(void *arg);
+    void *arg;
+    uint64_t deadline_us;
+    uint32_t period_ms;
+    bool armed;
+    bool repeat;
+    struct hal_timer *next;
+};
+
+struct hal_tcp_priv {
+    int fd;
+    bool active;
+    bool connected;
+    bool closing;
+    const uint8_t *tx;
+    size_t tx_len;
+    size_t tx_offs;
+    struct hal_tcp *next;
+};
+
+struct hal_tcp_listener_priv {
+    int fd;
+};
+
+struct hal_dns_priv {
+    uint32_t ip_addr;
+    uint64_t due_us;
+    bool pending;
+    struct hal_dns *next;
+};
@@ -0,0 +1,101 @@
+#pragma once
+
+/** \file sim.h Internal interfaces of the Linux simulator
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * An emulated device on the HSPI bus, selected by its chip select: a GPIO or an expander line, as
+ * in spi_xfer::cs. Expanders aren't modelled beyond that.
+ */
+struct sim_spi_device {
+    const char *name;
+    unsigned cs;
+
+    /**
+     * Handle one transaction. rx is filled in with whatever the device drives on MISO.
+     */
+    void (*xfer)(struct sim_spi_device *dev, bool a0, const uint8_t *tx, size_t tx_len,
+            uint8_t *rx, size_t rx_len);
+
+    /**
+     * Number of transactions and bytes on the bus, for reporting at exit
+     */
+    uint64_t nr_xfers;
+    uint64_t nr_bytes;
+
+    struct sim_spi_device *next;
+};
+
+/**
+ * Most emulated MAX31855s, and so most --probe-script options
+ */
+#define SIM_MAX31855_MAX_PROBES     16
+
+/**
+ * Most names the simulated resolver knows, and so most --dns options
+ */
+#define SIM_MAX_DNS_NAMES           8
+
+/**
+ * Options from the command line
+ */
+struct sim_options {
+    const char *pbm_path;
+    const char *probe_scripts[SIM_MAX31855_MAX_PROBES];
+    unsigned nr_probe_scripts;
+    const char *flash_path;
+    const char *tcp_redirect_host;
+    double ambient_c;
+    uint16_t tcp_redirect_port;
+    uint16_t listen_port;
+    double duration_s;
+    bool fast;
+    bool wifi_fail;
+    uint8_t wifi_channel;
+    bool plant;
+    const char *dns_names[SIM_MAX_DNS_NAMES];
+    uint32_t dns_addrs[SIM_MAX_DNS_NAMES];
+    unsigned nr_dns_names;
+};
+
+extern struct sim_options sim_opts;
+
+/**
+ * Simulated time since start, in microseconds
+ */
+uint64_t sim_time_us(void);
+
+void sim_spi_register(struct sim_spi_device *dev);
+
+/**
+ * Levels the application has set its output GPIOs to
+ */
+uint32_t sim_gpio_out(void);
+
+/**
+ * Emulated SH1106 OLED. The panel contents are written to pbm_path whenever they change.
+ */
+void sim_sh1106_init(unsigned cs, const char *pbm_path);
+void sim_sh1106_sync(void);
+
+/**
+ * Add an emulated MAX31855, playing back a temperature script. See sim_max31855.c for the format.
+ * If plant is set the script is ignored, and the probe reads the thermal plant instead.
+ */
+int sim_max31855_init(unsigned cs, const char *script, bool plant);
+
+/**
+ * Thermal model of the pot the heater warms, with --plant. See sim_plant.c.
+ */
+void sim_plant_init(void);
+
+/**
+ * Bring the model up to the current time. Called before every GPIO change.
+ */
+void sim_plant_advance(void);
+double sim_plant_probe_temp(void);
+void sim_plant_report(void);
@@ -0,0 +1,114 @@
+/** \file sim_flash.c SPI flash, backed by a file
+ * The file is created on first use and grows as sectors are written. Anything never written reads
+ * back as erased. Writes AND into what is already there, as on real NOR flash, so code that
+ * forgets to erase first gets the same garbage it would on hardware.
+ */
+
+#include "hal.h"
+#include "sim/sim.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* The 4MiB part on an ESP-12 */
+#define SIM_FLASH_SIZE          (4ul * 1024 * 1024)
+
+static
+int _sim_flash_fd = -1;
+
+static
+int _sim_flash_open(void)
+{
+    if (_sim_flash_fd >= 0) {
+        return 0;
+    }
+
+    if (0 > (_sim_flash_fd = open(sim_opts.flash_path, O_RDWR | O_CREAT, 0644))) {
+        perror("sim: flash: open");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Read back what is in the file, with erased flash wherever the file is short.
+ */
+static
+int _sim_flash_pread(uint32_t addr, uint8_t *buf, size_t len)
+{
+    ssize_t ret = pread(_sim_flash_fd, buf, len, addr);
+
+    if (ret < 0) {
+        perror("sim: flash: pread");
+        return -1;
+    }
+
+    memset(buf + ret, 0xff, len - ret);
+
+    return 0;
+}
+
+static
+bool _sim_flash_check(uint32_t addr, size_t len)
+{
+    if (0 != (addr & 3) || 0 != (len & 3) || addr + len > SIM_FLASH_SIZE) {
+        fprintf(stderr, "sim: flash: bad access of %zu bytes at 0x%x\n", len, addr);
+        return false;
+    }
+
+    return 0 == _sim_flash_open();
+}
+
+int hal_flash_erase(unsigned sector)
+{
+    uint8_t buf[HAL_FLASH_SECTOR_SIZE];
+    uint32_t addr = sector * HAL_FLASH_SECTOR_SIZE;
+
+    if (false == _sim_flash_check(addr, sizeof(buf))) {
+        return -1;
+    }
+
+    memset(buf, 0xff, sizeof(buf));
+
+    return sizeof(buf) == pwrite(_sim_flash_fd, buf, sizeof(buf), addr) ? 0 : -1;
+}
+
+int hal_flash_write(uint32_t addr, const void *data, size_t len)
+{
+    const uint8_t *src = data;
+    uint8_t *buf = NULL;
+    int status = -1;
+
+    if (false == _sim_flash_check(addr, len) || 0 != ((uintptr_t)data & 3)) {
+        return -1;
+    }
+
+    if (NULL == (buf = malloc(len))) {
+        return -1;
+    }
+
+    if (0 == _sim_flash_pread(addr, buf, len)) {
+        for (size_t i = 0; i < len; i++) {
+            buf[i] &= src[i];
+        }
+
+        if ((ssize_t)len == pwrite(_sim_flash_fd, buf, len, addr)) {
+            status = 0;
+        }
+    }
+
+    free(buf);
+
+    return status;
+}
+
+int hal_flash_read(uint32_t addr, void *data, size_t len)
+{
+    if (false == _sim_flash_check(addr, len) || 0 != ((uintptr_t)data & 3)) {
+        return -1;
+    }
+
+    return _sim_flash_pread(addr, data, len);
+}
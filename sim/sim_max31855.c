@@ -0,0 +1,172 @@
+/** \file sim_max31855.c Emulated MAX31855 thermocouple converter
+ * Plays back a temperature script. Each line of the script is
+ *
+ *     <time in seconds> <probe temperature in C> [ok|open|gnd|vcc]
+ *
+ * Temperatures are linearly interpolated between points, and the fault (if any) of the most
+ * recent point applies. Blank lines and lines starting with '#' are ignored. Without a script
+ * the probe sits at a steady 42.5C.
+ *
+ * Any number of probes can be emulated, each on its own chip select and with its own script. A
+ * probe can instead read the thermal plant (sim_plant.c).
+ */
+
+#include "sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SIM_MAX31855_MAX_POINTS     1024
+
+#define SIM_MAX31855_OC_BIT         (1ul << 0)
+#define SIM_MAX31855_SCG_BIT        (1ul << 1)
+#define SIM_MAX31855_SCV_BIT        (1ul << 2)
+#define SIM_MAX31855_FAULT_BIT      (1ul << 16)
+
+/* Internal (cold junction) temperature, in 1/16ths of a degree */
+#define SIM_MAX31855_INT_TEMP       (25 * 16)
+
+struct sim_max31855_point {
+    double time_s;
+    double temp_c;
+    uint32_t fault;
+};
+
+static
+struct sim_max31855 {
+    struct sim_spi_device spi;
+    struct sim_max31855_point points[SIM_MAX31855_MAX_POINTS];
+    unsigned nr_points;
+    bool plant;
+} _sim_max31855[SIM_MAX31855_MAX_PROBES];
+
+static
+unsigned _sim_max31855_nr_probes = 0;
+
+static
+uint32_t _sim_max31855_sample(struct sim_max31855 *probe, double t, double *temp_c)
+{
+    unsigned i;
+
+    if (true == probe->plant) {
+        *temp_c = sim_plant_probe_temp();
+        return 0;
+    }
+
+    if (0 == probe->nr_points) {
+        *temp_c = 42.5;
+        return 0;
+    }
+
+    for (i = 0; i + 1 < probe->nr_points && probe->points[i + 1].time_s <= t; i++);
+
+    if (i + 1 == probe->nr_points || t <= probe->points[i].time_s) {
+        *temp_c = probe->points[i].temp_c;
+    } else {
+        struct sim_max31855_point *a = &probe->points[i],
+                                  *b = &probe->points[i + 1];
+        *temp_c = a->temp_c + (b->temp_c - a->temp_c) * (t - a->time_s) / (b->time_s - a->time_s);
+    }
+
+    return probe->points[i].fault;
+}
+
+static
+void _sim_max31855_xfer(struct sim_spi_device *dev, bool a0, const uint8_t *tx, size_t tx_len,
+        uint8_t *rx, size_t rx_len)
+{
+    struct sim_max31855 *probe = (struct sim_max31855 *)dev;
+    double temp_c;
+    uint32_t fault = _sim_max31855_sample(probe, sim_time_us() / 1e6, &temp_c),
+             word;
+    int32_t quarters = (int32_t)(temp_c * 4.0 + (temp_c < 0 ? -0.5 : 0.5));
+
+    word = ((uint32_t)quarters & 0x3fff) << 18;
+    word |= (SIM_MAX31855_INT_TEMP & 0xfff) << 4;
+    if (0 != fault) {
+        word |= SIM_MAX31855_FAULT_BIT | fault;
+    }
+
+    /* Shifted out MSB first */
+    for (size_t i = 0; i < rx_len; i++) {
+        rx[i] = i < 4 ? (word >> (24 - (i * 8))) & 0xff : 0;
+    }
+}
+
+static
+int _sim_max31855_load(struct sim_max31855 *probe, const char *script)
+{
+    FILE *fp = NULL;
+    char line[256];
+    int lineno = 0;
+
+    if (NULL == (fp = fopen(script, "r"))) {
+        perror("sim: max31855: fopen");
+        return -1;
+    }
+
+    while (NULL != fgets(line, sizeof(line), fp)) {
+        struct sim_max31855_point *pt = &probe->points[probe->nr_points];
+        char fault[16] = "ok";
+        int nr;
+
+        lineno++;
+
+        if ('#' == line[0] || '\n' == line[0]) {
+            continue;
+        }
+
+        if (SIM_MAX31855_MAX_POINTS == probe->nr_points) {
+            fprintf(stderr, "sim: max31855: %s: too many points\n", script);
+            break;
+        }
+
+        nr = sscanf(line, "%lf %lf %15s", &pt->time_s, &pt->temp_c, fault);
+        if (nr < 2) {
+            fprintf(stderr, "sim: max31855: %s:%d: bad line\n", script, lineno);
+            continue;
+        }
+
+        if (0 == strcmp(fault, "open")) {
+            pt->fault = SIM_MAX31855_OC_BIT;
+        } else if (0 == strcmp(fault, "gnd")) {
+            pt->fault = SIM_MAX31855_SCG_BIT;
+        } else if (0 == strcmp(fault, "vcc")) {
+            pt->fault = SIM_MAX31855_SCV_BIT;
+        } else {
+            pt->fault = 0;
+        }
+
+        probe->nr_points++;
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+int sim_max31855_init(unsigned cs, const char *script, bool plant)
+{
+    struct sim_max31855 *probe = NULL;
+
+    if (SIM_MAX31855_MAX_PROBES == _sim_max31855_nr_probes) {
+        fprintf(stderr, "sim: max31855: too many probes\n");
+        return -1;
+    }
+
+    probe = &_sim_max31855[_sim_max31855_nr_probes++];
+    memset(probe, 0, sizeof(*probe));
+
+    probe->spi.name = "max31855";
+    probe->spi.cs = cs;
+    probe->spi.xfer = _sim_max31855_xfer;
+    probe->plant = plant;
+
+    if (NULL != script && 0 != _sim_max31855_load(probe, script)) {
+        return -1;
+    }
+
+    sim_spi_register(&probe->spi);
+
+    return 0;
+}
@@ -0,0 +1,151 @@
+/** \file sim_plant.c Thermal model of the pot, for tuning the heater controller
+ * Two lumps: the heating element, and the milk it sits in, which loses heat to the room. The
+ * probe sees the milk through a first order lag. The element is powered whenever the heater GPIO
+ * is asserted. The model is stepped forward to the current time whenever it is looked at, and
+ * whenever a GPIO changes, so every switch of the heater lands where it happened.
+ *
+ * At exit the time spent off the profile's hold temperature is reported, so a change to the
+ * controller or its gains can be compared against the last run.
+ */
+
+#include "sim.h"
+
+#include "heater_config.h"
+
+#include <math.h>
+#include <stdio.h>
+
+/* Model parameters: a litre of milk in an insulated pot over a 100W element */
+#define SIM_PLANT_HEATER_W          100.0
+#define SIM_PLANT_ELEMENT_J_PER_K   150.0
+#define SIM_PLANT_ELEMENT_W_PER_K   8.0
+#define SIM_PLANT_MILK_J_PER_K      4000.0
+#define SIM_PLANT_LOSS_W_PER_K      1.5
+#define SIM_PLANT_PROBE_LAG_S       15.0
+
+#define SIM_PLANT_STEP_S            0.1
+
+static
+struct sim_plant {
+    bool enabled;
+    uint64_t time_us;
+    double element_c;
+    double milk_c;
+    double probe_c;
+
+    /* Accounting */
+    double heater_on_s;
+    uint64_t nr_switches;
+    bool heater_was_on;
+    double max_milk_c;
+    double hold_min_c;
+    double hold_max_c;
+    double hold_sq_err;
+    double hold_s;
+} _sim_plant;
+
+static
+bool _sim_plant_heater_on(void)
+{
+    bool level = 0 != (sim_gpio_out() & (1ul << HEATER_GPIO));
+
+    return HEATER_ACTIVE_LOW ? !level : level;
+}
+
+static
+void _sim_plant_step(struct sim_plant *plant, double dt, bool heater_on)
+{
+    double t = plant->time_us / 1e6,
+           q_element = (plant->element_c - plant->milk_c) * SIM_PLANT_ELEMENT_W_PER_K,
+           q_loss = (plant->milk_c - sim_opts.ambient_c) * SIM_PLANT_LOSS_W_PER_K;
+
+    plant->element_c += dt * ((true == heater_on ? SIM_PLANT_HEATER_W : 0) - q_element) /
+        SIM_PLANT_ELEMENT_J_PER_K;
+    plant->milk_c += dt * (q_element - q_loss) / SIM_PLANT_MILK_J_PER_K;
+    plant->probe_c += dt * (plant->milk_c - plant->probe_c) / SIM_PLANT_PROBE_LAG_S;
+
+    if (true == heater_on) {
+        plant->heater_on_s += dt;
+    }
+
+    if (plant->milk_c > plant->max_milk_c) {
+        plant->max_milk_c = plant->milk_c;
+    }
+
+    /* The hold, allowing the controller a while to settle after the ramp */
+    if (t >= HEATER_PROFILE_RAMP_S + 600 && t < HEATER_PROFILE_RAMP_S + HEATER_PROFILE_HOLD_S) {
+        double err = plant->milk_c - HEATER_PROFILE_TEMP_C;
+
+        if (0 == plant->hold_s || plant->milk_c < plant->hold_min_c) {
+            plant->hold_min_c = plant->milk_c;
+        }
+        if (0 == plant->hold_s || plant->milk_c > plant->hold_max_c) {
+            plant->hold_max_c = plant->milk_c;
+        }
+        plant->hold_sq_err += err * err * dt;
+        plant->hold_s += dt;
+    }
+
+    plant->time_us += (uint64_t)(dt * 1e6);
+}
+
+void sim_plant_advance(void)
+{
+    struct sim_plant *plant = &_sim_plant;
+    uint64_t now = sim_time_us();
+    bool heater_on = false;
+
+    if (false == plant->enabled) {
+        return;
+    }
+
+    heater_on = _sim_plant_heater_on();
+
+    if (heater_on != plant->heater_was_on) {
+        plant->nr_switches++;
+        plant->heater_was_on = heater_on;
+    }
+
+    while (plant->time_us < now) {
+        double dt = (now - plant->time_us) / 1e6;
+
+        _sim_plant_step(plant, dt > SIM_PLANT_STEP_S ? SIM_PLANT_STEP_S : dt, heater_on);
+    }
+}
+
+void sim_plant_init(void)
+{
+    struct sim_plant *plant = &_sim_plant;
+
+    plant->enabled = true;
+    plant->time_us = sim_time_us();
+    plant->element_c = plant->milk_c = plant->probe_c = plant->max_milk_c = sim_opts.ambient_c;
+}
+
+double sim_plant_probe_temp(void)
+{
+    sim_plant_advance();
+
+    return _sim_plant.probe_c;
+}
+
+void sim_plant_report(void)
+{
+    struct sim_plant *plant = &_sim_plant;
+
+    if (false == plant->enabled) {
+        return;
+    }
+
+    sim_plant_advance();
+
+    fprintf(stderr, "sim: plant: milk %.2f C, peak %.2f C, heater on %.0f s (%.1f%%), %llu switches\n",
+            plant->milk_c, plant->max_milk_c, plant->heater_on_s,
+            0 != plant->time_us ? plant->heater_on_s * 1e8 / plant->time_us : 0,
+            (unsigned long long)plant->nr_switches);
+
+    if (0 != plant->hold_s) {
+        fprintf(stderr, "sim: plant: hold %.0f s at %.2f to %.2f C, RMS error %.3f C\n", plant->hold_s,
+                plant->hold_min_c, plant->hold_max_c, sqrt(plant->hold_sq_err / plant->hold_s));
+    }
+}
@@ -0,0 +1,128 @@
+/** \file sim_sh1106.c Emulated SH1106 OLED controller
+ * Interprets the command and data stream the driver sends, keeps a copy of the 132x64 display
+ * RAM, and renders the visible 128 columns to a PBM file when they change.
+ */
+
+#include "sim.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sh1106_cmds.h"
+
+#define SIM_SH1106_RAM_COLS     132
+#define SIM_SH1106_PAGES        8
+#define SIM_SH1106_WIDTH        128
+#define SIM_SH1106_COL_OFFSET   2
+
+static
+struct sim_sh1106 {
+    struct sim_spi_device spi;
+    const char *pbm_path;
+    uint8_t ram[SIM_SH1106_PAGES][SIM_SH1106_RAM_COLS];
+    unsigned page;
+    unsigned col;
+    bool invert;
+    bool display_on;
+    bool dirty;
+
+    /* Second byte of a two byte command still to come */
+    bool cmd_arg_pending;
+} _sim_sh1106;
+
+static
+void _sim_sh1106_command(struct sim_sh1106 *oled, uint8_t cmd)
+{
+    if (true == oled->cmd_arg_pending) {
+        /* Contrast level or DC-DC setting, neither of which changes what we render */
+        oled->cmd_arg_pending = false;
+        return;
+    }
+
+    if (cmd <= 0x0f) {
+        oled->col = (oled->col & 0xf0) | (cmd & 0xf);
+    } else if (cmd <= 0x1f) {
+        oled->col = (oled->col & 0x0f) | ((cmd & 0xf) << 4);
+    } else if ((cmd & 0xf8) == SH1106_CMD_SET_PAGE_ADDR(0)) {
+        oled->page = cmd & 0x7;
+    } else if ((cmd & 0xfe) == SH1106_CMD_INVERT_DISPLAY(false)) {
+        oled->invert = !!(cmd & 1);
+        oled->dirty = true;
+    } else if ((cmd & 0xfe) == SH1106_CMD_DISPLAY_ON(false)) {
+        oled->display_on = !!(cmd & 1);
+        oled->dirty = true;
+    } else if (SH1106_CMD_SET_CONTRAST_MODE == cmd || SH1106_CMD_DC_DC_CONTROL_MODE == cmd) {
+        oled->cmd_arg_pending = true;
+    }
+}
+
+static
+void _sim_sh1106_xfer(struct sim_spi_device *dev, bool a0, const uint8_t *tx, size_t tx_len,
+        uint8_t *rx, size_t rx_len)
+{
+    struct sim_sh1106 *oled = (struct sim_sh1106 *)dev;
+
+    for (size_t i = 0; i < tx_len; i++) {
+        if (false == a0) {
+            _sim_sh1106_command(oled, tx[i]);
+        } else if (oled->col < SIM_SH1106_RAM_COLS) {
+            /* The column address stops incrementing at the end of the RAM */
+            if (oled->ram[oled->page][oled->col] != tx[i]) {
+                oled->ram[oled->page][oled->col] = tx[i];
+                oled->dirty = true;
+            }
+            oled->col++;
+        }
+    }
+
+    memset(rx, 0xff, rx_len);
+}
+
+void sim_sh1106_init(unsigned cs, const char *pbm_path)
+{
+    struct sim_sh1106 *oled = &_sim_sh1106;
+
+    memset(oled, 0, sizeof(*oled));
+
+    oled->spi.name = "sh1106";
+    oled->spi.cs = cs;
+    oled->spi.xfer = _sim_sh1106_xfer;
+    oled->pbm_path = pbm_path;
+
+    sim_spi_register(&oled->spi);
+}
+
+void sim_sh1106_sync(void)
+{
+    struct sim_sh1106 *oled = &_sim_sh1106;
+    char tmp_path[512];
+    FILE *fp = NULL;
+
+    if (false == oled->dirty || NULL == oled->pbm_path) {
+        return;
+    }
+
+    oled->dirty = false;
+
+    /* Write to the side and rename, so a viewer never sees a partial image */
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", oled->pbm_path);
+    if (NULL == (fp = fopen(tmp_path, "wb"))) {
+        perror("sim: sh1106: fopen");
+        return;
+    }
+
+    fprintf(fp, "P1\n%d %d\n", SIM_SH1106_WIDTH, SIM_SH1106_PAGES * 8);
+
+    for (int y = 0; y < SIM_SH1106_PAGES * 8; y++) {
+        for (int x = 0; x < SIM_SH1106_WIDTH; x++) {
+            bool lit = !!(oled->ram[y / 8][x + SIM_SH1106_COL_OFFSET] & (1 << (y % 8)));
+
+            lit = oled->display_on && (lit ^ oled->invert);
+            fputc(lit ? '1' : '0', fp);
+        }
+        fputc('\n', fp);
+    }
+
+    fclose(fp);
+    rename(tmp_path, oled->pbm_path);
+}
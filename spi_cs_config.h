@@ -0,0 +1,38 @@
+#pragma once
+
+/**
+ * Chip select expanders. A GPIO per chip select runs out after a couple of devices, so more can be
+ * hung off an expander, and selected with SPI_CS_EXPANDER(line) in place of a GPIO number.
+ */
+#define SPI_CS_EXPANDER_NONE        0
+
+/**
+ * 74HC138 3-to-8 decoder. The line number goes out on the address GPIOs, then the active low
+ * enable is asserted. Only the one selected output ever goes low.
+ */
+#define SPI_CS_EXPANDER_DECODER     1
+
+/**
+ * 74HC595 shift registers, chained for more than 8 lines. SER and SRCLK sit on HSPI MOSI and CLK,
+ * so selecting a line is an 8 bit transfer per register followed by a pulse on the latch (RCLK)
+ * GPIO. Other traffic on the bus shifts through the registers too, but the outputs only change when
+ * latched.
+ */
+#define SPI_CS_EXPANDER_SHIFT_REG   2
+
+#define SPI_CS_EXPANDER_TYPE        SPI_CS_EXPANDER_NONE
+
+/**
+ * 74HC138 wiring: address lines A, B, C and the G2A enable. G1 is tied high and G2B low. GPIO9
+ * and GPIO10 are only free with the flash in DIO mode.
+ */
+#define SPI_CS_DECODER_A0_GPIO      0
+#define SPI_CS_DECODER_A1_GPIO      9
+#define SPI_CS_DECODER_A2_GPIO      10
+#define SPI_CS_DECODER_EN_GPIO      2
+
+/**
+ * 74HC595 wiring: the latch GPIO, and how many registers are chained (at most 4)
+ */
+#define SPI_CS_SHIFT_REG_LATCH_GPIO 2
+#define SPI_CS_SHIFT_REG_NR_BYTES   1
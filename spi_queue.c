@@ -0,0 +1,172 @@
+/** \file spi_queue.c Interrupt-driven HSPI transaction queue
+ * Transactions are started back to back as the previous one completes (from the HSPI transaction
+ * done interrupt, on hardware), so drivers never have to spin waiting for the bus. Completion
+ * callbacks are deferred to a task so they can live in flash and take their time.
+ *
+ * Functions not marked ICACHE_FLASH_ATTR here are called from the ISR, and must stay in IRAM.
+ */
+
+#include "spi_queue.h"
+#include "hal.h"
+
+#define SPI_QUEUE_TASK_PRIO         HAL_TASK_PRIO_HIGH
+
+/**
+ * Transactions waiting to go out. The head is the one on the bus.
+ */
+static
+struct spi_xfer *volatile _spi_queue_head,
+                *_spi_queue_tail;
+
+/**
+ * Transactions that are complete but whose callbacks haven't run yet.
+ */
+static
+struct spi_xfer *volatile _spi_done_head,
+                *_spi_done_tail;
+
+static volatile
+bool _spi_done_posted = false;
+
+/**
+ * Bus clock to switch to before the next transaction starts, or 0
+ */
+static volatile
+uint32_t _spi_next_speed_hz = 0;
+
+
+void spi_queue_complete(void)
+{
+    struct spi_xfer *xfer = _spi_queue_head;
+
+    if (NULL == xfer) {
+        /* Spurious, or someone else driving the bus */
+        return;
+    }
+
+    /* Move to the done list, and kick the completion task */
+    _spi_queue_head = xfer->next;
+    if (NULL == _spi_queue_head) {
+        _spi_queue_tail = NULL;
+    }
+
+    xfer->next = NULL;
+    if (NULL == _spi_done_tail) {
+        _spi_done_head = xfer;
+    } else {
+        _spi_done_tail->next = xfer;
+    }
+    _spi_done_tail = xfer;
+
+    if (false == _spi_done_posted) {
+        _spi_done_posted = true;
+        hal_task_post(SPI_QUEUE_TASK_PRIO, 0, 0);
+    }
+
+    if (0 != _spi_next_speed_hz) {
+        hal_spi_set_speed(_spi_next_speed_hz);
+        _spi_next_speed_hz = 0;
+    }
+
+    if (NULL != _spi_queue_head) {
+        hal_spi_start(_spi_queue_head);
+    }
+}
+
+static ICACHE_FLASH_ATTR
+void _spi_queue_task(uint32_t sig, uint32_t par)
+{
+    for (;;) {
+        struct spi_xfer *xfer;
+
+        hal_spi_lock();
+        xfer = _spi_done_head;
+        if (NULL != xfer) {
+            _spi_done_head = xfer->next;
+            if (NULL == _spi_done_head) {
+                _spi_done_tail = NULL;
+            }
+        } else {
+            _spi_done_posted = false;
+        }
+        hal_spi_unlock();
+
+        if (NULL == xfer) {
+            break;
+        }
+
+        xfer->next = NULL;
+        xfer->pending = false;
+
+        if (NULL != xfer->done) {
+            xfer->done(xfer, xfer->arg);
+        }
+    }
+}
+
+ICACHE_FLASH_ATTR
+int spi_queue_init(void)
+{
+    _spi_queue_head = _spi_queue_tail = NULL;
+    _spi_done_head = _spi_done_tail = NULL;
+    _spi_next_speed_hz = 0;
+
+    if (0 != hal_task_register(SPI_QUEUE_TASK_PRIO, _spi_queue_task)) {
+        os_printf("SPI: Failed to set up completion task\r\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+int spi_queue_submit(struct spi_xfer *xfer)
+{
+    if (true == xfer->pending || (0 == xfer->tx_len && 0 == xfer->rx_len) ||
+            xfer->rx_len > SPI_XFER_MAX_RX)
+    {
+        return -1;
+    }
+
+    xfer->next = NULL;
+    xfer->tx_offs = 0;
+    xfer->pending = true;
+
+    hal_spi_lock();
+    if (NULL == _spi_queue_tail) {
+        /* Bus is idle, start this one right away */
+        _spi_queue_head = _spi_queue_tail = xfer;
+        hal_spi_start(xfer);
+    } else {
+        _spi_queue_tail->next = xfer;
+        _spi_queue_tail = xfer;
+    }
+    hal_spi_unlock();
+
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+void spi_queue_set_speed(uint32_t speed_hz)
+{
+    hal_spi_lock();
+    if (NULL == _spi_queue_head) {
+        hal_spi_set_speed(speed_hz);
+        _spi_next_speed_hz = 0;
+    } else {
+        /* Left for spi_queue_complete() */
+        _spi_next_speed_hz = speed_hz;
+    }
+    hal_spi_unlock();
+}
+
+ICACHE_FLASH_ATTR
+void spi_queue_wait_idle(void)
+{
+    while (NULL != _spi_queue_head) {
+        hal_spi_poll();
+    }
+
+    /* Run the completions now, rather than leaving the transactions marked pending */
+    _spi_queue_task(0, 0);
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "spi_cs_config.h"
+
+/**
+ * Value for spi_xfer::a0_gpio if the device has no A0 (data/command select) line.
+ */
+#define SPI_XFER_NO_A0              0xff
+
+/**
+ * Value for spi_xfer::cs selecting line n of the chip select expander (see spi_cs_config.h)
+ * rather than a GPIO.
+ */
+#define SPI_CS_EXPANDER(n)          (0x80 | (n))
+#define SPI_CS_IS_EXPANDER(cs)      (0 != ((cs) & 0x80))
+#define SPI_CS_EXPANDER_LINE(cs)    ((cs) & 0x7f)
+
+/**
+ * Number of lines the configured expander provides
+ */
+#if SPI_CS_EXPANDER_TYPE == SPI_CS_EXPANDER_DECODER
+#define SPI_CS_EXPANDER_NR_LINES    8
+#elif SPI_CS_EXPANDER_TYPE == SPI_CS_EXPANDER_SHIFT_REG
+#define SPI_CS_EXPANDER_NR_LINES    (SPI_CS_SHIFT_REG_NR_BYTES * 8)
+#else
+#define SPI_CS_EXPANDER_NR_LINES    0
+#endif
+
+/**
+ * Largest number of bytes that can be received in a single transaction.
+ */
+#define SPI_XFER_MAX_RX             64
+
+struct spi_xfer;
+
+/**
+ * Completion callback for a transaction. Called from task context (not the ISR) once the
+ * chip select has been released.
+ */
+typedef void (*spi_xfer_done_func_t)(struct spi_xfer *xfer, void *arg);
+
+/**
+ * A single SPI transaction. Owned by the caller, and must not be touched between being passed to
+ * spi_queue_submit() and the completion callback being invoked.
+ */
+struct spi_xfer {
+    /**
+     * Next transaction in the queue. Private.
+     */
+    struct spi_xfer *next;
+
+    /**
+     * Data to write out. Must be word aligned. May be any length; transfers longer than the HSPI
+     * FIFO are chained under the same chip select.
+     */
+    const void *tx;
+
+    /**
+     * Buffer to receive into, after tx has been written out. Must be word aligned, and have room
+     * for rx_len rounded up to a whole word.
+     */
+    void *rx;
+
+    /**
+     * Number of bytes to write
+     */
+    uint16_t tx_len;
+
+    /**
+     * Number of bytes to read, at most SPI_XFER_MAX_RX
+     */
+    uint16_t rx_len;
+
+    /**
+     * Chip select, driven low for the duration of the transaction: a GPIO number, or
+     * SPI_CS_EXPANDER(line)
+     */
+    uint8_t cs;
+
+    /**
+     * GPIO to drive with a0_level for the duration of the transaction, or SPI_XFER_NO_A0
+     */
+    uint8_t a0_gpio;
+
+    /**
+     * Level for the A0 GPIO
+     */
+    bool a0_level;
+
+    /**
+     * Set while the transaction is queued or in flight
+     */
+    volatile bool pending;
+
+    /**
+     * Bytes of tx written so far. Private, for use by the HAL backend.
+     */
+    uint16_t tx_offs;
+
+    /**
+     * Function to call on completion, can be NULL
+     */
+    spi_xfer_done_func_t done;
+
+    /**
+     * Argument passed to the done callback
+     */
+    void *arg;
+};
+
+/**
+ * Set up the completion task. The bus itself must already have been set up with hal_spi_init().
+ *
+ * \return 0 on success, -1 otherwise.
+ */
+int spi_queue_init(void);
+
+/**
+ * Queue a transaction. The transaction is started immediately if the bus is idle.
+ *
+ * \return 0 on success, -1 if the transaction is already pending or is malformed.
+ */
+int spi_queue_submit(struct spi_xfer *xfer);
+
+/**
+ * Change the bus clock. Takes effect straight away if the bus is idle, and otherwise between the
+ * transaction in flight and the next, so no transaction is ever clocked at two speeds.
+ */
+void spi_queue_set_speed(uint32_t speed_hz);
+
+/**
+ * Spin until every queued transaction has gone out on the bus, then run the completion
+ * callbacks. Only for use at start of day or when benchmarking.
+ */
+void spi_queue_wait_idle(void);
+
+/**
+ * Called by the HAL backend, possibly from interrupt context, once the transaction at the head of
+ * the queue is complete and its chip select released. Starts the next transaction, if any.
+ */
+void spi_queue_complete(void);
+
+/**
+ * Convenience to check if a transaction is still queued or in flight.
+ */
+static inline
+bool spi_xfer_pending(const struct spi_xfer *xfer)
+{
+    return xfer->pending;
+}
@@ -0,0 +1,494 @@
+/** \file telemetry.c Buffered, batched sample uploads
+ * The ring is indexed by three free-running counters: samples before _tm_head have been
+ * acknowledged, those between _tm_head and _tm_sent are in batches on the wire, and those between
+ * _tm_sent and _tm_tail have yet to be sent. Batches complete in order, since the HTTP client
+ * matches responses to requests in order. When the connection drops, every batch on the wire or
+ * queued in the client fails, and we rewind and rebuild them once reconnected.
+ *
+ * When the ring fills with nothing in flight (the collector is unreachable), the oldest samples
+ * spill into the flash log instead of being dropped. The flash log is always drained before the
+ * ring, so samples reach the collector in the order they were taken.
+ */
+
+#include "telemetry.h"
+
+#include "hal.h"
+#include "http_client.h"
+#include "flash_log.h"
+#include "max31855.h"
+#include "telemetry_codec.h"
+
+/* Longest encoding of one sample, "[4294967295,255,-8192,-2048,255]," */
+#define TELEMETRY_SAMPLE_JSON_MAX       34
+
+/* The batch wrapper, with room for the uptime */
+#define TELEMETRY_BATCH_JSON_OVERHEAD   64
+
+#define TELEMETRY_SAMPLES_LEN \
+    (TELEMETRY_BATCH_JSON_OVERHEAD + TELEMETRY_MAX_BATCH * TELEMETRY_SAMPLE_JSON_MAX)
+
+/* A batch body holds either samples or a status document */
+#define TELEMETRY_BODY_LEN \
+    (TELEMETRY_SAMPLES_LEN > TELEMETRY_STATUS_MAX ? TELEMETRY_SAMPLES_LEN : TELEMETRY_STATUS_MAX)
+
+static
+struct telemetry_sample _tm_ring[TELEMETRY_RING_LEN];
+
+static
+uint32_t _tm_head,
+         _tm_sent,
+         _tm_tail;
+
+/**
+ * Batches on the wire. The HTTP client sends bodies in place, so each one keeps its own buffer.
+ */
+static
+struct telemetry_batch {
+    uint16_t nr_samples;
+
+    /* A status document of status_len bytes rather than samples */
+    bool status;
+    uint16_t status_len;
+
+    /* Samples came from the flash log, read from flash_start up to flash_end */
+    bool from_flash;
+    uint32_t flash_start,
+             flash_end;
+
+    char body[TELEMETRY_BODY_LEN];
+} _tm_batches[HTTP_CLIENT_MAX_PIPELINE];
+
+/**
+ * The samples being encoded into a batch, gathered from the ring or read from flash
+ */
+static
+struct telemetry_sample _tm_batch_samples[TELEMETRY_MAX_BATCH];
+
+static
+uint8_t _tm_batch_head,
+        _tm_batch_tail;
+
+static
+struct http_client *_tm_client;
+
+/* Status document waiting to go out, if _tm_status_len is not 0 */
+static
+char _tm_status[TELEMETRY_STATUS_MAX];
+
+/* Breaks the build if a status document doesn't fit the batch that carries it */
+typedef char _telemetry_status_fits_batch[sizeof(_tm_status) <= sizeof(_tm_batches[0].body) ? 1 : -1];
+
+static
+size_t _tm_status_len = 0;
+
+static
+struct telemetry_config _tm_config = {
+    .batch_size = TELEMETRY_DEFAULT_BATCH_SIZE,
+    .flush_interval_ms = TELEMETRY_DEFAULT_FLUSH_MS,
+    .encoding = TELEMETRY_DEFAULT_ENCODING,
+};
+
+static
+struct telemetry_stats _tm_stats;
+
+static
+uint32_t _tm_clock_ms,
+         _tm_clock_last_us,
+         _tm_clock_frac_us;
+
+ICACHE_FLASH_ATTR
+uint32_t telemetry_time_ms(void)
+{
+    uint32_t now_us = hal_time_us();
+
+    /* Unsigned subtraction copes with hal_time_us() wrapping, as long as we're called hourly */
+    _tm_clock_frac_us += now_us - _tm_clock_last_us;
+    _tm_clock_last_us = now_us;
+
+    _tm_clock_ms += _tm_clock_frac_us / 1000;
+    _tm_clock_frac_us %= 1000;
+
+    return _tm_clock_ms;
+}
+
+ICACHE_FLASH_ATTR
+void telemetry_set_time_ms(uint32_t now_ms)
+{
+    _tm_clock_ms = now_ms;
+    _tm_clock_last_us = hal_time_us();
+    _tm_clock_frac_us = 0;
+}
+
+/**
+ * Sign-extend a two's complement field of the given width.
+ */
+static inline
+int16_t _telemetry_sext(uint32_t v, unsigned bits)
+{
+    return (int16_t)((int32_t)(v << (32 - bits)) >> (32 - bits));
+}
+
+ICACHE_FLASH_ATTR
+void telemetry_make_sample(unsigned probe, const struct max31855_dev *dev, struct telemetry_sample *sample)
+{
+    sample->time_ms = telemetry_time_ms();
+    sample->probe_temp = max31855_report_temp(dev);
+    sample->int_temp = _telemetry_sext(dev->int_temp, 12);
+    sample->probe = probe;
+    sample->flags = dev->flags;
+}
+
+ICACHE_FLASH_ATTR
+void telemetry_record_sample(const struct telemetry_sample *sample)
+{
+    if (_tm_tail - _tm_head == TELEMETRY_RING_LEN) {
+        if (_tm_head != _tm_sent) {
+            /* The oldest samples are on the wire; drop this one instead */
+            _tm_stats.dropped++;
+            return;
+        }
+
+        /* Nothing is getting through; keep the oldest sample in flash */
+        if (0 != flash_log_append(&_tm_ring[_tm_head % TELEMETRY_RING_LEN])) {
+            _tm_stats.dropped++;
+        } else {
+            _tm_stats.spilled++;
+        }
+
+        _tm_head++;
+        _tm_sent++;
+    }
+
+    _tm_ring[_tm_tail % TELEMETRY_RING_LEN] = *sample;
+    _tm_tail++;
+}
+
+ICACHE_FLASH_ATTR
+void telemetry_record(unsigned probe, const struct max31855_dev *dev)
+{
+    struct telemetry_sample sample;
+
+    telemetry_make_sample(probe, dev, &sample);
+    telemetry_record_sample(&sample);
+}
+
+/**
+ * The collector responded to the oldest batch on the wire.
+ */
+static ICACHE_FLASH_ATTR
+void _telemetry_on_response(struct http_client *client, unsigned response_code, const char *body, size_t length)
+{
+    struct telemetry_batch *batch = &_tm_batches[_tm_batch_head % HTTP_CLIENT_MAX_PIPELINE];
+
+    _tm_batch_head++;
+
+    if (0 == response_code && true == batch->status) {
+        /* Send it again once we reconnect, unless there's a newer one by then */
+        if (0 == _tm_status_len) {
+            os_memcpy(_tm_status, batch->body, batch->status_len);
+            _tm_status_len = batch->status_len;
+        }
+        return;
+    }
+
+    if (0 == response_code) {
+        /*
+         * The connection went away. Every batch after this one fails the same way, so rewinding
+         * to the oldest undelivered sample rebuilds all of them once we reconnect.
+         */
+        _tm_sent = _tm_head;
+        flash_log_rewind();
+        return;
+    }
+
+    if (true == batch->status) {
+        if (response_code < 200 || response_code >= 300) {
+            os_printf("TELEMETRY: Collector rejected a status report, status %u\r\n", response_code);
+        }
+        return;
+    }
+
+    if (response_code < 200 || response_code >= 300) {
+        /* Resending something the collector refused won't help */
+        os_printf("TELEMETRY: Collector rejected a batch of %u samples, status %u\r\n",
+                batch->nr_samples, response_code);
+        _tm_stats.rejected_batches++;
+    } else {
+        _tm_stats.delivered += batch->nr_samples;
+    }
+
+    if (true == batch->from_flash) {
+        flash_log_commit(batch->flash_end);
+    } else {
+        _tm_head += batch->nr_samples;
+    }
+}
+
+/**
+ * Encode the batch's samples as JSON. Temperatures stay in the device's fixed-point units: quarter
+ * degrees for the probe, 1/16ths for the cold junction.
+ */
+static ICACHE_FLASH_ATTR
+int _telemetry_encode_json(struct telemetry_batch *batch, const struct telemetry_sample *samples, unsigned nr_samples)
+{
+    char *p = batch->body;
+
+    p += os_sprintf(p, "{\"now\":%u,\"fields\":[\"t_ms\",\"probe\",\"q4\",\"int_q16\",\"flags\"],\"samples\":[",
+            telemetry_time_ms());
+
+    for (unsigned i = 0; i < nr_samples; i++) {
+        const struct telemetry_sample *sample = &samples[i];
+
+        p += os_sprintf(p, "%s[%u,%u,%d,%d,%u]", 0 == i ? "" : ",", sample->time_ms, sample->probe,
+                sample->probe_temp, sample->int_temp, sample->flags);
+    }
+
+    p += os_sprintf(p, "]}");
+
+    return p - batch->body;
+}
+
+/**
+ * Encode the batch's samples in the packed binary format described in telemetry_codec.h.
+ */
+static ICACHE_FLASH_ATTR
+int _telemetry_encode_binary(struct telemetry_batch *batch, const struct telemetry_sample *samples, unsigned nr_samples)
+{
+    struct telemetry_codec_probe probes[TELEMETRY_CODEC_MAX_PROBES];
+    uint8_t *p = (uint8_t *)batch->body;
+    uint32_t now_ms = telemetry_time_ms();
+
+    os_memset(probes, 0, sizeof(probes));
+
+    *p++ = TELEMETRY_CODEC_MAGIC;
+    *p++ = TELEMETRY_CODEC_VERSION;
+    p = telemetry_put_varint(p, now_ms);
+    p = telemetry_put_varint(p, nr_samples);
+
+    for (unsigned i = 0; i < nr_samples; i++) {
+        const struct telemetry_sample *sample = &samples[i];
+        struct telemetry_codec_probe *probe = &probes[sample->probe % TELEMETRY_CODEC_MAX_PROBES];
+        uint8_t *hdr = p++;
+
+        *hdr = (sample->probe & TELEMETRY_CODEC_HDR_PROBE_MASK) |
+            ((sample->flags << TELEMETRY_CODEC_HDR_FLAGS_SHIFT) & TELEMETRY_CODEC_HDR_FLAGS_MASK);
+
+        if (false == probe->seen) {
+            p = telemetry_put_varint(p, now_ms - sample->time_ms);
+            p = telemetry_put_varint(p, telemetry_zigzag(sample->probe_temp));
+            p = telemetry_put_varint(p, telemetry_zigzag(sample->int_temp));
+            *hdr |= TELEMETRY_CODEC_HDR_INT_TEMP;
+            probe->seen = true;
+        } else {
+            uint32_t interval_ms = sample->time_ms - probe->time_ms;
+
+            p = telemetry_put_varint(p, telemetry_zigzag((int32_t)(interval_ms - probe->interval_ms)));
+            p = telemetry_put_varint(p, telemetry_zigzag(sample->probe_temp - probe->probe_temp));
+            if (sample->int_temp != probe->int_temp) {
+                p = telemetry_put_varint(p, telemetry_zigzag(sample->int_temp - probe->int_temp));
+                *hdr |= TELEMETRY_CODEC_HDR_INT_TEMP;
+            }
+            probe->interval_ms = interval_ms;
+        }
+
+        probe->time_ms = sample->time_ms;
+        probe->probe_temp = sample->probe_temp;
+        probe->int_temp = sample->int_temp;
+    }
+
+    return p - (uint8_t *)batch->body;
+}
+
+/**
+ * Gather the next batch to send: the oldest unread records in the flash log if there are any,
+ * otherwise the oldest unsent samples in the ring if a batch is due.
+ *
+ * \return Number of samples gathered into _tm_batch_samples.
+ */
+static ICACHE_FLASH_ATTR
+unsigned _telemetry_gather(struct telemetry_batch *batch)
+{
+    uint32_t unsent = _tm_tail - _tm_sent;
+    unsigned nr_samples = 0;
+
+    /* A backlog goes out as fast as the link allows, in the biggest batches we can make */
+    while (0 != flash_log_unread()) {
+        batch->from_flash = true;
+        batch->flash_start = flash_log_tell();
+        nr_samples = flash_log_read(_tm_batch_samples, TELEMETRY_MAX_BATCH, &batch->flash_end);
+
+        if (0 != nr_samples) {
+            return nr_samples;
+        }
+
+        /*
+         * Nothing but corrupt records. They can be written off now unless earlier reads are still
+         * in flight; otherwise the next delivered batch commits past them.
+         */
+        if (_tm_batch_head == _tm_batch_tail) {
+            flash_log_commit(batch->flash_end);
+        }
+    }
+
+    batch->from_flash = false;
+
+    if (0 == unsent) {
+        return 0;
+    }
+
+    /* A partial batch waits until its oldest sample has waited long enough */
+    if (unsent < _tm_config.batch_size &&
+            telemetry_time_ms() - _tm_ring[_tm_sent % TELEMETRY_RING_LEN].time_ms < _tm_config.flush_interval_ms)
+    {
+        return 0;
+    }
+
+    nr_samples = unsent < _tm_config.batch_size ? unsent : _tm_config.batch_size;
+
+    for (unsigned i = 0; i < nr_samples; i++) {
+        _tm_batch_samples[i] = _tm_ring[(_tm_sent + i) % TELEMETRY_RING_LEN];
+    }
+
+    return nr_samples;
+}
+
+ICACHE_FLASH_ATTR
+void telemetry_poll(void)
+{
+    while (NULL != _tm_client && HTTP_CLIENT_CONNECTED == _tm_client->state &&
+            0 != http_client_free_slots(_tm_client))
+    {
+        struct telemetry_batch *batch = &_tm_batches[_tm_batch_tail % HTTP_CLIENT_MAX_PIPELINE];
+        enum http_content_type content_type;
+        unsigned nr_samples = 0;
+        int len = 0;
+
+        if (0 != _tm_status_len) {
+            os_memcpy(batch->body, _tm_status, _tm_status_len);
+
+            if (0 != http_client_send_message(_tm_client, HTTP_METHOD_POST, NULL,
+                        TELEMETRY_STATUS_RESOURCE, HTTP_CONTENT_TYPE_JSON, batch->body, _tm_status_len,
+                        _telemetry_on_response))
+            {
+                break;
+            }
+
+            batch->status = true;
+            batch->status_len = _tm_status_len;
+            batch->from_flash = false;
+            batch->nr_samples = 0;
+            _tm_batch_tail++;
+            _tm_status_len = 0;
+            continue;
+        }
+
+        batch->status = false;
+
+        if (0 == (nr_samples = _telemetry_gather(batch))) {
+            break;
+        }
+
+        if (TELEMETRY_ENCODING_BINARY == _tm_config.encoding) {
+            len = _telemetry_encode_binary(batch, _tm_batch_samples, nr_samples);
+            content_type = HTTP_CONTENT_TYPE_OCTET_STREAM;
+        } else {
+            len = _telemetry_encode_json(batch, _tm_batch_samples, nr_samples);
+            content_type = HTTP_CONTENT_TYPE_JSON;
+        }
+
+        if (0 != http_client_send_message(_tm_client, HTTP_METHOD_POST, NULL,
+                    TELEMETRY_COLLECTOR_RESOURCE, content_type, batch->body, len, _telemetry_on_response))
+        {
+            if (true == batch->from_flash) {
+                flash_log_seek(batch->flash_start);
+            }
+            break;
+        }
+
+        batch->nr_samples = nr_samples;
+        _tm_batch_tail++;
+
+        if (false == batch->from_flash) {
+            _tm_sent += nr_samples;
+        }
+    }
+}
+
+ICACHE_FLASH_ATTR
+int telemetry_send_status(const char *json, size_t len)
+{
+    if (len > sizeof(_tm_status)) {
+        return -1;
+    }
+
+    os_memcpy(_tm_status, json, len);
+    _tm_status_len = len;
+
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+bool telemetry_idle(void)
+{
+    return _tm_head == _tm_tail && _tm_batch_head == _tm_batch_tail && 0 == flash_log_unread();
+}
+
+ICACHE_FLASH_ATTR
+void telemetry_shutdown(void)
+{
+    /* Responses still to come would refer to batches we are about to forget */
+    _tm_batch_head = _tm_batch_tail;
+    flash_log_rewind();
+
+    while (_tm_head != _tm_tail) {
+        if (0 != flash_log_append(&_tm_ring[_tm_head % TELEMETRY_RING_LEN])) {
+            _tm_stats.dropped += _tm_tail - _tm_head;
+            break;
+        }
+
+        _tm_stats.spilled++;
+        _tm_head++;
+    }
+
+    _tm_head = _tm_sent = _tm_tail;
+}
+
+ICACHE_FLASH_ATTR
+void telemetry_set_config(const struct telemetry_config *cfg)
+{
+    _tm_config = *cfg;
+
+    if (0 == _tm_config.batch_size) {
+        _tm_config.batch_size = 1;
+    } else if (_tm_config.batch_size > TELEMETRY_MAX_BATCH) {
+        _tm_config.batch_size = TELEMETRY_MAX_BATCH;
+    }
+}
+
+ICACHE_FLASH_ATTR
+void telemetry_get_config(struct telemetry_config *cfg)
+{
+    *cfg = _tm_config;
+}
+
+ICACHE_FLASH_ATTR
+void telemetry_get_stats(struct telemetry_stats *stats)
+{
+    *stats = _tm_stats;
+    stats->pending = _tm_tail - _tm_head;
+}
+
+ICACHE_FLASH_ATTR
+void telemetry_init(struct http_client *client)
+{
+    _tm_client = client;
+    _tm_client->fail_unsent_on_disconnect = true;
+    _tm_head = _tm_sent = _tm_tail = 0;
+    _tm_batch_head = _tm_batch_tail = 0;
+    _tm_status_len = 0;
+    _tm_clock_last_us = hal_time_us();
+
+    if (0 != flash_log_init()) {
+        os_printf("TELEMETRY: Flash log unavailable, samples will be lost during outages\r\n");
+    }
+}
@@ -0,0 +1,175 @@
+#pragma once
+
+/** \file telemetry.h Buffered, batched sample uploads
+ * Samples are recorded into a fixed-size ring as they are read, and uploaded to the collector in
+ * batches of several samples per request. A sample stays in the ring until the collector has
+ * acknowledged the batch carrying it, so a dropped connection costs nothing but a resend. During
+ * a longer outage the overflow is spooled to the flash log (flash_log.h) and drained, oldest
+ * first, once the collector is reachable again.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "telemetry_config.h"
+
+struct http_client;
+struct max31855_dev;
+
+/**
+ * One probe reading, in the MAX31855's own fixed-point units
+ */
+struct telemetry_sample {
+    /**
+     * Milliseconds since boot when the sample was taken
+     */
+    uint32_t time_ms;
+
+    /**
+     * Probe temperature in quarter degrees C, filtered over the reporting interval. Not valid if
+     * flags != 0
+     */
+    int16_t probe_temp;
+
+    /**
+     * Cold junction temperature in 1/16ths of a degree C
+     */
+    int16_t int_temp;
+
+    /**
+     * Index of the probe the sample came from
+     */
+    uint8_t probe;
+
+    /**
+     * MAX31855_FLAG_* fault flags
+     */
+    uint8_t flags;
+};
+
+enum telemetry_encoding {
+    /**
+     * Self-describing JSON, readable by anything
+     */
+    TELEMETRY_ENCODING_JSON = 0,
+
+    /**
+     * Delta and varint packed binary, see telemetry_codec.h
+     */
+    TELEMETRY_ENCODING_BINARY,
+};
+
+struct telemetry_config {
+    /**
+     * Number of samples to send per upload, at most TELEMETRY_MAX_BATCH
+     */
+    uint16_t batch_size;
+
+    /**
+     * Upload a partial batch once its oldest sample is this old
+     */
+    uint32_t flush_interval_ms;
+
+    /**
+     * How batches are encoded on the wire
+     */
+    enum telemetry_encoding encoding;
+};
+
+struct telemetry_stats {
+    /**
+     * Samples in the ring, not yet acknowledged by the collector
+     */
+    uint32_t pending;
+
+    /**
+     * Samples moved from the ring to the flash log
+     */
+    uint32_t spilled;
+
+    /**
+     * Samples lost because the ring was full and they could not be spilled
+     */
+    uint32_t dropped;
+
+    /**
+     * Samples the collector acknowledged
+     */
+    uint32_t delivered;
+
+    /**
+     * Batches the collector rejected, whose samples were discarded
+     */
+    uint32_t rejected_batches;
+};
+
+/**
+ * Set up the sample ring and attach it to the HTTP client used for uploads. Telemetry must be the
+ * only user of the client, since it matches responses to batches in order.
+ */
+void telemetry_init(struct http_client *client);
+
+/**
+ * Change the batching parameters. Takes effect from the next flush.
+ */
+void telemetry_set_config(const struct telemetry_config *cfg);
+void telemetry_get_config(struct telemetry_config *cfg);
+
+/**
+ * Record the latest reading from a probe. If the ring is full the oldest sample is spilled to the
+ * flash log, or the new one is dropped if the oldest samples are part of an upload in flight.
+ */
+void telemetry_record(unsigned probe, const struct max31855_dev *dev);
+
+/**
+ * Fill in a sample from the latest reading from a probe, timestamped now, without recording it.
+ */
+void telemetry_make_sample(unsigned probe, const struct max31855_dev *dev, struct telemetry_sample *sample);
+
+/**
+ * Record a sample made earlier by telemetry_make_sample(), as telemetry_record() would.
+ */
+void telemetry_record_sample(const struct telemetry_sample *sample);
+
+/**
+ * Queue a JSON status document for TELEMETRY_STATUS_RESOURCE, to go out ahead of the next batch.
+ * The document is copied. One still waiting to go is replaced. One lost with the connection
+ * goes again once it is back, unless it has been replaced by then; one the collector refuses is
+ * dropped.
+ *
+ * \return 0 on success, -1 if the document is longer than TELEMETRY_STATUS_MAX.
+ */
+int telemetry_send_status(const char *json, size_t len);
+
+/**
+ * Upload any batches that are due. Call periodically; does nothing while the client is not
+ * connected, so samples accumulate until it is.
+ */
+void telemetry_poll(void);
+
+/**
+ * Whether every sample recorded so far, including any backlog in the flash log, has been
+ * delivered or rejected.
+ */
+bool telemetry_idle(void);
+
+/**
+ * Give up on uploading for now and move every undelivered sample in the ring to the flash log, to
+ * be sent after the next boot. Anything in flight is abandoned, so only call this right before
+ * powering down.
+ */
+void telemetry_shutdown(void);
+
+/**
+ * Milliseconds since boot. Unlike hal_time_us() this doesn't wrap for 49 days, as long as it is
+ * called at least once an hour.
+ */
+uint32_t telemetry_time_ms(void);
+
+/**
+ * Set the clock telemetry_time_ms() reads, to carry it across deep sleep.
+ */
+void telemetry_set_time_ms(uint32_t now_ms);
+
+void telemetry_get_stats(struct telemetry_stats *stats);
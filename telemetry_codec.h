@@ -0,0 +1,114 @@
+#pragma once
+
+/** \file telemetry_codec.h Compact binary encoding of a batch of samples
+ * Shared by the encoder in telemetry.c and the reference decoder in tools/telemetry_decode.c, so
+ * this header must not depend on the platform.
+ *
+ * All integers are unsigned LEB128 varints; signed values are zigzag encoded first. A batch is
+ *
+ *     magic (1 byte, TELEMETRY_CODEC_MAGIC)
+ *     version (1 byte, TELEMETRY_CODEC_VERSION)
+ *     varint now_ms            uptime when the batch was encoded
+ *     varint nr_samples
+ *     nr_samples samples
+ *
+ * and each sample is a header byte, with the probe index in bits 0-3, the fault flags in bits
+ * 4-6, and bit 7 set if the cold junction temperature follows, then
+ *
+ *     first sample from this probe in the batch:
+ *         varint age_ms        now_ms - sample time
+ *         zigzag probe_temp    quarter degrees
+ *         zigzag int_temp      1/16ths of a degree (always present, bit 7 is set)
+ *     later samples from the same probe:
+ *         zigzag dod_ms        change in the interval since the previous sample from this probe
+ *         zigzag probe_temp    change since the previous sample from this probe
+ *         zigzag int_temp      change since the previous sample from this probe, only if bit 7
+ *
+ * At a steady sample rate the interval barely changes and neither do the temperatures, so most
+ * samples come to three bytes.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TELEMETRY_CODEC_MAGIC           0xb7
+#define TELEMETRY_CODEC_VERSION         1
+
+#define TELEMETRY_CODEC_MAX_PROBES      16
+
+#define TELEMETRY_CODEC_HDR_PROBE_MASK  0x0f
+#define TELEMETRY_CODEC_HDR_FLAGS_SHIFT 4
+#define TELEMETRY_CODEC_HDR_FLAGS_MASK  0x70
+#define TELEMETRY_CODEC_HDR_INT_TEMP    0x80
+
+/* Magic, version and two 32-bit varints */
+#define TELEMETRY_CODEC_BATCH_HDR_MAX   12
+
+/* Header byte, a 32-bit varint and two 16-bit zigzag varints */
+#define TELEMETRY_CODEC_SAMPLE_MAX      12
+
+/**
+ * What both ends remember about each probe while walking a batch
+ */
+struct telemetry_codec_probe {
+    bool seen;
+    uint32_t time_ms;
+    uint32_t interval_ms;
+    int16_t probe_temp;
+    int16_t int_temp;
+};
+
+static inline
+uint32_t telemetry_zigzag(int32_t v)
+{
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static inline
+int32_t telemetry_unzigzag(uint32_t v)
+{
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+/**
+ * Append a varint. The caller guarantees there is room for 5 bytes.
+ */
+static inline
+uint8_t *telemetry_put_varint(uint8_t *p, uint32_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+
+    *p++ = v;
+
+    return p;
+}
+
+/**
+ * Read a varint, without going past end.
+ *
+ * \return Pointer past the varint, or NULL if it was truncated or too long.
+ */
+static inline
+const uint8_t *telemetry_get_varint(const uint8_t *p, const uint8_t *end, uint32_t *v)
+{
+    uint32_t val = 0;
+
+    for (unsigned shift = 0; shift < 35; shift += 7) {
+        if (p == end) {
+            return NULL;
+        }
+
+        val |= (uint32_t)(*p & 0x7f) << shift;
+
+        if (0 == (*p++ & 0x80)) {
+            *v = val;
+            return p;
+        }
+    }
+
+    return NULL;
+}
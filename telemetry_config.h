@@ -0,0 +1,30 @@
+#pragma once
+
+/**
+ * Number of samples held in RAM waiting to be uploaded. At the default 500ms sample rate and one
+ * probe this covers a little over two minutes without a connection.
+ */
+#define TELEMETRY_RING_LEN              256
+
+/**
+ * Largest batch one upload can carry. The batch size in struct telemetry_config is clamped to
+ * this.
+ */
+#define TELEMETRY_MAX_BATCH             16
+
+/**
+ * Longest status document telemetry_send_status() takes. Batch buffers are made big enough to
+ * carry one, so this costs HTTP_CLIENT_MAX_PIPELINE times over whatever it adds beyond a batch of
+ * samples.
+ */
+#define TELEMETRY_STATUS_MAX            1024
+
+/**
+ * Defaults for struct telemetry_config
+ */
+#define TELEMETRY_DEFAULT_BATCH_SIZE    8
+#define TELEMETRY_DEFAULT_FLUSH_MS      10000
+#define TELEMETRY_DEFAULT_ENCODING      TELEMETRY_ENCODING_BINARY
+
+#define TELEMETRY_COLLECTOR_RESOURCE    "/samples"
+#define TELEMETRY_STATUS_RESOURCE       "/status"
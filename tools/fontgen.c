@@ -0,0 +1,237 @@
+/** \file fontgen.c Font record generator
+ * Host tool, run at build time. Transposes the fonts into the layout the SH1106 driver draws
+ * from: one word-aligned record per glyph, with the spacing column included and both the normal
+ * and inverted forms stored, so drawing a glyph is a single copy.
+ *
+ * The small font comes from font_5x7.h. The large font is read from a text file of 8x16 row-major
+ * pixel art (see font_8x16.txt).
+ *
+ * Usage: fontgen [large font file] > font_cache.h
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "font_5x7.h"
+
+#define SMALL_WIDTH         (FONT_CHAR_WIDTH + 1)
+#define SMALL_WORDS         ((SMALL_WIDTH + 3)/4)
+
+#define LARGE_WIDTH         8
+#define LARGE_HEIGHT        16
+#define LARGE_PAGES         (LARGE_HEIGHT/8)
+#define LARGE_WORDS         ((LARGE_WIDTH + 3)/4)
+
+#define MAX_LARGE_GLYPHS    64
+
+struct large_glyph {
+    unsigned code;
+    uint8_t cols[LARGE_PAGES][LARGE_WIDTH];
+};
+
+static
+struct large_glyph large_glyphs[MAX_LARGE_GLYPHS];
+
+static
+unsigned nr_large_glyphs = 0;
+
+/**
+ * Pack bytes into little-endian words, so that the first byte goes out on the wire first.
+ */
+static
+void pack_words(uint32_t *words, const uint8_t *bytes, size_t nr_bytes, size_t nr_words, uint8_t mask)
+{
+    memset(words, 0, nr_words * sizeof(uint32_t));
+
+    for (size_t i = 0; i < nr_words * 4; i++) {
+        uint8_t b = (i < nr_bytes ? bytes[i] : 0) ^ mask;
+        words[i / 4] |= (uint32_t)b << ((i % 4) * 8);
+    }
+}
+
+static
+void print_words(const uint32_t *words, size_t nr_words)
+{
+    printf("{ ");
+    for (size_t i = 0; i < nr_words; i++) {
+        printf("0x%08x%s", words[i], i + 1 < nr_words ? ", " : " ");
+    }
+    printf("}");
+}
+
+static
+void emit_small(void)
+{
+    printf("/**\n"
+           " * 5x7 font: [character][inverted] -> %d columns, including spacing, padded to %d words\n"
+           " */\n", SMALL_WIDTH, SMALL_WORDS);
+    printf("static const\nuint32_t font_small_glyphs[256][2][%d] __attribute__((aligned(4))) = {\n", SMALL_WORDS);
+
+    for (unsigned c = 0; c < 256; c++) {
+        uint8_t cols[SMALL_WIDTH] = { 0 };
+        uint32_t words[SMALL_WORDS];
+
+        memcpy(cols, &font_data[c * FONT_CHAR_WIDTH], FONT_CHAR_WIDTH);
+
+        printf("    [0x%02x] = { ", c);
+        for (int inv = 0; inv < 2; inv++) {
+            pack_words(words, cols, SMALL_WIDTH, SMALL_WORDS, inv ? 0xff : 0x00);
+            print_words(words, SMALL_WORDS);
+            printf("%s", inv ? " },\n" : ", ");
+        }
+    }
+
+    printf("};\n\n");
+}
+
+/**
+ * Parse the large font description. Returns 0 on success.
+ */
+static
+int load_large(const char *filename)
+{
+    int status = 0;
+    FILE *fp = NULL;
+    char line[128];
+    struct large_glyph *glyph = NULL;
+    int row = 0,
+        lineno = 0;
+
+    if (NULL == (fp = fopen(filename, "r"))) {
+        fprintf(stderr, "fontgen: could not open %s\n", filename);
+        status = -1;
+        goto done;
+    }
+
+    while (NULL != fgets(line, sizeof(line), fp)) {
+        size_t len = strlen(line);
+
+        lineno++;
+
+        while (len > 0 && isspace((unsigned char)line[len - 1])) {
+            line[--len] = '\0';
+        }
+
+        if (0 == len || '#' == line[0]) {
+            continue;
+        }
+
+        if (0 == strncmp(line, "glyph ", 6)) {
+            const char *code = line + 6;
+
+            if (NULL != glyph && LARGE_HEIGHT != row) {
+                fprintf(stderr, "fontgen: %s:%d: previous glyph has %d rows\n", filename, lineno, row);
+                status = -1;
+                goto done;
+            }
+
+            if (MAX_LARGE_GLYPHS == nr_large_glyphs) {
+                fprintf(stderr, "fontgen: %s:%d: too many glyphs\n", filename, lineno);
+                status = -1;
+                goto done;
+            }
+
+            glyph = &large_glyphs[nr_large_glyphs++];
+            memset(glyph, 0, sizeof(*glyph));
+            glyph->code = (0 == strncmp(code, "0x", 2)) ? strtoul(code, NULL, 16) : (unsigned char)code[0];
+            row = 0;
+            continue;
+        }
+
+        if (NULL == glyph || LARGE_HEIGHT == row || LARGE_WIDTH != len) {
+            fprintf(stderr, "fontgen: %s:%d: unexpected line\n", filename, lineno);
+            status = -1;
+            goto done;
+        }
+
+        /* Transpose: bit 0 of each column byte is the top row of the page */
+        for (int x = 0; x < LARGE_WIDTH; x++) {
+            if ('X' == line[x]) {
+                glyph->cols[row / 8][x] |= 1 << (row % 8);
+            }
+        }
+
+        row++;
+    }
+
+    if (NULL != glyph && LARGE_HEIGHT != row) {
+        fprintf(stderr, "fontgen: %s: last glyph has %d rows\n", filename, row);
+        status = -1;
+    }
+
+done:
+    if (NULL != fp) {
+        fclose(fp);
+    }
+    return status;
+}
+
+static
+void emit_large(void)
+{
+    uint8_t index[256];
+
+    memset(index, 0xff, sizeof(index));
+
+    printf("/**\n"
+           " * 8x16 font: [glyph][inverted][page] -> %d columns, including spacing, in %d words\n"
+           " */\n", LARGE_WIDTH, LARGE_WORDS);
+    printf("static const\nuint32_t font_large_glyphs[%u][2][%d][%d] __attribute__((aligned(4))) = {\n",
+            nr_large_glyphs, LARGE_PAGES, LARGE_WORDS);
+
+    for (unsigned i = 0; i < nr_large_glyphs; i++) {
+        struct large_glyph *glyph = &large_glyphs[i];
+        uint32_t words[LARGE_WORDS];
+
+        index[glyph->code & 0xff] = i;
+
+        printf("    [%u] = { /* 0x%02x */\n", i, glyph->code);
+        for (int inv = 0; inv < 2; inv++) {
+            printf("        { ");
+            for (int page = 0; page < LARGE_PAGES; page++) {
+                pack_words(words, glyph->cols[page], LARGE_WIDTH, LARGE_WORDS, inv ? 0xff : 0x00);
+                print_words(words, LARGE_WORDS);
+                printf("%s", page + 1 < LARGE_PAGES ? ", " : " },\n");
+            }
+        }
+        printf("    },\n");
+    }
+
+    printf("};\n\n");
+
+    printf("/**\n"
+           " * Map from character to index in font_large_glyphs, FONT_LARGE_NONE if not present\n"
+           " */\n");
+    printf("static const\nuint8_t font_large_index[256] = {\n");
+    for (unsigned c = 0; c < 256; c++) {
+        printf("%s0x%02x,%s", 0 == c % 12 ? "    " : "", index[c], (11 == c % 12 || 255 == c) ? "\n" : " ");
+    }
+    printf("};\n");
+}
+
+int main(int argc, char *argv[])
+{
+    if (2 != argc) {
+        fprintf(stderr, "usage: %s [large font file]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (0 != load_large(argv[1])) {
+        return EXIT_FAILURE;
+    }
+
+    printf("/* Generated by tools/fontgen from font_5x7.h and %s. Do not edit. */\n\n", argv[1]);
+    printf("#pragma once\n\n#include <stdint.h>\n\n");
+    printf("#define FONT_SMALL_WIDTH        %d\n", SMALL_WIDTH);
+    printf("#define FONT_LARGE_WIDTH        %d\n", LARGE_WIDTH);
+    printf("#define FONT_LARGE_PAGES        %d\n", LARGE_PAGES);
+    printf("#define FONT_LARGE_NONE         0xff\n\n");
+
+    emit_small();
+    emit_large();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,627 @@
+/** \file http_parse_fuzz.c Fuzzer and benchmark for the HTTP response parser
+ * Host tool. Builds streams of random keep-alive responses (Content-Length, chunked and
+ * close-delimited bodies, interim responses, HTTP/1.0 and 1.1, odd header casing and spacing,
+ * headers that nearly match the ones the parser acts on), feeds them to http_response_parse() in
+ * randomly sized pieces, and checks that every status, body and keep-alive decision comes out as
+ * generated. Every other stream also goes through again with a few bytes mangled, which only has
+ * to be survived; build with -fsanitize=address,undefined to make that mean something.
+ *
+ * Usage: http_parse_fuzz [-n iterations] [-s seed] [-b]
+ *
+ * -b skips the fuzzing and times the parser instead, over a stream of typical collector replies
+ * fed a TCP segment at a time, and a byte at a time.
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "http_parse.h"
+
+#define MAX_STREAM_LEN      65536
+#define MAX_RESPONSES       8
+#define MAX_BODY_LEN        6000
+#define TCP_MSS             1460
+
+struct expect {
+    unsigned status;
+    bool keep_alive;
+    size_t body_off;
+    size_t body_len;
+};
+
+struct stream {
+    char data[MAX_STREAM_LEN];
+    size_t len;
+
+    /* What should come out of it */
+    struct expect expect[MAX_RESPONSES];
+    unsigned nr_expect;
+    char body[MAX_STREAM_LEN];
+    size_t body_len;
+};
+
+/* What actually came out */
+struct result {
+    struct expect got[MAX_RESPONSES + 1];
+    unsigned nr_got;
+    char body[MAX_STREAM_LEN];
+    size_t body_len;
+    size_t body_start;
+    bool overflow;
+};
+
+static
+uint64_t rng_state = 1;
+
+static
+uint32_t rng(void)
+{
+    /* xorshift64* */
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+
+    return (rng_state * 0x2545f4914f6cdd1dull) >> 32;
+}
+
+static
+uint32_t rng_below(uint32_t n)
+{
+    return rng() % n;
+}
+
+static __attribute__((format(printf, 2, 3)))
+void put(struct stream *st, const char *fmt, ...)
+{
+    va_list ap;
+    int nr;
+
+    va_start(ap, fmt);
+    nr = vsnprintf(st->data + st->len, sizeof(st->data) - st->len, fmt, ap);
+    va_end(ap);
+
+    if (nr < 0 || (size_t)nr >= sizeof(st->data) - st->len) {
+        fprintf(stderr, "stream overflow\n");
+        exit(EXIT_FAILURE);
+    }
+
+    st->len += nr;
+}
+
+static
+void put_bytes(struct stream *st, const char *data, size_t len)
+{
+    if (len > sizeof(st->data) - st->len) {
+        fprintf(stderr, "stream overflow\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(st->data + st->len, data, len);
+    st->len += len;
+}
+
+static
+const char *eol(void)
+{
+    return 0 == rng_below(8) ? "\n" : "\r\n";
+}
+
+/**
+ * A header name, in random case
+ */
+static
+void put_name(struct stream *st, const char *name)
+{
+    for (; '\0' != *name; name++) {
+        char c = *name;
+
+        if (c >= 'a' && c <= 'z' && 0 == rng_below(3)) {
+            c -= 'a' - 'A';
+        }
+
+        put(st, "%c", c);
+    }
+
+    put(st, ":%s", (const char *[]){ "", " ", "  ", "\t" }[rng_below(4)]);
+}
+
+/**
+ * Headers the parser has to look past
+ */
+static
+void put_noise_headers(struct stream *st)
+{
+    static const char *const noise[] = {
+        "Server: kitchen-sink",
+        "Content-Type: application/json",
+        "Content-Lengthy: 12",
+        "X-Content-Length: 99",
+        "Connectionx: close",
+        "Transfer-Encodings: chunked",
+        "Date: Sat, 17 Oct 2026 10:00:00 GMT",
+        "X-Long: aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+            "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+        "X-Folded: first part",
+    };
+    unsigned nr = rng_below(4);
+
+    for (unsigned i = 0; i < nr; i++) {
+        unsigned which = rng_below(sizeof(noise) / sizeof(noise[0]));
+
+        put(st, "%s%s", noise[which], eol());
+
+        /* An obsolete folded continuation, which mentions a header we do act on */
+        if (0 == strncmp(noise[which], "X-Folded", 8)) {
+            put(st, " Connection: close%s", eol());
+        }
+    }
+}
+
+static
+void put_body(struct stream *st, size_t len)
+{
+    char buf[MAX_BODY_LEN];
+
+    for (size_t i = 0; i < len; i++) {
+        /* Lots of line ends and NULs, so nothing can be mistaken for framing */
+        switch (rng_below(8)) {
+        case 0:
+            buf[i] = '\r';
+            break;
+        case 1:
+            buf[i] = '\n';
+            break;
+        case 2:
+            buf[i] = '\0';
+            break;
+        default:
+            buf[i] = rng();
+        }
+    }
+
+    memcpy(st->body + st->body_len, buf, len);
+    st->body_len += len;
+
+    st->expect[st->nr_expect].body_len += len;
+}
+
+/**
+ * Add a response to the stream. last is set for the final response, which can be one that only
+ * the connection closing brings to an end.
+ */
+static
+void gen_response(struct stream *st, bool last)
+{
+    static const unsigned statuses[] = { 200, 200, 201, 202, 204, 304, 400, 404, 500, 503 };
+    struct expect *exp = &st->expect[st->nr_expect];
+    bool http_1_0 = 0 == rng_below(5),
+         no_body = false;
+    unsigned status = statuses[rng_below(sizeof(statuses) / sizeof(statuses[0]))];
+    enum { FRAME_LENGTH, FRAME_CHUNKED, FRAME_CLOSE } frame = FRAME_LENGTH;
+    enum { CONN_NONE, CONN_CLOSE, CONN_KEEP_ALIVE } conn = CONN_NONE;
+    size_t body_len = 0;
+
+    memset(exp, 0, sizeof(*exp));
+    exp->status = status;
+    exp->body_off = st->body_len;
+
+    if (false == http_1_0 && 0 == rng_below(8)) {
+        put(st, "HTTP/1.1 100 Continue%s", eol());
+        if (0 == rng_below(2)) {
+            put_noise_headers(st);
+        }
+        put(st, "%s", eol());
+    }
+
+    no_body = 204 == status || 304 == status;
+
+    if (false == no_body) {
+        unsigned pick = rng_below(last ? 5 : 4);
+
+        if (pick >= 4) {
+            frame = FRAME_CLOSE;
+        } else if (pick >= 2 && false == http_1_0) {
+            frame = FRAME_CHUNKED;
+        }
+
+        body_len = 0 == rng_below(10) ? 0 : rng_below(0 == rng_below(8) ? MAX_BODY_LEN : 300);
+    }
+
+    /* Only the last response may end the connection, which 1.0 does unless asked not to */
+    if (true == last && 0 == rng_below(3)) {
+        conn = CONN_CLOSE;
+    } else if (true == last && true == http_1_0 && 0 == rng_below(2)) {
+        conn = CONN_NONE;
+    } else if (true == http_1_0 || 0 == rng_below(3)) {
+        conn = CONN_KEEP_ALIVE;
+    }
+
+    if (FRAME_CLOSE == frame || CONN_CLOSE == conn) {
+        exp->keep_alive = false;
+    } else if (true == http_1_0) {
+        exp->keep_alive = CONN_KEEP_ALIVE == conn;
+    } else {
+        exp->keep_alive = true;
+    }
+
+    put(st, "HTTP/1.%c %u %s%s", http_1_0 ? '0' : '1', status,
+            (const char *[]){ "OK", "Whatever", "", "With several words" }[rng_below(4)], eol());
+    put_noise_headers(st);
+
+    if (CONN_CLOSE == conn) {
+        put_name(st, "connection");
+        put(st, "%s%s", 0 == rng_below(2) ? "close" : "Close", eol());
+    } else if (CONN_KEEP_ALIVE == conn) {
+        put_name(st, "connection");
+        put(st, "%s%s", 0 == rng_below(2) ? "keep-alive" : "Keep-Alive, Upgrade", eol());
+    }
+
+    if (FRAME_LENGTH == frame && false == no_body) {
+        put_name(st, "content-length");
+        put(st, "%zu%s%s", body_len, 0 == rng_below(4) ? " " : "", eol());
+    } else if (FRAME_CHUNKED == frame) {
+        put_name(st, "transfer-encoding");
+        put(st, "%s%s", 0 == rng_below(2) ? "chunked" : "gzip, Chunked", eol());
+    }
+
+    put_noise_headers(st);
+    put(st, "%s", eol());
+
+    if (FRAME_CHUNKED == frame) {
+        size_t left = body_len;
+
+        while (left > 0) {
+            size_t chunk = 1 + rng_below(left < 700 ? left : 700);
+
+            put(st, 0 == rng_below(2) ? "%zx" : "%zX", chunk);
+            if (0 == rng_below(6)) {
+                put(st, ";ext=\"1\"");
+            }
+            put(st, "%s", eol());
+
+            put_body(st, chunk);
+            put_bytes(st, st->body + st->body_len - chunk, chunk);
+            put(st, "%s", eol());
+
+            left -= chunk;
+        }
+
+        put(st, "0%s", eol());
+        if (0 == rng_below(4)) {
+            put(st, "X-Checksum: 1234%s", eol());
+        }
+        put(st, "%s", eol());
+    } else if (false == no_body) {
+        put_body(st, body_len);
+        put_bytes(st, st->body + st->body_len - body_len, body_len);
+    }
+
+    st->nr_expect++;
+}
+
+static
+void gen_stream(struct stream *st)
+{
+    unsigned nr = 1 + rng_below(MAX_RESPONSES);
+
+    st->len = 0;
+    st->nr_expect = 0;
+    st->body_len = 0;
+
+    for (unsigned i = 0; i < nr; i++) {
+        gen_response(st, i == nr - 1);
+
+        /* Nothing can follow a response the server closes the connection after */
+        if (false == st->expect[st->nr_expect - 1].keep_alive) {
+            break;
+        }
+    }
+}
+
+static
+void on_body(void *arg, const char *data, size_t len)
+{
+    struct result *res = arg;
+
+    if (len > sizeof(res->body) - res->body_len) {
+        res->overflow = true;
+        return;
+    }
+
+    memcpy(res->body + res->body_len, data, len);
+    res->body_len += len;
+}
+
+static
+void on_response(void *arg, unsigned status, bool keep_alive)
+{
+    struct result *res = arg;
+
+    if (res->nr_got > MAX_RESPONSES) {
+        res->overflow = true;
+        return;
+    }
+
+    res->got[res->nr_got].status = status;
+    res->got[res->nr_got].keep_alive = keep_alive;
+    res->got[res->nr_got].body_off = res->body_start;
+    res->got[res->nr_got].body_len = res->body_len - res->body_start;
+    res->nr_got++;
+
+    res->body_start = res->body_len;
+}
+
+/**
+ * Feed the stream through a parser in random pieces.
+ *
+ * \return 0 on success, -1 if the parser reported an error.
+ */
+static
+int feed(const char *data, size_t len, struct result *res)
+{
+    struct http_response_parser parser;
+    /* Mostly a few bytes at a time, now and then a byte at a time or a whole segment */
+    size_t max_piece = (size_t[]){ 1, 7, 64, TCP_MSS }[rng_below(4)];
+
+    memset(res, 0, sizeof(*res));
+    http_response_parser_init(&parser, on_body, on_response, res);
+
+    while (len > 0) {
+        size_t piece = 1 + rng_below(max_piece);
+
+        if (piece > len) {
+            piece = len;
+        }
+
+        len -= piece;
+
+        while (piece > 0) {
+            int nr = http_response_parse(&parser, data, piece);
+
+            if (nr < 0) {
+                return -1;
+            }
+
+            if (0 == nr || (size_t)nr > piece) {
+                fprintf(stderr, "parser consumed %d of %zu bytes\n", nr, piece);
+                abort();
+            }
+
+            data += nr;
+            piece -= nr;
+        }
+    }
+
+    http_response_parser_eof(&parser);
+
+    return 0;
+}
+
+static
+int check(const struct stream *st, const struct result *res)
+{
+    if (true == res->overflow) {
+        fprintf(stderr, "more out than went in\n");
+        return -1;
+    }
+
+    if (res->nr_got != st->nr_expect) {
+        fprintf(stderr, "%u responses, expected %u\n", res->nr_got, st->nr_expect);
+        return -1;
+    }
+
+    for (unsigned i = 0; i < st->nr_expect; i++) {
+        const struct expect *exp = &st->expect[i],
+                            *got = &res->got[i];
+        bool same_body = exp->body_len == got->body_len &&
+                0 == memcmp(st->body + exp->body_off, res->body + got->body_off, exp->body_len);
+
+        if (exp->status != got->status || exp->keep_alive != got->keep_alive || false == same_body) {
+            fprintf(stderr, "response %u: status %u keep-alive %d body %zu, expected %u %d %zu%s\n",
+                    i, got->status, got->keep_alive, got->body_len, exp->status, exp->keep_alive,
+                    exp->body_len, exp->body_len == got->body_len && false == same_body ?
+                    " (contents differ)" : "");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static
+void mangle(char *data, size_t *len)
+{
+    unsigned nr = 1 + rng_below(4);
+
+    for (unsigned i = 0; i < nr && *len > 1; i++) {
+        size_t at = rng_below(*len);
+
+        switch (rng_below(3)) {
+        case 0:
+            data[at] = rng();
+            break;
+        case 1:
+            /* Drop a byte */
+            memmove(data + at, data + at + 1, *len - at - 1);
+            (*len)--;
+            break;
+        default:
+            data[at] = (const char[]){ '\r', '\n', ':', ' ', '0', 'f', ';' }[rng_below(7)];
+        }
+    }
+}
+
+static
+int fuzz(unsigned iterations)
+{
+    static struct stream st;
+    static struct result res;
+    static char mangled[MAX_STREAM_LEN];
+    unsigned nr_rejected = 0;
+
+    for (unsigned i = 0; i < iterations; i++) {
+        size_t len;
+
+        gen_stream(&st);
+
+        if (0 != feed(st.data, st.len, &res)) {
+            fprintf(stderr, "iteration %u: parser rejected a good stream\n", i);
+            fwrite(st.data, 1, st.len, stderr);
+            return -1;
+        }
+
+        if (0 != check(&st, &res)) {
+            fprintf(stderr, "iteration %u: wrong result\n", i);
+            return -1;
+        }
+
+        if (0 != (i & 1)) {
+            continue;
+        }
+
+        memcpy(mangled, st.data, st.len);
+        len = st.len;
+        mangle(mangled, &len);
+
+        if (0 != feed(mangled, len, &res)) {
+            nr_rejected++;
+        } else if (true == res.overflow) {
+            fprintf(stderr, "iteration %u: more out than went in from a mangled stream\n", i);
+            return -1;
+        }
+    }
+
+    printf("%u streams parsed, %u of %u mangled streams rejected\n", iterations, nr_rejected,
+            (iterations + 1) / 2);
+
+    return 0;
+}
+
+static
+double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static
+void on_bench_body(void *arg, const char *data, size_t len)
+{
+    *(size_t *)arg += len;
+}
+
+static
+void on_bench_response(void *arg, unsigned status, bool keep_alive)
+{
+}
+
+static
+void bench_run(const char *name, const char *data, size_t len, size_t piece, unsigned nr_responses)
+{
+    struct http_response_parser parser;
+    size_t body = 0;
+    unsigned rounds = 0;
+    double start = now_s(),
+           elapsed = 0;
+
+    http_response_parser_init(&parser, on_bench_body, on_bench_response, &body);
+
+    do {
+        for (size_t off = 0; off < len;) {
+            size_t left = len - off < piece ? len - off : piece;
+
+            while (left > 0) {
+                int nr = http_response_parse(&parser, data + off, left);
+
+                if (nr < 0) {
+                    fprintf(stderr, "benchmark stream rejected\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                off += nr;
+                left -= nr;
+            }
+        }
+
+        rounds++;
+        elapsed = now_s() - start;
+    } while (elapsed < 1.0);
+
+    printf("%-14s %8.1f MB/s %8.2f ns/byte %8.0f ns/response\n", name,
+            (double)len * rounds / elapsed / 1e6, elapsed * 1e9 / ((double)len * rounds),
+            elapsed * 1e9 / ((double)nr_responses * rounds));
+}
+
+static
+int bench(void)
+{
+    static struct stream st;
+    static char data[MAX_STREAM_LEN];
+    size_t len = 0;
+    unsigned nr = 0;
+
+    /* Collector replies: short JSON bodies, mostly Content-Length with some chunked */
+    while (len < sizeof(data) - 512) {
+        st.len = 0;
+        put(&st, "HTTP/1.1 200 OK\r\nServer: collector\r\nContent-Type: application/json\r\n");
+
+        if (0 != (nr % 4)) {
+            put(&st, "Content-Length: 17\r\n\r\n{\"accepted\":true}");
+        } else {
+            put(&st, "Transfer-Encoding: chunked\r\n\r\n11\r\n{\"accepted\":true}\r\n0\r\n\r\n");
+        }
+
+        memcpy(data + len, st.data, st.len);
+        len += st.len;
+        nr++;
+    }
+
+    printf("parser state: %zu bytes\n", sizeof(struct http_response_parser));
+    bench_run("segments", data, len, TCP_MSS, nr);
+    bench_run("single bytes", data, len, 1, nr);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned iterations = 100000;
+    uint64_t seed = time(NULL);
+    bool benchmark = false;
+    int opt;
+
+    while (-1 != (opt = getopt(argc, argv, "n:s:b"))) {
+        switch (opt) {
+        case 'n':
+            iterations = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'b':
+            benchmark = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n iterations] [-s seed] [-b]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (true == benchmark) {
+        return 0 == bench() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    printf("seed %llu\n", (unsigned long long)seed);
+    rng_state = (seed << 1) | 1;
+
+    return 0 == fuzz(iterations) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
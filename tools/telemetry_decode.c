@@ -0,0 +1,151 @@
+/** \file telemetry_decode.c Reference decoder for binary telemetry batches
+ * Host tool. Decodes batches in the format described in telemetry_codec.h and prints one line per
+ * sample, as a collector would store it.
+ *
+ * Usage: telemetry_decode [batch file...]
+ *
+ * Each file holds one batch, exactly as it was POSTed. With no arguments a single batch is read
+ * from stdin.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "telemetry_codec.h"
+
+#define MAX_BATCH_LEN       65536
+
+static
+int decode_batch(const char *name, const uint8_t *buf, size_t len)
+{
+    struct telemetry_codec_probe probes[TELEMETRY_CODEC_MAX_PROBES];
+    const uint8_t *p = buf,
+                  *end = buf + len;
+    uint32_t now_ms, nr_samples;
+
+    memset(probes, 0, sizeof(probes));
+
+    if (len < 2 || TELEMETRY_CODEC_MAGIC != p[0]) {
+        fprintf(stderr, "%s: not a telemetry batch\n", name);
+        return -1;
+    }
+
+    if (TELEMETRY_CODEC_VERSION != p[1]) {
+        fprintf(stderr, "%s: unsupported version %u\n", name, p[1]);
+        return -1;
+    }
+
+    p += 2;
+
+    if (NULL == (p = telemetry_get_varint(p, end, &now_ms)) ||
+            NULL == (p = telemetry_get_varint(p, end, &nr_samples)))
+    {
+        fprintf(stderr, "%s: truncated batch header\n", name);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < nr_samples; i++) {
+        struct telemetry_codec_probe *probe = NULL;
+        uint32_t time_v, temp_v, int_v = 0;
+        uint8_t hdr;
+
+        if (p == end) {
+            goto truncated;
+        }
+
+        hdr = *p++;
+        probe = &probes[hdr & TELEMETRY_CODEC_HDR_PROBE_MASK];
+
+        if (NULL == (p = telemetry_get_varint(p, end, &time_v)) ||
+                NULL == (p = telemetry_get_varint(p, end, &temp_v)))
+        {
+            goto truncated;
+        }
+
+        if ((hdr & TELEMETRY_CODEC_HDR_INT_TEMP) && NULL == (p = telemetry_get_varint(p, end, &int_v))) {
+            goto truncated;
+        }
+
+        if (false == probe->seen) {
+            if (0 == (hdr & TELEMETRY_CODEC_HDR_INT_TEMP)) {
+                fprintf(stderr, "%s: sample %u: first sample of a probe lacks a cold junction temperature\n",
+                        name, i);
+                return -1;
+            }
+
+            probe->seen = true;
+            probe->time_ms = now_ms - time_v;
+            probe->interval_ms = 0;
+            probe->probe_temp = telemetry_unzigzag(temp_v);
+            probe->int_temp = telemetry_unzigzag(int_v);
+        } else {
+            probe->interval_ms += telemetry_unzigzag(time_v);
+            probe->time_ms += probe->interval_ms;
+            probe->probe_temp += telemetry_unzigzag(temp_v);
+            probe->int_temp += telemetry_unzigzag(int_v);
+        }
+
+        printf("%u,%u,%.2f,%.4f,%u\n", probe->time_ms, hdr & TELEMETRY_CODEC_HDR_PROBE_MASK,
+                probe->probe_temp / 4.0, probe->int_temp / 16.0,
+                (hdr & TELEMETRY_CODEC_HDR_FLAGS_MASK) >> TELEMETRY_CODEC_HDR_FLAGS_SHIFT);
+    }
+
+    if (p != end) {
+        fprintf(stderr, "%s: %zu trailing bytes\n", name, (size_t)(end - p));
+        return -1;
+    }
+
+    fprintf(stderr, "%s: %u samples in %zu bytes (%.2f bytes/sample)\n", name, nr_samples, len,
+            0 != nr_samples ? (double)len / nr_samples : 0.0);
+
+    return 0;
+
+truncated:
+    fprintf(stderr, "%s: truncated batch\n", name);
+    return -1;
+}
+
+static
+int decode_file(const char *name, FILE *fp)
+{
+    static uint8_t buf[MAX_BATCH_LEN];
+    size_t len = fread(buf, 1, sizeof(buf), fp);
+
+    if (ferror(fp)) {
+        perror(name);
+        return -1;
+    }
+
+    return decode_batch(name, buf, len);
+}
+
+int main(int argc, char *argv[])
+{
+    int status = EXIT_SUCCESS;
+
+    printf("time_ms,probe,temp_c,int_temp_c,flags\n");
+
+    if (argc < 2) {
+        return 0 == decode_file("stdin", stdin) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        FILE *fp = fopen(argv[i], "rb");
+
+        if (NULL == fp) {
+            perror(argv[i]);
+            status = EXIT_FAILURE;
+            continue;
+        }
+
+        if (0 != decode_file(argv[i], fp)) {
+            status = EXIT_FAILURE;
+        }
+
+        fclose(fp);
+    }
+
+    return status;
+}
@@ -0,0 +1,151 @@
+/** \file wifi_cache.c WiFi fast connect cache
+ */
+
+#include "wifi_cache.h"
+
+#include "crc16.h"
+
+#include <stddef.h>
+
+#define WIFI_CACHE_REC_MAGIC        0x49465779ul    /* "yWFI" */
+
+struct wifi_cache_record {
+    struct hal_wifi_link link;
+
+    /**
+     * CRC of the network name the link belongs to
+     */
+    uint16_t ssid_crc;
+
+    /**
+     * CRC of everything before it. The magic goes last, so a record is only taken as written once
+     * all of it is.
+     */
+    uint16_t crc;
+    uint32_t magic;
+};
+
+#define WIFI_CACHE_REC_CRC_LEN      offsetof(struct wifi_cache_record, crc)
+#define WIFI_CACHE_NR_RECS          (HAL_FLASH_SECTOR_SIZE / sizeof(struct wifi_cache_record))
+
+/* The newest record, and the slot the next one goes in */
+static
+struct wifi_cache_record _wc_newest;
+
+static
+bool _wc_have_newest = false,
+     _wc_scanned = false;
+
+static
+unsigned _wc_next = 0;
+
+static ICACHE_FLASH_ATTR
+uint32_t _wifi_cache_rec_addr(unsigned slot)
+{
+    return WIFI_CACHE_SECTOR * HAL_FLASH_SECTOR_SIZE + slot * sizeof(struct wifi_cache_record);
+}
+
+static ICACHE_FLASH_ATTR
+bool _wifi_cache_rec_erased(const struct wifi_cache_record *rec)
+{
+    const uint32_t *words = (const uint32_t *)rec;
+
+    for (size_t i = 0; i < sizeof(*rec) / 4; i++) {
+        if (0xfffffffful != words[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Find the newest intact record, and where writing left off. Only done once; after that the RAM
+ * copy is kept up to date.
+ */
+static ICACHE_FLASH_ATTR
+int _wifi_cache_scan(void)
+{
+    struct wifi_cache_record rec;
+    unsigned slot;
+
+    if (true == _wc_scanned) {
+        return 0;
+    }
+
+    for (slot = 0; slot < WIFI_CACHE_NR_RECS; slot++) {
+        if (0 != hal_flash_read(_wifi_cache_rec_addr(slot), &rec, sizeof(rec))) {
+            os_printf("WIFICACHE: Failed to read record %u\r\n", slot);
+            return -1;
+        }
+
+        if (true == _wifi_cache_rec_erased(&rec)) {
+            break;
+        }
+
+        /* A torn record still takes up its slot */
+        if (WIFI_CACHE_REC_MAGIC == rec.magic && rec.crc == crc16_ccitt(&rec, WIFI_CACHE_REC_CRC_LEN)) {
+            _wc_newest = rec;
+            _wc_have_newest = true;
+        }
+    }
+
+    _wc_next = slot;
+    _wc_scanned = true;
+
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+int wifi_cache_load(const char *ssid, struct hal_wifi_link *link)
+{
+    if (0 != _wifi_cache_scan() || false == _wc_have_newest ||
+            _wc_newest.ssid_crc != crc16_ccitt(ssid, os_strlen(ssid)))
+    {
+        return -1;
+    }
+
+    *link = _wc_newest.link;
+
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+int wifi_cache_store(const char *ssid, const struct hal_wifi_link *link)
+{
+    struct wifi_cache_record rec;
+
+    if (0 != _wifi_cache_scan()) {
+        return -1;
+    }
+
+    os_memset(&rec, 0, sizeof(rec));
+    rec.link = *link;
+    rec.ssid_crc = crc16_ccitt(ssid, os_strlen(ssid));
+    rec.crc = crc16_ccitt(&rec, WIFI_CACHE_REC_CRC_LEN);
+    rec.magic = WIFI_CACHE_REC_MAGIC;
+
+    if (true == _wc_have_newest && 0 == os_memcmp(&rec, &_wc_newest, sizeof(rec))) {
+        return 0;
+    }
+
+    if (WIFI_CACHE_NR_RECS == _wc_next) {
+        if (0 != hal_flash_erase(WIFI_CACHE_SECTOR)) {
+            os_printf("WIFICACHE: Failed to erase the cache\r\n");
+            return -1;
+        }
+        _wc_next = 0;
+    }
+
+    if (0 != hal_flash_write(_wifi_cache_rec_addr(_wc_next), &rec, sizeof(rec))) {
+        os_printf("WIFICACHE: Failed to write record %u\r\n", _wc_next);
+        _wc_next++;
+        return -1;
+    }
+
+    _wc_next++;
+    _wc_newest = rec;
+    _wc_have_newest = true;
+
+    return 0;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+/** \file wifi_cache.h WiFi fast connect cache
+ * Remembers where the network was found and the address it leased us, so the next connection,
+ * after a reset, a deep sleep or a dropout, can skip the scan and DHCP. The cache is a sector of
+ * flash that records are appended to whenever the link changes; the newest intact record wins,
+ * and the sector is only erased once it fills up.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hal.h"
+#include "wifi_cache_config.h"
+
+/**
+ * Find the newest link stored for the given network.
+ *
+ * \return 0 on success, -1 if there is none, or the flash could not be read.
+ */
+int wifi_cache_load(const char *ssid, struct hal_wifi_link *link);
+
+/**
+ * Store the link for the given network. Nothing is written if it is the one stored already.
+ *
+ * \return 0 on success, -1 on a flash error.
+ */
+int wifi_cache_store(const char *ssid, const struct hal_wifi_link *link);
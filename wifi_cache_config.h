@@ -0,0 +1,11 @@
+#pragma once
+
+/**
+ * SPI flash sector holding the WiFi fast connect cache, just past the sample log
+ */
+#define WIFI_CACHE_SECTOR           0x300
+
+/**
+ * Give up on a fast connect that hasn't got us on the network after this long, and scan instead
+ */
+#define WIFI_CACHE_FAST_TIMEOUT_MS  3000
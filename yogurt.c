@@ -1,15 +1,20 @@
-#include <driver/spi_interface.h>
-#include <driver/uart.h>
-
-#include <osapi.h>
-#include <gpio.h>
-#include <os_type.h>
-#include <user_interface.h>
-
-#include "c99_fixups.h"
+#include "hal.h"
 #include "max31855.h"
 #include "sh1106.h"
 #include "http_client.h"
+#include "http_server.h"
+#include "telemetry.h"
+#include "telemetry_codec.h"
+#include "rtc_log.h"
+#include "sched.h"
+#include "heater.h"
+#include "jitter.h"
+#include "console.h"
+#include "prof.h"
+#include "spi_queue.h"
+#include "wifi_cache.h"
+#include "collector.h"
+#include "settings.h"
 
 #include <stdint.h>
 
@@ -18,20 +23,24 @@
 
 struct thermo_probe {
     struct max31855_dev dev ALIGN(8);
-    bool changed;
-    bool enabled;
-    bool temp_showing;
-    int line;
 } ALIGN(4);
 
-static volatile
-os_timer_t temp_timer;
+/* Chip select of every probe fitted, in display order */
+static
+const uint8_t probe_cs[] = { MAX31855_PROBE_CS };
+
+#define NR_PROBES       ARRAY_LEN(probe_cs)
 
+#ifdef YOGURT_LOW_POWER
 static
-struct http_client http_cl = { .state = HTTP_CLIENT_IDLE };
+struct hal_timer temp_timer;
+#endif
 
 static
-struct thermo_probe thermo_devs[2] ALIGN(4);
+struct http_client http_cl;
+
+static
+struct thermo_probe thermo_devs[NR_PROBES] ALIGN(4);
 
 static
 bool wifi_connected = false;
@@ -40,166 +49,439 @@ static
 bool wifi_changed = false;
 
 static
-int wifi_last_status = STATION_IDLE;
+enum hal_wifi_status wifi_last_status = HAL_WIFI_IDLE;
+
+#ifndef YOGURT_LOW_POWER
+/* Display fields for the WiFi status bar */
+static
+struct sh1106_text wifi_label_text,
+                   wifi_status_text;
+
+/*
+ * Display layout. Below the WiFi bar, each probe gets a row. Up to DISPLAY_LARGE_ROWS probes get
+ * two line tall readouts; past that every probe gets one line, and if they still don't all fit the
+ * display pages through them every DISPLAY_PAGE_MS.
+ */
+#define DISPLAY_FIRST_LINE      2
+#define DISPLAY_NR_LINES        8
+#define DISPLAY_LARGE_ROWS      ((DISPLAY_NR_LINES - DISPLAY_FIRST_LINE) / 2)
+#define DISPLAY_MAX_ROWS        (DISPLAY_NR_LINES - DISPLAY_FIRST_LINE)
+#define DISPLAY_PAGE_MS         3000
+
+/* Display fields for the probe name, temperature readout and fault/status message */
+struct display_row {
+    struct sh1106_text label_text;
+    struct sh1106_text temp_text;
+    struct sh1106_text status_text;
+};
+
+static
+struct display_row display_rows[DISPLAY_MAX_ROWS];
+
+static
+unsigned display_nr_rows = 0;
+
+/* Probe shown in the first row, and when the display last paged */
+static
+unsigned display_first_probe = 0;
+
+static
+uint32_t display_page_us = 0;
+
+/* Frames drawn, those that ran over their bus budget and left some for the next, and bytes sent */
+static
+uint32_t display_nr_frames = 0,
+         display_nr_deferred = 0,
+         display_nr_bytes = 0;
+
+/*
+ * The latest sample of each probe, as the display shows it. The probe task updates it at the end
+ * of each reporting interval, and the display reads it at its own pace, so the display never
+ * holds up acquisition and sampling faster doesn't redraw any more often.
+ */
+struct probe_snapshot {
+    int16_t temp;
+    uint8_t flags;
+};
+
+static
+struct probe_snapshot probe_snapshots[NR_PROBES];
+
+/* Bumped each time the snapshots are updated, and the update last drawn */
+static
+uint32_t probe_snapshot_seq = 0,
+         display_snapshot_seq = 0;
+#endif
+
+/*
+ * Task periods. Probes are read as fast as they convert and the readings filtered, with a sample
+ * reported every sample_ms of the settings. The display draws a frame every display_ms, and
+ * sooner when the WiFi changes, and the network is supervised slowly.
+ *
+ * The probes are read round-robin in PROBE_NR_SLOTS groups spread evenly across the conversion
+ * time, rather than all at once, so a long run of reads doesn't hold up the display on the shared
+ * bus. Every probe is still read once per conversion.
+ */
+#define PROBE_MIN_SLOT_MS       10
+#define PROBE_NR_SLOTS          (NR_PROBES < MAX31855_CONVERSION_MS / PROBE_MIN_SLOT_MS ? \
+                                    NR_PROBES : MAX31855_CONVERSION_MS / PROBE_MIN_SLOT_MS)
+#define PROBE_PERIOD_MS         ((MAX31855_CONVERSION_MS + PROBE_NR_SLOTS - 1) / PROBE_NR_SLOTS)
+#define UPLOAD_PERIOD_MS        1000
+#define NETWORK_PERIOD_MS       1000
+#define SCHED_REPORT_MS         60000
+
+/* Task events */
+#define UPLOAD_EVENT_SAMPLE     (1ul << 0)
+#define DISPLAY_EVENT_REDRAW    (1ul << 0)
+
+#ifndef YOGURT_LOW_POWER
+static
+struct sched_task heater_task,
+                  probe_task,
+                  upload_task,
+                  display_task,
+                  network_task,
+                  stats_task;
+
+#ifdef PROF_ENABLE
+static
+struct sched_task prof_task;
+#endif
+#endif
+
+#ifndef YOGURT_LOW_POWER
+/*
+ * Probe read timing. Reads are meant to start on a fixed grid of PROBE_PERIOD_MS from the first
+ * one; how far each strays from it is kept in sample_jitter. With the hardware timer, irq_jitter
+ * keeps how far the timer interrupt itself strays.
+ */
+static
+struct jitter_hist sample_jitter;
+
+#ifdef YOGURT_HW_TIMER
+static
+struct jitter_hist irq_jitter;
+#endif
+
+static
+uint32_t probe_due_us = 0;
+
+static
+bool probe_grid_started = false;
+
+/* Ramp up to the incubation temperature, hold it, then let the batch cool */
+static
+const struct heater_profile_step heater_profile[] = {
+    { HEATER_STEP_RAMP, HEATER_TEMP(HEATER_PROFILE_TEMP_C), HEATER_PROFILE_RAMP_S },
+    { HEATER_STEP_HOLD, HEATER_TEMP(HEATER_PROFILE_TEMP_C), HEATER_PROFILE_HOLD_S },
+    { HEATER_STEP_OFF, 0, 0 },
+};
+#endif
+
+/* Port the metrics are served on */
+#define METRICS_PORT        80
+
+/* Connection attempts, and fast connects that had to fall back to a scan, for the metrics */
+static
+uint32_t nr_wifi_connects = 0,
+         nr_wifi_fallbacks = 0;
+
+#ifndef YOGURT_LOW_POWER
+/* The network settings have changed, and the network task is to join the new network */
+static
+bool wifi_reconfigure = false;
+#endif
+
+/* Where the network was found last time, if we know */
+static
+struct hal_wifi_link wifi_link;
+
+static
+bool wifi_have_link = false;
+
+/* The attempt under way is a fast connect, and when it started */
+static
+bool wifi_fast = false;
 
-/* Backoff for HTTP server TCP connection */
 static
-int backoff = 0;
+uint32_t wifi_connecting_since_us = 0;
 
-#define MAX_BACKOFF     20
+/* How long the last connection took to come up, and whether it was a fast connect */
+static
+uint32_t wifi_connect_us = 0;
 
 static
-char ssid[32] = "SiprExtend",
-     psk[64] = "lolnsaownsyou";
+bool wifi_connect_fast = false;
+
+/**
+ * Put the radio in station mode, and look up where the network was last time.
+ */
+static ICACHE_FLASH_ATTR
+void setup_wifi(void)
+{
+    hal_wifi_init();
+
+    wifi_have_link = 0 == wifi_cache_load(settings_get()->ssid, &wifi_link);
+}
 
 /**
- * Setup the wifi interface parameters, and initiate a connection to the STA.
+ * Setup the wifi interface parameters, and initiate a connection to the STA. Goes straight to the
+ * access point we were on last time if we know it, and scans otherwise.
  */
 static ICACHE_FLASH_ATTR
 void setup_wifi_interface(void)
 {
-    struct station_config wifi_sta_cfg;
+    const struct settings *settings = settings_get();
 
-    os_memcpy(&wifi_sta_cfg.ssid, ssid, 32);
-    os_memcpy(&wifi_sta_cfg.password, psk, 64);
-    wifi_sta_cfg.bssid_set = 0;
-    wifi_station_set_config(&wifi_sta_cfg);
+    os_printf("WIFI: SSID=%s\r\n", settings->ssid);
 
-    os_printf("WIFI: SSID=%s PSK=%s\r\n", wifi_sta_cfg.ssid, wifi_sta_cfg.password);
+    wifi_fast = wifi_have_link;
+    wifi_connecting_since_us = hal_time_us();
 
-    if (true == wifi_station_connect()) {
-        os_printf("WIFI: Connecting.\r\n");
+    if (0 == hal_wifi_connect(settings->ssid, settings->psk,
+                true == wifi_fast ? &wifi_link : NULL))
+    {
+        if (true == wifi_fast) {
+            os_printf("WIFI: Connecting to %02x:%02x:%02x:%02x:%02x:%02x on channel %u.\r\n",
+                    wifi_link.bssid[0], wifi_link.bssid[1], wifi_link.bssid[2],
+                    wifi_link.bssid[3], wifi_link.bssid[4], wifi_link.bssid[5], wifi_link.channel);
+        } else {
+            os_printf("WIFI: Connecting.\r\n");
+        }
+        nr_wifi_connects++;
     }
 }
 
 /**
- * Set up the HTTP client connection, and periodically check its status.
- *
- * Attempt to automatically reconnect if the connection to the service failed.
+ * A fast connect didn't work out. Forget where the network was, and scan for it.
  */
 static ICACHE_FLASH_ATTR
-void check_http_client_conn(void)
+void wifi_fall_back(const char *why)
+{
+    os_printf("WIFI: %s, scanning.\r\n", why);
+
+    wifi_have_link = false;
+    nr_wifi_fallbacks++;
+
+    setup_wifi_interface();
+}
+
+/**
+ * We're on the network. Note how long that took, and remember where it was for next time.
+ */
+static ICACHE_FLASH_ATTR
+void wifi_got_ip(void)
 {
-    ip_addr_t addr;
+    struct hal_wifi_link link;
 
-    if (HTTP_CLIENT_CONNECTED == http_cl.state || HTTP_CLIENT_CONNECTING == http_cl.state) {
-        /* Nothing to do here */
+    if (0 != hal_wifi_get_link(&link, &wifi_connect_us)) {
         return;
     }
 
-    if (HTTP_CLIENT_IDLE == http_cl.state || MAX_BACKOFF == backoff) {
-        IP4_ADDR(&addr, 172, 16, 1, 1);
-        if (0 != http_client_connect(&http_cl, addr.addr, 24666)) {
-            os_printf("Network connection failure, skipping.\r\n");
-        }
-        backoff = 0;
-    } else {
-        if (0 == backoff) {
-            os_printf("Waiting 10s before retrying connection...\r\n");
-        }
-        backoff++;
+    wifi_connect_fast = wifi_fast;
+
+    os_printf("WIFI: Connected in %u ms%s, channel %u, address %u.%u.%u.%u\r\n",
+            wifi_connect_us / 1000, true == wifi_fast ? " (fast)" : "", link.channel,
+            link.ip & 0xff, (link.ip >> 8) & 0xff, (link.ip >> 16) & 0xff, link.ip >> 24);
+
+    if (0 != wifi_cache_store(settings_get()->ssid, &link)) {
+        os_printf("ERROR: Could not store the WiFi link.\r\n");
     }
+
+    wifi_link = link;
+    wifi_have_link = true;
 }
 
-static
-char message[256];
+/**
+ * Set up the HTTP client, the collectors it connects to and the samples that go up over it.
+ */
+static ICACHE_FLASH_ATTR
+void setup_uploads(void)
+{
+    const struct settings *settings = settings_get();
+    struct telemetry_config cfg;
+
+    http_client_init(&http_cl);
+    collector_init(&http_cl);
+    collector_set_host(settings->collector);
+    telemetry_init(&http_cl);
+
+    telemetry_get_config(&cfg);
+    cfg.batch_size = settings->batch_size;
+    telemetry_set_config(&cfg);
+}
+
+/**
+ * Start the connection to a collector once the WiFi is up, and stop it when the WiFi goes. In
+ * between, the HTTP client keeps the connection up by itself, failing over between collectors
+ * and retrying with backoff as soon as it fails or drops.
+ */
+static ICACHE_FLASH_ATTR
+void check_http_client_conn(void)
+{
+    if (HAL_WIFI_GOT_IP != wifi_last_status) {
+        collector_stop();
+        return;
+    }
+
+    collector_start();
+    collector_poll();
+}
 
 /**
- * Send a temperature update to the remote service
+ * Upload whatever samples are due. Samples are batched, and held in the telemetry ring while the
+ * collector is unreachable.
  */
 static ICACHE_FLASH_ATTR
 void update_service(void)
 {
+    telemetry_poll();
 }
 
+#ifndef YOGURT_LOW_POWER
 /**
- * Update the information displayed on the OLED.
+ * Draw a frame: update the information displayed on the OLED from the latest snapshot, and send
+ * as much of what changed as the frame's bus budget allows. Whatever is over budget goes out with
+ * the next frame.
  */
 static ICACHE_FLASH_ATTR
 void redraw_display(void)
 {
     char temp_str[32];
+    bool paged = false;
+    size_t nr_bytes = 0;
+
+    PROF_START(redraw_display);
 
     /* Check if we need to redraw the Wifi network status */
     if (true == wifi_changed) {
-        /* Draw the top line, inverted */
-        sh1106_clear_page(0, true, 0);
-        sh1106_display_puts(0, 102, "WiFi", true, SH1106_TEXT_ALIGN_RIGHT);
+        const char *status_msg = NULL;
 
-        if (STATION_GOT_IP == wifi_last_status) {
-            sh1106_display_puts(0, 0, ssid, true, SH1106_TEXT_ALIGN_LEFT);
-        } else {
-            switch (wifi_last_status) {
-            case STATION_IDLE:
-                sh1106_display_puts(0, 2, "Not Connected", true, SH1106_TEXT_ALIGN_LEFT);
-                break;
-            case STATION_WRONG_PASSWORD:
-                sh1106_display_puts(0, 2, "Bad WPA PSK", true, SH1106_TEXT_ALIGN_LEFT);
-                break;
-            case STATION_CONNECTING:
-                sh1106_display_puts(0, 2, "Connecting", true, SH1106_TEXT_ALIGN_LEFT);
-                break;
-            case STATION_NO_AP_FOUND:
-                sh1106_display_puts(0, 2, "WiFi Timeout", true, SH1106_TEXT_ALIGN_LEFT);
-                break;
-            case STATION_CONNECT_FAIL:
-                sh1106_display_puts(0, 2, "Unable to Connect", true, SH1106_TEXT_ALIGN_LEFT);
-                break;
-            default:
-                sh1106_display_puts(0, 2, "WiFi Failure", true, SH1106_TEXT_ALIGN_LEFT);
-                break;
-            }
+        switch (wifi_last_status) {
+        case HAL_WIFI_GOT_IP:
+            status_msg = settings_get()->ssid;
+            break;
+        case HAL_WIFI_IDLE:
+            status_msg = "Not Connected";
+            break;
+        case HAL_WIFI_WRONG_PASSWORD:
+            status_msg = "Bad WPA PSK";
+            break;
+        case HAL_WIFI_CONNECTING:
+            status_msg = "Connecting";
+            break;
+        case HAL_WIFI_NO_AP_FOUND:
+            status_msg = "WiFi Timeout";
+            break;
+        case HAL_WIFI_CONNECT_FAIL:
+            status_msg = "Unable to Connect";
+            break;
+        default:
+            status_msg = "WiFi Failure";
+            break;
         }
+
+        sh1106_text_set(&wifi_status_text, status_msg);
         wifi_changed = false;
     }
 
-    for (int i = 0; i < ARRAY_LEN(thermo_devs); i++) {
-        struct thermo_probe *probe = &thermo_devs[i];
+    /* Page on to the next set of probes, if they don't all fit */
+    if (NR_PROBES > display_nr_rows && hal_time_us() - display_page_us >= DISPLAY_PAGE_MS * 1000) {
+        display_first_probe += display_nr_rows;
+        if (display_first_probe >= NR_PROBES) {
+            display_first_probe = 0;
+        }
+        display_page_us = hal_time_us();
+        paged = true;
+    }
+
+    /* Each field only redraws what changed, so an unchanged reading costs no bus time. Without a
+     * new snapshot or a new page, nothing has. */
+    if (true == paged || display_snapshot_seq != probe_snapshot_seq) {
+        for (unsigned row = 0; row < display_nr_rows; row++) {
+            struct display_row *fields = &display_rows[row];
+            unsigned id = display_first_probe + row;
+            const struct probe_snapshot *snap = NULL;
 
-        /* Probe attributes changed */
-        if (true == probe->changed) {
-            /* Display message indicating probe is not active */
-            os_sprintf(temp_str, "Probe %d: ", i + 1);
-            temp_str[31] = '\0';
-            sh1106_display_puts(probe->line, 0, temp_str, false, SH1106_TEXT_ALIGN_LEFT);
-            if (false == probe->enabled) {
-                sh1106_display_puts(probe->line, 0, "Inactive", false, SH1106_TEXT_ALIGN_RIGHT);
-                probe->changed = false;
+            if (id >= NR_PROBES) {
+                /* Past the last probe on the last page */
+                sh1106_text_clear(&fields->label_text);
+                sh1106_text_clear(&fields->temp_text);
+                sh1106_text_clear(&fields->status_text);
+                continue;
             }
-        }
 
-        if (true == probe->enabled) {
-            struct max31855_dev *dev = &probe->dev;
+            snap = &probe_snapshots[id];
 
-            if (0 == dev->flags) {
-                if (false == probe->temp_showing) {
-                    sh1106_clear_page(probe->line, false, 64);
-                }
+            os_sprintf(temp_str, "Probe %u: ", id + 1);
+            temp_str[31] = '\0';
+            sh1106_text_set(&fields->label_text, temp_str);
 
-                os_sprintf(temp_str, "%u.%02u" "\xb0" "C", dev->probe_temp >> 2, (dev->probe_temp & 0x3) * 25);
-                temp_str[31] = '\0';
-                sh1106_display_puts(probe->line, 0, temp_str, false, SH1106_TEXT_ALIGN_RIGHT);
+            if (0 == snap->flags) {
+                int16_t temp = snap->temp;
 
-                probe->temp_showing = true;
+                os_sprintf(temp_str, "%u.%02u" "\xb0" "C", temp >> 2, (temp & 0x3) * 25);
+                temp_str[31] = '\0';
+                sh1106_text_clear(&fields->status_text);
+                sh1106_text_set(&fields->temp_text, temp_str);
             } else {
-                if (true == probe->temp_showing) {
-                    sh1106_clear_page(probe->line, false, 64);
-                }
-
-                if (dev->flags & MAX31855_FLAG_NO_PROBE) {
-                    sh1106_display_puts(probe->line, 0, "Disconnected", false, SH1106_TEXT_ALIGN_RIGHT);
+                if (snap->flags & MAX31855_FLAG_NO_PROBE) {
+                    os_strcpy(temp_str, "Disconnected");
                 } else {
-                    os_sprintf(temp_str, "%s Short", dev->flags & MAX31855_FLAG_SHORT_GND ? "Ground" : "Vcc");
+                    os_sprintf(temp_str, "%s Short", snap->flags & MAX31855_FLAG_SHORT_GND ? "Ground" : "Vcc");
                     temp_str[31] = '\0';
-                    sh1106_display_puts(probe->line, 0, temp_str, false, SH1106_TEXT_ALIGN_RIGHT);
                 }
-
-                probe->temp_showing = false;
+                sh1106_text_clear(&fields->temp_text);
+                sh1106_text_set(&fields->status_text, temp_str);
             }
         }
     }
 
+    display_snapshot_seq = probe_snapshot_seq;
+
+    nr_bytes = sh1106_display_flush_budget(settings_get()->display_budget);
+
+    display_nr_frames++;
+    display_nr_bytes += nr_bytes;
+    if (true == sh1106_display_dirty()) {
+        display_nr_deferred++;
+    }
+
+    PROF_END(redraw_display);
+}
+
+/**
+ * Draw the static parts of the display, and set up the WiFi status bar.
+ */
+static ICACHE_FLASH_ATTR
+void setup_display(void)
+{
+    /* The top line is an inverted bar */
+    sh1106_clear_page(0, true, 0);
+
+    sh1106_text_init(&wifi_label_text, 0, 102, true, false, SH1106_TEXT_ALIGN_RIGHT);
+    sh1106_text_init(&wifi_status_text, 0, 2, true, false, SH1106_TEXT_ALIGN_LEFT);
+
+    sh1106_text_set(&wifi_label_text, "WiFi");
+    wifi_changed = true;
+
+    /* Lay out a row per probe, as big as will fit */
+    display_nr_rows = NR_PROBES > DISPLAY_MAX_ROWS ? DISPLAY_MAX_ROWS : NR_PROBES;
+
+    for (unsigned row = 0; row < display_nr_rows; row++) {
+        struct display_row *fields = &display_rows[row];
+        bool large = NR_PROBES <= DISPLAY_LARGE_ROWS;
+        unsigned line = DISPLAY_FIRST_LINE + (true == large ? row * 2 : row);
+
+        sh1106_text_init(&fields->label_text, line, 0, false, false, SH1106_TEXT_ALIGN_LEFT);
+        sh1106_text_init(&fields->temp_text, line, 0, false, large, SH1106_TEXT_ALIGN_RIGHT);
+        sh1106_text_init(&fields->status_text, line, 0, false, false, SH1106_TEXT_ALIGN_RIGHT);
+    }
+
+    display_first_probe = 0;
+    display_page_us = hal_time_us();
 }
+#endif /* YOGURT_LOW_POWER */
 
 /**
  * Check and update the status of the Wifi connection. If the status indicates we're not connected, attempt to force a reconnect.
@@ -207,26 +489,48 @@ void redraw_display(void)
 static ICACHE_FLASH_ATTR
 void check_wifi(void)
 {
-    int wifi_status = wifi_station_get_connect_status();
+    enum hal_wifi_status wifi_status = hal_wifi_status();
+
+    /* The SDK reconnects by itself after a dropout; time that from when we notice */
+    if (HAL_WIFI_CONNECTING == wifi_status && HAL_WIFI_CONNECTING != wifi_last_status) {
+        wifi_connecting_since_us = hal_time_us();
+    }
 
     switch (wifi_status) {
-    case STATION_IDLE:
+    case HAL_WIFI_IDLE:
         setup_wifi_interface();
         break;
-    case STATION_CONNECTING:
-        os_printf("WIFI: Still attempting to connect.\r\n");
+    case HAL_WIFI_CONNECTING:
+        if (true == wifi_fast &&
+                hal_time_us() - wifi_connecting_since_us >= WIFI_CACHE_FAST_TIMEOUT_MS * 1000)
+        {
+            wifi_fall_back("Fast connect timed out");
+        } else {
+            os_printf("WIFI: Still attempting to connect.\r\n");
+        }
         break;
-    case STATION_WRONG_PASSWORD:
+    case HAL_WIFI_WRONG_PASSWORD:
         os_printf("WIFI: Wrong password for wifi, aborting.\r\n");
         break;
-    case STATION_NO_AP_FOUND:
-        os_printf("WIFI: Could not find specified wifi AP, aborting\r\n");
+    case HAL_WIFI_NO_AP_FOUND:
+        if (true == wifi_fast) {
+            wifi_fall_back("Access point not where it was");
+        } else {
+            os_printf("WIFI: Could not find specified wifi AP, aborting\r\n");
+        }
         break;
-    case STATION_CONNECT_FAIL:
-        os_printf("WIFI: Connection failed. Retrying.\r\n");
-        setup_wifi_interface();
+    case HAL_WIFI_CONNECT_FAIL:
+        if (true == wifi_fast) {
+            wifi_fall_back("Fast connect failed");
+        } else {
+            os_printf("WIFI: Connection failed. Retrying.\r\n");
+            setup_wifi_interface();
+        }
         break;
-    case STATION_GOT_IP:
+    case HAL_WIFI_GOT_IP:
+        if (HAL_WIFI_GOT_IP != wifi_last_status) {
+            wifi_got_ip();
+        }
         wifi_connected = true;
         break;
     default:
@@ -239,139 +543,1155 @@ void check_wifi(void)
     }
 }
 
+#ifndef YOGURT_LOW_POWER
 /**
- * The meat of our polling loop. Check the wifi, sample the temperature from the thermocouples, and send
- * a message out.
+ * Account for a probe tick against the grid. ref_us is when the tick fired: the timer interrupt
+ * with the hardware timer, otherwise the start of the task.
  */
 static ICACHE_FLASH_ATTR
-void sample_temperature(void *arg)
+void probe_account_timing(uint32_t ref_us, uint32_t start_us)
 {
-    /* Check the status of Wifi before we move along */
-    check_wifi();
+    /* With the hardware timer, the grid starts at its first interrupt */
+    if (false == probe_grid_started) {
+        probe_due_us = ref_us;
+        probe_grid_started = true;
+    }
+
+    /* A tick more than a whole period late stands in for the ones that never came */
+    while ((int32_t)(ref_us - probe_due_us) >= (int32_t)(PROBE_PERIOD_MS * 1000)) {
+        probe_due_us += PROBE_PERIOD_MS * 1000;
+        sample_jitter.missed++;
+    }
+
+#ifdef YOGURT_HW_TIMER
+    jitter_record(&irq_jitter, probe_due_us, ref_us);
+#endif
+    jitter_record(&sample_jitter, probe_due_us, start_us);
+
+    probe_due_us += PROBE_PERIOD_MS * 1000;
+}
+
+#ifdef YOGURT_HW_TIMER
+/**
+ * Hardware timer interrupt: note the time, and leave the reads to the probe task.
+ */
+static
+void probe_hw_tick(uint32_t now_us)
+{
+    sched_post_from_isr(&probe_task, now_us);
+}
+#endif
+
+/**
+ * Start a read of the probes in this slot; the driver filters the readings as they come in. Every
+ * sample_ms, close the reporting interval and queue its samples for upload and display.
+ */
+static ICACHE_FLASH_ATTR
+void probe_task_run(struct sched_task *task, uint32_t events)
+{
+    static unsigned slot = 0,
+                    rounds = 0;
+    uint32_t now = hal_time_us(),
+             ref = now;
 
-    for (int i = 0; i < ARRAY_LEN(thermo_devs); i++) {
-        struct thermo_probe *dev = &thermo_devs[i];
+#ifdef YOGURT_HW_TIMER
+    if (0 != (events & SCHED_EVENT_ISR)) {
+        ref = task->isr_data;
+    }
+#endif
+
+    probe_account_timing(ref, now);
+
+    /* The sample period is read every round, so a change takes effect at the next sample */
+    if (0 == slot && ++rounds >= settings_get()->sample_ms / MAX31855_CONVERSION_MS) {
+        rounds = 0;
+
+        for (int i = 0; i < NR_PROBES; i++) {
+            struct max31855_dev *dev = &thermo_devs[i].dev;
 
-        if (true == dev->enabled) {
-            max31855_read(&dev->dev);
+            max31855_end_interval(dev);
+            telemetry_record(i, dev);
+
+            probe_snapshots[i].temp = max31855_report_temp(dev);
+            probe_snapshots[i].flags = dev->flags;
         }
+        probe_snapshot_seq++;
+
+        /* The display picks the new snapshot up with its next frame */
+        sched_post(&upload_task, UPLOAD_EVENT_SAMPLE);
+    }
+
+    for (int i = slot; i < NR_PROBES; i += PROBE_NR_SLOTS) {
+        max31855_read(&thermo_devs[i].dev, NULL, NULL);
     }
 
-    /* Check our HTTP connection status if WiFi is up */
-    if (STATION_GOT_IP == wifi_last_status) {
-        check_http_client_conn();
+    if (++slot == PROBE_NR_SLOTS) {
+        slot = 0;
     }
+}
+
+/**
+ * Run the heater controller from the latest filtered reading of its probe. This is the highest
+ * priority task, and only does arithmetic, so nothing queued behind the display or the network
+ * holds it up by more than whatever is running when its tick comes round.
+ */
+static ICACHE_FLASH_ATTR
+void heater_task_run(struct sched_task *task, uint32_t events)
+{
+    struct max31855_dev *dev = &thermo_devs[HEATER_PROBE].dev;
+
+    heater_step(dev->interval.filtered, 0 == dev->flags && 0 != dev->interval.nr_samples);
+}
 
+/**
+ * Upload on every new sample, and once a period so partial batches go out on time.
+ */
+static ICACHE_FLASH_ATTR
+void upload_task_run(struct sched_task *task, uint32_t events)
+{
     update_service();
+}
+
+static ICACHE_FLASH_ATTR
+void display_task_run(struct sched_task *task, uint32_t events)
+{
     redraw_display();
 }
 
 /**
- * Set up the specified temperature probe, so we can talk to the MAX31855.
- *
- * \param id The internal ID used for this temperature probe
- * \param enable Whether or not to mark this temperature probe as enabled
- * \param csn_id The ID of the GPIO to be used as a chip select.
- *
- * \return 0 on success, a non-zero error code otherwise.
+ * Supervise the WiFi and the connection to the collector.
  */
 static ICACHE_FLASH_ATTR
-int setup_temp_probe(int id, bool enable, int csn_id)
+void network_task_run(struct sched_task *task, uint32_t events)
 {
-    int status = 0;
-    struct thermo_probe *probe = NULL;
+    enum http_client_state http_state = http_cl.state;
 
-    if (id >= ARRAY_LEN(thermo_devs)) {
-        status = -1;
-        os_printf("ERROR: Probe %d is not configured to exist.\r\n", id);
-        goto done;
+    /* Done here rather than as the settings change, so a response to the change can get out first */
+    if (true == wifi_reconfigure) {
+        wifi_reconfigure = false;
+        wifi_have_link = 0 == wifi_cache_load(settings_get()->ssid, &wifi_link);
+        wifi_changed = true;
+        setup_wifi_interface();
     }
 
-    probe = &thermo_devs[id];
-    probe->enabled = enable;
-    probe->line = 2 + id;
-    probe->temp_showing = false;
-    probe->changed = true;
-
-    if (true == enable) {
-        if (0 != max31855_init(&probe->dev, MAX31855_SPI_IFACE, csn_id)) {
-            os_printf("ERROR: Failed to initialize probe %d state\r\n", id);
-            status = -1;
-            goto done;
-        }
+    check_wifi();
+    check_http_client_conn();
+
+    if (true == wifi_changed) {
+        sched_post(&display_task, DISPLAY_EVENT_REDRAW);
     }
 
-done:
-    return status;
+    /* Don't leave a backlog waiting for the next upload period once we're back */
+    if (http_state != http_cl.state || HTTP_CLIENT_CONNECTED == http_cl.state) {
+        sched_post(&upload_task, UPLOAD_EVENT_SAMPLE);
+    }
 }
 
 /**
- * Initialization entry point.
+ * The pieces of the status report, and the longest it can come to: every %u as ten digits, the
+ * collector name as long as it is allowed to be, and both histograms as long as they get. The
+ * conversions themselves are counted too, which leaves a little to spare.
  */
-ICACHE_FLASH_ATTR
-void user_init(void)
+#define STATUS_JSON_HEAD        "{\"uptime_ms\":%u,\"jitter\":{\"sample\":"
+#define STATUS_JSON_IRQ         ",\"irq\":"
+#define STATUS_JSON_WIFI        "},\"wifi\":{\"connect_ms\":%u,\"fast\":%s,\"connects\":%u," \
+                                "\"fallbacks\":%u}"
+#define STATUS_JSON_COLLECTOR   ",\"collector\":{\"host\":\"%.*s\",\"connects\":%u,\"failures\":%u," \
+                                "\"drops\":%u,\"connect_ms\":%u,\"max_connect_ms\":%u,\"rtt_ms\":%u," \
+                                "\"connected_s\":%u}}"
+#define STATUS_JSON_MAX         (sizeof(STATUS_JSON_HEAD) + 10 + \
+                                 2 * JITTER_JSON_MAX + sizeof(STATUS_JSON_IRQ) + \
+                                 sizeof(STATUS_JSON_WIFI) + 3 * 10 + sizeof("false") + \
+                                 sizeof(STATUS_JSON_COLLECTOR) + COLLECTOR_HOST_LEN + 7 * 10)
+
+/* Breaks the build if the longest status report is more than telemetry takes */
+typedef char _status_fits_telemetry[STATUS_JSON_MAX <= TELEMETRY_STATUS_MAX ? 1 : -1];
+
+static ICACHE_FLASH_ATTR
+void stats_task_run(struct sched_task *task, uint32_t events)
 {
-    SpiAttr spi_attr;
+    static char status[STATUS_JSON_MAX];
+    const struct collector_endpoint *endpoint = collector_get(collector_current());
+    struct http_client_stats collector;
+    char *p = status;
 
-    /* Initialize the UART */
-    uart_init(BIT_RATE_115200, BIT_RATE_115200);
-    os_delay_us(100);
+    sched_report();
+    heater_report();
 
-    /*
-     * Initialize the GPIO subsystem
-     */
-    gpio_init();
+    /* The probe timing goes to the collector as well, then starts over */
+    jitter_report(&sample_jitter);
+    p += os_sprintf(p, STATUS_JSON_HEAD, telemetry_time_ms());
+    p += jitter_format_json(&sample_jitter, p);
+    jitter_reset(&sample_jitter);
 
-    /*
-     * Print a welcome message
-     */
-    os_printf("Yogurt Monitor is Starting...\r\n");
+#ifdef YOGURT_HW_TIMER
+    jitter_report(&irq_jitter);
+    p += os_sprintf(p, STATUS_JSON_IRQ);
+    p += jitter_format_json(&irq_jitter, p);
+    jitter_reset(&irq_jitter);
+#endif
 
-    /* Fire up the wifi interface */
-    ETS_UART_INTR_DISABLE();
-    wifi_set_opmode(STATION_MODE);
-    ETS_UART_INTR_ENABLE();
-
-    /* Set up the GPIOs for the hardware SPI */
-    WRITE_PERI_REG(PERIPHS_IO_MUX, 0x105);
-    /* HSPI MISO */
-    PIN_FUNC_SELECT(PERIPHS_IO_MUX_MTDI_U, 2);
-    /* HSPI MOSI */
-    PIN_FUNC_SELECT(PERIPHS_IO_MUX_MTCK_U, 2);
-    /* HSPI CLK */
-    PIN_FUNC_SELECT(PERIPHS_IO_MUX_MTMS_U, 2);
+    p += os_sprintf(p, STATUS_JSON_WIFI,
+            wifi_connect_us / 1000, true == wifi_connect_fast ? "true" : "false", nr_wifi_connects,
+            nr_wifi_fallbacks);
 
-    /* Set up the SPI interface */
-    spi_attr.bitOrder = SpiBitOrder_MSBFirst;
-    spi_attr.speed = SpiSpeed_10MHz;
-    spi_attr.mode = SpiMode_Master;
-    spi_attr.subMode = SpiSubMode_0;
-    SPIInit(SpiNum_HSPI, &spi_attr);
+    http_client_get_stats(&http_cl, &collector);
+    p += os_sprintf(p, STATUS_JSON_COLLECTOR, COLLECTOR_HOST_LEN - 1,
+            NULL != endpoint ? endpoint->host : "", collector.nr_connects, collector.nr_failures,
+            collector.nr_drops, collector.last_connect_us / 1000, collector.max_connect_us / 1000,
+            collector.last_rtt_us / 1000, collector.connected_ms / 1000);
 
-    /* Configure the chip select for the MAX31855 */
-    PIN_FUNC_SELECT(PERIPHS_IO_MUX_GPIO2_U, FUNC_GPIO2);
-    gpio_output_set(0, 0, (1 << MAX31855_SPI_CSN), 0);
-    gpio_output_set((1 << MAX31855_SPI_CSN), 0, 0, 0);
+    if (0 != telemetry_send_status(status, p - status)) {
+        os_printf("STATS: Status report of %u bytes not sent\r\n", (unsigned)(p - status));
+        return;
+    }
 
-    setup_temp_probe(0, true, MAX31855_SPI_CSN);
-    setup_temp_probe(1, false, 0);
+    sched_post(&upload_task, UPLOAD_EVENT_SAMPLE);
+}
 
-    /* Configure the chip selects for the SH1106 */
-    PIN_FUNC_SELECT(PERIPHS_IO_MUX_GPIO4_U, FUNC_GPIO4);    /* Chip select */
-    PIN_FUNC_SELECT(PERIPHS_IO_MUX_GPIO5_U, FUNC_GPIO5);    /* A0/Display Write Select */
-    PIN_FUNC_SELECT(PERIPHS_IO_MUX_MTDO_U, FUNC_GPIO15);    /* Display chip reset */
+#ifdef PROF_ENABLE
+static ICACHE_FLASH_ATTR
+void prof_task_run(struct sched_task *task, uint32_t events)
+{
+    prof_report();
+}
 
-    /* Enable the display control GPIOs and assert them, holding the display in reset */
-    gpio_output_set(0, 0, (1 << SH1106_SPI_CSN) | (1 << SH1106_SPI_A0) | (1 << SH1106_SPI_RSTN), 0);
-    gpio_output_set((1 << SH1106_SPI_A0),  (1 << SH1106_SPI_RSTN) | (1 << SH1106_SPI_CSN), 0, 0);
+static ICACHE_FLASH_ATTR
+void prof_cmd_run(int argc, char *argv[])
+{
+    prof_report();
+}
 
-    /* Enable the SH1106-based display */
-    sh1106_display_init(0x80);
-    sh1106_display_set_invert(false);
+static
+struct console_cmd prof_cmd = {
+    .name = "prof",
+    .help = "Print the hot path profile and start it over",
+    .func = prof_cmd_run,
+};
+#endif
 
-    /* Arm event timer (500ms, repeating) to sample the temperature probe */
-    os_timer_disarm((os_timer_t *)&temp_timer);
-    os_timer_setfn((os_timer_t *)&temp_timer, (os_timer_func_t *)sample_temperature, NULL);
-    os_timer_arm((os_timer_t *)&temp_timer, 500, 1);
+static
+struct http_server status_server;
+
+/**
+ * A family of Prometheus metrics: one metric, and a sample of it for each label set.
+ */
+struct metric_family {
+    const char *name;
+    const char *type;
+    const char *help;
+
+    /**
+     * Number of samples in the family
+     */
+    unsigned nr_samples;
+
+    /**
+     * Write sample i's labels and value, snprintf() style.
+     *
+     * \return The length of the whole sample, even if it didn't fit, or -1 to leave it out.
+     */
+    int (*sample)(unsigned i, char *buf, size_t len);
+};
+
+/**
+ * Write a temperature in 1/2^frac_bits degrees as decimal degrees, to the hundredth
+ */
+static ICACHE_FLASH_ATTR
+int metric_temp(char *buf, size_t len, const char *labels, int32_t temp, unsigned frac_bits)
+{
+    uint32_t mag = temp < 0 ? -temp : temp,
+             centi = ((mag & ((1ul << frac_bits) - 1)) * 100) >> frac_bits;
+
+    return os_snprintf(buf, len, "%s %s%u.%02u", labels, temp < 0 ? "-" : "", mag >> frac_bits, centi);
 }
 
+static ICACHE_FLASH_ATTR
+int metric_uptime(unsigned i, char *buf, size_t len)
+{
+    return os_snprintf(buf, len, " %u", telemetry_time_ms() / 1000);
+}
+
+static ICACHE_FLASH_ATTR
+int metric_probe_temp(unsigned i, char *buf, size_t len)
+{
+    const struct max31855_dev *dev = &thermo_devs[i].dev;
+    char labels[16];
+
+    if (0 != dev->flags) {
+        return -1;
+    }
+
+    os_sprintf(labels, "{probe=\"%u\"}", i + 1);
+
+    return metric_temp(buf, len, labels, max31855_report_temp(dev), 2);
+}
+
+static ICACHE_FLASH_ATTR
+int metric_probe_cold_junction(unsigned i, char *buf, size_t len)
+{
+    const struct max31855_dev *dev = &thermo_devs[i].dev;
+    char labels[16];
+
+    os_sprintf(labels, "{probe=\"%u\"}", i + 1);
+
+    /* 12 bits, sign extended, in sixteenths of a degree */
+    return metric_temp(buf, len, labels, (int16_t)(dev->int_temp << 4) >> 4, 4);
+}
+
+static ICACHE_FLASH_ATTR
+int metric_probe_fault(unsigned i, char *buf, size_t len)
+{
+    return os_snprintf(buf, len, "{probe=\"%u\"} %u", i + 1, thermo_devs[i].dev.flags);
+}
+
+static ICACHE_FLASH_ATTR
+int metric_samples(unsigned i, char *buf, size_t len)
+{
+    static const char *const states[] = { "delivered", "dropped", "spilled" };
+    struct telemetry_stats stats;
+
+    telemetry_get_stats(&stats);
+
+    return os_snprintf(buf, len, "{state=\"%s\"} %u", states[i],
+            0 == i ? stats.delivered : 1 == i ? stats.dropped : stats.spilled);
+}
+
+static ICACHE_FLASH_ATTR
+int metric_samples_pending(unsigned i, char *buf, size_t len)
+{
+    struct telemetry_stats stats;
+
+    telemetry_get_stats(&stats);
+
+    return os_snprintf(buf, len, " %u", stats.pending);
+}
+
+static ICACHE_FLASH_ATTR
+int metric_rejected_batches(unsigned i, char *buf, size_t len)
+{
+    struct telemetry_stats stats;
+
+    telemetry_get_stats(&stats);
+
+    return os_snprintf(buf, len, " %u", stats.rejected_batches);
+}
+
+static ICACHE_FLASH_ATTR
+int metric_wifi_connects(unsigned i, char *buf, size_t len)
+{
+    return os_snprintf(buf, len, " %u", nr_wifi_connects);
+}
+
+static ICACHE_FLASH_ATTR
+int metric_wifi_fallbacks(unsigned i, char *buf, size_t len)
+{
+    return os_snprintf(buf, len, " %u", nr_wifi_fallbacks);
+}
+
+static ICACHE_FLASH_ATTR
+int metric_wifi_connect_time(unsigned i, char *buf, size_t len)
+{
+    return os_snprintf(buf, len, "{fast=\"%u\"} %u.%03u", true == wifi_connect_fast,
+            wifi_connect_us / 1000000, wifi_connect_us / 1000 % 1000);
+}
+
+static ICACHE_FLASH_ATTR
+int metric_collector_connects(unsigned i, char *buf, size_t len)
+{
+    static const char *const outcomes[] = { "failed", "dropped" };
+    struct http_client_stats stats;
+
+    http_client_get_stats(&http_cl, &stats);
+
+    if (0 == i) {
+        return os_snprintf(buf, len, " %u", stats.nr_connects);
+    }
+
+    return os_snprintf(buf, len, "{outcome=\"%s\"} %u", outcomes[i - 1],
+            1 == i ? stats.nr_failures : stats.nr_drops);
+}
+
+static ICACHE_FLASH_ATTR
+int metric_collector_connected(unsigned i, char *buf, size_t len)
+{
+    struct http_client_stats stats;
+
+    http_client_get_stats(&http_cl, &stats);
+
+    return os_snprintf(buf, len, " %u.%03u", stats.connected_ms / 1000, stats.connected_ms % 1000);
+}
+
+static ICACHE_FLASH_ATTR
+int metric_collector_connect_time(unsigned i, char *buf, size_t len)
+{
+    static const char *const which[] = { "last", "max" };
+    struct http_client_stats stats;
+    uint32_t us;
+
+    http_client_get_stats(&http_cl, &stats);
+    us = 0 == i ? stats.last_connect_us : stats.max_connect_us;
+
+    return os_snprintf(buf, len, "{which=\"%s\"} %u.%06u", which[i], us / 1000000, us % 1000000);
+}
+
+static ICACHE_FLASH_ATTR
+int metric_collector_backoff(unsigned i, char *buf, size_t len)
+{
+    return os_snprintf(buf, len, " %u.%03u", http_cl.stats.backoff_ms / 1000,
+            http_cl.stats.backoff_ms % 1000);
+}
+
+static ICACHE_FLASH_ATTR
+int metric_collector_rtt(unsigned i, char *buf, size_t len)
+{
+    const struct collector_endpoint *ep = collector_get(i);
+
+    if (NULL == ep || 0 == ep->srtt_us) {
+        return -1;
+    }
+
+    return os_snprintf(buf, len, "{host=\"%s\"} %u.%06u", ep->host, ep->srtt_us / 1000000,
+            ep->srtt_us % 1000000);
+}
+
+static ICACHE_FLASH_ATTR
+int metric_collector_failures(unsigned i, char *buf, size_t len)
+{
+    const struct collector_endpoint *ep = collector_get(i);
+
+    if (NULL == ep) {
+        return -1;
+    }
+
+    return os_snprintf(buf, len, "{host=\"%s\"} %u", ep->host, ep->nr_failures);
+}
+
+static ICACHE_FLASH_ATTR
+int metric_collector_current(unsigned i, char *buf, size_t len)
+{
+    const struct collector_endpoint *ep = collector_get(i);
+
+    if (NULL == ep) {
+        return -1;
+    }
+
+    return os_snprintf(buf, len, "{host=\"%s\"} %u", ep->host, (int)i == collector_current());
+}
+
+/* More collectors than this aren't reported */
+#define METRIC_MAX_COLLECTORS       8
+
+static ICACHE_FLASH_ATTR
+int metric_heater_setpoint(unsigned i, char *buf, size_t len)
+{
+    struct heater_stats stats;
+
+    heater_get_stats(&stats);
+
+    return metric_temp(buf, len, "", stats.setpoint, HEATER_TEMP_FRAC_BITS);
+}
+
+static ICACHE_FLASH_ATTR
+int metric_heater_duty(unsigned i, char *buf, size_t len)
+{
+    struct heater_stats stats;
+    uint32_t duty;
+
+    heater_get_stats(&stats);
+
+    /* Thousandths */
+    duty = ((int64_t)stats.duty * 1000) >> HEATER_DUTY_FRAC_BITS;
+
+    return os_snprintf(buf, len, " %u.%03u", duty / 1000, duty % 1000);
+}
+
+static ICACHE_FLASH_ATTR
+int metric_display_frames(unsigned i, char *buf, size_t len)
+{
+    static const char *const outcomes[] = { "complete", "deferred" };
+
+    return os_snprintf(buf, len, "{outcome=\"%s\"} %u", outcomes[i],
+            0 == i ? display_nr_frames - display_nr_deferred : display_nr_deferred);
+}
+
+static ICACHE_FLASH_ATTR
+int metric_display_bytes(unsigned i, char *buf, size_t len)
+{
+    return os_snprintf(buf, len, " %u", display_nr_bytes);
+}
+
+static ICACHE_FLASH_ATTR
+int metric_http_requests(unsigned i, char *buf, size_t len)
+{
+    static const char *const outcomes[] = { "served", "error", "refused" };
+
+    return os_snprintf(buf, len, "{outcome=\"%s\"} %u", outcomes[i],
+            0 == i ? status_server.nr_served : 1 == i ? status_server.nr_errors : status_server.nr_refused);
+}
+
+#ifdef PROF_ENABLE
+static ICACHE_FLASH_ATTR
+int metric_prof_calls(unsigned i, char *buf, size_t len)
+{
+    const struct prof_point *point = prof_get(i);
+
+    if (NULL == point) {
+        return -1;
+    }
+
+    return os_snprintf(buf, len, "{point=\"%s\"} %u", point->name, point->count);
+}
+
+static ICACHE_FLASH_ATTR
+int metric_prof_cycles(unsigned i, char *buf, size_t len)
+{
+    const struct prof_point *point = prof_get(i);
+
+    if (NULL == point) {
+        return -1;
+    }
+
+    return os_snprintf(buf, len, "{point=\"%s\"} %llu", point->name,
+            (unsigned long long)point->total);
+}
+
+/* More points than this aren't reported */
+#define METRIC_MAX_PROF_POINTS      32
+#endif
+
+static
+const struct metric_family metric_families[] = {
+    { "yogurt_uptime_seconds", "gauge", "Time since boot", 1, metric_uptime },
+    { "yogurt_probe_temperature_celsius", "gauge", "Filtered probe temperature",
+        NR_PROBES, metric_probe_temp },
+    { "yogurt_probe_cold_junction_celsius", "gauge", "Probe cold junction temperature",
+        NR_PROBES, metric_probe_cold_junction },
+    { "yogurt_probe_fault", "gauge", "Probe fault flags: 1 open, 2 short to ground, 4 short to Vcc",
+        NR_PROBES, metric_probe_fault },
+    { "yogurt_telemetry_samples_total", "counter", "Samples by what became of them",
+        3, metric_samples },
+    { "yogurt_telemetry_samples_pending", "gauge", "Samples waiting to be uploaded",
+        1, metric_samples_pending },
+    { "yogurt_telemetry_rejected_batches_total", "counter", "Batches the collector refused",
+        1, metric_rejected_batches },
+    { "yogurt_wifi_connects_total", "counter", "WiFi connection attempts", 1, metric_wifi_connects },
+    { "yogurt_wifi_fallbacks_total", "counter", "Fast WiFi connects that fell back to a scan",
+        1, metric_wifi_fallbacks },
+    { "yogurt_wifi_connect_seconds", "gauge", "Time the last WiFi connection took to come up",
+        1, metric_wifi_connect_time },
+    { "yogurt_collector_connects_total", "counter",
+        "Collector connection attempts, and those that failed or later dropped",
+        3, metric_collector_connects },
+    { "yogurt_collector_connected_seconds_total", "counter", "Time connected to the collector",
+        1, metric_collector_connected },
+    { "yogurt_collector_connect_seconds", "gauge", "Time collector connections took to come up",
+        2, metric_collector_connect_time },
+    { "yogurt_collector_backoff_seconds", "gauge", "Wait before the pending collector reconnect",
+        1, metric_collector_backoff },
+    { "yogurt_collector_rtt_seconds", "gauge", "Smoothed request round trip time, by collector",
+        METRIC_MAX_COLLECTORS, metric_collector_rtt },
+    { "yogurt_collector_failures_total", "counter",
+        "Failed connection attempts and broken connections, by collector",
+        METRIC_MAX_COLLECTORS, metric_collector_failures },
+    { "yogurt_collector_current", "gauge", "1 for the collector in use",
+        METRIC_MAX_COLLECTORS, metric_collector_current },
+    { "yogurt_heater_setpoint_celsius", "gauge", "Heater setpoint", 1, metric_heater_setpoint },
+    { "yogurt_heater_duty_ratio", "gauge", "Heater duty", 1, metric_heater_duty },
+    { "yogurt_display_frames_total", "counter",
+        "Display frames, by whether all they drew fit their bus budget", 2, metric_display_frames },
+    { "yogurt_display_bytes_total", "counter", "Bytes sent to the display", 1, metric_display_bytes },
+    { "yogurt_http_requests_total", "counter", "Status server requests by outcome",
+        3, metric_http_requests },
+#ifdef PROF_ENABLE
+    { "yogurt_prof_calls_total", "counter", "Passes through each profile point since its last report",
+        METRIC_MAX_PROF_POINTS, metric_prof_calls },
+    { "yogurt_prof_cycles_total", "counter", "CPU cycles in each profile point since its last report",
+        METRIC_MAX_PROF_POINTS, metric_prof_cycles },
+#endif
+};
+
+/**
+ * Render the metrics in the Prometheus text format, a line at a time. The cursor holds the family
+ * in the upper bits, and the line within it below: 0 for the HELP and TYPE comments, then a line
+ * per sample.
+ */
+static ICACHE_FLASH_ATTR
+size_t metrics_render(uint32_t *cursor, char *buf, size_t len)
+{
+    size_t used = 0;
+
+    for (;;) {
+        unsigned family = *cursor >> 8,
+                 line = *cursor & 0xff;
+        const struct metric_family *fam = NULL;
+        size_t room = len - used;
+        int nr = 0;
+
+        if (family >= ARRAY_LEN(metric_families)) {
+            break;
+        }
+
+        fam = &metric_families[family];
+
+        if (line > fam->nr_samples) {
+            *cursor = (family + 1) << 8;
+            continue;
+        }
+
+        if (0 == line) {
+            nr = os_snprintf(buf + used, room, "# HELP %s %s\n# TYPE %s %s\n",
+                    fam->name, fam->help, fam->name, fam->type);
+        } else {
+            int name_len = os_snprintf(buf + used, room, "%s", fam->name),
+                sample_len = 0;
+
+            if (name_len < 0 || (size_t)name_len >= room) {
+                break;
+            }
+
+            sample_len = fam->sample(line - 1, buf + used + name_len, room - name_len);
+            if (sample_len < 0) {
+                (*cursor)++;
+                continue;
+            }
+
+            /* The newline goes where the sample's NUL was, if the sample fit */
+            nr = name_len + sample_len + 1;
+            if ((size_t)nr < room) {
+                buf[used + nr - 1] = '\n';
+            }
+        }
+
+        /* Leave a line that doesn't fit, NUL and all, for the next buffer */
+        if (nr < 0 || (size_t)nr >= room) {
+            break;
+        }
+
+        used += nr;
+        (*cursor)++;
+    }
+
+    return used;
+}
+
+static
+struct http_server_resource metrics_resource = {
+    .path = "/metrics",
+    .content_type = "text/plain; version=0.0.4",
+    .render = metrics_render,
+};
+
+/**
+ * Put changed settings into effect, on the fly. The sample period is picked up by the probe task
+ * by itself.
+ */
+static ICACHE_FLASH_ATTR
+void apply_settings(uint32_t changed)
+{
+    const struct settings *settings = settings_get();
+
+    if (0 != (changed & SETTINGS_WIFI)) {
+        wifi_reconfigure = true;
+    }
+
+    if (0 != (changed & SETTINGS_COLLECTOR)) {
+        collector_set_host(settings->collector);
+    }
+
+    if (0 != (changed & SETTINGS_SPI)) {
+        spi_queue_set_speed(settings->spi_hz);
+    }
+
+    if (0 != (changed & SETTINGS_DISPLAY)) {
+        display_task.min_interval_ms = settings->display_ms;
+        sched_set_period(&display_task, settings->display_ms);
+    }
+
+    if (0 != (changed & SETTINGS_BATCH)) {
+        struct telemetry_config cfg;
+
+        telemetry_get_config(&cfg);
+        cfg.batch_size = settings->batch_size;
+        telemetry_set_config(&cfg);
+    }
+}
+
+/**
+ * config lists the settings, config NAME VALUE changes one (the rest of the line is the value, so
+ * it can have spaces in; leave it out for an empty value), and config save saves them.
+ */
+static ICACHE_FLASH_ATTR
+void config_cmd_run(int argc, char *argv[])
+{
+    char value[CONSOLE_LINE_LEN];
+    char *p = value;
+
+    if (1 == argc) {
+        for (unsigned i = 0; settings_format(i, value, sizeof(value)) >= 0; i++) {
+            os_printf("CONFIG: %s\r\n", value);
+        }
+        return;
+    }
+
+    if (2 == argc && 0 == os_strcmp("save", argv[1])) {
+        os_printf("CONFIG: %s\r\n", 0 == settings_save() ? "Saved" : "Could not save");
+        return;
+    }
+
+    *p = '\0';
+    for (int i = 2; i < argc; i++) {
+        p += os_sprintf(p, "%s%s", 2 == i ? "" : " ", argv[i]);
+    }
+
+    if (0 == settings_set(argv[1], value)) {
+        settings_apply();
+        os_printf("CONFIG: %s changed, config save to keep it\r\n", argv[1]);
+    }
+}
+
+static
+struct console_cmd config_cmd = {
+    .name = "config",
+    .help = "List settings; config NAME VALUE to change one; config save",
+    .func = config_cmd_run,
+};
+
+/**
+ * Render the settings, one name=value a line.
+ */
+static ICACHE_FLASH_ATTR
+size_t config_render(uint32_t *cursor, char *buf, size_t len)
+{
+    size_t used = 0;
+
+    for (;;) {
+        int nr = settings_format(*cursor, buf + used, len - used);
+
+        /* Leave a line that doesn't fit, newline and all, for the next buffer */
+        if (nr < 0 || (size_t)nr + 1 >= len - used) {
+            break;
+        }
+
+        buf[used + nr] = '\n';
+        used += nr + 1;
+        (*cursor)++;
+    }
+
+    return used;
+}
+
+/**
+ * Compare a token without giving away how much of it matched in how long it took.
+ */
+static ICACHE_FLASH_ATTR
+bool config_token_matches(const char *token, const char *given)
+{
+    size_t len = os_strlen(token),
+           given_len = os_strlen(given);
+    uint8_t diff = len != given_len;
+
+    for (size_t i = 0; i < len; i++) {
+        diff |= token[i] ^ (i < given_len ? given[i] : '\0');
+    }
+
+    return 0 == diff;
+}
+
+/**
+ * Change settings from a form: the token setting first, then a field per setting to change, and a
+ * save field to save them all too. Settings up to a bad one are still changed. Until a token is
+ * set from the console, every POST is refused and the settings can only be read over HTTP.
+ */
+static ICACHE_FLASH_ATTR
+unsigned config_post(char *body, size_t len)
+{
+    const char *token = settings_get()->token;
+    unsigned status = 200;
+    bool save = false;
+    char *name = NULL,
+         *value = NULL;
+    int ret = 0;
+
+    if ('\0' == *token || 0 != http_form_next(&body, &name, &value) ||
+            0 != os_strcmp("token", name) || false == config_token_matches(token, value))
+    {
+        os_printf("CONFIG: Refused a change over HTTP\r\n");
+        return 403;
+    }
+
+    while (0 == (ret = http_form_next(&body, &name, &value))) {
+        if (0 == os_strcmp("save", name)) {
+            save = true;
+        } else if (0 != settings_set(name, value)) {
+            break;
+        }
+    }
+
+    if (1 != ret) {
+        status = 400;
+    }
+
+    settings_apply();
+
+    if (200 == status && true == save && 0 != settings_save()) {
+        status = 500;
+    }
+
+    return status;
+}
+
+static
+struct http_server_resource config_resource = {
+    .path = "/config",
+    .content_type = "text/plain",
+    .render = config_render,
+    .post = config_post,
+};
+
+static ICACHE_FLASH_ATTR
+void add_task(struct sched_task *task, const char *name, sched_func_t func, uint8_t prio,
+        uint32_t period_ms, uint32_t min_interval_ms)
+{
+    os_memset(task, 0, sizeof(*task));
+
+    task->name = name;
+    task->func = func;
+    task->prio = prio;
+    task->period_ms = period_ms;
+    task->min_interval_ms = min_interval_ms;
+
+    sched_add(task);
+}
+
+/**
+ * Set up the tasks that make up the application, each at its own rate and priority.
+ */
+static ICACHE_FLASH_ATTR
+void setup_tasks(void)
+{
+    sched_init();
+
+    if (HEATER_PROBE < NR_PROBES) {
+        heater_init(heater_profile, ARRAY_LEN(heater_profile));
+        add_task(&heater_task, "heater", heater_task_run, 5, HEATER_CONTROL_MS, 0);
+    } else {
+        os_printf("ERROR: Heater probe %d is not configured to exist.\r\n", HEATER_PROBE);
+    }
+
+    jitter_init(&sample_jitter, "sample");
+    probe_grid_started = false;
+
+#ifdef YOGURT_HW_TIMER
+    jitter_init(&irq_jitter, "irq");
+    add_task(&probe_task, "probes", probe_task_run, 4, 0, 0);
+
+    if (0 != hal_hw_timer_start(PROBE_PERIOD_MS * 1000, probe_hw_tick)) {
+        os_printf("ERROR: Hardware timer unavailable, timing probes in software\r\n");
+        sched_set_period(&probe_task, PROBE_PERIOD_MS);
+    }
+#else
+    add_task(&probe_task, "probes", probe_task_run, 4, PROBE_PERIOD_MS, 0);
+
+    /* The grid starts where the scheduler starts the task's ticks */
+    probe_due_us = hal_time_us() + PROBE_PERIOD_MS * 1000;
+    probe_grid_started = true;
+#endif
+    add_task(&upload_task, "upload", upload_task_run, 3, UPLOAD_PERIOD_MS, 0);
+    add_task(&display_task, "display", display_task_run, 2, settings_get()->display_ms,
+            settings_get()->display_ms);
+    add_task(&network_task, "network", network_task_run, 1, NETWORK_PERIOD_MS, 0);
+    add_task(&stats_task, "stats", stats_task_run, 0, SCHED_REPORT_MS, 0);
+
+    if (0 != console_init()) {
+        os_printf("ERROR: Could not set up the console.\r\n");
+    }
+
+    console_add(&config_cmd);
+
+    http_server_add_resource(&status_server, &metrics_resource);
+    http_server_add_resource(&status_server, &config_resource);
+    if (0 != http_server_start(&status_server, METRICS_PORT)) {
+        os_printf("ERROR: Could not start the status server.\r\n");
+    }
+
+#ifdef PROF_ENABLE
+    console_add(&prof_cmd);
+    if (0 != PROF_REPORT_MS) {
+        add_task(&prof_task, "prof", prof_task_run, 0, PROF_REPORT_MS, 0);
+    }
+#endif
+
+    /* Draw the initial screen and bring the network up straight away */
+    sched_post(&display_task, DISPLAY_EVENT_REDRAW);
+    sched_post(&network_task, SCHED_EVENT_TICK);
+}
+#endif /* YOGURT_LOW_POWER */
+
+/**
+ * Set up the specified temperature probe, so we can talk to the MAX31855.
+ *
+ * \param id The internal ID used for this temperature probe
+ * \param cs The probe's chip select: a GPIO, or SPI_CS_EXPANDER(line)
+ *
+ * \return 0 on success, a non-zero error code otherwise.
+ */
+static ICACHE_FLASH_ATTR
+int setup_temp_probe(int id, uint8_t cs)
+{
+    int status = 0;
+    struct thermo_probe *probe = NULL;
+
+    if (id >= NR_PROBES || id >= TELEMETRY_CODEC_MAX_PROBES) {
+        status = -1;
+        os_printf("ERROR: Probe %d is not configured to exist.\r\n", id);
+        goto done;
+    }
+
+    probe = &thermo_devs[id];
+
+    /* Expander lines are driven by the HAL; a GPIO chip select is ours to set up */
+    if (false == SPI_CS_IS_EXPANDER(cs)) {
+        hal_gpio_enable_output(cs);
+        hal_gpio_set(1 << cs);
+    }
+
+    if (0 != max31855_init(&probe->dev, MAX31855_SPI_IFACE, cs)) {
+        os_printf("ERROR: Failed to initialize probe %d state\r\n", id);
+        status = -1;
+        goto done;
+    }
+
+done:
+    return status;
+}
+
+/**
+ * Bring up the SPI bus and the thermocouple probes on it.
+ */
+static ICACHE_FLASH_ATTR
+void setup_probes(void)
+{
+    /* Set up the SPI interface */
+    hal_spi_init(settings_get()->spi_hz);
+    spi_queue_init();
+
+    for (int i = 0; i < NR_PROBES; i++) {
+        setup_temp_probe(i, probe_cs[i]);
+    }
+}
+
+#ifdef YOGURT_LOW_POWER
+/*
+ * Low power mode, for battery-backed units. The device spends nearly all its time in deep sleep.
+ * Each wake reads the probes and stashes the samples in RTC memory, then goes straight back to
+ * sleep with the radio never powered. Every LOW_POWER_RADIO_EVERY wakes, or sooner if RTC memory
+ * is about to fill, the radio comes up too and everything is uploaded. The display is left alone.
+ */
+
+/* Time from one wake to the next */
+#define LOW_POWER_WAKE_MS               30000
+
+/* Shortest deep sleep, however long the wake took */
+#define LOW_POWER_MIN_SLEEP_MS          1000
+
+/* Bring the radio up every this many wakes */
+#define LOW_POWER_RADIO_EVERY           20
+
+/* How long a radio wake waits for the collector before keeping the samples in flash instead */
+#define LOW_POWER_FLUSH_TIMEOUT_MS      20000
+
+static
+struct rtc_log_state low_power_state;
+
+static
+bool low_power_radio = false;
+
+static
+unsigned low_power_reads_pending = 0;
+
+/**
+ * Save our state to RTC memory and go into deep sleep until the next wake is due.
+ */
+static ICACHE_FLASH_ATTR
+void low_power_sleep(void)
+{
+    uint32_t awake_ms = hal_time_us() / 1000,
+             sleep_ms = LOW_POWER_MIN_SLEEP_MS;
+    bool radio = false;
+
+    hal_timer_disarm(&temp_timer);
+
+    if (awake_ms + LOW_POWER_MIN_SLEEP_MS < LOW_POWER_WAKE_MS) {
+        sleep_ms = LOW_POWER_WAKE_MS - awake_ms;
+    }
+
+    low_power_state.wakes++;
+    low_power_state.clock_ms = telemetry_time_ms() + sleep_ms;
+
+    /* Come up with the radio on if it's time, or if the next wake's samples would not fit */
+    radio = 0 == low_power_state.wakes % LOW_POWER_RADIO_EVERY ||
+        rtc_log_count() + 2 * NR_PROBES > RTC_LOG_NR_SAMPLES;
+    low_power_state.flags = true == radio ? RTC_LOG_FLAG_RADIO : 0;
+
+    rtc_log_save(&low_power_state);
+    hal_deep_sleep(sleep_ms * 1000, radio);
+}
+
+/**
+ * A probe read has completed. Without the radio the sample goes to RTC memory, and once every
+ * probe is read we are done.
+ */
+static ICACHE_FLASH_ATTR
+void on_probe_read_low_power(struct max31855_dev *dev, int status, void *arg)
+{
+    struct thermo_probe *probe = arg;
+    struct telemetry_sample sample;
+
+    /* A single reading makes up the interval */
+    max31855_end_interval(dev);
+    telemetry_make_sample(probe - thermo_devs, dev, &sample);
+
+    if (true == low_power_radio) {
+        telemetry_record_sample(&sample);
+    } else if (0 != rtc_log_append(&sample)) {
+        os_printf("LOWPOWER: RTC memory full, sample lost\r\n");
+    }
+
+    low_power_reads_pending--;
+
+    if (false == low_power_radio && 0 == low_power_reads_pending) {
+        low_power_sleep();
+    }
+}
+
+/**
+ * Polling loop for a wake with the radio up. Brings up the connection and uploads everything,
+ * then goes back to sleep.
+ */
+static ICACHE_FLASH_ATTR
+void low_power_flush(void *arg)
+{
+    check_wifi();
+    check_http_client_conn();
+
+    update_service();
+
+    if (0 != low_power_reads_pending) {
+        return;
+    }
+
+    if (true == telemetry_idle()) {
+        /* Everything from RTC memory has been delivered */
+        rtc_log_clear();
+        low_power_sleep();
+    } else if (hal_time_us() / 1000 >= LOW_POWER_FLUSH_TIMEOUT_MS) {
+        os_printf("LOWPOWER: Collector unreachable, keeping samples in flash\r\n");
+        telemetry_shutdown();
+        rtc_log_clear();
+        low_power_sleep();
+    }
+}
+
+/**
+ * Start of a wake: read the probes, and if the radio is up this time, upload everything held in
+ * RTC memory along with the new samples.
+ */
+static ICACHE_FLASH_ATTR
+void low_power_start(void)
+{
+    if (0 != rtc_log_init(&low_power_state)) {
+        /* Power-on, or RTC memory was corrupted. Either way the radio is up */
+        os_printf("LOWPOWER: No saved state, starting over\r\n");
+        low_power_state.flags = RTC_LOG_FLAG_RADIO;
+    } else {
+        telemetry_set_time_ms(low_power_state.clock_ms);
+    }
+
+    low_power_radio = 0 != (low_power_state.flags & RTC_LOG_FLAG_RADIO);
+
+    setup_probes();
+
+    if (true == low_power_radio) {
+        struct telemetry_config cfg;
+
+        os_printf("LOWPOWER: Wake %u, uploading %u samples\r\n", low_power_state.wakes, rtc_log_count());
+
+        setup_wifi();
+        setup_uploads();
+
+        /* Everything held is overdue already, so don't hold back partial batches */
+        telemetry_get_config(&cfg);
+        cfg.flush_interval_ms = 0;
+        telemetry_set_config(&cfg);
+
+        for (unsigned i = 0; i < rtc_log_count(); i++) {
+            telemetry_record_sample(rtc_log_sample(i));
+        }
+    }
+
+    low_power_reads_pending = NR_PROBES;
+
+    for (int i = 0; i < NR_PROBES; i++) {
+        max31855_read(&thermo_devs[i].dev, on_probe_read_low_power, &thermo_devs[i]);
+    }
+
+    if (true == low_power_radio) {
+        hal_timer_disarm(&temp_timer);
+        hal_timer_setfn(&temp_timer, low_power_flush, NULL);
+        hal_timer_arm(&temp_timer, NETWORK_PERIOD_MS, true);
+    } else if (0 == low_power_reads_pending) {
+        low_power_sleep();
+    }
+}
+#endif /* YOGURT_LOW_POWER */
+
+/**
+ * Initialization entry point.
+ */
+ICACHE_FLASH_ATTR
+void user_init(void)
+{
+    /* Initialize the UART and GPIO subsystems */
+    hal_init();
+
+    /*
+     * Print a welcome message
+     */
+    os_printf("Yogurt Monitor is Starting...\r\n");
+
+#ifdef YOGURT_LOW_POWER
+    settings_init(NULL);
+    low_power_start();
+#else
+    settings_init(apply_settings);
+
+    /* Fire up the wifi interface */
+    setup_wifi();
+    setup_uploads();
+
+    setup_probes();
+
+    /* Enable the display control GPIOs and assert them, holding the display in reset */
+    hal_gpio_enable_output(SH1106_SPI_CSN);     /* Chip select */
+    hal_gpio_enable_output(SH1106_SPI_A0);      /* A0/Display Write Select */
+    hal_gpio_enable_output(SH1106_SPI_RSTN);    /* Display chip reset */
+    hal_gpio_set(1 << SH1106_SPI_A0);
+    hal_gpio_clear((1 << SH1106_SPI_RSTN) | (1 << SH1106_SPI_CSN));
+
+    /* Enable the SH1106-based display */
+    sh1106_display_init(0x80);
+    sh1106_display_set_invert(false);
+    setup_display();
+
+#ifdef SH1106_BENCHMARK
+    sh1106_benchmark();
+#endif
+
+#ifdef HTTP_CLIENT_BENCHMARK
+    http_client_benchmark();
+#endif
+
+    setup_tasks();
+#endif
+}